@@ -537,6 +537,9 @@ mb_menu_dump(MBMenu *mb,MBMenuMenu *menu)
 void
 mb_menu_activate(MBMenu *mb, int x, int y)
 {
+  /* For clients that didn't call mb_menu_load_icons() themselves */
+  mb_menu_load_icons(mb);
+
   XGrabPointer(mb->dpy, mb->root, True,
 	       (ButtonPressMask|ButtonReleaseMask),
 	       GrabModeAsync,
@@ -1088,7 +1091,6 @@ new_menu_item(MBMenu *mb, char *title, char *icon, char *info,
 	      void *cb_data
 	      )
 {
-  MBPixbufImage *img_tmp;
   MBMenuItem *menu_item = (MBMenuItem *)malloc(sizeof(MBMenuItem));
    
    menu_item->type      = MBMENU_ITEM_APP; 
@@ -1124,34 +1126,96 @@ new_menu_item(MBMenu *mb, char *title, char *icon, char *info,
 	 menu_item->cb_data = cb_data;
      }
 
+   /* Loaded, all together, by mb_menu_load_icons() */
    if (icon != NULL && mb->icon_dimention)
-   {
       menu_item->icon_fn = strdup(icon);
 
-      if ((menu_item->img = mb_pixbuf_img_new_from_file(mb->pb, 
-							menu_item->icon_fn)) 
-	  != NULL)
+   return menu_item;
+}
+
+/* Returns False if out of memory, leaving the rest unloaded */
+static Bool
+menu_collect_pending_icons(MBMenuMenu   *menu,
+			   MBMenuItem ***items,
+			   int          *n,
+			   int          *size)
+{
+  MBMenuItem  *item, **tmp;
+
+  for (item = menu->items; item != NULL; item = item->next_item)
+    {
+      if (item->icon_fn && item->img == NULL)
 	{
-	  if (menu_item->img->width != mb->icon_dimention 
-	      || menu_item->img->height != mb->icon_dimention )
+	  if (*n == *size)
 	    {
-	      img_tmp = mb_pixbuf_img_scale(mb->pb, menu_item->img, 
-					    mb->icon_dimention, 
-					    mb->icon_dimention);
-	      mb_pixbuf_img_free(mb->pb, menu_item->img);
-	      menu_item->img = img_tmp;
+	      tmp = realloc(*items, (*size ? *size * 2 : 64) 
+			    * sizeof(MBMenuItem *));
+	      if (tmp == NULL)
+		return False;
+
+	      *items = tmp;
+	      *size  = *size ? *size * 2 : 64;
 	    }
+	  (*items)[(*n)++] = item;
 	}
-      else
+
+      if (item->child 
+	  && !menu_collect_pending_icons(item->child, items, n, size))
+	return False;
+    }
+
+  return True;
+}
+
+/* Decodes every icon not yet loaded in one parallel batch */
+void
+mb_menu_load_icons(MBMenu *mb)
+{
+  MBMenuItem    **items = NULL;
+  MBPixbufImage **imgs;
+  const char    **paths;
+  int             i, n = 0, size = 0;
+
+  if (!mb->icon_dimention || mb->rootmenu == NULL)
+    return;
+
+  menu_collect_pending_icons(mb->rootmenu, &items, &n, &size);
+
+  if (n == 0)
+    return;
+
+  paths = malloc(n * sizeof(char *));
+  imgs  = malloc(n * sizeof(MBPixbufImage *));
+
+  /* Out of memory, show the items without icons for now */
+  if (paths == NULL || imgs == NULL)
+    {
+      free(paths);
+      free(imgs);
+      free(items);
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    paths[i] = items[i]->icon_fn;
+
+  mb_pixbuf_img_load_batch(mb->pb, paths, n, 
+			   mb->icon_dimention, mb->icon_dimention, imgs);
+
+  for (i = 0; i < n; i++)
+    {
+      if ((items[i]->img = imgs[i]) == NULL)
 	{
 	  if (mb_want_warnings())
-	    fprintf(stderr, "failed to load image: %s \n", menu_item->icon_fn);
-	  free(menu_item->icon_fn);
-	  menu_item->icon_fn = (char *)NULL;
+	    fprintf(stderr, "failed to load image: %s \n", items[i]->icon_fn);
+	  free(items[i]->icon_fn);
+	  items[i]->icon_fn = (char *)NULL;
 	}
-   }
+    }
 
-   return menu_item;
+  free(paths);
+  free(imgs);
+  free(items);
 }
 
 static MBMenuItem*
@@ -1578,32 +1642,13 @@ mb_menu_xmenu_paint_active_item(MBMenu *mb,MBMenuMenu *menu)
 
      if (menu->active_item->child)
        {
-	 int y;
-	 for (y = (menu->active_item->h/2) - 2; 
-	      y < (menu->active_item->h/2) + 3; y++)
-	   {
-	     mb_pixbuf_img_plot_pixel(mb->pb,img, 
-				      menu->width - 10, y,
-				      mb_col_red(mb->bg_col),  
-				      mb_col_green(mb->bg_col),
-				      mb_col_blue(mb->bg_col));
-	   }
-	 for (y = (menu->active_item->h/2) - 1; 
-	      y < (menu->active_item->h/2) + 2; y++)
-	   {
-	     mb_pixbuf_img_plot_pixel(mb->pb, img, 
-				     menu->width - 9, y,
-				     mb_col_red(mb->bg_col),  
-				     mb_col_green(mb->bg_col),
-				     mb_col_blue(mb->bg_col));
-
-	   }
-	 mb_pixbuf_img_plot_pixel(mb->pb, img, 
-				 menu->width - 8, (menu->active_item->h/2),
-				 mb_col_red(mb->bg_col),  
-				 mb_col_green(mb->bg_col),
-				 mb_col_blue(mb->bg_col));
-
+	 mb_pixbuf_img_fill_arrow(mb->pb, img, 
+				  menu->width - 10, 
+				  (menu->active_item->h/2) - 2,
+				  5, MBPIXBUF_ARROW_RIGHT,
+				  mb_col_red(mb->bg_col),  
+				  mb_col_green(mb->bg_col),
+				  mb_col_blue(mb->bg_col), 0);
        }
 
 
@@ -1670,7 +1715,6 @@ mb_menu_xmenu_paint(MBMenu *mb,MBMenuMenu *menu)
    MBPixbufImage *img_dest;
 
    char *tmp_title;
-   int x,y;
    int sx;
 
    if (menu->items == NULL) return;
@@ -1728,13 +1772,12 @@ mb_menu_xmenu_paint(MBMenu *mb,MBMenuMenu *menu)
      {
        if (mb->trans)
 	 {
-	   for (x = 0; x < menu->width; x++)
-	     for (y = 0; y < menu->height; y++)
-	       mb_pixbuf_img_plot_pixel_with_alpha(mb->pb, img_dest, x, y, 
-						   mb_col_red(mb->bg_col),  
-						   mb_col_green(mb->bg_col),
-						   mb_col_blue(mb->bg_col),
-						   mb->trans);
+	   mb_pixbuf_img_blend_rect(mb->pb, img_dest, 
+				    0, 0, menu->width, menu->height,
+				    mb_col_red(mb->bg_col),  
+				    mb_col_green(mb->bg_col),
+				    mb_col_blue(mb->bg_col),
+				    255 - mb->trans);
 	 } else {
 	   mb_pixbuf_img_fill(mb->pb, img_dest,
 			      mb_col_red(mb->bg_col),  
@@ -1759,16 +1802,13 @@ mb_menu_xmenu_paint(MBMenu *mb,MBMenuMenu *menu)
 
      if (item->type == MBMENU_ITEM_SEPERATOR)
        {
-	 for ( x = WPAD + mb->inner_border_width; 
-	       x < menu->width - (WPAD + mb->inner_border_width);
-	       x++)
-	   {
-	     mb_pixbuf_img_plot_pixel(mb->pb, img_dest, 
-				     x, item->y+(item->h/2),
-				     mb_col_red(mb->bd_col),  
-				     mb_col_green(mb->bd_col),
-				     mb_col_blue(mb->bd_col));
-	   }
+	 mb_pixbuf_img_hline(mb->pb, img_dest, 
+			     WPAD + mb->inner_border_width, 
+			     item->y+(item->h/2),
+			     menu->width - 2 * (WPAD + mb->inner_border_width),
+			     mb_col_red(mb->bd_col),  
+			     mb_col_green(mb->bd_col),
+			     mb_col_blue(mb->bd_col), 0);
 	 continue;
        }
 
@@ -1799,28 +1839,12 @@ mb_menu_xmenu_paint(MBMenu *mb,MBMenuMenu *menu)
      /* Child Arrow */
      if (item->child)
        {
-	 int y;
-	 for (y = item->y+(item->h/2) - 2; y < item->y+(item->h/2) + 3; y++)
-	   {
-	     mb_pixbuf_img_plot_pixel(mb->pb, img_dest, 
-				     menu->width - 8, y,
-				     mb_col_red(mb->fg_col),  
-				     mb_col_green(mb->fg_col),
-				     mb_col_blue(mb->fg_col));
-	   }
-	 for (y = item->y+(item->h/2) - 1; y < item->y+(item->h/2) + 2; y++)
-	   {
-	     mb_pixbuf_img_plot_pixel(mb->pb, img_dest, 
-				     menu->width - 7, y,
-				     mb_col_red(mb->fg_col),  
-				     mb_col_green(mb->fg_col),
-				     mb_col_blue(mb->fg_col));
-	   }
-	 mb_pixbuf_img_plot_pixel(mb->pb, img_dest, 
-				 menu->width - 6, item->y+(item->h/2),
-				 mb_col_red(mb->fg_col),  
-				 mb_col_green(mb->fg_col),
-				 mb_col_blue(mb->fg_col));
+	 mb_pixbuf_img_fill_arrow(mb->pb, img_dest, 
+				  menu->width - 8, item->y+(item->h/2) - 2,
+				  5, MBPIXBUF_ARROW_RIGHT,
+				  mb_col_red(mb->fg_col),  
+				  mb_col_green(mb->fg_col),
+				  mb_col_blue(mb->fg_col), 0);
        }
    }
 
@@ -1829,24 +1853,20 @@ mb_menu_xmenu_paint(MBMenu *mb,MBMenuMenu *menu)
    if (mb->inner_border_width)
      {
        unsigned char r,g,b;
+       int           bw = mb->inner_border_width;
 
        r = mb_col_red(mb->bd_col);
        g = mb_col_green(mb->bd_col);
        b = mb_col_blue(mb->bd_col);
        
-       for(y = 0; y < mb->inner_border_width; y++) 
-	 for(x = 0; x < menu->width; x++)
-	   mb_pixbuf_img_plot_pixel(mb->pb, img_dest, x, y, r, g, b);
-       
-       for(x = 1; x <= mb->inner_border_width; x++)
-	 for(y = 0; y < menu->height; y++) 
-	   mb_pixbuf_img_plot_pixel(mb->pb, img_dest, menu->width-x, y, r, g, b);
-       for(y = 1; y <= mb->inner_border_width; y++) 
-	 for(x = 0; x < menu->width; x++)
-	   mb_pixbuf_img_plot_pixel(mb->pb, img_dest, x, menu->height-y, r, g, b);
-       for(x = 0; x < mb->inner_border_width; x++)
-	 for(y = 0; y < menu->height; y++) 
-	   mb_pixbuf_img_plot_pixel(mb->pb, img_dest, x, y, r, g, b);
+       mb_pixbuf_img_fill_rect(mb->pb, img_dest, 
+			       0, 0, menu->width, bw, r, g, b, 0);
+       mb_pixbuf_img_fill_rect(mb->pb, img_dest, 
+			       menu->width - bw, 0, bw, menu->height, r, g, b, 0);
+       mb_pixbuf_img_fill_rect(mb->pb, img_dest, 
+			       0, menu->height - bw, menu->width, bw, r, g, b, 0);
+       mb_pixbuf_img_fill_rect(mb->pb, img_dest, 
+			       0, 0, bw, menu->height, r, g, b, 0);
      }
    
    mb_pixbuf_img_render_to_drawable(mb->pb, img_dest, 
@@ -329,7 +329,8 @@ mb_menu_set_col(MBMenu             *mbmenu,
  * your own risk, its unsupported. 
  *
  * @param mbmenu mb menu instance
- * @param trans Transparency level
+ * @param trans Transparency level, from 0 for an opaque background to
+ *        255 for none at all
  */
 void
 mb_menu_set_trans(MBMenu *mbmenu, int trans);
@@ -417,11 +418,23 @@ Bool mb_menu_is_active(MBMenu *mbmenu);
  * @param x x co-ord ( relative to root window origin ) to activate menu
  * @param y y co-ord ( relative to root window origin ) to activate menu
  *
+ * Loads any icons not yet loaded first, see #mb_menu_load_icons.
  */
 void mb_menu_activate(MBMenu *mbmenu, 
 		      int     x, 
 		      int     y);
 
+/**
+ * Loads the icons of every item added so far, decoding them together
+ * on all CPUs. Items' icons are not loaded as they are added, so their
+ * img stays NULL until this is called. Call it once the menu is built
+ * to do the decoding up front; otherwise #mb_menu_activate does it,
+ * delaying the first popup.
+ *
+ * @param mbmenu mb menu instance
+ */
+void mb_menu_load_icons(MBMenu *mbmenu);
+
 /**
  * Deactivates ( hides ) a mbmenu instance.
  *
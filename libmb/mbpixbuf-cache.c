@@ -0,0 +1,292 @@
+/* mbpixbuf-cache.c libmb
+ *
+ * Process wide cache of decoded images, shared by every MBPixbuf.
+ *
+ * Entries are keyed on the file's path, device, inode, size and mtime,
+ * so an edited file is decoded again, plus the size asked for and the
+ * internal format ( bytes per pixel and premultiplication ) it was
+ * decoded to. Images handed out are clones of the cached image, sharing
+ * its pixels, so a caller writing to one after
+ * mb_pixbuf_img_make_writable() gets its own copy and leaves the cache's
+ * alone.
+ *
+ * The cache keeps its own reference to each image. Once the images'
+ * total size passes the budget, the least recently used entries are
+ * dropped. Callers may of course still hold them.
+ *
+ * Off unless a budget is set with mb_pixbuf_image_cache_set_budget()
+ * or 'MBPIXBUF_IMAGE_CACHE' gives one in kilobytes. Every entry point
+ * takes the one lock, so MBPixbufs on different threads may share it.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+#include <pthread.h>
+
+#define CACHE_BUCKETS  256
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry
+{
+  char          *path;
+  unsigned int   hash;
+  dev_t          dev;
+  ino_t          ino;
+  off_t          size;
+  time_t         mtime;
+  int            width, height;	/* asked for, 0 for natural size */
+  int            internal_bytespp;
+  int            premultiply;
+
+  MBPixbufImage *img;
+  size_t         bytes;
+
+  CacheEntry    *hash_next;
+  CacheEntry    *lru_prev, *lru_next;	/* head is most recent */
+};
+
+static struct 
+{
+  Bool                  configured;
+  size_t                budget;
+  CacheEntry           *buckets[CACHE_BUCKETS];
+  CacheEntry           *lru_head, *lru_tail;
+  MBPixbufImageCacheStats stats;
+} _cache;
+
+static pthread_mutex_t _cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+_path_hash(const char *path)
+{
+  unsigned int h = 5381;
+
+  while (*path)
+    h = h * 33 + (unsigned char)*path++;
+
+  return h;
+}
+
+static void
+_cache_configure(void)
+{
+  char *env;
+
+  if (_cache.configured)
+    return;
+
+  _cache.configured = True;
+
+  if ((env = getenv("MBPIXBUF_IMAGE_CACHE")) != NULL)
+    _cache.budget = (size_t)strtoul(env, NULL, 10) * 1024;
+}
+
+static void
+_lru_unlink(CacheEntry *e)
+{
+  if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else             _cache.lru_head       = e->lru_next;
+
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else             _cache.lru_tail       = e->lru_prev;
+}
+
+static void
+_lru_push_head(CacheEntry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = _cache.lru_head;
+
+  if (_cache.lru_head) _cache.lru_head->lru_prev = e;
+  else                 _cache.lru_tail = e;
+
+  _cache.lru_head = e;
+}
+
+static void
+_cache_remove(MBPixbuf *pb, CacheEntry *e)
+{
+  CacheEntry **link = &_cache.buckets[e->hash % CACHE_BUCKETS];
+
+  while (*link != e)
+    link = &(*link)->hash_next;
+
+  *link = e->hash_next;
+  _lru_unlink(e);
+
+  _cache.stats.bytes -= e->bytes;
+  _cache.stats.entries--;
+
+  mb_pixbuf_img_free(pb, e->img);
+  free(e->path);
+  free(e);
+}
+
+static void
+_cache_trim(MBPixbuf *pb, size_t budget)
+{
+  while (_cache.lru_tail && _cache.stats.bytes > budget)
+    {
+      _cache_remove(pb, _cache.lru_tail);
+      _cache.stats.evictions++;
+    }
+}
+
+Bool
+_mb_pixbuf_image_cache_enabled(void)
+{
+  Bool enabled;
+
+  pthread_mutex_lock(&_cache_lock);
+  _cache_configure();
+  enabled = _cache.budget > 0;
+  pthread_mutex_unlock(&_cache_lock);
+
+  return enabled;
+}
+
+MBPixbufImage *
+_mb_pixbuf_image_cache_lookup(MBPixbuf          *pb,
+			      const char        *path,
+			      const struct stat *st,
+			      int                width,
+			      int                height)
+{
+  CacheEntry    *e;
+  MBPixbufImage *img = NULL;
+  unsigned int   hash = _path_hash(path);
+
+  pthread_mutex_lock(&_cache_lock);
+
+  for (e = _cache.buckets[hash % CACHE_BUCKETS]; e; e = e->hash_next)
+    if (e->hash == hash && !strcmp(e->path, path)
+	&& e->width == width && e->height == height
+	&& e->internal_bytespp == pb->internal_bytespp
+	&& e->premultiply == pb->premultiply)
+      break;
+
+  if (e != NULL
+      && (e->dev != st->st_dev || e->ino != st->st_ino
+	  || e->size != st->st_size || e->mtime != st->st_mtime))
+    {
+      /* File has changed under us */
+      _cache_remove(pb, e);
+      e = NULL;
+    }
+
+  if (e != NULL && (img = mb_pixbuf_img_clone(pb, e->img)) != NULL)
+    {
+      _lru_unlink(e);
+      _lru_push_head(e);
+      _cache.stats.hits++;
+    }
+  else
+    _cache.stats.misses++;
+
+  pthread_mutex_unlock(&_cache_lock);
+
+  return img;
+}
+
+void
+_mb_pixbuf_image_cache_insert(MBPixbuf          *pb,
+			      const char        *path,
+			      const struct stat *st,
+			      int                width,
+			      int                height,
+			      MBPixbufImage     *img)
+{
+  CacheEntry *e;
+  size_t      bytes;
+
+  bytes = (size_t)img->rowstride * img->height;
+
+  pthread_mutex_lock(&_cache_lock);
+
+  if (bytes > _cache.budget || (e = malloc(sizeof(CacheEntry))) == NULL)
+    goto out;
+
+  /* The caller has @img, the cache keeps its own clone of it */
+  if ((e->path = strdup(path)) == NULL
+      || (e->img = mb_pixbuf_img_clone(pb, img)) == NULL)
+    {
+      free(e->path);
+      free(e);
+      goto out;
+    }
+
+  e->hash             = _path_hash(path);
+  e->dev              = st->st_dev;
+  e->ino              = st->st_ino;
+  e->size             = st->st_size;
+  e->mtime            = st->st_mtime;
+  e->width            = width;
+  e->height           = height;
+  e->internal_bytespp = pb->internal_bytespp;
+  e->premultiply      = pb->premultiply;
+  e->bytes            = bytes;
+
+  e->hash_next = _cache.buckets[e->hash % CACHE_BUCKETS];
+  _cache.buckets[e->hash % CACHE_BUCKETS] = e;
+  _lru_push_head(e);
+
+  _cache.stats.bytes += bytes;
+  _cache.stats.entries++;
+
+  _cache_trim(pb, _cache.budget);
+
+ out:
+  pthread_mutex_unlock(&_cache_lock);
+}
+
+void
+mb_pixbuf_image_cache_set_budget(MBPixbuf *pb, size_t bytes)
+{
+  pthread_mutex_lock(&_cache_lock);
+
+  _cache.configured = True;
+  _cache.budget     = bytes;
+
+  _cache_trim(pb, bytes);
+
+  pthread_mutex_unlock(&_cache_lock);
+}
+
+void
+mb_pixbuf_image_cache_flush(MBPixbuf *pb)
+{
+  pthread_mutex_lock(&_cache_lock);
+
+  while (_cache.lru_tail)
+    _cache_remove(pb, _cache.lru_tail);
+
+  pthread_mutex_unlock(&_cache_lock);
+}
+
+void
+mb_pixbuf_image_cache_get_stats(MBPixbufImageCacheStats *stats)
+{
+  pthread_mutex_lock(&_cache_lock);
+
+  *stats = _cache.stats;
+  stats->budget = _cache.budget;
+
+  pthread_mutex_unlock(&_cache_lock);
+}
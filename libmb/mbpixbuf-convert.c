@@ -0,0 +1,406 @@
+/* mbpixbuf-convert.c libmb
+ *
+ * Row writers turning internal image data into XImage pixels, and
+ * readers doing the reverse.
+ *
+ * Rendering used to go through mb_pixbuf_get_pixel() and XPutPixel()
+ * for every pixel, switching on depth and byte order each time. Here a
+ * writer is picked once per render for the internal format, the XImage
+ * bits per pixel and its byte order, and fills whole rows of
+ * ximg->data directly. Whole byte 32 bit formats use the SIMD kernels.
+ * Grabs from drawables likewise read whole rows rather than going
+ * through XGetPixel().
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+/* Fetch a source pixel into r, g, b, a and step on */
+
+#define FETCH_RGB(s)                                  \
+      r = (s)[0]; g = (s)[1]; b = (s)[2]; a = 0xff;   \
+      (s) += 3;
+
+#define FETCH_RGBA(s)                                 \
+      r = (s)[0]; g = (s)[1]; b = (s)[2]; a = (s)[3]; \
+      (s) += 4;
+
+#define FETCH_565(s)                                  \
+      internal_16bpp_pixel_to_rgb((s), r, g, b);      \
+      a = 0xff;                                       \
+      (s) += 2;
+
+#define FETCH_565A(s)                                 \
+      internal_16bpp_pixel_to_rgb((s), r, g, b);      \
+      a = (s)[2];                                     \
+      (s) += 3;
+
+/* Store a pixel value and step on */
+
+#define STORE_16_LSB(d,p)                             \
+      (d)[0] = (p); (d)[1] = (p) >> 8;                \
+      (d) += 2;
+
+#define STORE_16_MSB(d,p)                             \
+      (d)[0] = (p) >> 8; (d)[1] = (p);                \
+      (d) += 2;
+
+#define STORE_24_LSB(d,p)                             \
+      (d)[0] = (p); (d)[1] = (p) >> 8; (d)[2] = (p) >> 16; \
+      (d) += 3;
+
+#define STORE_24_MSB(d,p)                             \
+      (d)[0] = (p) >> 16; (d)[1] = (p) >> 8; (d)[2] = (p); \
+      (d) += 3;
+
+#define STORE_32_LSB(d,p)                             \
+      (d)[0] = (p); (d)[1] = (p) >> 8;                \
+      (d)[2] = (p) >> 16; (d)[3] = (p) >> 24;         \
+      (d) += 4;
+
+#define STORE_32_MSB(d,p)                             \
+      (d)[0] = (p) >> 24; (d)[1] = (p) >> 16;         \
+      (d)[2] = (p) >> 8; (d)[3] = (p);                \
+      (d) += 4;
+
+#define DEFINE_WRITER(name, FETCH, STORE)                               \
+static void                                                             \
+name(const MBPixbufRowFormat *f,                                        \
+     unsigned char           *dp,                                       \
+     const unsigned char     *sp,                                       \
+     int                      n)                                        \
+{                                                                       \
+  unsigned long p;                                                      \
+  int           x, r, g, b, a;                                          \
+                                                                        \
+  for (x = 0; x < n; x++)                                               \
+    {                                                                   \
+      FETCH(sp)                                                         \
+      p = ((unsigned long)(r >> f->r_loss) << f->r_shift)               \
+	| ((unsigned long)(g >> f->g_loss) << f->g_shift)               \
+	| ((unsigned long)(b >> f->b_loss) << f->b_shift)               \
+	| (((unsigned long)a << f->a_shift) & f->a_mask);               \
+      STORE(dp,p)                                                       \
+    }                                                                   \
+}
+
+#define DEFINE_WRITERS(src, FETCH)                                      \
+  DEFINE_WRITER(_write_##src##_16_lsb, FETCH, STORE_16_LSB)             \
+  DEFINE_WRITER(_write_##src##_16_msb, FETCH, STORE_16_MSB)             \
+  DEFINE_WRITER(_write_##src##_24_lsb, FETCH, STORE_24_LSB)             \
+  DEFINE_WRITER(_write_##src##_24_msb, FETCH, STORE_24_MSB)             \
+  DEFINE_WRITER(_write_##src##_32_lsb, FETCH, STORE_32_LSB)             \
+  DEFINE_WRITER(_write_##src##_32_msb, FETCH, STORE_32_MSB)
+
+DEFINE_WRITERS(rgb,  FETCH_RGB)
+DEFINE_WRITERS(rgba, FETCH_RGBA)
+DEFINE_WRITERS(565,  FETCH_565)
+DEFINE_WRITERS(565a, FETCH_565A)
+
+#define WRITERS(src)                                                    \
+  { _write_##src##_16_lsb, _write_##src##_16_msb,                       \
+    _write_##src##_24_lsb, _write_##src##_24_msb,                       \
+    _write_##src##_32_lsb, _write_##src##_32_msb }
+
+/* [ 565, 565a, rgb, rgba ][ bits per pixel, byte order ] */
+static const MBPixbufWriteRowFunc _writers[4][6] = {
+  WRITERS(565),
+  WRITERS(565a),
+  WRITERS(rgb),
+  WRITERS(rgba)
+};
+
+/* Internal 565 is stored least significant byte first, as is a
+ * LSBFirst 565 XImage, so rows just copy.
+ */
+static void
+_write_565_to_565_lsb(const MBPixbufRowFormat *f,
+		      unsigned char           *d,
+		      const unsigned char     *s,
+		      int                      n)
+{
+  memcpy(d, s, n * 2);
+}
+
+static void
+_write_565a_to_565_lsb(const MBPixbufRowFormat *f,
+		       unsigned char           *d,
+		       const unsigned char     *s,
+		       int                      n)
+{
+  int x;
+
+  for (x = 0; x < n; x++, s += 3, d += 2)
+    {
+      d[0] = s[0];
+      d[1] = s[1];
+    }
+}
+
+static void
+_write_565_to_565_msb(const MBPixbufRowFormat *f,
+		      unsigned char           *d,
+		      const unsigned char     *s,
+		      int                      n)
+{
+  int x;
+
+  for (x = 0; x < n; x++, s += 2, d += 2)
+    {
+      d[0] = s[1];
+      d[1] = s[0];
+    }
+}
+
+static void
+_write_565a_to_565_msb(const MBPixbufRowFormat *f,
+		       unsigned char           *d,
+		       const unsigned char     *s,
+		       int                      n)
+{
+  int x;
+
+  for (x = 0; x < n; x++, s += 3, d += 2)
+    {
+      d[0] = s[1];
+      d[1] = s[0];
+    }
+}
+
+static void
+_channel_from_mask(unsigned long mask, int *shift, int *loss)
+{
+  int bits = 0;
+
+  *shift = 0;
+
+  if (!mask)
+    {
+      *loss = 8;
+      return;
+    }
+
+  while (!(mask & 1))
+    {
+      mask >>= 1;
+      (*shift)++;
+    }
+
+  while (mask & 1)
+    {
+      mask >>= 1;
+      bits++;
+    }
+
+  if (bits > 8)
+    {
+      /* Low bits of wide channels are left 0 */
+      *shift += bits - 8;
+      *loss   = 0;
+    }
+  else
+    *loss = 8 - bits;
+}
+
+static int
+_byte_offset(int shift, int msb_first)
+{
+  return msb_first ? 3 - shift / 8 : shift / 8;
+}
+
+/* Column of the _writers and _readers tables for an XImage, -1 when
+ * it needs the pixel at a time paths.
+ */
+static int
+_row_format(MBPixbuf *pb, XImage *ximg, MBPixbufRowFormat *f)
+{
+  int col;
+
+  /* Palette and gray visuals */
+  if (pb->depth <= 8)
+    return -1;
+
+  switch (ximg->bits_per_pixel)
+    {
+    case 16: col = 0; break;
+    case 24: col = 2; break;
+    case 32: col = 4; break;
+    default: return -1;
+    }
+
+  _channel_from_mask(pb->vis->red_mask,   &f->r_shift, &f->r_loss);
+  _channel_from_mask(pb->vis->green_mask, &f->g_shift, &f->g_loss);
+  _channel_from_mask(pb->vis->blue_mask,  &f->b_shift, &f->b_loss);
+
+  /* Matches mb_pixbuf_get_pixel(), only ARGB carries alpha */
+  f->a_shift = 24;
+  f->a_mask  = (pb->byte_order == MBPIXBUF_BYTE_ORDER_ARGB) ? 0xff000000UL : 0;
+  f->a_used  = (f->a_mask != 0);
+
+  return col + (ximg->byte_order == MSBFirst);
+}
+
+MBPixbufWriteRowFunc
+_mb_pixbuf_row_writer(MBPixbuf          *pb,
+		      MBPixbufImage     *img,
+		      XImage            *ximg,
+		      MBPixbufRowFormat *f)
+{
+  int src, dst, msb;
+
+  if ((dst = _row_format(pb, ximg, f)) < 0)
+    return NULL;
+
+  msb = (ximg->byte_order == MSBFirst);
+
+  src = (pb->internal_bytespp == 3) * 2 + (img->has_alpha != 0);
+
+  if (ximg->bits_per_pixel == 32
+      && !f->r_loss && !f->g_loss && !f->b_loss
+      && !(f->r_shift % 8) && !(f->g_shift % 8) && !(f->b_shift % 8)
+      && f->r_shift <= 24 && f->g_shift <= 24 && f->b_shift <= 24
+      && pb->internal_bytespp == 3)
+    {
+      f->r_byte = _byte_offset(f->r_shift, msb);
+      f->g_byte = _byte_offset(f->g_shift, msb);
+      f->b_byte = _byte_offset(f->b_shift, msb);
+      f->a_byte = 6 - f->r_byte - f->g_byte - f->b_byte;
+
+      return img->has_alpha ?
+	pb->kernels->write_rgba_row_32 : pb->kernels->write_rgb_row_32;
+    }
+
+  if (ximg->bits_per_pixel == 16 && pb->internal_bytespp == 2
+      && f->r_shift == 11 && f->r_loss == 3
+      && f->g_shift == 5  && f->g_loss == 2
+      && f->b_shift == 0  && f->b_loss == 3)
+    {
+      if (msb)
+	return img->has_alpha ? _write_565a_to_565_msb : _write_565_to_565_msb;
+
+      return img->has_alpha ? _write_565a_to_565_lsb : _write_565_to_565_lsb;
+    }
+
+  return _writers[src][dst];
+}
+
+/* Readers. Load an XImage pixel, put it as internal data leaving any
+ * alpha byte untouched.
+ */
+
+#define LOAD_16_LSB(s)                                \
+      p = (s)[0] | (s)[1] << 8;                       \
+      (s) += 2;
+
+#define LOAD_16_MSB(s)                                \
+      p = (s)[0] << 8 | (s)[1];                       \
+      (s) += 2;
+
+#define LOAD_24_LSB(s)                                \
+      p = (s)[0] | (s)[1] << 8 | (unsigned long)(s)[2] << 16; \
+      (s) += 3;
+
+#define LOAD_24_MSB(s)                                \
+      p = (unsigned long)(s)[0] << 16 | (s)[1] << 8 | (s)[2]; \
+      (s) += 3;
+
+#define LOAD_32_LSB(s)                                \
+      p = (s)[0] | (s)[1] << 8 | (unsigned long)(s)[2] << 16 \
+	| (unsigned long)(s)[3] << 24;                \
+      (s) += 4;
+
+#define LOAD_32_MSB(s)                                \
+      p = (unsigned long)(s)[0] << 24 | (unsigned long)(s)[1] << 16 \
+	| (s)[2] << 8 | (s)[3];                       \
+      (s) += 4;
+
+#define PUT_565(d)                                    \
+      internal_rgb_to_16bpp_pixel(r, g, b, (d));      \
+      (d) += 2;
+
+#define PUT_565A(d)                                   \
+      internal_rgb_to_16bpp_pixel(r, g, b, (d));      \
+      (d) += 3;
+
+#define PUT_RGB(d)                                    \
+      (d)[0] = r; (d)[1] = g; (d)[2] = b;             \
+      (d) += 3;
+
+#define PUT_RGBA(d)                                   \
+      (d)[0] = r; (d)[1] = g; (d)[2] = b;             \
+      (d) += 4;
+
+#define DEFINE_READER(name, LOAD, PUT)                                  \
+static void                                                             \
+name(const MBPixbufRowFormat *f,                                        \
+     unsigned char           *dp,                                       \
+     const unsigned char     *sp,                                       \
+     int                      n)                                        \
+{                                                                       \
+  unsigned long p;                                                      \
+  int           x, r, g, b;                                             \
+                                                                        \
+  for (x = 0; x < n; x++)                                               \
+    {                                                                   \
+      LOAD(sp)                                                          \
+      r = ((p >> f->r_shift) << f->r_loss) & 0xff;                      \
+      g = ((p >> f->g_shift) << f->g_loss) & 0xff;                      \
+      b = ((p >> f->b_shift) << f->b_loss) & 0xff;                      \
+      PUT(dp)                                                           \
+    }                                                                   \
+}
+
+#define DEFINE_READERS(dst, PUT)                                        \
+  DEFINE_READER(_read_16_lsb_##dst, LOAD_16_LSB, PUT)                   \
+  DEFINE_READER(_read_16_msb_##dst, LOAD_16_MSB, PUT)                   \
+  DEFINE_READER(_read_24_lsb_##dst, LOAD_24_LSB, PUT)                   \
+  DEFINE_READER(_read_24_msb_##dst, LOAD_24_MSB, PUT)                   \
+  DEFINE_READER(_read_32_lsb_##dst, LOAD_32_LSB, PUT)                   \
+  DEFINE_READER(_read_32_msb_##dst, LOAD_32_MSB, PUT)
+
+DEFINE_READERS(565,  PUT_565)
+DEFINE_READERS(565a, PUT_565A)
+DEFINE_READERS(rgb,  PUT_RGB)
+DEFINE_READERS(rgba, PUT_RGBA)
+
+#define READERS(dst)                                                    \
+  { _read_16_lsb_##dst, _read_16_msb_##dst,                             \
+    _read_24_lsb_##dst, _read_24_msb_##dst,                             \
+    _read_32_lsb_##dst, _read_32_msb_##dst }
+
+/* [ 565, 565a, rgb, rgba ][ bits per pixel, byte order ] */
+static const MBPixbufReadRowFunc _readers[4][6] = {
+  READERS(565),
+  READERS(565a),
+  READERS(rgb),
+  READERS(rgba)
+};
+
+MBPixbufReadRowFunc
+_mb_pixbuf_row_reader(MBPixbuf          *pb,
+		      XImage            *ximg,
+		      Bool               has_alpha,
+		      MBPixbufRowFormat *f)
+{
+  int src;
+
+  if ((src = _row_format(pb, ximg, f)) < 0)
+    return NULL;
+
+  return _readers[(pb->internal_bytespp == 3) * 2 + (has_alpha != 0)][src];
+}
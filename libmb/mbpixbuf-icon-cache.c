@@ -0,0 +1,567 @@
+/* mbpixbuf-icon-cache.c libmb
+ *
+ * On disk cache of decoded, and optionally scaled, images in the
+ * internal pixel layout, mapped straight into memory so loading an icon
+ * costs no decoding and no copying. Written by the mb-icon-cache tool.
+ *
+ * The file is, all in native byte order;
+ *
+ *   IconCacheHeader
+ *   IconCacheDir   dirs[n_dirs]      every directory images came from
+ *   IconCacheEntry entries[n_entries] sorted by path, width, height
+ *   strings                           nul terminated paths
+ *   pixel data                        each blob 16 byte aligned
+ *
+ * Like GTK's icon-theme.cache, the cache is only used while none of the
+ * directories has been modified more recently than the cache file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/mman.h>
+
+#define ICON_CACHE_MAGIC       "MBICACHE"
+#define ICON_CACHE_VERSION     1
+#define ICON_CACHE_BYTE_ORDER  0x01020304
+#define ICON_CACHE_ALIGN       16
+
+typedef struct IconCacheHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t internal_bytespp;
+  uint32_t premultiplied;
+  uint32_t n_dirs;
+  uint32_t dirs_offset;
+  uint32_t n_entries;
+  uint32_t entries_offset;
+} IconCacheHeader;
+
+typedef struct IconCacheDir
+{
+  uint32_t path_offset;
+} IconCacheDir;
+
+typedef struct IconCacheEntry
+{
+  uint32_t path_offset;
+  int32_t  width;	/* asked for, 0 for natural size */
+  int32_t  height;
+  int32_t  img_width;
+  int32_t  img_height;
+  uint32_t has_alpha;
+  uint32_t data_offset;
+  uint32_t data_size;
+} IconCacheEntry;
+
+struct MBPixbufIconCache
+{
+  unsigned char        *map;
+  size_t                size;
+  const IconCacheEntry *entries;
+  int                   n_entries;
+  int                   internal_bytespp;
+  int                   refcount;
+};
+
+static void
+_icon_cache_unref(MBPixbufIconCache *cache)
+{
+  if (--cache->refcount > 0)
+    return;
+
+  munmap(cache->map, cache->size);
+  free(cache);
+}
+
+/* A path at @offset, ending inside the map */
+static Bool
+_icon_cache_string_ok(unsigned char *map, size_t size, uint32_t offset)
+{
+  return offset < size && memchr(map + offset, 0, size - offset) != NULL;
+}
+
+static Bool
+_icon_cache_check(unsigned char *map, size_t size, time_t mtime)
+{
+  IconCacheHeader *hdr = (IconCacheHeader *)map;
+  IconCacheDir    *dirs;
+  IconCacheEntry  *entries;
+  struct stat      st;
+  uint32_t         i;
+
+  if (size < sizeof(IconCacheHeader)
+      || memcmp(hdr->magic, ICON_CACHE_MAGIC, 8)
+      || hdr->version != ICON_CACHE_VERSION
+      || hdr->byte_order != ICON_CACHE_BYTE_ORDER
+      || hdr->dirs_offset > size
+      || hdr->n_dirs > (size - hdr->dirs_offset) / sizeof(IconCacheDir)
+      || hdr->entries_offset > size
+      || hdr->n_entries > (size - hdr->entries_offset) / sizeof(IconCacheEntry))
+    return False;
+
+  /* Lookups compare against every entry's path */
+  entries = (IconCacheEntry *)(map + hdr->entries_offset);
+
+  for (i = 0; i < hdr->n_entries; i++)
+    if (!_icon_cache_string_ok(map, size, entries[i].path_offset))
+      return False;
+
+  dirs = (IconCacheDir *)(map + hdr->dirs_offset);
+
+  for (i = 0; i < hdr->n_dirs; i++)
+    {
+      if (!_icon_cache_string_ok(map, size, dirs[i].path_offset))
+	return False;
+
+      if (stat((char *)map + dirs[i].path_offset, &st)
+	  || st.st_mtime > mtime)
+	return False;
+    }
+
+  return True;
+}
+
+MBPixbufIconCache *
+mb_pixbuf_icon_cache_open(MBPixbuf *pb, const char *filename)
+{
+  MBPixbufIconCache *cache;
+  IconCacheHeader   *hdr;
+  struct stat        st;
+  unsigned char     *map;
+  int                fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return NULL;
+
+  if (fstat(fd, &st) || st.st_size < sizeof(IconCacheHeader))
+    {
+      close(fd);
+      return NULL;
+    }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  hdr = (IconCacheHeader *)map;
+
+  if (!_icon_cache_check(map, st.st_size, st.st_mtime)
+      || hdr->internal_bytespp != pb->internal_bytespp
+      || hdr->premultiplied != pb->premultiply)
+    {
+      munmap(map, st.st_size);
+      return NULL;
+    }
+
+  if ((cache = malloc(sizeof(MBPixbufIconCache))) == NULL)
+    {
+      munmap(map, st.st_size);
+      return NULL;
+    }
+
+  cache->map              = map;
+  cache->size             = st.st_size;
+  cache->entries          = (IconCacheEntry *)(map + hdr->entries_offset);
+  cache->n_entries        = hdr->n_entries;
+  cache->internal_bytespp = hdr->internal_bytespp;
+  cache->refcount         = 1;
+
+  return cache;
+}
+
+void
+mb_pixbuf_icon_cache_close(MBPixbufIconCache *cache)
+{
+  if (cache) _icon_cache_unref(cache);
+}
+
+static void
+_icon_cache_image_destroy(unsigned char *data, void *user_data)
+{
+  _icon_cache_unref(user_data);
+}
+
+static int
+_entry_cmp(const char *path, int width, int height, 
+	   const IconCacheEntry *e, const unsigned char *map)
+{
+  int r = strcmp(path, (const char *)map + e->path_offset);
+
+  if (r)                return r;
+  if (width != e->width)  return width - e->width;
+
+  return height - e->height;
+}
+
+MBPixbufImage *
+mb_pixbuf_icon_cache_lookup(MBPixbufIconCache *cache,
+			    const char        *path,
+			    int                width,
+			    int                height)
+{
+  const IconCacheEntry *e = NULL;
+  MBPixbufImage        *img;
+  int                   lo = 0, hi, mid, r;
+  size_t                bpp;
+
+  if (cache == NULL)
+    return NULL;
+
+  hi = cache->n_entries - 1;
+
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      r   = _entry_cmp(path, width, height, &cache->entries[mid], cache->map);
+
+      if (r == 0) { e = &cache->entries[mid]; break; }
+      if (r < 0)  hi = mid - 1;
+      else        lo = mid + 1;
+    }
+
+  if (e == NULL)
+    return NULL;
+
+  bpp = cache->internal_bytespp + (e->has_alpha ? 1 : 0);
+
+  if (e->data_offset > cache->size
+      || e->data_size > cache->size - e->data_offset
+      || (size_t)e->img_width * e->img_height * bpp != e->data_size)
+    return NULL;
+
+  if ((img = _mb_pixbuf_slab_img_alloc(NULL, 0)) == NULL)
+    return NULL;
+
+  img->width            = e->img_width;
+  img->height           = e->img_height;
+  img->rgba             = cache->map + e->data_offset;
+  img->has_alpha        = e->has_alpha ? 1 : 0;
+  img->ximg             = NULL;
+  img->internal_bytespp = cache->internal_bytespp;
+  img->rowstride        = e->img_width * bpp;
+  img->premultiplied    = ((IconCacheHeader *)cache->map)->premultiplied;
+  img->refcount         = 1;
+  img->destroy_fn       = _icon_cache_image_destroy;
+  img->destroy_data     = cache;
+
+  /* The map is read only, drawing on the image copies it */
+  _mb_pixbuf_img_set_read_only(img);
+
+  cache->refcount++;
+
+  return img;
+}
+
+void
+mb_pixbuf_set_icon_cache(MBPixbuf *pb, MBPixbufIconCache *cache)
+{
+  if (cache) cache->refcount++;
+  if (pb->icon_cache) _icon_cache_unref(pb->icon_cache);
+
+  pb->icon_cache = cache;
+}
+
+/* Writing */
+
+typedef struct BuildEntry
+{
+  const char    *path;
+  int            width, height;
+  MBPixbufImage *img;
+} BuildEntry;
+
+static int
+_build_entry_sort(const void *a, const void *b)
+{
+  const BuildEntry *ea = a, *eb = b;
+  int r = strcmp(ea->path, eb->path);
+
+  if (r) return r;
+  if (ea->width != eb->width) return ea->width - eb->width;
+
+  return ea->height - eb->height;
+}
+
+static char *
+_dir_of(const char *path)
+{
+  char *dir, *slash;
+
+  if ((dir = strdup(path)) == NULL)
+    return NULL;
+
+  if ((slash = strrchr(dir, '/')) == NULL)
+    {
+      free(dir);
+      return strdup(".");
+    }
+
+  if (slash == dir) slash++;
+  *slash = '\0';
+
+  return dir;
+}
+
+static Bool
+_write_padded(FILE *fp, const void *data, size_t size, size_t *offset)
+{
+  static const unsigned char zeros[ICON_CACHE_ALIGN];
+  size_t pad = (ICON_CACHE_ALIGN - (*offset % ICON_CACHE_ALIGN)) 
+               % ICON_CACHE_ALIGN;
+
+  if (pad && fwrite(zeros, 1, pad, fp) != pad)
+    return False;
+
+  *offset += pad;
+
+  if (size && fwrite(data, 1, size, fp) != size)
+    return False;
+
+  *offset += size;
+  return True;
+}
+
+/* Entries are stored packed, so drop any padding on the end of rows */
+static Bool
+_write_image(FILE *fp, MBPixbufImage *img, size_t *offset)
+{
+  size_t len = img->width * (img->internal_bytespp + img->has_alpha);
+  int    y;
+
+  if (!_write_padded(fp, NULL, 0, offset))
+    return False;
+
+  for (y = 0; y < img->height; y++)
+    if (len && fwrite(img->rgba + y * img->rowstride, 1, len, fp) != len)
+      return False;
+
+  *offset += len * img->height;
+  return True;
+}
+
+Bool
+mb_pixbuf_icon_cache_build(MBPixbuf    *pb,
+			   const char  *filename,
+			   const char **paths,
+			   int          n_paths,
+			   const int   *sizes,
+			   int          n_sizes)
+{
+  static const int natural = 0;
+  IconCacheHeader  hdr;
+  IconCacheDir    *dirs = NULL;
+  IconCacheEntry  *entries = NULL;
+  BuildEntry      *build;
+  char           **dir_names, *tmpname = NULL;
+  size_t           offset, data_offset;
+  FILE            *fp = NULL;
+  Bool             ok = False;
+  int              i, j, n = 0, n_dirs = 0, fd = -1;
+
+  if (n_sizes == 0) 
+    {
+      sizes   = &natural;
+      n_sizes = 1;
+    }
+
+  build     = malloc((n_paths ? n_paths * n_sizes : 1) * sizeof(BuildEntry));
+  dir_names = malloc((n_paths ? n_paths : 1) * sizeof(char *));
+
+  if (build == NULL || dir_names == NULL)
+    goto out;
+
+  for (i = 0; i < n_paths; i++)
+    {
+      MBPixbufImage *img;
+      char          *dir;
+
+      /* Straight from the decoder, not from any cache */
+      if ((img = _mb_pixbuf_img_load_file(pb, paths[i], 0, 0)) == NULL)
+	continue;
+
+      if ((dir = _dir_of(paths[i])) == NULL)
+	{
+	  mb_pixbuf_img_free(pb, img);
+	  goto out;
+	}
+
+      for (j = 0; j < n_dirs; j++)
+	if (!strcmp(dir_names[j], dir))
+	  break;
+
+      if (j == n_dirs)
+	dir_names[n_dirs++] = dir;
+      else
+	free(dir);
+
+      for (j = 0; j < n_sizes; j++)
+	{
+	  build[n].path   = paths[i];
+	  build[n].width  = sizes[j];
+	  build[n].height = sizes[j];
+
+	  if (sizes[j] > 0 
+	      && (sizes[j] != img->width || sizes[j] != img->height))
+	    build[n].img = mb_pixbuf_img_scale(pb, img, sizes[j], sizes[j]);
+	  else
+	    build[n].img = mb_pixbuf_img_ref(img);
+
+	  if (build[n].img == NULL)
+	    {
+	      mb_pixbuf_img_free(pb, img);
+	      goto out;
+	    }
+
+	  n++;
+	}
+
+      mb_pixbuf_img_free(pb, img);
+    }
+
+  qsort(build, n, sizeof(BuildEntry), _build_entry_sort);
+
+  /* Lay the file out */
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, ICON_CACHE_MAGIC, 8);
+
+  hdr.version          = ICON_CACHE_VERSION;
+  hdr.byte_order       = ICON_CACHE_BYTE_ORDER;
+  hdr.internal_bytespp = pb->internal_bytespp;
+  hdr.premultiplied    = pb->premultiply;
+  hdr.n_dirs           = n_dirs;
+  hdr.dirs_offset      = sizeof(hdr);
+  hdr.n_entries        = n;
+  hdr.entries_offset   = hdr.dirs_offset + n_dirs * sizeof(IconCacheDir);
+
+  dirs    = calloc(n_dirs ? n_dirs : 1, sizeof(IconCacheDir));
+  entries = calloc(n ? n : 1, sizeof(IconCacheEntry));
+
+  if (dirs == NULL || entries == NULL)
+    goto out;
+
+  offset = hdr.entries_offset + n * sizeof(IconCacheEntry);
+
+  for (i = 0; i < n_dirs; i++)
+    {
+      dirs[i].path_offset = offset;
+      offset += strlen(dir_names[i]) + 1;
+    }
+
+  for (i = 0; i < n; i++)
+    if (i > 0 && !strcmp(build[i].path, build[i-1].path))
+      entries[i].path_offset = entries[i-1].path_offset;
+    else
+      {
+	entries[i].path_offset = offset;
+	offset += strlen(build[i].path) + 1;
+      }
+
+  data_offset = offset;
+
+  for (i = 0; i < n; i++)
+    {
+      MBPixbufImage *img = build[i].img;
+
+      offset = (offset + ICON_CACHE_ALIGN - 1) & ~(size_t)(ICON_CACHE_ALIGN - 1);
+
+      entries[i].width       = build[i].width;
+      entries[i].height      = build[i].height;
+      entries[i].img_width   = img->width;
+      entries[i].img_height  = img->height;
+      entries[i].has_alpha   = img->has_alpha;
+      entries[i].data_offset = offset;
+      entries[i].data_size   = img->width * img->height 
+	                         * (pb->internal_bytespp + img->has_alpha);
+      offset += entries[i].data_size;
+    }
+
+  /* Write to the side and rename, so readers never see half a file */
+  if ((tmpname = malloc(strlen(filename) + 8)) == NULL)
+    goto out;
+
+  sprintf(tmpname, "%s.XXXXXX", filename);
+
+  if ((fd = mkstemp(tmpname)) < 0)
+    goto out;
+
+  fchmod(fd, 0644);
+
+  if ((fp = fdopen(fd, "wb")) == NULL)
+    {
+      close(fd);
+      goto out;
+    }
+
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+      || fwrite(dirs, sizeof(IconCacheDir), n_dirs, fp) != n_dirs
+      || fwrite(entries, sizeof(IconCacheEntry), n, fp) != n)
+    goto out;
+
+  for (i = 0; i < n_dirs; i++)
+    if (fwrite(dir_names[i], 1, strlen(dir_names[i]) + 1, fp) 
+	!= strlen(dir_names[i]) + 1)
+      goto out;
+
+  for (i = 0; i < n; i++)
+    if (i == 0 || strcmp(build[i].path, build[i-1].path))
+      if (fwrite(build[i].path, 1, strlen(build[i].path) + 1, fp) 
+	  != strlen(build[i].path) + 1)
+	goto out;
+
+  offset = data_offset;
+
+  for (i = 0; i < n; i++)
+    if (!_write_image(fp, build[i].img, &offset))
+      goto out;
+
+  if (fclose(fp) == 0)
+    {
+      fp = NULL;
+      ok = (rename(tmpname, filename) == 0);
+
+      /* The rename touches the directory if the cache is kept alongside
+       * the images, so make sure the cache is the newer.
+       */
+      if (ok) utime(filename, NULL);
+    }
+
+ out:
+  if (fp) fclose(fp);
+  if (!ok && fd >= 0) unlink(tmpname);
+
+  for (i = 0; i < n; i++)
+    mb_pixbuf_img_free(pb, build[i].img);
+
+  for (i = 0; i < n_dirs; i++)
+    free(dir_names[i]);
+
+  free(tmpname);
+  free(build);
+  free(dir_names);
+  free(dirs);
+  free(entries);
+
+  return ok;
+}
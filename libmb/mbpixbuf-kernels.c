@@ -0,0 +1,1278 @@
+/* mbpixbuf-kernels.c libmb
+ *
+ * Copyright (C) 2002 Matthew Allum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Pixel row kernels used by mbpixbuf.c, with SSE2/SSSE3/AVX2 and NEON
+ * versions picked at runtime.
+ *
+ * All versions of the straight alpha kernels use the same blend as
+ * alpha_composite();
+ *
+ *   t = fg * a + bg * (255 - a) + 128
+ *   c = (t + (t >> 8)) >> 8
+ *
+ * which is an exact rounded divide by 255 for every input, the 0 and
+ * 255 alpha special cases in the macro are only shortcuts. t never goes
+ * above 65407, so it fits an unsigned 16 bit lane.
+ */
+
+#include "mbpixbuf-private.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define MBPIXBUF_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MBPIXBUF_NEON_SIMD 1
+#include <arm_neon.h>
+#endif
+
+static inline int
+_clamp_alpha_level(int alpha_level)
+{
+  if (alpha_level > 255)  return 255;
+  if (alpha_level < -255) return -255;
+  return alpha_level;
+}
+
+/* Plain C */
+
+static void
+_over_rgb_row_c(unsigned char       *dp,
+		const unsigned char *sp,
+		int                  n,
+		int                  alpha_level,
+		int                  write_alpha)
+{
+  int x, a;
+
+  for (x = 0; x < n; x++)
+    {
+      a = sp[3];
+
+      if (alpha_level)
+	{
+	  a += alpha_level;
+	  if (a < 0) a = 0;
+	  if (a > 255) a = 255;
+	}
+
+      alpha_composite(dp[0], sp[0], a, dp[0]);
+      alpha_composite(dp[1], sp[1], a, dp[1]);
+      alpha_composite(dp[2], sp[2], a, dp[2]);
+
+      sp += 4;
+      dp += 3;
+    }
+}
+
+static void
+_over_rgba_row_c(unsigned char       *dp,
+		 const unsigned char *sp,
+		 int                  n,
+		 int                  alpha_level,
+		 int                  write_alpha)
+{
+  int x, a;
+
+  for (x = 0; x < n; x++)
+    {
+      a = sp[3];
+
+      if (alpha_level)
+	{
+	  a += alpha_level;
+	  if (a < 0) a = 0;
+	  if (a > 255) a = 255;
+	}
+
+      alpha_composite(dp[0], sp[0], a, dp[0]);
+      alpha_composite(dp[1], sp[1], a, dp[1]);
+      alpha_composite(dp[2], sp[2], a, dp[2]);
+
+      if (write_alpha) dp[3] = a;
+
+      sp += 4;
+      dp += 4;
+    }
+}
+
+/* 565, on packed pixels in spread form. Shared by every kernel set. */
+
+static void
+_over_565_row(unsigned char       *dp,
+	      const unsigned char *sp,
+	      int                  n,
+	      int                  alpha_level,
+	      int                  write_alpha)
+{
+  unsigned short s, d;
+  int x, a;
+
+  for (x = 0; x < n; x++, sp += 3, dp += 2)
+    {
+      a = sp[2];
+
+      if (alpha_level)
+	{
+	  a += alpha_level;
+	  if (a < 0) a = 0;
+	  if (a > 255) a = 255;
+	}
+
+      if (a == 0)
+	continue;
+
+      s = SHORT_FROM_2BYTES(sp);
+
+      if (a != 255)
+	{
+	  d = SHORT_FROM_2BYTES(dp);
+	  s = _mb_blend_565(spread_from_565(s), spread_from_565(d), a);
+	}
+
+      BYTES_FROM_SHORT(dp, s);
+    }
+}
+
+static void
+_over_565a_row(unsigned char       *dp,
+	       const unsigned char *sp,
+	       int                  n,
+	       int                  alpha_level,
+	       int                  write_alpha)
+{
+  unsigned short s, d;
+  int x, a;
+
+  for (x = 0; x < n; x++, sp += 3, dp += 3)
+    {
+      a = sp[2];
+
+      if (alpha_level)
+	{
+	  a += alpha_level;
+	  if (a < 0) a = 0;
+	  if (a > 255) a = 255;
+	}
+
+      if (write_alpha)
+	dp[2] = a;
+
+      if (a == 0)
+	continue;
+
+      s = SHORT_FROM_2BYTES(sp);
+
+      if (a != 255)
+	{
+	  d = SHORT_FROM_2BYTES(dp);
+	  s = _mb_blend_565(spread_from_565(s), spread_from_565(d), a);
+	}
+
+      BYTES_FROM_SHORT(dp, s);
+    }
+}
+
+/* Premultiplied sources; dst = src + dst * (255 - a) / 255 */
+
+static inline unsigned char
+_premul_over(int s, int d, int ialpha)
+{
+  int t = d * ialpha + 128;
+
+  t = s + ((t + (t >> 8)) >> 8);
+  return (t > 255) ? 255 : t;
+}
+
+/* Fetches a premultiplied rgba source pixel into @c, returning its
+ * alpha. A non zero @alpha_level means rescaling the color channels to
+ * the new alpha, the only place a divide is needed.
+ */
+static inline int
+_premul_source(const unsigned char *sp, int a, int alpha_level, int *c)
+{
+  int na, i;
+
+  if (!alpha_level)
+    return a;
+
+  na = a + alpha_level;
+  if (na < 0) na = 0;
+  if (na > 255) na = 255;
+
+  for (i = 0; i < 3; i++)
+    {
+      if (a == 0)
+	c[i] = 0;
+      else
+	{
+	  c[i] = (c[i] * na + a / 2) / a;
+	  if (c[i] > 255) c[i] = 255;
+	}
+    }
+
+  return na;
+}
+
+static void
+_over_premul_rgb_row_c(unsigned char       *dp,
+		       const unsigned char *sp,
+		       int                  n,
+		       int                  alpha_level,
+		       int                  write_alpha)
+{
+  int x, a, c[3];
+
+  for (x = 0; x < n; x++, sp += 4, dp += 3)
+    {
+      c[0] = sp[0]; c[1] = sp[1]; c[2] = sp[2];
+      a = _premul_source(sp, sp[3], alpha_level, c);
+
+      dp[0] = _premul_over(c[0], dp[0], 255 - a);
+      dp[1] = _premul_over(c[1], dp[1], 255 - a);
+      dp[2] = _premul_over(c[2], dp[2], 255 - a);
+    }
+}
+
+static void
+_over_premul_rgba_row_c(unsigned char       *dp,
+			const unsigned char *sp,
+			int                  n,
+			int                  alpha_level,
+			int                  write_alpha)
+{
+  int x, a, c[3];
+
+  for (x = 0; x < n; x++, sp += 4, dp += 4)
+    {
+      c[0] = sp[0]; c[1] = sp[1]; c[2] = sp[2];
+      a = _premul_source(sp, sp[3], alpha_level, c);
+
+      dp[0] = _premul_over(c[0], dp[0], 255 - a);
+      dp[1] = _premul_over(c[1], dp[1], 255 - a);
+      dp[2] = _premul_over(c[2], dp[2], 255 - a);
+
+      if (write_alpha) dp[3] = a;
+    }
+}
+
+#define SPREAD_565_LANE_ONE  ((uint64_t)1 << 42 | (uint64_t)1 << 21 | 1)
+
+static inline unsigned short
+_premul_over_565(uint64_t src, uint64_t dst, int ialpha)
+{
+  uint64_t t;
+
+  t = dst * ialpha + SPREAD_565_LANE_ROUND;
+  t = t + ((t >> 8) & SPREAD_565_LANE_MASK);
+  t = ((t >> 8) & SPREAD_565_LANE_MASK) + src;
+
+  /* saturate any lane that went past 255 */
+  t |= ((t >> 8) & SPREAD_565_LANE_ONE) * 0xff;
+
+  return spread_to_565(t & SPREAD_565_LANE_MASK);
+}
+
+static inline uint64_t
+_premul_source_565(const unsigned char *sp, int *a, int alpha_level)
+{
+  unsigned short s = SHORT_FROM_2BYTES(sp);
+  int c[3];
+
+  if (!alpha_level)
+    return spread_from_565(s);
+
+  internal_16bpp_pixel_to_rgb(sp, c[0], c[1], c[2]);
+  *a = _premul_source(sp, *a, alpha_level, c);
+
+  return spread_from_rgb(c[0], c[1], c[2]);
+}
+
+static void
+_over_premul_565_row(unsigned char       *dp,
+		     const unsigned char *sp,
+		     int                  n,
+		     int                  alpha_level,
+		     int                  write_alpha)
+{
+  unsigned short d;
+  uint64_t s;
+  int x, a;
+
+  for (x = 0; x < n; x++, sp += 3, dp += 2)
+    {
+      a = sp[2];
+      s = _premul_source_565(sp, &a, alpha_level);
+
+      d = SHORT_FROM_2BYTES(dp);
+      d = _premul_over_565(s, spread_from_565(d), 255 - a);
+      BYTES_FROM_SHORT(dp, d);
+    }
+}
+
+static void
+_over_premul_565a_row(unsigned char       *dp,
+		      const unsigned char *sp,
+		      int                  n,
+		      int                  alpha_level,
+		      int                  write_alpha)
+{
+  unsigned short d;
+  uint64_t s;
+  int x, a;
+
+  for (x = 0; x < n; x++, sp += 3, dp += 3)
+    {
+      a = sp[2];
+      s = _premul_source_565(sp, &a, alpha_level);
+
+      d = SHORT_FROM_2BYTES(dp);
+      d = _premul_over_565(s, spread_from_565(d), 255 - a);
+      BYTES_FROM_SHORT(dp, d);
+
+      if (write_alpha) dp[2] = a;
+    }
+}
+
+/* Premultiplied destinations, shared by every kernel set. The result
+ * must match compositing onto the same destination in straight form, so
+ * the destination is unpremultiplied, blended as alpha_composite() does
+ * and premultiplied again by the alpha it is left with.
+ */
+
+static inline void
+_over_to_premul_row(unsigned char       *dp,
+		    const unsigned char *sp,
+		    int                  n,
+		    int                  alpha_level,
+		    int                  write_alpha,
+		    int                  bytespp,
+		    int                  src_premul)
+{
+  int x, i, a, sa, da, oa, sc[3], dc[3];
+
+  for (x = 0; x < n; x++, sp += bytespp + 1, dp += bytespp + 1)
+    {
+      sa = sp[bytespp];
+      da = dp[bytespp];
+      a  = sa;
+
+      if (alpha_level)
+	{
+	  a += alpha_level;
+	  if (a < 0) a = 0;
+	  if (a > 255) a = 255;
+	}
+
+      oa = write_alpha ? a : da;
+
+      if (bytespp == 2)
+	{
+	  internal_16bpp_pixel_to_rgb(sp, sc[0], sc[1], sc[2]);
+	  internal_16bpp_pixel_to_rgb(dp, dc[0], dc[1], dc[2]);
+	}
+      else
+	{
+	  sc[0] = sp[0]; sc[1] = sp[1]; sc[2] = sp[2];
+	  dc[0] = dp[0]; dc[1] = dp[1]; dc[2] = dp[2];
+	}
+
+      for (i = 0; i < 3; i++)
+	{
+	  if (src_premul)
+	    sc[i] = _mb_unpremultiply(sc[i], sa);
+
+	  dc[i] = _mb_unpremultiply(dc[i], da);
+	  alpha_composite(dc[i], sc[i], a, dc[i]);
+	  dc[i] = _mb_premultiply(dc[i], oa);
+	}
+
+      if (bytespp == 2)
+	internal_rgb_to_16bpp_pixel(dc[0], dc[1], dc[2], dp)
+      else
+	{ dp[0] = dc[0]; dp[1] = dc[1]; dp[2] = dc[2]; }
+
+      dp[bytespp] = oa;
+    }
+}
+
+static void
+_over_to_premul_rgba_row(unsigned char       *dp,
+			 const unsigned char *sp,
+			 int                  n,
+			 int                  alpha_level,
+			 int                  write_alpha)
+{
+  _over_to_premul_row(dp, sp, n, alpha_level, write_alpha, 3, False);
+}
+
+static void
+_over_premul_to_premul_rgba_row(unsigned char       *dp,
+				const unsigned char *sp,
+				int                  n,
+				int                  alpha_level,
+				int                  write_alpha)
+{
+  _over_to_premul_row(dp, sp, n, alpha_level, write_alpha, 3, True);
+}
+
+static void
+_over_to_premul_565a_row(unsigned char       *dp,
+			 const unsigned char *sp,
+			 int                  n,
+			 int                  alpha_level,
+			 int                  write_alpha)
+{
+  _over_to_premul_row(dp, sp, n, alpha_level, write_alpha, 2, False);
+}
+
+static void
+_over_premul_to_premul_565a_row(unsigned char       *dp,
+				const unsigned char *sp,
+				int                  n,
+				int                  alpha_level,
+				int                  write_alpha)
+{
+  _over_to_premul_row(dp, sp, n, alpha_level, write_alpha, 2, True);
+}
+
+static void
+_write_rgb_row_32_c(const MBPixbufRowFormat *fmt,
+		    unsigned char           *dp,
+		    const unsigned char     *sp,
+		    int                      n)
+{
+  unsigned char a = fmt->a_used ? 0xff : 0;
+  int x;
+
+  for (x = 0; x < n; x++, sp += 3, dp += 4)
+    {
+      dp[fmt->r_byte] = sp[0];
+      dp[fmt->g_byte] = sp[1];
+      dp[fmt->b_byte] = sp[2];
+      dp[fmt->a_byte] = a;
+    }
+}
+
+static void
+_write_rgba_row_32_c(const MBPixbufRowFormat *fmt,
+		     unsigned char           *dp,
+		     const unsigned char     *sp,
+		     int                      n)
+{
+  int x;
+
+  for (x = 0; x < n; x++, sp += 4, dp += 4)
+    {
+      dp[fmt->r_byte] = sp[0];
+      dp[fmt->g_byte] = sp[1];
+      dp[fmt->b_byte] = sp[2];
+      dp[fmt->a_byte] = fmt->a_used ? sp[3] : 0;
+    }
+}
+
+static void
+_scale_vfilter_row_c(unsigned char               *dst,
+		     const unsigned short *const *rows,
+		     const short                 *weights,
+		     int                          ntaps,
+		     int                          n)
+{
+  int x, k, acc;
+
+  for (x = 0; x < n; x++)
+    {
+      acc = 1 << 20;
+
+      for (k = 0; k < ntaps; k++)
+	acc += weights[k] * rows[k][x];
+
+      acc >>= 21;
+      dst[x] = (acc > 255) ? 255 : acc;
+    }
+}
+
+static const MBPixbufKernels _kernels_c = {
+  "c",
+  _over_rgb_row_c,
+  _over_rgba_row_c,
+  _over_565_row,
+  _over_565a_row,
+  _over_premul_rgb_row_c,
+  _over_premul_rgba_row_c,
+  _over_premul_565_row,
+  _over_premul_565a_row,
+  _over_to_premul_rgba_row,
+  _over_premul_to_premul_rgba_row,
+  _over_to_premul_565a_row,
+  _over_premul_to_premul_565a_row,
+  _write_rgb_row_32_c,
+  _write_rgba_row_32_c,
+  _scale_vfilter_row_c
+};
+
+#ifdef MBPIXBUF_X86_SIMD
+
+/* SSE2, 4 pixels per iteration */
+
+__attribute__((target("sse2")))
+static inline __m128i
+_blend_epi16_sse2(__m128i s, __m128i d, __m128i a)
+{
+  __m128i t;
+
+  t = _mm_add_epi16(_mm_mullo_epi16(s, a),
+		    _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+  t = _mm_add_epi16(t, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/* Blend four rgba pixels, @s over @d, returning rgba with the alpha
+ * byte taken from the adjusted source alpha or left as in @d.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+_over4_sse2(__m128i s, __m128i d, int alpha_level, int write_alpha)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+  __m128i a, ab, lo, hi;
+
+  a = _mm_srli_epi32(s, 24);
+
+  if (alpha_level > 0)
+    a = _mm_adds_epu8(a, _mm_set1_epi32(alpha_level));
+  else if (alpha_level < 0)
+    a = _mm_subs_epu8(a, _mm_set1_epi32(-alpha_level));
+
+  ab = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+  ab = _mm_or_si128(ab, _mm_slli_epi32(ab, 16));
+
+  lo = _blend_epi16_sse2(_mm_unpacklo_epi8(s, zero),
+			 _mm_unpacklo_epi8(d, zero),
+			 _mm_unpacklo_epi8(ab, zero));
+  hi = _blend_epi16_sse2(_mm_unpackhi_epi8(s, zero),
+			 _mm_unpackhi_epi8(d, zero),
+			 _mm_unpackhi_epi8(ab, zero));
+
+  lo = _mm_and_si128(_mm_packus_epi16(lo, hi), rgb_mask);
+
+  if (write_alpha)
+    return _mm_or_si128(lo, _mm_slli_epi32(a, 24));
+
+  return _mm_or_si128(lo, _mm_andnot_si128(rgb_mask, d));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+_div255_epi16_sse2(__m128i x)
+{
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* As above for a premultiplied @s, alpha_level must be 0 */
+__attribute__((target("sse2")))
+static inline __m128i
+_over4_premul_sse2(__m128i s, __m128i d, int write_alpha)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+  __m128i a, ia, lo, hi;
+
+  a  = _mm_srli_epi32(s, 24);
+  ia = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+  ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+  ia = _mm_xor_si128(ia, _mm_set1_epi32(-1));
+
+  lo = _div255_epi16_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+					  _mm_unpacklo_epi8(ia, zero)));
+  hi = _div255_epi16_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+					  _mm_unpackhi_epi8(ia, zero)));
+
+  lo = _mm_and_si128(_mm_adds_epu8(_mm_packus_epi16(lo, hi), s), rgb_mask);
+
+  if (write_alpha)
+    return _mm_or_si128(lo, _mm_slli_epi32(a, 24));
+
+  return _mm_or_si128(lo, _mm_andnot_si128(rgb_mask, d));
+}
+
+__attribute__((target("sse2")))
+static void
+_over_premul_rgba_row_sse2(unsigned char       *dp,
+			   const unsigned char *sp,
+			   int                  n,
+			   int                  alpha_level,
+			   int                  write_alpha)
+{
+  int x = 0;
+
+  if (!alpha_level)
+    for (; x + 4 <= n; x += 4, sp += 16, dp += 16)
+      {
+	__m128i s = _mm_loadu_si128((const __m128i *)sp);
+	__m128i d = _mm_loadu_si128((const __m128i *)dp);
+
+	_mm_storeu_si128((__m128i *)dp, _over4_premul_sse2(s, d, write_alpha));
+      }
+
+  if (x < n)
+    _over_premul_rgba_row_c(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+__attribute__((target("sse2")))
+static void
+_over_rgba_row_sse2(unsigned char       *dp,
+		    const unsigned char *sp,
+		    int                  n,
+		    int                  alpha_level,
+		    int                  write_alpha)
+{
+  int x = 0;
+
+  alpha_level = _clamp_alpha_level(alpha_level);
+
+  for (; x + 4 <= n; x += 4, sp += 16, dp += 16)
+    {
+      __m128i s = _mm_loadu_si128((const __m128i *)sp);
+      __m128i d = _mm_loadu_si128((const __m128i *)dp);
+
+      _mm_storeu_si128((__m128i *)dp,
+		       _over4_sse2(s, d, alpha_level, write_alpha));
+    }
+
+  if (x < n)
+    _over_rgba_row_c(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+/* SSSE3, 4 pixels per iteration onto a packed rgb row */
+
+__attribute__((target("ssse3")))
+static inline void
+_over_rgb_row_ssse3_generic(unsigned char       *dp,
+			    const unsigned char *sp,
+			    int                  n,
+			    int                  alpha_level,
+			    int                  premul)
+{
+  const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+				       6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i pack   = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+				       10, 12, 13, 14, -1, -1, -1, -1);
+  int x = 0;
+
+  alpha_level = _clamp_alpha_level(alpha_level);
+
+  if (!premul || !alpha_level)
+    for (; x + 4 <= n; x += 4, sp += 16, dp += 12)
+      {
+	__m128i s, d;
+	unsigned int tail;
+
+	memcpy(&tail, dp + 8, 4);
+	d = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)dp),
+			       _mm_cvtsi32_si128(tail));
+	d = _mm_shuffle_epi8(d, expand);
+	s = _mm_loadu_si128((const __m128i *)sp);
+
+	if (premul)
+	  d = _over4_premul_sse2(s, d, 0);
+	else
+	  d = _over4_sse2(s, d, alpha_level, 0);
+
+	d = _mm_shuffle_epi8(d, pack);
+
+	_mm_storel_epi64((__m128i *)dp, d);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(d, 8));
+	memcpy(dp + 8, &tail, 4);
+      }
+
+  if (x < n)
+    {
+      if (premul)
+	_over_premul_rgb_row_c(dp, sp, n - x, alpha_level, 0);
+      else
+	_over_rgb_row_c(dp, sp, n - x, alpha_level, 0);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void
+_over_rgb_row_ssse3(unsigned char       *dp,
+		    const unsigned char *sp,
+		    int                  n,
+		    int                  alpha_level,
+		    int                  write_alpha)
+{
+  _over_rgb_row_ssse3_generic(dp, sp, n, alpha_level, 0);
+}
+
+__attribute__((target("ssse3")))
+static void
+_over_premul_rgb_row_ssse3(unsigned char       *dp,
+			   const unsigned char *sp,
+			   int                  n,
+			   int                  alpha_level,
+			   int                  write_alpha)
+{
+  _over_rgb_row_ssse3_generic(dp, sp, n, alpha_level, 1);
+}
+
+/* pshufb mask placing 4 source pixels of @src_bpp bytes as 32 bit ones */
+__attribute__((target("ssse3")))
+static __m128i
+_write_32_mask_ssse3(const MBPixbufRowFormat *fmt, int src_bpp)
+{
+  char m[16];
+  int  i;
+
+  for (i = 0; i < 4; i++)
+    {
+      m[i*4 + fmt->r_byte] = i * src_bpp;
+      m[i*4 + fmt->g_byte] = i * src_bpp + 1;
+      m[i*4 + fmt->b_byte] = i * src_bpp + 2;
+      m[i*4 + fmt->a_byte] = (src_bpp == 4 && fmt->a_used) ? i * 4 + 3 : -1;
+    }
+
+  return _mm_loadu_si128((const __m128i *)m);
+}
+
+__attribute__((target("ssse3")))
+static void
+_write_rgb_row_32_ssse3(const MBPixbufRowFormat *fmt,
+			unsigned char           *dp,
+			const unsigned char     *sp,
+			int                      n)
+{
+  __m128i mask, fill;
+  int     x = 0;
+
+  mask = _write_32_mask_ssse3(fmt, 3);
+  fill = _mm_set1_epi32(fmt->a_used ? 0xff << (fmt->a_byte * 8) : 0);
+
+  for (; x + 4 <= n; x += 4, sp += 12, dp += 16)
+    {
+      unsigned int tail;
+      __m128i      s;
+
+      memcpy(&tail, sp + 8, 4);
+      s = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)sp),
+			     _mm_cvtsi32_si128(tail));
+      s = _mm_or_si128(_mm_shuffle_epi8(s, mask), fill);
+
+      _mm_storeu_si128((__m128i *)dp, s);
+    }
+
+  if (x < n)
+    _write_rgb_row_32_c(fmt, dp, sp, n - x);
+}
+
+__attribute__((target("ssse3")))
+static void
+_write_rgba_row_32_ssse3(const MBPixbufRowFormat *fmt,
+			 unsigned char           *dp,
+			 const unsigned char     *sp,
+			 int                      n)
+{
+  __m128i mask;
+  int     x = 0;
+
+  mask = _write_32_mask_ssse3(fmt, 4);
+
+  for (; x + 4 <= n; x += 4, sp += 16, dp += 16)
+    {
+      __m128i s = _mm_loadu_si128((const __m128i *)sp);
+
+      _mm_storeu_si128((__m128i *)dp, _mm_shuffle_epi8(s, mask));
+    }
+
+  if (x < n)
+    _write_rgba_row_32_c(fmt, dp, sp, n - x);
+}
+
+/* 8 values per iteration, taps taken in pairs by pmaddwd. Row values
+ * and weights both fit a signed 16 bit lane.
+ */
+__attribute__((target("sse2")))
+static void
+_scale_vfilter_row_sse2(unsigned char               *dst,
+			const unsigned short *const *rows,
+			const short                 *weights,
+			int                          ntaps,
+			int                          n)
+{
+  __m128i lo, hi, a, b, w;
+  int     x = 0, k;
+
+  for (; x + 8 <= n; x += 8)
+    {
+      lo = hi = _mm_set1_epi32(1 << 20);
+
+      for (k = 0; k < ntaps; k += 2)
+	{
+	  a = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+
+	  if (k + 1 < ntaps)
+	    {
+	      b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + x));
+	      w = _mm_set1_epi32((weights[k + 1] << 16)
+				 | (unsigned short)weights[k]);
+	    }
+	  else
+	    {
+	      b = _mm_setzero_si128();
+	      w = _mm_set1_epi32((unsigned short)weights[k]);
+	    }
+
+	  lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+	  hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+	}
+
+      lo = _mm_packs_epi32(_mm_srai_epi32(lo, 21), _mm_srai_epi32(hi, 21));
+      _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(lo, lo));
+    }
+
+  for (; x < n; x++)
+    {
+      int acc = 1 << 20;
+
+      for (k = 0; k < ntaps; k++)
+	acc += weights[k] * rows[k][x];
+
+      acc >>= 21;
+      dst[x] = (acc > 255) ? 255 : acc;
+    }
+}
+
+static const MBPixbufKernels _kernels_sse2 = {
+  "sse2",
+  _over_rgb_row_c,
+  _over_rgba_row_sse2,
+  _over_565_row,
+  _over_565a_row,
+  _over_premul_rgb_row_c,
+  _over_premul_rgba_row_sse2,
+  _over_premul_565_row,
+  _over_premul_565a_row,
+  _over_to_premul_rgba_row,
+  _over_premul_to_premul_rgba_row,
+  _over_to_premul_565a_row,
+  _over_premul_to_premul_565a_row,
+  _write_rgb_row_32_c,
+  _write_rgba_row_32_c,
+  _scale_vfilter_row_sse2
+};
+
+static const MBPixbufKernels _kernels_ssse3 = {
+  "ssse3",
+  _over_rgb_row_ssse3,
+  _over_rgba_row_sse2,
+  _over_565_row,
+  _over_565a_row,
+  _over_premul_rgb_row_ssse3,
+  _over_premul_rgba_row_sse2,
+  _over_premul_565_row,
+  _over_premul_565a_row,
+  _over_to_premul_rgba_row,
+  _over_premul_to_premul_rgba_row,
+  _over_to_premul_565a_row,
+  _over_premul_to_premul_565a_row,
+  _write_rgb_row_32_ssse3,
+  _write_rgba_row_32_ssse3,
+  _scale_vfilter_row_sse2
+};
+
+/* AVX2, 8 pixels per iteration */
+
+__attribute__((target("avx2")))
+static void
+_over_rgba_row_avx2(unsigned char       *dp,
+		    const unsigned char *sp,
+		    int                  n,
+		    int                  alpha_level,
+		    int                  write_alpha)
+{
+  const __m256i zero     = _mm256_setzero_si256();
+  const __m256i rgb_mask = _mm256_set1_epi32(0x00ffffff);
+  const __m256i c255     = _mm256_set1_epi16(255);
+  const __m256i c128     = _mm256_set1_epi16(128);
+  int x = 0;
+
+  alpha_level = _clamp_alpha_level(alpha_level);
+
+  for (; x + 8 <= n; x += 8, sp += 32, dp += 32)
+    {
+      __m256i s, d, a, ab, lo, hi, alo, ahi, t;
+
+      s = _mm256_loadu_si256((const __m256i *)sp);
+      d = _mm256_loadu_si256((const __m256i *)dp);
+
+      a = _mm256_srli_epi32(s, 24);
+
+      if (alpha_level > 0)
+	a = _mm256_adds_epu8(a, _mm256_set1_epi32(alpha_level));
+      else if (alpha_level < 0)
+	a = _mm256_subs_epu8(a, _mm256_set1_epi32(-alpha_level));
+
+      ab = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+      ab = _mm256_or_si256(ab, _mm256_slli_epi32(ab, 16));
+
+      alo = _mm256_unpacklo_epi8(ab, zero);
+      ahi = _mm256_unpackhi_epi8(ab, zero);
+
+      t  = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero),
+					       alo),
+			    _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero),
+					       _mm256_sub_epi16(c255, alo)));
+      t  = _mm256_add_epi16(t, c128);
+      lo = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+
+      t  = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero),
+					       ahi),
+			    _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero),
+					       _mm256_sub_epi16(c255, ahi)));
+      t  = _mm256_add_epi16(t, c128);
+      hi = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+
+      /* unpack/pack work per 128 bit lane so the order comes back intact */
+      lo = _mm256_and_si256(_mm256_packus_epi16(lo, hi), rgb_mask);
+
+      if (write_alpha)
+	lo = _mm256_or_si256(lo, _mm256_slli_epi32(a, 24));
+      else
+	lo = _mm256_or_si256(lo, _mm256_andnot_si256(rgb_mask, d));
+
+      _mm256_storeu_si256((__m256i *)dp, lo);
+    }
+
+  if (x < n)
+    _over_rgba_row_sse2(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+static const MBPixbufKernels _kernels_avx2 = {
+  "avx2",
+  _over_rgb_row_ssse3,
+  _over_rgba_row_avx2,
+  _over_565_row,
+  _over_565a_row,
+  _over_premul_rgb_row_ssse3,
+  _over_premul_rgba_row_sse2,
+  _over_premul_565_row,
+  _over_premul_565a_row,
+  _over_to_premul_rgba_row,
+  _over_premul_to_premul_rgba_row,
+  _over_to_premul_565a_row,
+  _over_premul_to_premul_565a_row,
+  _write_rgb_row_32_ssse3,
+  _write_rgba_row_32_ssse3,
+  _scale_vfilter_row_sse2
+};
+
+#endif /* MBPIXBUF_X86_SIMD */
+
+#ifdef MBPIXBUF_NEON_SIMD
+
+/* NEON, 8 pixels per iteration */
+
+static inline uint8x8_t
+_blend_u8_neon(uint8x8_t s, uint8x8_t d, uint8x8_t a, uint8x8_t ia)
+{
+  uint16x8_t t;
+
+  t = vmlal_u8(vmull_u8(s, a), d, ia);
+  t = vaddq_u16(t, vdupq_n_u16(128));
+  return vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+}
+
+static inline uint8x8_t
+_adjust_alpha_neon(uint8x8_t a, int alpha_level)
+{
+  if (alpha_level > 0)
+    return vqadd_u8(a, vdup_n_u8(alpha_level));
+  if (alpha_level < 0)
+    return vqsub_u8(a, vdup_n_u8(-alpha_level));
+  return a;
+}
+
+static void
+_over_rgb_row_neon(unsigned char       *dp,
+		   const unsigned char *sp,
+		   int                  n,
+		   int                  alpha_level,
+		   int                  write_alpha)
+{
+  int x = 0;
+
+  alpha_level = _clamp_alpha_level(alpha_level);
+
+  for (; x + 8 <= n; x += 8, sp += 32, dp += 24)
+    {
+      uint8x8x4_t s = vld4_u8(sp);
+      uint8x8x3_t d = vld3_u8(dp);
+      uint8x8_t   a, ia;
+
+      a  = _adjust_alpha_neon(s.val[3], alpha_level);
+      ia = vmvn_u8(a);
+
+      d.val[0] = _blend_u8_neon(s.val[0], d.val[0], a, ia);
+      d.val[1] = _blend_u8_neon(s.val[1], d.val[1], a, ia);
+      d.val[2] = _blend_u8_neon(s.val[2], d.val[2], a, ia);
+
+      vst3_u8(dp, d);
+    }
+
+  if (x < n)
+    _over_rgb_row_c(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+static void
+_over_rgba_row_neon(unsigned char       *dp,
+		    const unsigned char *sp,
+		    int                  n,
+		    int                  alpha_level,
+		    int                  write_alpha)
+{
+  int x = 0;
+
+  alpha_level = _clamp_alpha_level(alpha_level);
+
+  for (; x + 8 <= n; x += 8, sp += 32, dp += 32)
+    {
+      uint8x8x4_t s = vld4_u8(sp);
+      uint8x8x4_t d = vld4_u8(dp);
+      uint8x8_t   a, ia;
+
+      a  = _adjust_alpha_neon(s.val[3], alpha_level);
+      ia = vmvn_u8(a);
+
+      d.val[0] = _blend_u8_neon(s.val[0], d.val[0], a, ia);
+      d.val[1] = _blend_u8_neon(s.val[1], d.val[1], a, ia);
+      d.val[2] = _blend_u8_neon(s.val[2], d.val[2], a, ia);
+
+      if (write_alpha) d.val[3] = a;
+
+      vst4_u8(dp, d);
+    }
+
+  if (x < n)
+    _over_rgba_row_c(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+static inline uint8x8_t
+_premul_over_u8_neon(uint8x8_t s, uint8x8_t d, uint8x8_t ia)
+{
+  uint16x8_t t;
+
+  t = vaddq_u16(vmull_u8(d, ia), vdupq_n_u16(128));
+  return vqadd_u8(s, vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8));
+}
+
+static void
+_over_premul_rgb_row_neon(unsigned char       *dp,
+			  const unsigned char *sp,
+			  int                  n,
+			  int                  alpha_level,
+			  int                  write_alpha)
+{
+  int x = 0;
+
+  if (!alpha_level)
+    for (; x + 8 <= n; x += 8, sp += 32, dp += 24)
+      {
+	uint8x8x4_t s  = vld4_u8(sp);
+	uint8x8x3_t d  = vld3_u8(dp);
+	uint8x8_t   ia = vmvn_u8(s.val[3]);
+
+	d.val[0] = _premul_over_u8_neon(s.val[0], d.val[0], ia);
+	d.val[1] = _premul_over_u8_neon(s.val[1], d.val[1], ia);
+	d.val[2] = _premul_over_u8_neon(s.val[2], d.val[2], ia);
+
+	vst3_u8(dp, d);
+      }
+
+  if (x < n)
+    _over_premul_rgb_row_c(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+static void
+_over_premul_rgba_row_neon(unsigned char       *dp,
+			   const unsigned char *sp,
+			   int                  n,
+			   int                  alpha_level,
+			   int                  write_alpha)
+{
+  int x = 0;
+
+  if (!alpha_level)
+    for (; x + 8 <= n; x += 8, sp += 32, dp += 32)
+      {
+	uint8x8x4_t s  = vld4_u8(sp);
+	uint8x8x4_t d  = vld4_u8(dp);
+	uint8x8_t   ia = vmvn_u8(s.val[3]);
+
+	d.val[0] = _premul_over_u8_neon(s.val[0], d.val[0], ia);
+	d.val[1] = _premul_over_u8_neon(s.val[1], d.val[1], ia);
+	d.val[2] = _premul_over_u8_neon(s.val[2], d.val[2], ia);
+
+	if (write_alpha) d.val[3] = s.val[3];
+
+	vst4_u8(dp, d);
+      }
+
+  if (x < n)
+    _over_premul_rgba_row_c(dp, sp, n - x, alpha_level, write_alpha);
+}
+
+static void
+_write_rgb_row_32_neon(const MBPixbufRowFormat *fmt,
+		       unsigned char           *dp,
+		       const unsigned char     *sp,
+		       int                      n)
+{
+  uint8x8x4_t d;
+  int         x = 0;
+
+  d.val[fmt->a_byte] = vdup_n_u8(fmt->a_used ? 0xff : 0);
+
+  for (; x + 8 <= n; x += 8, sp += 24, dp += 32)
+    {
+      uint8x8x3_t s = vld3_u8(sp);
+
+      d.val[fmt->r_byte] = s.val[0];
+      d.val[fmt->g_byte] = s.val[1];
+      d.val[fmt->b_byte] = s.val[2];
+
+      vst4_u8(dp, d);
+    }
+
+  if (x < n)
+    _write_rgb_row_32_c(fmt, dp, sp, n - x);
+}
+
+static void
+_write_rgba_row_32_neon(const MBPixbufRowFormat *fmt,
+			unsigned char           *dp,
+			const unsigned char     *sp,
+			int                      n)
+{
+  uint8x8x4_t d;
+  int         x = 0;
+
+  for (; x + 8 <= n; x += 8, sp += 32, dp += 32)
+    {
+      uint8x8x4_t s = vld4_u8(sp);
+
+      d.val[fmt->r_byte] = s.val[0];
+      d.val[fmt->g_byte] = s.val[1];
+      d.val[fmt->b_byte] = s.val[2];
+      d.val[fmt->a_byte] = fmt->a_used ? s.val[3] : vdup_n_u8(0);
+
+      vst4_u8(dp, d);
+    }
+
+  if (x < n)
+    _write_rgba_row_32_c(fmt, dp, sp, n - x);
+}
+
+static void
+_scale_vfilter_row_neon(unsigned char               *dst,
+			const unsigned short *const *rows,
+			const short                 *weights,
+			int                          ntaps,
+			int                          n)
+{
+  int32x4_t lo, hi;
+  int16x8_t r;
+  int       x = 0, k;
+
+  for (; x + 8 <= n; x += 8)
+    {
+      lo = hi = vdupq_n_s32(1 << 20);
+
+      for (k = 0; k < ntaps; k++)
+	{
+	  r  = vreinterpretq_s16_u16(vld1q_u16(rows[k] + x));
+	  lo = vmlal_n_s16(lo, vget_low_s16(r), weights[k]);
+	  hi = vmlal_n_s16(hi, vget_high_s16(r), weights[k]);
+	}
+
+      r = vcombine_s16(vshrn_n_s32(lo, 16), vshrn_n_s32(hi, 16));
+      vst1_u8(dst + x, vqshrun_n_s16(r, 5));
+    }
+
+  for (; x < n; x++)
+    {
+      int acc = 1 << 20;
+
+      for (k = 0; k < ntaps; k++)
+	acc += weights[k] * rows[k][x];
+
+      acc >>= 21;
+      dst[x] = (acc > 255) ? 255 : acc;
+    }
+}
+
+static const MBPixbufKernels _kernels_neon = {
+  "neon",
+  _over_rgb_row_neon,
+  _over_rgba_row_neon,
+  _over_565_row,
+  _over_565a_row,
+  _over_premul_rgb_row_neon,
+  _over_premul_rgba_row_neon,
+  _over_premul_565_row,
+  _over_premul_565a_row,
+  _over_to_premul_rgba_row,
+  _over_premul_to_premul_rgba_row,
+  _over_to_premul_565a_row,
+  _over_premul_to_premul_565a_row,
+  _write_rgb_row_32_neon,
+  _write_rgba_row_32_neon,
+  _scale_vfilter_row_neon
+};
+
+#endif /* MBPIXBUF_NEON_SIMD */
+
+const MBPixbufKernels *
+_mb_pixbuf_kernels_select (void)
+{
+  if (getenv("MBPIXBUF_NO_SIMD"))
+    return &_kernels_c;
+
+#ifdef MBPIXBUF_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    return &_kernels_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return &_kernels_ssse3;
+  if (__builtin_cpu_supports("sse2"))
+    return &_kernels_sse2;
+#endif
+
+#ifdef MBPIXBUF_NEON_SIMD
+  return &_kernels_neon;
+#endif
+
+  return &_kernels_c;
+}
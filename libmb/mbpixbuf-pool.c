@@ -0,0 +1,254 @@
+/* mbpixbuf-pool.c libmb
+ *
+ * Process wide pool of worker threads for splitting pixbuf work, such
+ * as decoding a batch of images, across CPUs.
+ *
+ * A job is n independent tasks. The thread submitting it works on the
+ * tasks too and returns once all are done. Only one job runs on the
+ * pool at a time; a job submitted while the pool is busy, including
+ * one submitted from inside a task, just runs in the calling thread so
+ * nothing ever waits on itself.
+ *
+ * Threads are started the first time a job wants them, one fewer than
+ * the CPUs online, and live for the rest of the process.
+ *
+ * Pixel operations on large images use it through _mb_pixbuf_run_bands,
+ * which cuts the rows into bands that are each one task.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+#include <pthread.h>
+
+#define POOL_MAX_THREADS 32
+
+/* Bands per thread, so a slow band doesn't hold up the whole job */
+#define BANDS_PER_THREAD 4
+
+/* Fewest rows worth handing to a thread on their own */
+#define BAND_MIN_ROWS    8
+
+static struct
+{
+  pthread_mutex_t   lock;
+  pthread_cond_t    work;	/* a job has tasks left */
+  pthread_cond_t    done;	/* a worker left the job */
+  pthread_once_t    once;
+  int               n_threads;
+
+  /* The current job */
+  Bool              busy;
+  MBPixbufTaskFunc  func;
+  void             *data;
+  int               n_tasks;
+  int               next;	/* next task to hand out, atomic */
+  int               n_done;
+  int               active;	/* workers in the job */
+  int               max_active;
+}
+_pool =
+{
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_ONCE_INIT,
+};
+
+/* Runs tasks until there are none left, returns how many it ran */
+static int
+_pool_run_tasks(MBPixbufTaskFunc func, void *data, int n_tasks)
+{
+  int i, n = 0;
+
+  while ((i = __sync_fetch_and_add(&_pool.next, 1)) < n_tasks)
+    {
+      func(data, i);
+      n++;
+    }
+
+  return n;
+}
+
+static void *
+_pool_worker(void *arg)
+{
+  MBPixbufTaskFunc  func;
+  void             *data;
+  int               n_tasks, n;
+
+  pthread_mutex_lock(&_pool.lock);
+
+  for (;;)
+    {
+      while (!_pool.busy
+	     || __atomic_load_n(&_pool.next, __ATOMIC_RELAXED) >= _pool.n_tasks
+	     || _pool.active >= _pool.max_active)
+	pthread_cond_wait(&_pool.work, &_pool.lock);
+
+      /* The job can't change while we are counted in it */
+      _pool.active++;
+      func    = _pool.func;
+      data    = _pool.data;
+      n_tasks = _pool.n_tasks;
+
+      pthread_mutex_unlock(&_pool.lock);
+
+      n = _pool_run_tasks(func, data, n_tasks);
+
+      pthread_mutex_lock(&_pool.lock);
+
+      _pool.active--;
+      _pool.n_done += n;
+      pthread_cond_signal(&_pool.done);
+    }
+
+  return NULL;
+}
+
+static void
+_pool_init(void)
+{
+  pthread_attr_t attr;
+  pthread_t      thread;
+  long           n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+  if (n > POOL_MAX_THREADS) n = POOL_MAX_THREADS;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (_pool.n_threads = 0; _pool.n_threads < n; _pool.n_threads++)
+    if (pthread_create(&thread, &attr, _pool_worker, NULL) != 0)
+      break;
+
+  pthread_attr_destroy(&attr);
+}
+
+int
+_mb_pixbuf_pool_n_cpus(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return (n < 1) ? 1 : (n > POOL_MAX_THREADS + 1) ? POOL_MAX_THREADS + 1 : n;
+}
+
+void
+_mb_pixbuf_pool_run(int               max_threads,
+		    int               n_tasks,
+		    MBPixbufTaskFunc  func,
+		    void             *data)
+{
+  int i, n;
+
+  if (max_threads <= 0)
+    max_threads = _mb_pixbuf_pool_n_cpus();
+
+  if (n_tasks > 1 && max_threads > 1)
+    {
+      pthread_once(&_pool.once, _pool_init);
+
+      pthread_mutex_lock(&_pool.lock);
+
+      if (!_pool.busy && _pool.n_threads > 0)
+	{
+	  _pool.busy       = True;
+	  _pool.func       = func;
+	  _pool.data       = data;
+	  _pool.n_tasks    = n_tasks;
+	  _pool.next       = 0;
+	  _pool.n_done     = 0;
+	  _pool.max_active = max_threads - 1;
+
+	  pthread_cond_broadcast(&_pool.work);
+	  pthread_mutex_unlock(&_pool.lock);
+
+	  n = _pool_run_tasks(func, data, n_tasks);
+
+	  pthread_mutex_lock(&_pool.lock);
+
+	  _pool.n_done += n;
+
+	  while (_pool.n_done < n_tasks || _pool.active > 0)
+	    pthread_cond_wait(&_pool.done, &_pool.lock);
+
+	  _pool.busy = False;
+	  pthread_mutex_unlock(&_pool.lock);
+
+	  return;
+	}
+
+      pthread_mutex_unlock(&_pool.lock);
+    }
+
+  for (i = 0; i < n_tasks; i++)
+    func(data, i);
+}
+
+typedef struct Bands
+{
+  MBPixbufBandFunc  func;
+  void             *data;
+  int               height;
+  int               n_bands;
+} Bands;
+
+static void
+_band_task(void *data, int index)
+{
+  Bands *b = data;
+
+  b->func(b->data,
+	  (int)(((long long)b->height * index) / b->n_bands),
+	  (int)(((long long)b->height * (index + 1)) / b->n_bands));
+}
+
+void
+_mb_pixbuf_run_bands(MBPixbuf         *pb,
+		     int               height,
+		     long              pixels,
+		     MBPixbufBandFunc  func,
+		     void             *data)
+{
+  Bands b;
+  int   n_threads;
+
+  if (height <= 0)
+    return;
+
+  n_threads = (pb->n_threads > 0) ? pb->n_threads : _mb_pixbuf_pool_n_cpus();
+
+  if (n_threads < 2 || pixels < MBPIXBUF_PARALLEL_MIN_PIXELS
+      || height < 2 * BAND_MIN_ROWS)
+    {
+      func(data, 0, height);
+      return;
+    }
+
+  b.func    = func;
+  b.data    = data;
+  b.height  = height;
+  b.n_bands = n_threads * BANDS_PER_THREAD;
+
+  if (b.n_bands > height / BAND_MIN_ROWS)
+    b.n_bands = height / BAND_MIN_ROWS;
+
+  _mb_pixbuf_pool_run(n_threads, b.n_bands, _band_task, &b);
+}
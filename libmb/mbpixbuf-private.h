@@ -0,0 +1,539 @@
+#ifndef _HAVE_MBPIXBUF_PRIVATE_H
+#define _HAVE_MBPIXBUF_PRIVATE_H
+
+/* libmb
+ * Copyright (C) 2002 Matthew Allum
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Internal to libmb, not installed. */
+
+#include "mbpixbuf.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define alpha_composite(composite, fg, alpha, bg) {               \
+    ush temp;                                                     \
+    if ((alpha) == 0)                                             \
+       (composite) = (bg);                                        \
+    else if ((alpha) == 255)                                      \
+        (composite) = (fg);                                       \
+    else {                                                        \
+        temp = ((ush)(fg)*(ush)(alpha) +                          \
+                (ush)(bg)*(ush)(255 - (ush)(alpha)) + (ush)128);  \
+    (composite) = (ush)((temp + (temp >> 8)) >> 8);             } \
+}
+
+#ifdef WORDS_BIGENDIAN
+#define  SHORT_FROM_2BYTES(p) ( *(p+1) | (*(p) << 8) )
+#define  2BYTES_FROM_SHORT(p,s)                       \
+     *((p)+1)   = (unsigned char) s;                  \
+     *(p)       = (unsigned char) ((s >> 8) & 0xff);
+#else
+#define  SHORT_FROM_2BYTES(p) ( *(p) | (*((p)+1) << 8) )
+#define  BYTES_FROM_SHORT(p,s)                       \
+     *(p)   = (unsigned char) s;                      \
+     *((p)+1) = (unsigned char) ((s >> 8) & 0xff);
+#endif
+
+#define internal_16bpp_pixel_to_rgb(p,r,g,b)           \
+      {                                                \
+         unsigned short s = SHORT_FROM_2BYTES(p);      \
+         (r) = (( s & 0xf800) >> 8);                   \
+         (g) = (( s & 0x07e0) >> 3);                   \
+         (b) = (( s & 0x001f) << 3);                   \
+      }
+
+
+#define internal_rgb_to_16bpp_pixel(r,g,b,p)          \
+     {                                                \
+      unsigned short s = (  (((b) >> 3) & 0x001f) |   \
+                            (((g) << 3) & 0x07e0) |   \
+                            (((r) << 8) & 0xf800) );  \
+      BYTES_FROM_SHORT(p,s)                           \
+     }
+
+#define internal_16bpp_pixel_next(p) \
+      (p) += 2
+
+typedef unsigned short ush;
+
+/* Rows of images libmb allocates are padded to start on this boundary.
+ * Images wrapping other memory, such as icon cache entries, may have
+ * any rowstride so nothing may count on it.
+ */
+#define MBPIXBUF_ROW_ALIGN  16
+
+#define mb_pixbuf_aligned_rowstride(width, bpp)                   \
+      ( ((width) * (bpp) + MBPIXBUF_ROW_ALIGN - 1)                \
+	& ~(MBPIXBUF_ROW_ALIGN - 1) )
+
+/* Address of pixel @x, @y of @img */
+#define mb_pixbuf_img_pixel(img, x, y)                            \
+      ( (img)->rgba + (y) * (img)->rowstride                      \
+	+ (x) * ((img)->internal_bytespp + (img)->has_alpha) )
+
+/*
+ * 565 'spread' form. The 8 bit values internal_16bpp_pixel_to_rgb()
+ * would give are laid out in 21 bit lanes of a 64 bit word;
+ *
+ *   r << 42 | g << 21 | b
+ *
+ * Lanes are wide enough for the whole alpha_composite() sum so all
+ * three channels are blended with two multiplies, giving exactly what
+ * unpacking, alpha_composite() and repacking would.
+ */
+#define SPREAD_565_LANE_MASK   ((uint64_t)0xff << 42 | (uint64_t)0xff << 21 | 0xff)
+#define SPREAD_565_LANE_ROUND  ((uint64_t)0x80 << 42 | (uint64_t)0x80 << 21 | 0x80)
+
+#define spread_from_565(s)                            \
+      ( ((uint64_t)((s) & 0xf800) << 34)              \
+	| ((uint64_t)((s) & 0x07e0) << 18)            \
+	| (uint64_t)(((s) & 0x001f) << 3) )
+
+#define spread_from_rgb(r,g,b)                        \
+      ( ((uint64_t)(r) << 42) | ((uint64_t)(g) << 21) | (uint64_t)(b) )
+
+#define spread_to_565(v)                              \
+      (unsigned short)( (((v) >> 34) & 0xf800)        \
+			| (((v) >> 18) & 0x07e0)      \
+			| (((v) >> 3)  & 0x001f) )
+
+static inline unsigned short
+_mb_blend_565(uint64_t fg, uint64_t bg, int alpha)
+{
+  uint64_t t;
+
+  t = fg * alpha + bg * (255 - alpha) + SPREAD_565_LANE_ROUND;
+  t = t + ((t >> 8) & SPREAD_565_LANE_MASK);
+
+  return spread_to_565((t >> 8) & SPREAD_565_LANE_MASK);
+}
+
+/*
+ * Row kernels. Each works on @n pixels of a single row, the callers
+ * take care of clipping and stepping between rows.
+ *
+ * The 'over' kernels alpha composite a 3+1 byte RGBA source over a
+ * 3 byte ( rgb ) or 3+1 byte ( rgba ) destination. @alpha_level is
+ * added to the source alpha ( clamped to 0-255 ) before blending and,
+ * when @write_alpha is set, the result is stored as the destination
+ * alpha. Every implementation must produce output bit identical to
+ * alpha_composite() above.
+ */
+typedef void (*MBPixbufOverRowFunc) (unsigned char       *dst,
+				     const unsigned char *src,
+				     int                  n,
+				     int                  alpha_level,
+				     int                  write_alpha);
+
+/*
+ * Describes how a pixel is laid out in an XImage for the row writers.
+ * A pixel value is
+ *
+ *   (r >> r_loss) << r_shift | (g >> g_loss) << g_shift 
+ *     | (b >> b_loss) << b_shift | ((a << a_shift) & a_mask)
+ *
+ * stored in bits_per_pixel bits in the XImage byte order. When every
+ * channel is a whole byte of a 32 bit pixel *_byte give their offsets
+ * in memory, a_byte being the remaining byte which is written as alpha
+ * if a_used, 0 otherwise.
+ */
+typedef struct MBPixbufRowFormat
+{
+  int           r_shift, g_shift, b_shift, a_shift;
+  int           r_loss,  g_loss,  b_loss;
+  unsigned long a_mask;
+
+  int           r_byte, g_byte, b_byte, a_byte;
+  int           a_used;
+} MBPixbufRowFormat;
+
+/*
+ * Row writers convert @n internal pixels from @src to XImage pixels at
+ * @dst.
+ */
+typedef void (*MBPixbufWriteRowFunc) (const MBPixbufRowFormat *fmt,
+				      unsigned char           *dst,
+				      const unsigned char     *src,
+				      int                      n);
+
+/*
+ * Row readers convert @n XImage pixels at @src to internal pixels at
+ * @dst, leaving any alpha byte as it is.
+ */
+typedef void (*MBPixbufReadRowFunc) (const MBPixbufRowFormat *fmt,
+				     unsigned char           *dst,
+				     const unsigned char     *src,
+				     int                      n);
+
+/*
+ * Vertical pass of the bilinear scaler. Each of the @n 8 bit outputs
+ * is the sum of @ntaps 8.7 fixed point row values times their 2.14
+ * weights, rounded. The weights sum to 1 << 14. mbpixbuf-scale.c
+ */
+typedef void (*MBPixbufScaleRowFunc) (unsigned char               *dst,
+				      const unsigned short *const *rows,
+				      const short                 *weights,
+				      int                          ntaps,
+				      int                          n);
+
+/*
+ * The 565 'over' kernels do the same for a 2+1 byte source onto a
+ * 2 byte or 2+1 byte destination, without unpacking to 8 bit channels.
+ *
+ * The premul versions take a source with premultiplied alpha and
+ * compute dst = src + dst * (255 - a) / 255.
+ *
+ * The to_premul versions are for a destination with premultiplied
+ * alpha, from a straight or a premul source. They give what compositing
+ * onto the destination in straight form would, premultiplied by the
+ * alpha the destination is left with.
+ *
+ * The 32 writers convert 3 and 3+1 byte rows to whole byte 32 bit
+ * XImage pixels, the common case for rendering.
+ */
+struct MBPixbufKernels
+{
+  const char          *name;
+  MBPixbufOverRowFunc  over_rgb_row;
+  MBPixbufOverRowFunc  over_rgba_row;
+  MBPixbufOverRowFunc  over_565_row;
+  MBPixbufOverRowFunc  over_565a_row;
+  MBPixbufOverRowFunc  over_premul_rgb_row;
+  MBPixbufOverRowFunc  over_premul_rgba_row;
+  MBPixbufOverRowFunc  over_premul_565_row;
+  MBPixbufOverRowFunc  over_premul_565a_row;
+  MBPixbufOverRowFunc  over_to_premul_rgba_row;
+  MBPixbufOverRowFunc  over_premul_to_premul_rgba_row;
+  MBPixbufOverRowFunc  over_to_premul_565a_row;
+  MBPixbufOverRowFunc  over_premul_to_premul_565a_row;
+  MBPixbufWriteRowFunc write_rgb_row_32;
+  MBPixbufWriteRowFunc write_rgba_row_32;
+  MBPixbufScaleRowFunc scale_vfilter_row;
+};
+
+/* Single channel premultiply and unpremultiply, rounding */
+
+static inline unsigned char
+_mb_premultiply(int c, int alpha)
+{
+  int t = c * alpha + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline unsigned char
+_mb_unpremultiply(int c, int alpha)
+{
+  if (alpha == 255) return c;
+  if (alpha == 0)   return 0;
+
+  c = (c * 255 + alpha / 2) / alpha;
+  return (c > 255) ? 255 : c;
+}
+
+/* Picks the best kernels for the running CPU. Setting the enviromental
+ * variable 'MBPIXBUF_NO_SIMD' forces the plain C versions.
+ */
+const MBPixbufKernels *
+_mb_pixbuf_kernels_select (void);
+
+/* Picks a row writer for rendering @img into @ximg, filling in @fmt.
+ * NULL if the visual needs the pixel at a time path. mbpixbuf-convert.c
+ */
+MBPixbufWriteRowFunc
+_mb_pixbuf_row_writer(MBPixbuf          *pb,
+		      MBPixbufImage     *img,
+		      XImage            *ximg,
+		      MBPixbufRowFormat *fmt);
+
+/* As above for grabbing from an XImage to an internal image with or
+ * without alpha.
+ */
+MBPixbufReadRowFunc
+_mb_pixbuf_row_reader(MBPixbuf          *pb,
+		      XImage            *ximg,
+		      Bool               has_alpha,
+		      MBPixbufRowFormat *fmt);
+
+/* Converts all of @img into @ximg's pixels, as rendering does. @ximg
+ * must be at least as big. mbpixbuf.c
+ */
+void
+_mb_pixbuf_img_write_ximage(MBPixbuf      *pb,
+			    MBPixbufImage *img,
+			    XImage        *ximg);
+
+/* A new image whose pixels are left for the caller to write, all of
+ * them. mbpixbuf.c
+ */
+MBPixbufImage *
+_mb_pixbuf_img_new_uninit(MBPixbuf *pb, int w, int h, int has_alpha);
+
+/* Makes writes to @img's pixels copy them first, for images on read
+ * only memory. mbpixbuf.c
+ */
+void
+_mb_pixbuf_img_set_read_only(MBPixbufImage *img);
+
+/* Builds @pb's inverse colormap and dither table from its palette.
+ * False, leaving neither, if out of memory. mbpixbuf.c
+ */
+Bool
+_mb_pixbuf_color_cube_init(MBPixbuf *pb);
+
+/* Converts @n pixels at @p, just copied from @src into @dest, to
+ * @dest's premultiplication when the two differ. mbpixbuf.c
+ */
+void
+_mb_pixbuf_match_alpha_row(MBPixbufImage *dest, MBPixbufImage *src,
+			   unsigned char *p, int n);
+
+/* The kernel compositing @src onto @dest, mbpixbuf.c */
+MBPixbufOverRowFunc
+_mb_pixbuf_over_row_func(MBPixbuf      *pb,
+			 MBPixbufImage *dest,
+			 MBPixbufImage *src);
+
+/* Scales @src to @dw x @dh rows in the same internal format at @dst,
+ * @dst_stride bytes apart. @emit, if set, is called as each row is
+ * finished. Large scales are split into row bands across threads, so
+ * rows may be emitted out of order and from other threads; a zero
+ * @dst_stride reuses @dst for every row and each band gets its own.
+ * mbpixbuf-scale.c
+ */
+typedef void (*MBPixbufScaleEmitFunc) (void          *data,
+				       int            y,
+				       unsigned char *row);
+
+Bool
+_mb_pixbuf_scale_rows(MBPixbuf             *pb,
+		      MBPixbufImage        *src,
+		      unsigned char        *dst,
+		      int                   dst_stride,
+		      int                   dw,
+		      int                   dh,
+		      MBPixbufFilter        filter,
+		      MBPixbufScaleEmitFunc emit,
+		      void                 *data);
+
+/* Box scales @nch channel 8 bit rows pushed one at a time, top to
+ * bottom, from @sw x @sh to @dw x @dh. Each output row is passed to
+ * @emit once complete. mbpixbuf-scale.c
+ */
+typedef struct MBPixbufRowScaler MBPixbufRowScaler;
+
+MBPixbufRowScaler *
+_mb_pixbuf_row_scaler_new(int                   sw,
+			  int                   sh,
+			  int                   dw,
+			  int                   dh,
+			  int                   nch,
+			  MBPixbufScaleEmitFunc emit,
+			  void                 *data);
+
+void
+_mb_pixbuf_row_scaler_push(MBPixbufRowScaler *rs, const unsigned char *row);
+
+void
+_mb_pixbuf_row_scaler_free(MBPixbufRowScaler *rs);
+
+/* Decoder plumbing, mbpixbuf.c. _mb_pixbuf_load_begin() makes the
+ * image a decoder of a @width x @height image fills, at the size wanted
+ * if there is one. *@scaler is set when rows need scaling on the way
+ * in, and must be freed once decoding is done. Each decoded 8 bit
+ * rgb(a) row, @width pixels wide, then goes to _mb_pixbuf_load_row().
+ * The row may be modified.
+ */
+MBPixbufImage *
+_mb_pixbuf_load_begin(MBPixbuf           *pb, 
+		      int                 width, 
+		      int                 height,
+		      int                 has_alpha,
+		      int                 want_width,
+		      int                 want_height,
+		      MBPixbufRowScaler **scaler);
+
+void
+_mb_pixbuf_load_row(MBPixbuf          *pb, 
+		    MBPixbufImage     *img, 
+		    MBPixbufRowScaler *scaler,
+		    int                y, 
+		    unsigned char     *row,
+		    int                width);
+
+/* XPM decoder, mbpixbuf-xpm.c */
+MBPixbufImage *
+_mb_pixbuf_load_xpm_data(MBPixbuf            *pb, 
+			 const unsigned char *bytes, 
+			 size_t               size, 
+			 int                  width, 
+			 int                  height);
+
+/* Decodes an image, bypassing any caches, at @width x @height or
+ * natural size if either is 0. The format is sniffed from the data,
+ * @filename's suffix is only a fallback for XPMs missing their magic
+ * comment and may be NULL. mbpixbuf.c
+ */
+MBPixbufImage *
+_mb_pixbuf_img_load_data(MBPixbuf            *pb,
+			 const unsigned char *data,
+			 size_t               len,
+			 const char          *filename,
+			 int                  width,
+			 int                  height);
+
+MBPixbufImage *
+_mb_pixbuf_img_load_fd(MBPixbuf   *pb,
+		       int         fd,
+		       const char *filename,
+		       int         width,
+		       int         height);
+
+MBPixbufImage *
+_mb_pixbuf_img_load_file(MBPixbuf   *pb,
+			 const char *filename,
+			 int         width,
+			 int         height);
+
+/* Decoded image cache, mbpixbuf-cache.c. Lookups take a stat() of
+ * the file and the size asked for, 0 x 0 for natural size, and return
+ * a new reference or NULL.
+ */
+Bool
+_mb_pixbuf_image_cache_enabled(void);
+
+MBPixbufImage *
+_mb_pixbuf_image_cache_lookup(MBPixbuf          *pb,
+			      const char        *path,
+			      const struct stat *st,
+			      int                width,
+			      int                height);
+
+void
+_mb_pixbuf_image_cache_insert(MBPixbuf          *pb,
+			      const char        *path,
+			      const struct stat *st,
+			      int                width,
+			      int                height,
+			      MBPixbufImage     *img);
+
+/* Image allocator, mbpixbuf-slab.c. Allocates an image header followed
+ * by @pixel_bytes of MBPIXBUF_ROW_ALIGN aligned pixels, uninitialised,
+ * from @slab or from malloc if NULL. Release it, rather than free(), once
+ * done; a ref keeps it for something else sharing the pixels.
+ */
+MBPixbufSlab *
+_mb_pixbuf_slab_new(void);
+
+void
+_mb_pixbuf_slab_unref(MBPixbufSlab *slab);
+
+MBPixbufImage *
+_mb_pixbuf_slab_img_alloc(MBPixbufSlab *slab, size_t pixel_bytes);
+
+/* The pixels allocated with @img, NULL if none */
+unsigned char *
+_mb_pixbuf_slab_img_pixels(MBPixbufImage *img);
+
+void
+_mb_pixbuf_slab_img_ref(MBPixbufImage *img);
+
+void
+_mb_pixbuf_slab_img_release(MBPixbufImage *img);
+
+/* Worker pool, mbpixbuf-pool.c. Runs @func(@data, i) for i from 0 to
+ * @n_tasks - 1 on up to @max_threads threads, the caller's included,
+ * or the CPUs online if @max_threads is 0. Returns when all are done.
+ */
+typedef void (*MBPixbufTaskFunc) (void *data, int index);
+
+void
+_mb_pixbuf_pool_run(int               max_threads,
+		    int               n_tasks,
+		    MBPixbufTaskFunc  func,
+		    void             *data);
+
+int
+_mb_pixbuf_pool_n_cpus(void);
+
+/* Splits rows 0 to @height - 1 into bands and runs @func(@data, y0, y1)
+ * on each across pb->n_threads threads. Work of fewer than
+ * MBPIXBUF_PARALLEL_MIN_PIXELS @pixels is done in one call in the
+ * calling thread. mbpixbuf-pool.c
+ */
+#define MBPIXBUF_PARALLEL_MIN_PIXELS  (256 * 256)
+
+typedef void (*MBPixbufBandFunc) (void *data, int y0, int y1);
+
+void
+_mb_pixbuf_run_bands(MBPixbuf         *pb,
+		     int               height,
+		     long              pixels,
+		     MBPixbufBandFunc  func,
+		     void             *data);
+
+/* X error trapping, mbpixbuf.c */
+
+void
+_mbpb_trap_errors(void);
+
+int
+_mbpb_untrap_errors(void);
+
+/* MIT-SHM segment pool, mbpixbuf-shm.c. 
+ *
+ * _mb_pixbuf_shm_create_image() gives a shared XImage backed by a free
+ * pooled segment, or NULL if none can be had. It must be handed on to
+ * _mb_pixbuf_shm_put_image(), which sends it and destroys the XImage;
+ * the segment stays busy until the server has finished with it.
+ */
+XImage *
+_mb_pixbuf_shm_create_image(MBPixbuf            *pb,
+			    int                  depth,
+			    int                  format,
+			    int                  width,
+			    int                  height,
+			    MBPixbufShmSegment **seg);
+
+void
+_mb_pixbuf_shm_put_image(MBPixbuf           *pb,
+			 MBPixbufShmSegment *seg,
+			 Drawable            drw,
+			 GC                  gc,
+			 XImage             *ximg,
+			 int                 dx,
+			 int                 dy);
+
+/* Grabs an area of a drawable into a pooled segment with
+ * XShmGetImage(). The XImage is only good until the next use of the
+ * pool and is freed with XDestroyImage(). NULL on failure.
+ */
+XImage *
+_mb_pixbuf_shm_get_image(MBPixbuf *pb,
+			 Drawable  drw,
+			 int       x,
+			 int       y,
+			 int       width,
+			 int       height);
+
+void
+_mb_pixbuf_shm_pool_free(MBPixbuf *pb);
+
+#endif
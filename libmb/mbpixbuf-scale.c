@@ -0,0 +1,867 @@
+/* mbpixbuf-scale.c libmb
+ *
+ * Separable image scaler.
+ *
+ * Each axis gets a table of contributions, the first source pixel and
+ * tap count for every output pixel plus fixed point weights where the
+ * filter needs them. Source rows are filtered horizontally once into a
+ * small cache, then output rows are built by filtering the cached rows
+ * vertically. Scaling up on one axis and down on the other needs no
+ * intermediate image.
+ *
+ *  NEAREST   - nearest source pixel, no arithmetic.
+ *  BOX       - nearest when enlarging an axis, the truncated average of
+ *              the source pixels it covers when shrinking. What
+ *              mb_pixbuf_img_scale() has always done.
+ *  BILINEAR  - linear interpolation when enlarging, area weighted
+ *              averaging when shrinking.
+ *
+ * Bilinear weights are 2.14 fixed point and horizontally filtered
+ * values are kept as 8.7 so the vertical pass fits 16 bit SIMD
+ * multiplies, see the scale_vfilter_row kernels.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+/* Scratch, and the row buffer when scaling into an image, up to these
+ * sizes live on the stack
+ */
+#define SCALE_STACK_SCRATCH  16384
+#define SCALE_STACK_ROW      4096
+
+#define WEIGHT_ONE           (1 << 14)
+
+/* Box averages of up to this many samples divide by multiplying */
+#define BOX_RECIP_MAX        65535
+
+typedef struct Contrib
+{
+  int   *first;
+  int   *count;
+  int   *wofs;
+  short *weight;
+  int    min_count;
+} Contrib;
+
+static int
+_contrib_max_taps(int src, int dst, MBPixbufFilter filter)
+{
+  if (filter == MBPIXBUF_FILTER_NEAREST || (dst >= src && filter == MBPIXBUF_FILTER_BOX))
+    return 1;
+
+  if (dst >= src)
+    return 2;
+
+  return (src + dst - 1) / dst + 1;
+}
+
+static void
+_contrib_build(Contrib *c, int src, int dst, MBPixbufFilter filter)
+{
+  int i, k, wofs = 0;
+
+  c->min_count = 0x7fffffff;
+
+  for (i = 0; i < dst; i++)
+    {
+      c->first[i] = (int)(((long long)i * src) / dst);
+      c->wofs[i]  = wofs;
+
+      if (filter == MBPIXBUF_FILTER_NEAREST || dst >= src)
+	c->count[i] = 1;
+      else
+	c->count[i] = (int)(((long long)(i + 1) * src) / dst) - c->first[i];
+
+      if (filter != MBPIXBUF_FILTER_BILINEAR)
+	{
+	  if (c->count[i] < c->min_count)
+	    c->min_count = c->count[i];
+	  continue;
+	}
+
+      if (dst >= src)
+	{
+	  /* Sample at the output pixel's center */
+	  long long pos = ((long long)(2 * i + 1) * src << 16) / (2 * dst)
+	                   - 0x8000;
+	  int       f;
+
+	  if (pos < 0) pos = 0;
+
+	  c->first[i] = (int)(pos >> 16);
+	  f           = (int)(pos & 0xffff) >> 2;
+
+	  if (c->first[i] >= src - 1)
+	    {
+	      c->first[i] = src - 1;
+	      c->count[i] = 1;
+	      c->weight[wofs++] = WEIGHT_ONE;
+	    }
+	  else
+	    {
+	      c->count[i] = 2;
+	      c->weight[wofs++] = WEIGHT_ONE - f;
+	      c->weight[wofs++] = f;
+	    }
+	}
+      else
+	{
+	  /* Weight each source pixel by how much of it is covered */
+	  long long a = ((long long)i * src << 16) / dst;
+	  long long b = ((long long)(i + 1) * src << 16) / dst;
+	  int       sum = 0, big = wofs;
+
+	  c->first[i] = (int)(a >> 16);
+	  c->count[i] = (int)((b + 0xffff) >> 16) - c->first[i];
+
+	  for (k = 0; k < c->count[i]; k++)
+	    {
+	      long long lo = (long long)(c->first[i] + k) << 16;
+	      long long hi = lo + 0x10000;
+
+	      if (lo < a) lo = a;
+	      if (hi > b) hi = b;
+
+	      c->weight[wofs + k] = (short)(((hi - lo) * WEIGHT_ONE) / (b - a));
+	      sum += c->weight[wofs + k];
+
+	      if (c->weight[wofs + k] > c->weight[big]) big = wofs + k;
+	    }
+
+	  /* Rounding slack goes to the largest weight */
+	  c->weight[big] += WEIGHT_ONE - sum;
+	  wofs += c->count[i];
+	}
+    }
+}
+
+/* Horizontal passes, one source row of @nch 8 bit channels */
+
+static void
+_hfilter_box(const Contrib *c, int *dst, const unsigned char *src,
+	     int dw, int nch)
+{
+  const unsigned char *s;
+  int x, k, ch, sum;
+
+  for (x = 0; x < dw; x++)
+    for (ch = 0; ch < nch; ch++)
+      {
+	s   = src + c->first[x] * nch + ch;
+	sum = 0;
+
+	for (k = 0; k < c->count[x]; k++, s += nch)
+	  sum += *s;
+
+	*dst++ = sum;
+      }
+}
+
+static void
+_hfilter_bilinear(const Contrib *c, unsigned short *dst,
+		  const unsigned char *src, int dw, int nch)
+{
+  const unsigned char *s;
+  const short         *w;
+  int x, k, ch, acc;
+
+  for (x = 0; x < dw; x++)
+    for (ch = 0; ch < nch; ch++)
+      {
+	s   = src + c->first[x] * nch + ch;
+	w   = c->weight + c->wofs[x];
+	acc = 1 << 6;
+
+	for (k = 0; k < c->count[x]; k++, s += nch)
+	  acc += w[k] * *s;
+
+	*dst++ = acc >> 7;
+      }
+}
+
+static void
+_unpack_565_row(unsigned char *dst, const unsigned char *src, int n,
+		int has_alpha)
+{
+  int x, r, g, b;
+
+  for (x = 0; x < n; x++)
+    {
+      internal_16bpp_pixel_to_rgb(src, r, g, b);
+      internal_16bpp_pixel_next(src);
+
+      *dst++ = r; *dst++ = g; *dst++ = b;
+
+      if (has_alpha) *dst++ = *src++;
+    }
+}
+
+static void
+_pack_565_row(unsigned char *dst, const unsigned char *src, int n,
+	      int has_alpha)
+{
+  int x;
+
+  for (x = 0; x < n; x++, src += 3 + has_alpha)
+    {
+      internal_rgb_to_16bpp_pixel(src[0], src[1], src[2], dst);
+      internal_16bpp_pixel_next(dst);
+
+      if (has_alpha) *dst++ = src[3];
+    }
+}
+
+/* Exact truncating divide by n for values up to 255 * n */
+static inline unsigned int
+_box_div(unsigned int v, unsigned int n, uint64_t recip)
+{
+  if (n > BOX_RECIP_MAX)
+    return v / n;
+
+  return (unsigned int)((v * recip) >> 40);
+}
+
+static inline uint64_t
+_box_recip(unsigned int n)
+{
+  return (((uint64_t)1 << 40) / n) + 1;
+}
+
+static void
+_scale_nearest(MBPixbuf *pb, MBPixbufImage *src, unsigned char *dst,
+	       int dst_stride, int dw, int dh, int y0, int y1,
+	       MBPixbufScaleEmitFunc emit, void *data, int *xofs)
+{
+  const unsigned char *s, *srow;
+  unsigned char       *d;
+  int                  x, y, k, bpp, sstride;
+
+  bpp     = pb->internal_bytespp + src->has_alpha;
+  sstride = src->rowstride;
+
+  for (x = 0; x < dw; x++)
+    xofs[x] = (int)(((long long)x * src->width) / dw) * bpp;
+
+  for (y = y0; y < y1; y++)
+    {
+      srow = src->rgba + (int)(((long long)y * src->height) / dh) * sstride;
+      d    = dst + y * dst_stride;
+
+      if (bpp == 4)
+	for (x = 0; x < dw; x++, d += 4)
+	  memcpy(d, srow + xofs[x], 4);
+      else
+	for (x = 0; x < dw; x++)
+	  for (s = srow + xofs[x], k = 0; k < bpp; k++)
+	    *d++ = *s++;
+
+      if (emit) emit(data, y, dst + y * dst_stride);
+    }
+}
+
+/* Scales output rows @y0 to @y1 - 1 */
+static Bool
+_scale_rows(MBPixbuf             *pb,
+	    MBPixbufImage        *src,
+	    unsigned char        *dst,
+	    int                   dst_stride,
+	    int                   dw,
+	    int                   dh,
+	    int                   y0,
+	    int                   y1,
+	    MBPixbufFilter        filter,
+	    MBPixbufScaleEmitFunc emit,
+	    void                 *data)
+{
+  uint64_t       stack_scratch[SCALE_STACK_SCRATCH / sizeof(uint64_t)];
+  unsigned char *scratch, *p, *unpacked = NULL, *out8 = NULL, *d;
+  const unsigned char  *srow;
+  const unsigned short *rows[2];
+  Contrib        xc, yc;
+  int            sw = src->width, sh = src->height;
+  int            nch, xtaps, ytaps, y, k, i, n, slot;
+  int            cached[2] = { -1, -1 }, next_slot = 0;
+  void          *hrows[2];
+  int           *acc = NULL;
+  size_t         need, hsize;
+  uint64_t       recip[4];
+  Bool           bilinear, accumulate;
+
+  if (dw <= 0 || dh <= 0 || sw <= 0 || sh <= 0)
+    return False;
+
+  nch = 3 + src->has_alpha;
+
+  if (filter == MBPIXBUF_FILTER_BOX && dw >= sw && dh >= sh)
+    filter = MBPIXBUF_FILTER_NEAREST;
+
+  if (filter == MBPIXBUF_FILTER_NEAREST)
+    {
+      int *xofs;
+
+      need = dw * sizeof(int);
+      xofs = (need <= sizeof(stack_scratch)) ?
+	(int *)stack_scratch : malloc(need);
+
+      if (xofs == NULL)
+	return False;
+
+      _scale_nearest(pb, src, dst, dst_stride, dw, dh, y0, y1,
+		     emit, data, xofs);
+
+      if ((void *)xofs != (void *)stack_scratch) free(xofs);
+      return True;
+    }
+
+  bilinear = (filter == MBPIXBUF_FILTER_BILINEAR);
+
+  xtaps = _contrib_max_taps(sw, dw, filter);
+  ytaps = _contrib_max_taps(sh, dh, filter);
+  hsize = dw * nch * (bilinear ? sizeof(unsigned short) : sizeof(int));
+
+  /* Box, and bilinear when shrinking vertically, sum rows as they are
+   * filtered. Otherwise every output row needs at most two source rows
+   * which the vfilter kernel combines.
+   */
+  accumulate = (!bilinear || ytaps > 2);
+
+  /* Carve everything out of one block, ints first for alignment */
+  need = (3 * dw + 3 * dh) * sizeof(int)
+         + (accumulate ? dw * nch * sizeof(int) : 0)
+         + 2 * hsize
+         + (dw * xtaps + dh * ytaps) * sizeof(short)
+         + ((pb->internal_bytespp == 2) ? (sw + dw) * nch : 0);
+
+  scratch = (need <= sizeof(stack_scratch)) ?
+    (unsigned char *)stack_scratch : malloc(need);
+
+  if (scratch == NULL)
+    return False;
+
+  p = scratch;
+  xc.first = (int *)p; p += dw * sizeof(int);
+  xc.count = (int *)p; p += dw * sizeof(int);
+  xc.wofs  = (int *)p; p += dw * sizeof(int);
+  yc.first = (int *)p; p += dh * sizeof(int);
+  yc.count = (int *)p; p += dh * sizeof(int);
+  yc.wofs  = (int *)p; p += dh * sizeof(int);
+
+  if (accumulate)
+    {
+      acc = (int *)p; p += dw * nch * sizeof(int);
+    }
+
+  hrows[0] = p;        p += hsize;
+  hrows[1] = p;        p += hsize;
+
+  xc.weight = (short *)p; p += dw * xtaps * sizeof(short);
+  yc.weight = (short *)p; p += dh * ytaps * sizeof(short);
+
+  if (pb->internal_bytespp == 2)
+    {
+      unpacked = p; p += sw * nch;
+      out8     = p; p += dw * nch;
+    }
+
+  _contrib_build(&xc, sw, dw, filter);
+  _contrib_build(&yc, sh, dh, filter);
+
+  if (!bilinear)
+    for (i = 0; i < 4; i++)
+      recip[i] = _box_recip((xc.min_count + (i >> 1))
+			    * (yc.min_count + (i & 1)));
+
+  for (y = y0; y < y1; y++)
+    {
+      for (k = 0; k < yc.count[y]; k++)
+	{
+	  int sy = yc.first[y] + k;
+
+	  /* Rows shared with the previous output row are kept */
+	  if (cached[0] == sy)      slot = 0;
+	  else if (cached[1] == sy) slot = 1;
+	  else
+	    {
+	      slot = next_slot;
+	      next_slot ^= 1;
+
+	      srow = src->rgba + sy * src->rowstride;
+
+	      if (unpacked)
+		{
+		  _unpack_565_row(unpacked, srow, sw, src->has_alpha);
+		  srow = unpacked;
+		}
+
+	      if (bilinear)
+		_hfilter_bilinear(&xc, hrows[slot], srow, dw, nch);
+	      else
+		_hfilter_box(&xc, hrows[slot], srow, dw, nch);
+
+	      cached[slot] = sy;
+	    }
+
+	  if (!accumulate)
+	    rows[k] = hrows[slot];
+	  else if (bilinear)
+	    {
+	      const unsigned short *h = hrows[slot];
+	      int                   w = yc.weight[yc.wofs[y] + k];
+
+	      if (k == 0)
+		for (i = 0; i < dw * nch; i++)
+		  acc[i] = w * h[i];
+	      else
+		for (i = 0; i < dw * nch; i++)
+		  acc[i] += w * h[i];
+	    }
+	  else
+	    {
+	      const int *h = hrows[slot];
+
+	      if (k == 0)
+		memcpy(acc, h, dw * nch * sizeof(int));
+	      else
+		for (i = 0; i < dw * nch; i++)
+		  acc[i] += h[i];
+	    }
+	}
+
+      d = out8 ? out8 : dst + y * dst_stride;
+
+      if (!accumulate)
+	pb->kernels->scale_vfilter_row(d, rows, yc.weight + yc.wofs[y],
+				       yc.count[y], dw * nch);
+      else if (bilinear)
+	for (i = 0; i < dw * nch; i++)
+	  {
+	    n    = (acc[i] + (1 << 20)) >> 21;
+	    d[i] = (n > 255) ? 255 : n;
+	  }
+      else
+	{
+	  int x, ch, yi = yc.count[y] - yc.min_count;
+
+	  for (x = 0, i = 0; x < dw; x++)
+	    {
+	      n = xc.count[x] * yc.count[y];
+
+	      for (ch = 0; ch < nch; ch++, i++)
+		d[i] = _box_div(acc[i], n,
+				recip[((xc.count[x] - xc.min_count) << 1) + yi]);
+	    }
+	}
+
+      if (out8)
+	_pack_565_row(dst + y * dst_stride, out8, dw, src->has_alpha);
+
+      if (emit) emit(data, y, dst + y * dst_stride);
+    }
+
+  if (scratch != (unsigned char *)stack_scratch) free(scratch);
+
+  return True;
+}
+
+typedef struct ScaleBands
+{
+  MBPixbuf             *pb;
+  MBPixbufImage        *src;
+  unsigned char        *dst;
+  int                   dst_stride;
+  int                   dw, dh;
+  MBPixbufFilter        filter;
+  MBPixbufScaleEmitFunc emit;
+  void                 *data;
+  int                   failed;
+} ScaleBands;
+
+static void
+_scale_band(void *data, int y0, int y1)
+{
+  ScaleBands    *j = data;
+  unsigned char *row = NULL;
+  Bool           ok;
+
+  /* Rows scaled into a single buffer need one per band */
+  if (j->dst_stride == 0 && (y0 > 0 || y1 < j->dh))
+    {
+      row = malloc(j->dw * (j->pb->internal_bytespp + j->src->has_alpha));
+
+      if (row == NULL)
+	{
+	  __sync_fetch_and_or(&j->failed, 1);
+	  return;
+	}
+    }
+
+  ok = _scale_rows(j->pb, j->src, row ? row : j->dst, j->dst_stride,
+		   j->dw, j->dh, y0, y1, j->filter, j->emit, j->data);
+
+  if (!ok) __sync_fetch_and_or(&j->failed, 1);
+
+  free(row);
+}
+
+Bool
+_mb_pixbuf_scale_rows(MBPixbuf             *pb,
+		      MBPixbufImage        *src,
+		      unsigned char        *dst,
+		      int                   dst_stride,
+		      int                   dw,
+		      int                   dh,
+		      MBPixbufFilter        filter,
+		      MBPixbufScaleEmitFunc emit,
+		      void                 *data)
+{
+  ScaleBands j;
+  long       spixels, dpixels;
+
+  if (dw <= 0 || dh <= 0 || src->width <= 0 || src->height <= 0)
+    return False;
+
+  j.pb         = pb;
+  j.src        = src;
+  j.dst        = dst;
+  j.dst_stride = dst_stride;
+  j.dw         = dw;
+  j.dh         = dh;
+  j.filter     = filter;
+  j.emit       = emit;
+  j.data       = data;
+  j.failed     = 0;
+
+  spixels = (long)src->width * src->height;
+  dpixels = (long)dw * dh;
+
+  _mb_pixbuf_run_bands(pb, dh, (spixels > dpixels) ? spixels : dpixels,
+		       _scale_band, &j);
+
+  return !j.failed;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_scale_with_filter(MBPixbuf       *pb,
+				MBPixbufImage  *img,
+				int             new_width,
+				int             new_height,
+				MBPixbufFilter  filter)
+{
+  MBPixbufImage *img_scaled;
+
+  if (new_width <= 0 || new_height <= 0)
+    return NULL;
+
+  img_scaled = _mb_pixbuf_img_new_uninit(pb, new_width, new_height,
+					 img->has_alpha);
+
+  if (img_scaled == NULL)
+    return NULL;
+
+  img_scaled->premultiplied = img->premultiplied;
+
+  if (!_mb_pixbuf_scale_rows(pb, img, img_scaled->rgba, img_scaled->rowstride,
+			     new_width, new_height, filter, NULL, NULL))
+    {
+      mb_pixbuf_img_free(pb, img_scaled);
+      return NULL;
+    }
+
+  return img_scaled;
+}
+
+/* Scaling straight into part of another image */
+
+typedef struct ScaleTarget
+{
+  MBPixbuf            *pb;
+  MBPixbufImage       *src;
+  MBPixbufImage       *dst;
+  int                  dx, dy;
+  int                  x0, x1, y0, y1; /* visible part of the scaled image */
+  MBPixbufOverRowFunc  over_row;
+} ScaleTarget;
+
+static unsigned char *
+_target_row(ScaleTarget *t, int y)
+{
+  return mb_pixbuf_img_pixel(t->dst, t->dx + t->x0, t->dy + y);
+}
+
+static void
+_emit_copy(void *data, int y, unsigned char *row)
+{
+  ScaleTarget   *t = data;
+  unsigned char *dp;
+  int            x, sbc, cbc;
+
+  if (y < t->y0 || y >= t->y1)
+    return;
+
+  sbc = t->pb->internal_bytespp + t->src->has_alpha;
+  cbc = t->pb->internal_bytespp;
+  dp  = _target_row(t, y);
+  row += t->x0 * sbc;
+
+  if (t->src->has_alpha == t->dst->has_alpha)
+    {
+      memcpy(dp, row, (t->x1 - t->x0) * sbc);
+      _mb_pixbuf_match_alpha_row(t->dst, t->src, dp, t->x1 - t->x0);
+      return;
+    }
+
+  for (x = t->x0; x < t->x1; x++, row += sbc)
+    {
+      memcpy(dp, row, cbc);
+      dp += cbc;
+
+      if (t->dst->has_alpha) *dp++ = 0xff;
+    }
+}
+
+static void
+_emit_over(void *data, int y, unsigned char *row)
+{
+  ScaleTarget *t = data;
+
+  if (y < t->y0 || y >= t->y1)
+    return;
+
+  t->over_row(_target_row(t, y), row + t->x0 * (t->pb->internal_bytespp + 1),
+	      t->x1 - t->x0, 0, True);
+}
+
+static void
+_scale_to_target(MBPixbuf      *pb,
+		 MBPixbufImage *src,
+		 MBPixbufImage *dst,
+		 int            dx,
+		 int            dy,
+		 int            dw,
+		 int            dh,
+		 Bool           composite)
+{
+  unsigned char  stack_row[SCALE_STACK_ROW];
+  unsigned char *row;
+  ScaleTarget    t;
+  size_t         row_size;
+  int            sbc;
+
+  if (dw <= 0 || dh <= 0)
+    return;
+
+  if (!mb_pixbuf_img_make_writable(pb, dst))
+    return;
+
+  t.pb  = pb;
+  t.src = src;
+  t.dst = dst;
+  t.dx  = dx;
+  t.dy  = dy;
+  t.x0  = (dx < 0) ? -dx : 0;
+  t.y0  = (dy < 0) ? -dy : 0;
+  t.x1  = (dx + dw > dst->width)  ? dst->width - dx  : dw;
+  t.y1  = (dy + dh > dst->height) ? dst->height - dy : dh;
+
+  if (t.x0 >= t.x1 || t.y0 >= t.y1)
+    return;
+
+  sbc = pb->internal_bytespp + src->has_alpha;
+
+  /* Entirely inside a matching image, scale in place */
+  if (!composite && src->has_alpha == dst->has_alpha
+      && (!src->has_alpha || src->premultiplied == dst->premultiplied)
+      && t.x0 == 0 && t.y0 == 0 && t.x1 == dw && t.y1 == dh)
+    {
+      _mb_pixbuf_scale_rows(pb, src, _target_row(&t, 0), dst->rowstride,
+			    dw, dh, MBPIXBUF_FILTER_BOX, NULL, NULL);
+      return;
+    }
+
+  row_size = dw * sbc;
+  row = (row_size <= sizeof(stack_row)) ? stack_row : malloc(row_size);
+
+  if (row == NULL)
+    return;
+
+  if (composite)
+    t.over_row = _mb_pixbuf_over_row_func(pb, dst, src);
+
+  _mb_pixbuf_scale_rows(pb, src, row, 0, dw, dh, MBPIXBUF_FILTER_BOX,
+			composite ? _emit_over : _emit_copy, &t);
+
+  if (row != stack_row) free(row);
+}
+
+void
+mb_pixbuf_img_scale_into(MBPixbuf      *pb,
+			 MBPixbufImage *src,
+			 MBPixbufImage *dst,
+			 int            dx,
+			 int            dy,
+			 int            dw,
+			 int            dh)
+{
+  _scale_to_target(pb, src, dst, dx, dy, dw, dh, False);
+}
+
+void
+mb_pixbuf_img_scale_composite(MBPixbuf      *pb,
+			      MBPixbufImage *src,
+			      MBPixbufImage *dst,
+			      int            dx,
+			      int            dy,
+			      int            dw,
+			      int            dh)
+{
+  _scale_to_target(pb, src, dst, dx, dy, dw, dh, src->has_alpha);
+}
+
+/* Streaming box scaler for the loaders. Decoded rows are pushed top to
+ * bottom and each output row goes to the emit callback as soon as the
+ * last source row it covers arrives, so only a row of sums is kept.
+ * Same results as the BOX filter on a fully decoded image.
+ */
+struct MBPixbufRowScaler
+{
+  Contrib                xc, yc;
+  int                    sh, dw, dh, nch;
+  int                    sy, y;	/* next source and output row */
+  int                   *hrow, *acc;
+  unsigned char         *out;
+  MBPixbufScaleEmitFunc  emit;
+  void                  *data;
+};
+
+MBPixbufRowScaler *
+_mb_pixbuf_row_scaler_new(int                   sw,
+			  int                   sh,
+			  int                   dw,
+			  int                   dh,
+			  int                   nch,
+			  MBPixbufScaleEmitFunc emit,
+			  void                 *data)
+{
+  MBPixbufRowScaler *rs;
+  unsigned char     *p;
+
+  if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+    return NULL;
+
+  rs = malloc(sizeof(MBPixbufRowScaler)
+	      + (3 * dw + 3 * dh + 2 * dw * nch) * sizeof(int)
+	      + dw * nch);
+  if (rs == NULL)
+    return NULL;
+
+  p = (unsigned char *)(rs + 1);
+  rs->xc.first = (int *)p; p += dw * sizeof(int);
+  rs->xc.count = (int *)p; p += dw * sizeof(int);
+  rs->xc.wofs  = (int *)p; p += dw * sizeof(int);
+  rs->yc.first = (int *)p; p += dh * sizeof(int);
+  rs->yc.count = (int *)p; p += dh * sizeof(int);
+  rs->yc.wofs  = (int *)p; p += dh * sizeof(int);
+  rs->hrow     = (int *)p; p += dw * nch * sizeof(int);
+  rs->acc      = (int *)p; p += dw * nch * sizeof(int);
+  rs->out      = p;
+
+  rs->xc.weight = rs->yc.weight = NULL;
+
+  _contrib_build(&rs->xc, sw, dw, MBPIXBUF_FILTER_BOX);
+  _contrib_build(&rs->yc, sh, dh, MBPIXBUF_FILTER_BOX);
+
+  rs->sh   = sh;
+  rs->dw   = dw;
+  rs->dh   = dh;
+  rs->nch  = nch;
+  rs->sy   = 0;
+  rs->y    = 0;
+  rs->emit = emit;
+  rs->data = data;
+
+  return rs;
+}
+
+static void
+_row_scaler_emit(MBPixbufRowScaler *rs)
+{
+  const int     *a = rs->acc;
+  unsigned char *d = rs->out;
+  int            x, ch, n, yn = rs->yc.count[rs->y];
+  uint64_t       recip[2];
+
+  recip[0] = _box_recip(rs->xc.min_count * yn);
+  recip[1] = _box_recip((rs->xc.min_count + 1) * yn);
+
+  for (x = 0; x < rs->dw; x++)
+    {
+      n = rs->xc.count[x] * yn;
+
+      for (ch = 0; ch < rs->nch; ch++)
+	*d++ = _box_div(*a++, n, recip[rs->xc.count[x] - rs->xc.min_count]);
+    }
+
+  rs->emit(rs->data, rs->y, rs->out);
+}
+
+void
+_mb_pixbuf_row_scaler_push(MBPixbufRowScaler *rs, const unsigned char *row)
+{
+  int sy = rs->sy++, i;
+
+  if (rs->y >= rs->dh)
+    return;
+
+  if (rs->dh >= rs->sh)
+    {
+      /* Enlarging, every output row this is nearest to gets it */
+      if (rs->yc.first[rs->y] != sy)
+	return;
+
+      _hfilter_box(&rs->xc, rs->acc, row, rs->dw, rs->nch);
+      _row_scaler_emit(rs);
+
+      while (++rs->y < rs->dh && rs->yc.first[rs->y] == sy)
+	rs->emit(rs->data, rs->y, rs->out);
+
+      return;
+    }
+
+  if (sy == rs->yc.first[rs->y])
+    _hfilter_box(&rs->xc, rs->acc, row, rs->dw, rs->nch);
+  else
+    {
+      _hfilter_box(&rs->xc, rs->hrow, row, rs->dw, rs->nch);
+
+      for (i = 0; i < rs->dw * rs->nch; i++)
+	rs->acc[i] += rs->hrow[i];
+    }
+
+  if (sy == rs->yc.first[rs->y] + rs->yc.count[rs->y] - 1)
+    {
+      _row_scaler_emit(rs);
+      rs->y++;
+    }
+}
+
+void
+_mb_pixbuf_row_scaler_free(MBPixbufRowScaler *rs)
+{
+  free(rs);
+}
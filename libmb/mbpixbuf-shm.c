@@ -0,0 +1,303 @@
+/* mbpixbuf-shm.c libmb
+ *
+ * Pool of MIT-SHM segments kept attached for the life of an MBPixbuf,
+ * used for rendering and for grabbing from drawables.
+ *
+ * Creating, attaching and tearing down a segment for every render costs
+ * several syscalls and a round trip. Instead segments, sized in power of
+ * two classes, are reused. XShmPutImage is sent with send_event set and
+ * a segment stays busy until its ShmCompletion event arrives ( or the
+ * server is otherwise known to have processed the put ) so rendering
+ * never waits on the server unless the whole pool is in flight.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+#include "mbutil.h"
+
+/* Smallest segment, and most segments, kept per pixbuf */
+#define SHM_MIN_SIZE   (64 * 1024)
+#define SHM_POOL_MAX   4
+
+struct MBPixbufShmSegment
+{
+  XShmSegmentInfo     info;
+  size_t              size;
+  Bool                busy;
+  unsigned long       serial;	/* of the XShmPutImage request */
+  MBPixbufShmSegment *next;
+};
+
+static size_t
+_shm_size_class(size_t size)
+{
+  size_t class = SHM_MIN_SIZE;
+
+  while (class < size)
+    class <<= 1;
+
+  return class;
+}
+
+static MBPixbufShmSegment *
+_shm_segment_new(MBPixbuf *pb, size_t size)
+{
+  MBPixbufShmSegment *seg;
+
+  if ((seg = malloc(sizeof(MBPixbufShmSegment))) == NULL)
+    return NULL;
+
+  seg->size   = size;
+  seg->busy   = False;
+  seg->serial = 0;
+  seg->next   = NULL;
+
+  seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|0777);
+
+  if (seg->info.shmid < 0)
+    {
+      free(seg);
+      return NULL;
+    }
+
+  seg->info.shmaddr = shmat(seg->info.shmid, 0, 0);
+
+  if (seg->info.shmaddr == (char *)-1)
+    {
+      shmctl(seg->info.shmid, IPC_RMID, 0);
+      free(seg);
+      return NULL;
+    }
+
+  /* Writable, so XShmGetImage() can use it too */
+  seg->info.readOnly = False;
+
+  _mbpb_trap_errors();
+
+  XShmAttach(pb->dpy, &seg->info);
+  XSync(pb->dpy, False);
+
+  /* The server is attached now, so mark the segment for removal. It
+   * goes away with the last detach, even if we crash.
+   */
+  shmctl(seg->info.shmid, IPC_RMID, 0);
+
+  if (_mbpb_untrap_errors())
+    {
+      shmdt(seg->info.shmaddr);
+      free(seg);
+      return NULL;
+    }
+
+  return seg;
+}
+
+static void
+_shm_segment_free(MBPixbuf *pb, MBPixbufShmSegment *seg)
+{
+  XShmDetach(pb->dpy, &seg->info);
+  shmdt(seg->info.shmaddr);
+  free(seg);
+}
+
+static Bool
+_shm_completion_predicate(Display *dpy, XEvent *ev, XPointer data)
+{
+  MBPixbuf           *pb = (MBPixbuf *)data;
+  MBPixbufShmSegment *seg;
+
+  if (ev->type != pb->shm_completion_event)
+    return False;
+
+  for (seg = pb->shm_pool; seg; seg = seg->next)
+    if (seg->info.shmseg == ((XShmCompletionEvent *)ev)->shmseg)
+      return True;
+
+  return False;
+}
+
+/* Marks segments the server is done with as free */
+static void
+_shm_pool_reap(MBPixbuf *pb)
+{
+  MBPixbufShmSegment *seg;
+  XEvent              ev;
+
+  while (XCheckIfEvent(pb->dpy, &ev, _shm_completion_predicate, (XPointer)pb))
+    for (seg = pb->shm_pool; seg; seg = seg->next)
+      if (seg->info.shmseg == ((XShmCompletionEvent *)&ev)->shmseg)
+	seg->busy = False;
+
+  /* Covers completions already pulled off the queue by the app */
+  for (seg = pb->shm_pool; seg; seg = seg->next)
+    if (seg->busy
+	&& (long)(LastKnownRequestProcessed(pb->dpy) - seg->serial) >= 0)
+      seg->busy = False;
+}
+
+static MBPixbufShmSegment *
+_shm_pool_get(MBPixbuf *pb, size_t size)
+{
+  MBPixbufShmSegment *seg, *best = NULL, **link;
+  int                 n = 0;
+
+  _shm_pool_reap(pb);
+
+  for (seg = pb->shm_pool; seg; seg = seg->next, n++)
+    if (!seg->busy && seg->size >= size && (!best || seg->size < best->size))
+      best = seg;
+
+  if (best) return best;
+
+  if (n >= SHM_POOL_MAX)
+    {
+      /* Pool full. Drop an idle segment that is too small, else wait
+       * for the server to finish with everything.
+       */
+      for (link = &pb->shm_pool; *link; link = &(*link)->next)
+	if (!(*link)->busy)
+	  break;
+
+      if (*link == NULL)
+	{
+	  XSync(pb->dpy, False);
+	  _shm_pool_reap(pb);
+	  return _shm_pool_get(pb, size);
+	}
+
+      seg   = *link;
+      *link = seg->next;
+      _shm_segment_free(pb, seg);
+    }
+
+  if ((seg = _shm_segment_new(pb, _shm_size_class(size))) == NULL)
+    return NULL;
+
+  seg->next    = pb->shm_pool;
+  pb->shm_pool = seg;
+
+  return seg;
+}
+
+XImage *
+_mb_pixbuf_shm_create_image(MBPixbuf            *pb,
+			    int                  depth,
+			    int                  format,
+			    int                  width,
+			    int                  height,
+			    MBPixbufShmSegment **seg_ret)
+{
+  MBPixbufShmSegment *seg;
+  XImage             *ximg;
+
+  ximg = XShmCreateImage(pb->dpy, pb->vis, depth, format, NULL, NULL,
+			 width, height);
+  if (ximg == NULL)
+    return NULL;
+
+  seg = _shm_pool_get(pb, ximg->bytes_per_line * ximg->height);
+
+  if (seg == NULL)
+    {
+      if (mb_want_warnings())
+	fprintf(stderr, "mbpixbuf: SHM can't attach SHM Segment for Shared XImage, falling back to XImages\n");
+      XDestroyImage(ximg);
+      return NULL;
+    }
+
+  ximg->data   = seg->info.shmaddr;
+  ximg->obdata = (char *)&seg->info;
+
+  *seg_ret = seg;
+
+  return ximg;
+}
+
+void
+_mb_pixbuf_shm_put_image(MBPixbuf           *pb,
+			 MBPixbufShmSegment *seg,
+			 Drawable            drw,
+			 GC                  gc,
+			 XImage             *ximg,
+			 int                 dx,
+			 int                 dy)
+{
+  seg->serial = NextRequest(pb->dpy);
+  seg->busy   = True;
+
+  XShmPutImage(pb->dpy, drw, gc, ximg, 0, 0,
+	       dx, dy, ximg->width, ximg->height, True);
+  XFlush(pb->dpy);
+
+  XDestroyImage(ximg);		/* Only frees the XImage itself */
+}
+
+XImage *
+_mb_pixbuf_shm_get_image(MBPixbuf *pb,
+			 Drawable  drw,
+			 int       x,
+			 int       y,
+			 int       width,
+			 int       height)
+{
+  MBPixbufShmSegment *seg;
+  XImage             *ximg;
+  Status              ok;
+
+  ximg = _mb_pixbuf_shm_create_image(pb, pb->depth, ZPixmap, 
+				     width, height, &seg);
+  if (ximg == NULL)
+    return NULL;
+
+  /* A round trip, so the segment is free again once this returns */
+  _mbpb_trap_errors();
+
+  ok = XShmGetImage(pb->dpy, drw, ximg, x, y, AllPlanes);
+
+  if (_mbpb_untrap_errors() || !ok)
+    {
+      XDestroyImage(ximg);
+      return NULL;
+    }
+
+  return ximg;
+}
+
+void
+_mb_pixbuf_shm_pool_free(MBPixbuf *pb)
+{
+  MBPixbufShmSegment *seg;
+  XEvent              ev;
+
+  if (pb->shm_pool == NULL) return;
+
+  /* Leave no completions of ours behind in the queue */
+  XSync(pb->dpy, False);
+  while (XCheckIfEvent(pb->dpy, &ev, _shm_completion_predicate, (XPointer)pb))
+    ;
+
+  while ((seg = pb->shm_pool) != NULL)
+    {
+      pb->shm_pool = seg->next;
+      XShmDetach(pb->dpy, &seg->info);
+      shmdt(seg->info.shmaddr);
+      free(seg);
+    }
+
+  XSync(pb->dpy, False);
+}
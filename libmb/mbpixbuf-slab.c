@@ -0,0 +1,235 @@
+/* mbpixbuf-slab.c libmb
+ *
+ * Allocator for images. An image's header and, when libmb owns them,
+ * its pixels come from one block;
+ *
+ *   SlabBlock      block bookkeeping
+ *   MBPixbufImage  the header
+ *   pixels         MBPIXBUF_ROW_ALIGN aligned
+ *
+ * Each MBPixbuf has a slab keeping freed blocks on a free list per size
+ * class, sized for icons from 16x16 to 64x64 plus one for headers of
+ * pixels held elsewhere such as clones, so the menus and trays painting
+ * the same few icon sizes over and over rarely reach malloc. Bigger
+ * images are plain allocations.
+ *
+ * Blocks are reference counted; the image holds one, and so does a
+ * buffer sharing its pixels with clones ( see mb_pixbuf_img_clone ), so
+ * the pixels outlive the header if need be. Each block in use holds a
+ * reference on its slab, so images may outlive their MBPixbuf.
+ *
+ * Images may be made on the worker pool's threads, so the slab is
+ * locked.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+#include <pthread.h>
+
+/* Freed blocks kept per size class */
+#define SLAB_MAX_FREE  32
+
+#define SLAB_ROUND(n)  (((n) + MBPIXBUF_ROW_ALIGN - 1)                     \
+			& ~(size_t)(MBPIXBUF_ROW_ALIGN - 1))
+
+typedef struct SlabBlock SlabBlock;
+
+struct SlabBlock
+{
+  MBPixbufSlab *slab;		/* NULL if not from a slab */
+  SlabBlock    *next;		/* on the free list */
+  int           refcount;
+  int           size_class;	/* -1 for none */
+  size_t        pixel_bytes;	/* room for pixels after the header */
+};
+
+#define BLOCK_SIZE   SLAB_ROUND(sizeof(SlabBlock))
+#define HEADER_SIZE  SLAB_ROUND(sizeof(MBPixbufImage))
+
+#define BLOCK_IMAGE(b)  ((MBPixbufImage *)((unsigned char *)(b) + BLOCK_SIZE))
+#define IMAGE_BLOCK(i)  ((SlabBlock *)((unsigned char *)(i) - BLOCK_SIZE))
+#define IMAGE_PIXELS(i) ((unsigned char *)(i) + HEADER_SIZE)
+
+/* Pixel bytes of each class, none then 16 to 64 pixels square with
+ * alpha
+ */
+static const size_t _size_classes[] = {
+  0, 16 * 16 * 4, 24 * 24 * 4, 32 * 32 * 4, 48 * 48 * 4, 64 * 64 * 4
+};
+
+#define N_SIZE_CLASSES  (sizeof(_size_classes) / sizeof(_size_classes[0]))
+
+struct MBPixbufSlab
+{
+  pthread_mutex_t  lock;
+  int              refcount;	/* the MBPixbuf's, plus blocks in use */
+  SlabBlock       *free[N_SIZE_CLASSES];
+  int              n_free[N_SIZE_CLASSES];
+};
+
+MBPixbufSlab *
+_mb_pixbuf_slab_new(void)
+{
+  MBPixbufSlab *slab;
+
+  if ((slab = calloc(1, sizeof(MBPixbufSlab))) == NULL)
+    return NULL;
+
+  pthread_mutex_init(&slab->lock, NULL);
+  slab->refcount = 1;
+
+  return slab;
+}
+
+static void
+_slab_free(MBPixbufSlab *slab)
+{
+  SlabBlock *b;
+  int        i;
+
+  for (i = 0; i < N_SIZE_CLASSES; i++)
+    while ((b = slab->free[i]) != NULL)
+      {
+	slab->free[i] = b->next;
+	free(b);
+      }
+
+  pthread_mutex_destroy(&slab->lock);
+  free(slab);
+}
+
+void
+_mb_pixbuf_slab_unref(MBPixbufSlab *slab)
+{
+  int refcount;
+
+  if (slab == NULL)
+    return;
+
+  pthread_mutex_lock(&slab->lock);
+  refcount = --slab->refcount;
+  pthread_mutex_unlock(&slab->lock);
+
+  if (refcount == 0)
+    _slab_free(slab);
+}
+
+static int
+_size_class(size_t pixel_bytes)
+{
+  int i;
+
+  for (i = 0; i < N_SIZE_CLASSES; i++)
+    if (pixel_bytes <= _size_classes[i])
+      return i;
+
+  return -1;
+}
+
+MBPixbufImage *
+_mb_pixbuf_slab_img_alloc(MBPixbufSlab *slab, size_t pixel_bytes)
+{
+  SlabBlock *b = NULL;
+  void      *mem;
+  int        c = -1;
+
+  if (slab)
+    {
+      c = _size_class(pixel_bytes);
+
+      pthread_mutex_lock(&slab->lock);
+
+      if (c >= 0 && (b = slab->free[c]) != NULL)
+	{
+	  slab->free[c] = b->next;
+	  slab->n_free[c]--;
+	}
+
+      slab->refcount++;
+      pthread_mutex_unlock(&slab->lock);
+    }
+
+  if (b == NULL)
+    {
+      if (c >= 0)
+	pixel_bytes = _size_classes[c];
+
+      if (posix_memalign(&mem, MBPIXBUF_ROW_ALIGN,
+			 BLOCK_SIZE + HEADER_SIZE + pixel_bytes) != 0)
+	{
+	  _mb_pixbuf_slab_unref(slab);
+	  return NULL;
+	}
+
+      b = mem;
+      b->size_class  = c;
+      b->pixel_bytes = pixel_bytes;
+    }
+
+  b->slab     = slab;
+  b->next     = NULL;
+  b->refcount = 1;
+
+  return BLOCK_IMAGE(b);
+}
+
+unsigned char *
+_mb_pixbuf_slab_img_pixels(MBPixbufImage *img)
+{
+  return IMAGE_BLOCK(img)->pixel_bytes ? IMAGE_PIXELS(img) : NULL;
+}
+
+void
+_mb_pixbuf_slab_img_ref(MBPixbufImage *img)
+{
+  IMAGE_BLOCK(img)->refcount++;
+}
+
+void
+_mb_pixbuf_slab_img_release(MBPixbufImage *img)
+{
+  SlabBlock    *b = IMAGE_BLOCK(img);
+  MBPixbufSlab *slab = b->slab;
+
+  if (--b->refcount > 0)
+    return;
+
+  if (slab == NULL)
+    {
+      free(b);
+      return;
+    }
+
+  pthread_mutex_lock(&slab->lock);
+
+  if (b->size_class >= 0 && slab->n_free[b->size_class] < SLAB_MAX_FREE
+      && slab->refcount > 1)
+    {
+      b->next = slab->free[b->size_class];
+      slab->free[b->size_class] = b;
+      slab->n_free[b->size_class]++;
+      b = NULL;
+    }
+
+  pthread_mutex_unlock(&slab->lock);
+
+  if (b) free(b);
+
+  _mb_pixbuf_slab_unref(slab);
+}
@@ -0,0 +1,373 @@
+/* mbpixbuf-transform.c libmb
+ *
+ * Rotations and flips.
+ *
+ * Rotating by 90 or 270 degrees turns source rows into destination
+ * columns, so the image is walked in square tiles small enough that the
+ * source rows and destination rows of a tile all stay in cache. Within
+ * a tile destination rows are written in order. Flips and rotating by
+ * 180 degrees only reverse rows or pixels, so they can be done in place.
+ *
+ * Every loop is stamped out once per pixel size, 2, 3 and 4 bytes, so
+ * each pixel is moved with a fixed size copy. Copying transforms work on
+ * a band of source rows at a time so large images can be split across
+ * threads.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
+
+/* Tile edge in pixels, 32 x 32 x 4 bytes is 4k each side */
+#define TRANSFORM_TILE  32
+
+/* Transforms source rows @y0 to @y1 - 1 of a @width x @height image,
+ * rows are @sstride bytes apart in @src and @dstride in @dst
+ */
+typedef void (*TransformFunc) (unsigned char       *dst,
+			       int                  dstride,
+			       const unsigned char *src,
+			       int                  sstride,
+			       int                  width,
+			       int                  height,
+			       int                  y0,
+			       int                  y1);
+
+typedef void (*InPlaceFunc) (unsigned char *p, int stride, 
+			     int width, int height);
+
+#define PIXEL_COPY(d, s, bpp)  memcpy((d), (s), (bpp))
+
+#define PIXEL_SWAP(a, b, bpp)                         \
+  {                                                   \
+    unsigned char _t[bpp];                            \
+    memcpy(_t, (a), (bpp));                           \
+    memcpy((a), (b), (bpp));                          \
+    memcpy((b), _t, (bpp));                           \
+  }
+
+#define DEFINE_TRANSFORMS(bpp)                                               \
+                                                                             \
+/* dst(x, y) = src(y, height - 1 - x) */                                     \
+static void                                                                  \
+_rotate_90_##bpp(unsigned char *dst, int dstride,                            \
+		 const unsigned char *src, int sstride,                      \
+		 int width, int height, int y0, int y1)                      \
+{                                                                            \
+  const unsigned char *sp;                                                   \
+  unsigned char       *dp;                                                   \
+  int tx, ty, x, y, xend, yend;                                              \
+                                                                             \
+  for (ty = y0; ty < y1; ty += TRANSFORM_TILE)                               \
+    for (tx = 0; tx < width; tx += TRANSFORM_TILE)                           \
+      {                                                                      \
+	xend = (tx + TRANSFORM_TILE < width)  ? tx + TRANSFORM_TILE : width; \
+	yend = (ty + TRANSFORM_TILE < y1) ? ty + TRANSFORM_TILE : y1;        \
+                                                                             \
+	for (x = tx; x < xend; x++)                                          \
+	  {                                                                  \
+	    dp = dst + x * dstride + (height - yend) * bpp;                  \
+	    sp = src + (yend - 1) * sstride + x * bpp;                       \
+                                                                             \
+	    for (y = yend - 1; y >= ty; y--, dp += bpp, sp -= sstride)       \
+	      PIXEL_COPY(dp, sp, bpp);                                       \
+	  }                                                                  \
+      }                                                                      \
+}                                                                            \
+                                                                             \
+/* dst(x, y) = src(width - 1 - y, x) */                                      \
+static void                                                                  \
+_rotate_270_##bpp(unsigned char *dst, int dstride,                           \
+		  const unsigned char *src, int sstride,                     \
+		  int width, int height, int y0, int y1)                     \
+{                                                                            \
+  const unsigned char *sp;                                                   \
+  unsigned char       *dp;                                                   \
+  int tx, ty, x, y, xend, yend;                                              \
+                                                                             \
+  for (ty = y0; ty < y1; ty += TRANSFORM_TILE)                               \
+    for (tx = 0; tx < width; tx += TRANSFORM_TILE)                           \
+      {                                                                      \
+	xend = (tx + TRANSFORM_TILE < width)  ? tx + TRANSFORM_TILE : width; \
+	yend = (ty + TRANSFORM_TILE < y1) ? ty + TRANSFORM_TILE : y1;        \
+                                                                             \
+	for (x = tx; x < xend; x++)                                          \
+	  {                                                                  \
+	    dp = dst + (width - 1 - x) * dstride + ty * bpp;                 \
+	    sp = src + ty * sstride + x * bpp;                               \
+                                                                             \
+	    for (y = ty; y < yend; y++, dp += bpp, sp += sstride)            \
+	      PIXEL_COPY(dp, sp, bpp);                                       \
+	  }                                                                  \
+      }                                                                      \
+}                                                                            \
+                                                                             \
+static void                                                                  \
+_reverse_copy_##bpp(unsigned char *dst, const unsigned char *src, int n)     \
+{                                                                            \
+  const unsigned char *sp = src + (n - 1) * bpp;                             \
+                                                                             \
+  for (; n > 0; n--, dst += bpp, sp -= bpp)                                  \
+    PIXEL_COPY(dst, sp, bpp);                                                \
+}                                                                            \
+                                                                             \
+static void                                                                  \
+_reverse_##bpp(unsigned char *p, int n)                                      \
+{                                                                            \
+  unsigned char *q = p + (n - 1) * bpp;                                      \
+                                                                             \
+  for (; p < q; p += bpp, q -= bpp)                                          \
+    PIXEL_SWAP(p, q, bpp);                                                   \
+}                                                                            \
+                                                                             \
+/* Swaps row @a with @b reversed, @n pixels each */                          \
+static void                                                                  \
+_reverse_swap_##bpp(unsigned char *a, unsigned char *b, int n)               \
+{                                                                            \
+  unsigned char *q = b + (n - 1) * bpp;                                      \
+                                                                             \
+  for (; n > 0; n--, a += bpp, q -= bpp)                                     \
+    PIXEL_SWAP(a, q, bpp);                                                   \
+}                                                                            \
+                                                                             \
+static void                                                                  \
+_flip_horiz_##bpp(unsigned char *dst, int dstride,                           \
+		  const unsigned char *src, int sstride,                     \
+		  int width, int height, int y0, int y1)                     \
+{                                                                            \
+  int y;                                                                     \
+                                                                             \
+  for (y = y0; y < y1; y++)                                                  \
+    _reverse_copy_##bpp(dst + y * dstride, src + y * sstride, width);        \
+}                                                                            \
+                                                                             \
+static void                                                                  \
+_rotate_180_##bpp(unsigned char *dst, int dstride,                           \
+		  const unsigned char *src, int sstride,                     \
+		  int width, int height, int y0, int y1)                     \
+{                                                                            \
+  int y;                                                                     \
+                                                                             \
+  for (y = y0; y < y1; y++)                                                  \
+    _reverse_copy_##bpp(dst + (height - 1 - y) * dstride,                    \
+			src + y * sstride, width);                           \
+}                                                                            \
+                                                                             \
+static void                                                                  \
+_flip_horiz_in_place_##bpp(unsigned char *p, int stride,                     \
+			   int width, int height)                            \
+{                                                                            \
+  int y;                                                                     \
+                                                                             \
+  for (y = 0; y < height; y++)                                               \
+    _reverse_##bpp(p + y * stride, width);                                   \
+}                                                                            \
+                                                                             \
+static void                                                                  \
+_rotate_180_in_place_##bpp(unsigned char *p, int stride,                     \
+			   int width, int height)                            \
+{                                                                            \
+  int y;                                                                     \
+                                                                             \
+  for (y = 0; y < height / 2; y++)                                           \
+    _reverse_swap_##bpp(p + y * stride, p + (height - 1 - y) * stride,       \
+			width);                                              \
+                                                                             \
+  if (height & 1)                                                            \
+    _reverse_##bpp(p + (height / 2) * stride, width);                        \
+}
+
+DEFINE_TRANSFORMS(2)
+DEFINE_TRANSFORMS(3)
+DEFINE_TRANSFORMS(4)
+
+/* Flipping vertically moves whole rows, so doesn't care for bpp */
+
+static void
+_flip_vert(unsigned char *dst, int dstride, 
+	   const unsigned char *src, int sstride,
+	   int width, int height, int y0, int y1, int bpp)
+{
+  int y;
+
+  for (y = y0; y < y1; y++)
+    memcpy(dst + (height - 1 - y) * dstride, src + y * sstride, width * bpp);
+}
+
+static void
+_flip_vert_in_place(unsigned char *p, int stride, 
+		    int width, int height, int bpp)
+{
+  unsigned char  buf[1024], *a, *b;
+  int            y, n, done, len = width * bpp;
+
+  for (y = 0; y < height / 2; y++)
+    {
+      a = p + y * stride;
+      b = p + (height - 1 - y) * stride;
+
+      for (done = 0; done < len; done += n)
+	{
+	  n = (len - done < sizeof(buf)) ? len - done : sizeof(buf);
+
+	  memcpy(buf, a + done, n);
+	  memcpy(a + done, b + done, n);
+	  memcpy(b + done, buf, n);
+	}
+    }
+}
+
+#define TRANSFORM_TABLE(name) { name##_2, name##_3, name##_4 }
+
+static const TransformFunc _rotate_90[]  = TRANSFORM_TABLE(_rotate_90);
+static const TransformFunc _rotate_180[] = TRANSFORM_TABLE(_rotate_180);
+static const TransformFunc _rotate_270[] = TRANSFORM_TABLE(_rotate_270);
+static const TransformFunc _flip_horiz[] = TRANSFORM_TABLE(_flip_horiz);
+
+static const InPlaceFunc _rotate_180_in_place[] 
+  = TRANSFORM_TABLE(_rotate_180_in_place);
+static const InPlaceFunc _flip_horiz_in_place[]
+  = TRANSFORM_TABLE(_flip_horiz_in_place);
+
+typedef struct TransformBands
+{
+  TransformFunc        func;	/* NULL to flip vertically */
+  unsigned char       *dst;
+  const unsigned char *src;
+  int                  dstride, sstride;
+  int                  width, height, bpp;
+} TransformBands;
+
+static void
+_transform_band(void *data, int y0, int y1)
+{
+  TransformBands *t = data;
+
+  if (t->func)
+    t->func(t->dst, t->dstride, t->src, t->sstride,
+	    t->width, t->height, y0, y1);
+  else
+    _flip_vert(t->dst, t->dstride, t->src, t->sstride,
+	       t->width, t->height, y0, y1, t->bpp);
+}
+
+MBPixbufImage *
+mb_pixbuf_img_transform (MBPixbuf          *pb,
+			 MBPixbufImage     *img,
+			 MBPixbufTransform  transform)
+{
+  MBPixbufImage  *img_trans;
+  TransformBands  t;
+  int             new_width, new_height;
+
+  switch (transform)
+    {
+    case MBPIXBUF_TRANS_ROTATE_90:
+    case MBPIXBUF_TRANS_ROTATE_270:
+      new_width  = img->height;
+      new_height = img->width;
+      break;
+    default:
+      new_width  = img->width;
+      new_height = img->height;
+      break;
+    }
+
+  t.bpp = pb->internal_bytespp + img->has_alpha;
+
+  switch (transform)
+    {
+    case MBPIXBUF_TRANS_ROTATE_90:
+      t.func = _rotate_90[t.bpp-2];
+      break;
+    case MBPIXBUF_TRANS_ROTATE_180:
+      t.func = _rotate_180[t.bpp-2];
+      break;
+    case MBPIXBUF_TRANS_ROTATE_270:
+      t.func = _rotate_270[t.bpp-2];
+      break;
+    case MBPIXBUF_TRANS_FLIP_VERT:
+      t.func = NULL;
+      break;
+    case MBPIXBUF_TRANS_FLIP_HORIZ:
+      t.func = _flip_horiz[t.bpp-2];
+      break;
+    default:
+      if (img->has_alpha)
+	return mb_pixbuf_img_rgba_new(pb, new_width, new_height);
+      else
+	return mb_pixbuf_img_rgb_new(pb, new_width, new_height);
+    }
+
+  /* Every pixel is written below */
+  img_trans = _mb_pixbuf_img_new_uninit(pb, new_width, new_height,
+					img->has_alpha);
+
+  if (img_trans == NULL)
+    return NULL;
+
+  img_trans->premultiplied = img->premultiplied;
+
+  t.dst     = img_trans->rgba;
+  t.dstride = img_trans->rowstride;
+  t.src     = img->rgba;
+  t.sstride = img->rowstride;
+  t.width   = img->width;
+  t.height  = img->height;
+
+  /* Bands are in source rows */
+  _mb_pixbuf_run_bands(pb, img->height, (long)img->width * img->height,
+		       _transform_band, &t);
+
+  return img_trans;
+}
+
+Bool
+mb_pixbuf_img_transform_in_place (MBPixbuf          *pb,
+				  MBPixbufImage     *img,
+				  MBPixbufTransform  transform)
+{
+  int bpp = pb->internal_bytespp + img->has_alpha;
+
+  /* Turning on the spot would need a new row size */
+  if (transform == MBPIXBUF_TRANS_ROTATE_90
+      || transform == MBPIXBUF_TRANS_ROTATE_270)
+    return False;
+
+  if (!mb_pixbuf_img_make_writable(pb, img))
+    return False;
+
+  switch (transform)
+    {
+    case MBPIXBUF_TRANS_ROTATE_180:
+      _rotate_180_in_place[bpp-2](img->rgba, img->rowstride, 
+				  img->width, img->height);
+      return True;
+    case MBPIXBUF_TRANS_FLIP_VERT:
+      _flip_vert_in_place(img->rgba, img->rowstride, 
+			  img->width, img->height, bpp);
+      return True;
+    case MBPIXBUF_TRANS_FLIP_HORIZ:
+      _flip_horiz_in_place[bpp-2](img->rgba, img->rowstride, 
+				  img->width, img->height);
+      return True;
+    default:
+      break;
+    }
+
+  return False;
+}
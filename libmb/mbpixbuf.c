@@ -23,78 +23,46 @@
 #include <strings.h>
 
 #include "mbpixbuf.h"
+#include "mbpixbuf-private.h"
 #include "mbutil.h"
 
 #include <setjmp.h>
-
-#define BYTE_ORD_24_RGB  0
-#define BYTE_ORD_24_RBG  1
-#define BYTE_ORD_24_BRG  2
-#define BYTE_ORD_24_BGR  3
-#define BYTE_ORD_24_GRB  4
-#define BYTE_ORD_24_GBR  5
-#define BYTE_ORD_32_ARGB 6
-
-#define alpha_composite(composite, fg, alpha, bg) {               \
-    ush temp;                                                     \
-    if ((alpha) == 0)                                             \
-       (composite) = (bg);                                        \
-    else if ((alpha) == 255)                                      \
-        (composite) = (fg);                                       \
-    else {                                                        \
-        temp = ((ush)(fg)*(ush)(alpha) +                          \
-                (ush)(bg)*(ush)(255 - (ush)(alpha)) + (ush)128);  \
-    (composite) = (ush)((temp + (temp >> 8)) >> 8);             } \
-}
-
-#ifdef WORDS_BIGENDIAN
-#define  SHORT_FROM_2BYTES(p) ( *(p+1) | (*(p) << 8) )
-#define  2BYTES_FROM_SHORT(p,s)                       \
-     *((p)+1)   = (unsigned char) s;                  \
-     *(p)       = (unsigned char) ((s >> 8) & 0xff);    
-#else
-#define  SHORT_FROM_2BYTES(p) ( *(p) | (*((p)+1) << 8) )
-#define  BYTES_FROM_SHORT(p,s)                       \
-     *(p)   = (unsigned char) s;                      \
-     *((p)+1) = (unsigned char) ((s >> 8) & 0xff);    
-#endif
-
-#define internal_16bpp_pixel_to_rgb(p,r,g,b)           \
-      {                                                \
-         unsigned short s = SHORT_FROM_2BYTES(p);      \
-         (r) = (( s & 0xf800) >> 8);                   \
-         (g) = (( s & 0x07e0) >> 3);                   \
-         (b) = (( s & 0x001f) << 3);                   \
-      }
-
-
-#define internal_rgb_to_16bpp_pixel(r,g,b,p)          \
-     {                                                \
-      unsigned short s = (  (((b) >> 3) & 0x001f) |   \
-                            (((g) << 3) & 0x07e0) |   \
-                            (((r) << 8) & 0xf800) );  \
-      BYTES_FROM_SHORT(p,s)                           \
-     }
-
-#define internal_16bpp_pixel_next(p) \
-      (p) += 2
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define BYTE_ORD_24_RGB  MBPIXBUF_BYTE_ORDER_RGB
+#define BYTE_ORD_24_RBG  MBPIXBUF_BYTE_ORDER_RBG
+#define BYTE_ORD_24_BRG  MBPIXBUF_BYTE_ORDER_BRG
+#define BYTE_ORD_24_BGR  MBPIXBUF_BYTE_ORDER_BGR
+#define BYTE_ORD_24_GRB  MBPIXBUF_BYTE_ORDER_GRB
+#define BYTE_ORD_24_GBR  MBPIXBUF_BYTE_ORDER_GBR
+#define BYTE_ORD_32_ARGB MBPIXBUF_BYTE_ORDER_ARGB
+
+typedef enum 
+{
+  MBPIXBUF_FORMAT_UNKNOWN,
+  MBPIXBUF_FORMAT_PNG,
+  MBPIXBUF_FORMAT_JPEG,
+  MBPIXBUF_FORMAT_XPM
+} MBPixbufImageFormat;
 
 #define IN_REGION(x,y,w,h) ( (x) > -1 && (x) < (w) && (y) > -1 && (y) <(h) ) 
 
-typedef unsigned short ush;
-
 #ifdef USE_PNG
-static unsigned char* 
-_load_png_file( const char *file, 
-		int *width, int *height, int *has_alpha );
+static MBPixbufImage * 
+_load_png_data( MBPixbuf *pb, const unsigned char *data, size_t len,
+		int width, int height );
 #endif
 
 #ifdef USE_JPG
-static unsigned char* 
-_load_jpg_file( const char *file, 
-		int *width, int *height, int *has_alpha );
+static MBPixbufImage * 
+_load_jpg_data( MBPixbuf *pb, const unsigned char *data, size_t len,
+		int width, int height );
 #endif
 
+
 static int _mbpb_trapped_error_code = 0;
 static int (*_mbpb_old_error_handler) (Display *d, XErrorEvent *e);
 
@@ -106,14 +74,14 @@ _mbpb_error_handler(Display     *display,
    return 0;
 }
 
-static void
+void
 _mbpb_trap_errors(void)
 {
    _mbpb_trapped_error_code = 0;
    _mbpb_old_error_handler = XSetErrorHandler(_mbpb_error_handler);
 }
 
-static int
+int
 _mbpb_untrap_errors(void)
 {
    XSetErrorHandler(_mbpb_old_error_handler);
@@ -141,41 +109,102 @@ _jpeg_error_exit (j_common_ptr cinfo)
   longjmp(myerr->setjmp_buffer, 1);
 }
 
-static unsigned char* 
-_load_jpg_file( const char *file, 
-		int *width, int *height, int *has_alpha )
+/* Source manager reading from memory, libjpeg 6b has no jpeg_mem_src */
+
+static void
+_jpeg_mem_init_source (j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+_jpeg_mem_fill_input_buffer (j_decompress_ptr cinfo)
+{
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+  /* Out of data, end the image as libjpeg's stdio source does */
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+
+  return TRUE;
+}
+
+static void
+_jpeg_mem_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpeg_source_mgr *src = cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+
+  if ((size_t)num_bytes > src->bytes_in_buffer)
+    _jpeg_mem_fill_input_buffer(cinfo);
+  else
+    {
+      src->next_input_byte += num_bytes;
+      src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void
+_jpeg_mem_term_source (j_decompress_ptr cinfo)
+{
+}
+
+/* Decodes straight into the internal format a scanline at a time. If
+ * a size is asked for libjpeg shrinks by up to 8 while decoding, as far
+ * as it can without going below it, and the rest is box filtered.
+ */
+static MBPixbufImage * 
+_load_jpg_data( MBPixbuf *pb, const unsigned char *data, size_t len,
+		int width, int height )
 {
   struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
   struct my_error_mgr jerr;
-  FILE * infile;		/* source file */
-  JSAMPLE *buffer;		/* Output row buffer */
-  int row_stride;		/* physical row width in output buffer */
- 
-  unsigned char *data = NULL;
-
-  if ((infile = fopen(file, "rb")) == NULL) {
-    if (mb_want_warnings())
-      fprintf(stderr, "mbpixbuf: can't open %s\n", file);
-    return NULL;
-  }
+  JSAMPLE *volatile buffer = NULL;	/* Output row buffer */
+  MBPixbufImage *volatile img = NULL;
+  MBPixbufRowScaler *volatile scaler = NULL;
+  MBPixbufRowScaler *rs;
+  JSAMPLE *row;
+  unsigned int denom;
 
   cinfo.err = jpeg_std_error(&jerr.pub);
   jerr.pub.error_exit = _jpeg_error_exit;
 
   if (setjmp(jerr.setjmp_buffer)) {
     jpeg_destroy_decompress(&cinfo);
-    fclose(infile);
+    if (buffer) free(buffer);
+    if (scaler) _mb_pixbuf_row_scaler_free(scaler);
+    if (img) mb_pixbuf_img_free(pb, img);
     return NULL;
   }
 
   jpeg_create_decompress(&cinfo);
-  jpeg_stdio_src(&cinfo, infile);
+
+  src.init_source       = _jpeg_mem_init_source;
+  src.fill_input_buffer = _jpeg_mem_fill_input_buffer;
+  src.skip_input_data   = _jpeg_mem_skip_input_data;
+  src.resync_to_restart = jpeg_resync_to_restart;
+  src.term_source       = _jpeg_mem_term_source;
+  src.next_input_byte   = data;
+  src.bytes_in_buffer   = len;
+  cinfo.src             = &src;
   jpeg_read_header(&cinfo, TRUE);
 
   cinfo.do_fancy_upsampling = FALSE;
   cinfo.do_block_smoothing  = FALSE;
   cinfo.out_color_space     = JCS_RGB;
   cinfo.scale_num           = 1;
+  cinfo.scale_denom         = 1;
+
+  if (width > 0 && height > 0)
+    for (denom = 2; denom <= 8; denom *= 2)
+      {
+	if ((cinfo.image_width + denom - 1) / denom < (unsigned int)width
+	    || (cinfo.image_height + denom - 1) / denom < (unsigned int)height)
+	  break;
+	cinfo.scale_denom = denom;
+      }
 
   jpeg_start_decompress(&cinfo);
 
@@ -184,87 +213,114 @@ _load_jpg_file( const char *file,
       if (mb_want_warnings())
 	fprintf( stderr, "mbpixbuf: jpegs with %d channles not supported\n", 
 		 cinfo.output_components );
-      jpeg_finish_decompress(&cinfo);
       jpeg_destroy_decompress(&cinfo);
       return NULL;
   }
 
-  *has_alpha = False;
-  *width     = cinfo.output_width;
-  *height    = cinfo.output_height;
- 
-  data = malloc(*width * *height * 3 );
-  row_stride = cinfo.output_width * cinfo.output_components;
-  buffer = malloc( sizeof(JSAMPLE)*row_stride );
+  img = _mb_pixbuf_load_begin(pb, cinfo.output_width, cinfo.output_height,
+			      False, width, height, &rs);
+  scaler = rs;
+
+  if (img == NULL)
+    longjmp(jerr.setjmp_buffer, 1);
+
+  /* 16bpp and scaling need somewhere to convert from */
+  if (pb->internal_bytespp == 2 || scaler)
+    {
+      buffer = malloc(sizeof(JSAMPLE) * cinfo.output_width * 3);
+      if (buffer == NULL)
+	longjmp(jerr.setjmp_buffer, 1);
+    }
 
   while (cinfo.output_scanline < cinfo.output_height) {
-    jpeg_read_scanlines(&cinfo, &buffer, 1);
-    memcpy( &data[ ( cinfo.output_scanline - 1 ) * row_stride ], 
-	    buffer, row_stride );
+    row = buffer ? buffer : img->rgba + cinfo.output_scanline * img->rowstride;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    _mb_pixbuf_load_row(pb, img, scaler, cinfo.output_scanline - 1, row,
+			cinfo.output_width);
   }
 
   jpeg_finish_decompress(&cinfo);
   jpeg_destroy_decompress(&cinfo);
-  fclose(infile);
 
   if (buffer) free(buffer);
+  if (scaler) _mb_pixbuf_row_scaler_free(scaler);
 
-  return data;
+  return img;
 }
 
 #endif
 
 #ifdef USE_PNG
 
-static unsigned char* 
-_load_png_file( const char *file, 
-	       int *width, int *height, int *has_alpha ) {
-  FILE *fd;
-  unsigned char *data;
-  unsigned char header[8];
-  int  bit_depth, color_type;
+/* Feeds libpng from a buffer in memory */
+typedef struct PngMemSource
+{
+  const unsigned char *data;
+  size_t               len, pos;
+} PngMemSource;
+
+static void
+_png_mem_read (png_structp png_ptr, png_bytep out, png_size_t n)
+{
+  PngMemSource *src = png_get_io_ptr(png_ptr);
+
+  if (n > src->len - src->pos)
+    png_error(png_ptr, "premature end of data");
+
+  memcpy(out, src->data + src->pos, n);
+  src->pos += n;
+}
+
+/* Decodes straight into the internal format a row at a time, scaling
+ * to a size if one is asked for, unless interlaced when the passes need
+ * a whole image to build up in.
+ */
+static MBPixbufImage * 
+_load_png_data( MBPixbuf *pb, const unsigned char *data, size_t len,
+		int width, int height ) 
+{
+  PngMemSource src;
+  int  bit_depth, color_type, passes, bpp;
 
-  png_uint_32  png_width, png_height, i, rowbytes;
+  png_uint_32  png_width, png_height, y;
   png_structp png_ptr;
   png_infop info_ptr;
-  png_bytep *row_pointers;
-  png_byte ct;
+  unsigned char *volatile buffer = NULL;
+  MBPixbufImage *volatile img = NULL;
+  MBPixbufRowScaler *volatile scaler = NULL;
+  MBPixbufRowScaler *rs;
+  unsigned char *row;
 
-  if ((fd = fopen( file, "rb" )) == NULL) return NULL;
-
-  fread( header, 1, 8, fd );
-  if ( ! png_check_sig( header, 8 ) ) 
-    {
-      fclose(fd);
-      return NULL;
-    }
+  if (len < 8 || png_sig_cmp( (png_bytep)data, 0, 8 ) ) 
+    return NULL;
 
   png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if ( ! png_ptr ) {
-    fclose(fd);
+  if ( ! png_ptr ) 
     return NULL;
-  }
 
   info_ptr = png_create_info_struct(png_ptr);
   if ( ! info_ptr ) {
     png_destroy_read_struct( &png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-    fclose(fd);
     return NULL;
   }
 
   if ( setjmp( png_jmpbuf( png_ptr ) ) ) {
     png_destroy_read_struct( &png_ptr, &info_ptr, NULL);
-    fclose(fd);
+    if (buffer) free(buffer);
+    if (scaler) _mb_pixbuf_row_scaler_free(scaler);
+    if (img) mb_pixbuf_img_free(pb, img);
     return NULL;
   }
 
-  png_init_io( png_ptr, fd );
+  src.data = data;
+  src.len  = len;
+  src.pos  = 8;
+
+  png_set_read_fn( png_ptr, &src, _png_mem_read );
   png_set_sig_bytes( png_ptr, 8);
   png_read_info( png_ptr, info_ptr);
   png_get_IHDR( png_ptr, info_ptr, &png_width, &png_height, &bit_depth, 
 		&color_type, NULL, NULL, NULL);
-  *width = (int) png_width;
-  *height = (int) png_height;
 
   if (( color_type == PNG_COLOR_TYPE_PALETTE )||
       ( png_get_valid( png_ptr, info_ptr, PNG_INFO_tRNS )))
@@ -274,15 +330,6 @@ _load_png_file( const char *file,
       ( color_type == PNG_COLOR_TYPE_GRAY_ALPHA ))
     png_set_gray_to_rgb(png_ptr);
 
-  ct = png_get_color_type(png_ptr, info_ptr);
-
-  if ( ct == PNG_COLOR_TYPE_RGB_ALPHA
-       || ct == PNG_COLOR_TYPE_GRAY_ALPHA
-       )
-    *has_alpha = 1;
-  else
-    *has_alpha = 0;
-
   /* 8 bits */
   if ( bit_depth == 16 )
     png_set_strip_16(png_ptr);
@@ -290,325 +337,59 @@ _load_png_file( const char *file,
   if (bit_depth < 8)
     png_set_packing(png_ptr);
 
-  /* not needed as data will be RGB not RGBA and have_alpha will reflect this
-    png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
-  */
+  passes = png_set_interlace_handling(png_ptr);
 
   png_read_update_info( png_ptr, info_ptr);
 
-  /* allocate space for data and row pointers */
-  rowbytes = png_get_rowbytes( png_ptr, info_ptr);
-  data = (unsigned char *) malloc( (rowbytes*(*height + 1)));
-  row_pointers = (png_bytep *) malloc( (*height)*sizeof(png_bytep));
-
-  if (( data == NULL )||( row_pointers == NULL )) {
-    png_destroy_read_struct( &png_ptr, &info_ptr, NULL);
-    free(data);
-    free(row_pointers);
-    return NULL;
-  }
-
-  for ( i = 0;  i < *height; i++ )
-    row_pointers[i] = data + i*rowbytes;
-
-  png_read_image( png_ptr, row_pointers );
-  png_read_end( png_ptr, NULL);
-
-  free(row_pointers);
-  png_destroy_read_struct( &png_ptr, &info_ptr, NULL);
-  fclose(fd);
-
-  return data;
-}
-
-#endif
-
-static unsigned char* 
-_load_xpm_file( MBPixbuf *pb, const char *filename, int *w, int *h, int *has_alpha)
-{ 				/* This hell is adapted from imlib ;-) */
-  FILE *file;
-  
-  struct _cmap
-  {
-    unsigned char       str[6];
-    unsigned char       transp;
-    short                 r, g, b;
-  } *cmap = NULL;
-  
-  unsigned char *data = NULL, *ptr = NULL, *end = NULL;
+  /* After expansion, so a tRNS chunk counts as alpha */
+  bpp = png_get_channels(png_ptr, info_ptr);
 
-  int pc, c = ' ', i = 0, j = 0, k = 0, ncolors = 0, cpp = 0, 
-    comment = 0, transp = 0, quote = 0, context = 0,  len, done = 0;
+  img = _mb_pixbuf_load_begin(pb, png_width, png_height, (bpp == 4),
+			      width, height, &rs);
+  scaler = rs;
 
-  char *line, s[257], tok[128], col[256];
+  if (img == NULL)
+    longjmp(png_jmpbuf(png_ptr), 1);
 
-  XColor xcol;
-  int lsz = 256;
-  
-  short lookup[128 - 32][128 - 32];
-  
-  if (!filename) return NULL;
-  
-  if ((file = fopen( filename, "rb" )) == NULL) return NULL;
-  
-  line = malloc(lsz);
-  
-  while (!done)
+  if (passes > 1 || pb->internal_bytespp == 2 || scaler)
     {
-      pc = c;
-      c = fgetc(file);
-      if (c == EOF)
-	break;
-      if (!quote)
-	{
-	  if ((pc == '/') && (c == '*'))
-	    comment = 1;
-	  else if ((pc == '*') && (c == '/') && (comment))
-	    comment = 0;
-	}
-      if (!comment)
-	{
-	  if ((!quote) && (c == '"'))
-	    {
-	      quote = 1;
-	      i = 0;
-	    }
-	  else if ((quote) && (c == '"'))
-	    {
-	      line[i] = 0;
-	      quote = 0;
-	      if (context == 0)
-		{
-		  /* Header */
-		  sscanf(line, "%i %i %i %i", w, h, &ncolors, &cpp);
-                  if (ncolors > 32766 || cpp > 5 || *w > 32767 || *h > 32767)
-		    {
-		      if (mb_want_warnings())
-			fprintf(stderr, "xpm file invalid");
-		      fclose(file);
-		      free(line);
-		      fclose(file);
-		      return NULL;
-		    }
-
-		  cmap = malloc(sizeof(struct _cmap) * ncolors);
-
-		  if (!cmap) 		      
-		    {
-		      free(line);
-		      fclose(file);
-		      return NULL;
-		    }
-
-		  data = malloc(*w ** h * 4);
-		  if (!data)
-		    {
-		      free(cmap);
-		      free(line);
-		      fclose(file);
-		      return NULL;
-		    }
-
-		  ptr = data;
-		  end = ptr + (*w ** h * 4);
-		  j = 0;
-		  context++;
-		}
-	      else if (context == 1)
-		{
-		  /* Color Table */
-		  if (j < ncolors)
-		    {
-		      int                 slen;
-		      int                 hascolor, iscolor;
-
-		      iscolor = 0;
-		      hascolor = 0;
-		      tok[0] = 0;
-		      col[0] = 0;
-		      s[0] = 0;
-		      len = strlen(line);
-		      strncpy((char*)cmap[j].str, line, cpp);
-		      cmap[j].str[cpp] = 0;
-		      cmap[j].r = -1;
-		      cmap[j].transp = 0;
-		      for (k = cpp; k < len; k++)
-			{
-			  if (line[k] != ' ')
-			    {
-			      s[0] = 0;
-			      sscanf(&line[k], "%256s", s);
-			      slen = strlen(s);
-			      k += slen;
-			      if (!strcmp(s, "c"))
-				iscolor = 1;
-			      if ((!strcmp(s, "m")) || (!strcmp(s, "s")) ||
-				  (!strcmp(s, "g4")) || (!strcmp(s, "g")) ||
-				  (!strcmp(s, "c")) || (k >= len))
-				{
-				  if (k >= len)
-				    {
-				      if (col[0])
-					strcat(col, " ");
-                                      if (strlen(col) + strlen(s) < sizeof(col))
-					strcat(col, s);
-				    }
-				  if (col[0])
-				    {
-				      if (!strcasecmp(col, "none"))
-					{
-					  transp = 1;
-					  cmap[j].transp = 1;
-					}
-				      else
-					{
-					  if ((((cmap[j].r < 0) ||
-						(!strcmp(tok, "c"))) &&
-					       (!hascolor)))
-					    {
-					      XParseColor(pb->dpy,
-							  DefaultColormap(pb->dpy, 
-									  pb->scr),
-
-							  col, &xcol);
-					      cmap[j].r = xcol.red >> 8;
-					      cmap[j].g = xcol.green >> 8;
-					      cmap[j].b = xcol.blue >> 8;
-					      if ((cmap[j].r == 255) &&
-						  (cmap[j].g == 0) &&
-						  (cmap[j].b == 255))
-						cmap[j].r = 254;
-					      if (iscolor)
-						hascolor = 1;
-					    }
-					}
-				    }
-				  strcpy(tok, s);
-				  col[0] = 0;
-				}
-			      else
-				{
-				  if (col[0])
-				    strcat(col, " ");
-				  strcat(col, s);
-				}
-			    }
-			}
-		    }
-		  j++;
-		  if (j >= ncolors)
-		    {
-		      if (cpp == 1)
-			for (i = 0; i < ncolors; i++)
-			  lookup[(int)cmap[i].str[0] - 32][0] = i;
-		      if (cpp == 2)
-			for (i = 0; i < ncolors; i++)
-			  lookup[(int)cmap[i].str[0] - 32][(int)cmap[i].str[1] - 32] = i;
-		      context++;
-		    }
-		}
-	      else
-		{
-		  /* Image Data */
-		  i = 0;
-		  if (cpp == 1)
-		    {
-		      for (i = 0; 
-			   ((i < 65536) && (ptr < end) && (line[i])); 
-			   i++)
-			{
-			  col[0] = line[i];
-			  if (transp && 
-			      cmap[lookup[(int)col[0] - 32][0]].transp)
-			    {
-			      *ptr++ = 0; *ptr++ = 0; *ptr++ = 0; *ptr++ = 0;
-			    }
-			  else 
-			    {
-			      int idx = lookup[(int)col[0] - 32][0];
-			      *ptr++ = (unsigned char)cmap[idx].r;
-			      *ptr++ = (unsigned char)cmap[idx].g;
-			      *ptr++ = (unsigned char)cmap[idx].b;
-			      if (transp) *ptr++ = 255; 
-			    }
-			}
-		    }
-		  else
-		    {
-		      for (i = 0; 
-			   ((i < 65536) && (ptr < end) && (line[i])); 
-			   i++)
-			{
-			  for (j = 0; j < cpp; j++, i++)
-			    {
-			      col[j] = line[i];
-			    }
-			  col[j] = 0;
-			  i--;
-			  for (j = 0; j < ncolors; j++)
-			    {
-			      if (!strcmp(col, (char*)cmap[j].str))
-				{
-				  if (transp && cmap[j].transp)
-				    {
-				      *ptr++ = 0;
-				      *ptr++ = 0;
-				      *ptr++ = 0;
-				      *ptr++ = 0;
-				    }
-				  else
-				    {
-				      *ptr++ = (unsigned char)cmap[j].r;
-				      *ptr++ = (unsigned char)cmap[j].g;
-				      *ptr++ = (unsigned char)cmap[j].b;
-				      if (transp) *ptr++ = 255;
-				    }
-				  j = ncolors;
-				}
-			    }
-			}
-		    }
-		}
-	    }
-	}
+      /* Row by row needs a row to convert from, passes a whole image */
+      buffer = malloc(png_width * bpp * ((passes > 1) ? png_height : 1));
+      if (buffer == NULL) 
+	longjmp(png_jmpbuf(png_ptr), 1);
+    }
 
-      /* Scan in line from XPM file */
-      if ((!comment) && (quote) && (c != '"'))
-	{
-	  if (c < 32)
-	    c = 32;
-	  else if (c > 127)
-	    c = 127;
-	  line[i++] = c;
-	}
-      if (i >= lsz)
-	{
-	  lsz += 256;
-	  line = realloc(line, lsz);
-	  if(line == NULL)
-	    {
-	      free(cmap);
-	      fclose(file);
-	      return NULL;
-	    }
-	}
+  if (passes > 1)
+    {
+      while (passes--)
+	for (y = 0; y < png_height; y++)
+	  png_read_row(png_ptr, buffer + y * png_width * bpp, NULL);
 
-      if ((ptr) && ((ptr - data) >= *w ** h * 4))
-	done = 1;
+      for (y = 0; y < png_height; y++)
+	_mb_pixbuf_load_row(pb, img, scaler, y, 
+			    buffer + y * png_width * bpp, png_width);
     }
-
-  if (transp)
-    *has_alpha = 1;
   else
-    *has_alpha = 0;
+    for (y = 0; y < png_height; y++)
+      {
+	row = buffer ? buffer : img->rgba + y * img->rowstride;
+	png_read_row(png_ptr, row, NULL);
+	_mb_pixbuf_load_row(pb, img, scaler, y, row, png_width);
+      }
+
+  png_read_end( png_ptr, NULL);
 
-  free(cmap);
-  free(line);
+  png_destroy_read_struct( &png_ptr, &info_ptr, NULL);
+
+  if (buffer) free(buffer);
+  if (scaler) _mb_pixbuf_row_scaler_free(scaler);
 
-  fclose(file);
-  return data;
+  return img;
 }
 
+#endif
+
+
 static int
 _paletteAlloc(MBPixbuf *pb)
 {
@@ -718,6 +499,188 @@ _paletteAlloc(MBPixbuf *pb)
 }
 
 
+static unsigned long
+_mb_pixbuf_palette_nearest(MBPixbuf *pb, int r, int g, int b)
+{
+  int                 i;
+  int                 dif;
+  int                 dr, dg, db;
+  unsigned long       col = 0;
+  int                 mindif = 0x7fffffff;
+
+  for (i = 0; i < pb->num_of_cols; i++)
+    {
+      dr = r - pb->palette[i].r;
+      if (dr < 0)
+	dr = -dr;
+      dg = g - pb->palette[i].g;
+      if (dg < 0)
+	dg = -dg;
+      db = b - pb->palette[i].b;
+      if (db < 0)
+	db = -db;
+      dif = dr + dg + db;
+      if (dif < mindif)
+	{
+	  mindif = dif;
+	  col = i;
+	}
+    }
+  return pb->palette[col].pixel;
+}
+
+/* 
+ * Inverse colormap. Each cell of the cube holds the palette pixel
+ * nearest its center, so a lookup is a single index. The dither table
+ * holds, for each position in a 4x4 Bayer matrix, the cube coordinate
+ * of every channel value nudged by up to half a palette step.
+ *
+ * The cube is filled a palette entry at a time, from per channel
+ * distance tables, keeping each cell's best so far. A row of cells
+ * whose worst best is already nearer than the entry can get is
+ * skipped. Ties go to the earlier entry, as a search of the palette
+ * for each cell would.
+ */
+Bool
+_mb_pixbuf_color_cube_init(MBPixbuf *pb)
+{
+  static const int bayer[16] = {  0,  8,  2, 10,
+				 12,  4, 14,  6,
+				  3, 11,  1,  9,
+				 15,  7, 13,  5 };
+  int   bits = 5, size, shift, half, r, g, b, i, v, step, levels;
+  int   dr[64], dg[64], db[64], *best, *row_worst, base, worst, cell;
+  char *env;
+
+  if ((env = getenv("MBPIXBUF_COLOR_CUBE_BITS")) != NULL)
+    {
+      bits = atoi(env);
+      if (bits < 3) bits = 3;
+      if (bits > 6) bits = 6;
+    }
+
+  size  = 1 << bits;
+  shift = 8 - bits;
+  half  = (1 << shift) / 2;
+
+  pb->color_cube_bits = bits;
+  pb->color_cube      = malloc(size * size * size);
+  pb->dither_table    = malloc(16 * 256);
+
+  best      = malloc(size * size * size * sizeof(int));
+  row_worst = malloc(size * size * sizeof(int));
+
+  if (!pb->color_cube || !pb->dither_table || !best || !row_worst)
+    {
+      /* Rendering searches the palette instead */
+      free(pb->color_cube);
+      free(pb->dither_table);
+      free(best);
+      free(row_worst);
+      pb->color_cube   = NULL;
+      pb->dither_table = NULL;
+      return False;
+    }
+
+  for (i = 0; i < size * size; i++)
+    row_worst[i] = 0x7fffffff;
+
+  for (i = 0; i < pb->num_of_cols; i++)
+    {
+      for (v = 0; v < size; v++)
+	{
+	  dr[v] = abs((v << shift) + half - pb->palette[i].r);
+	  dg[v] = abs((v << shift) + half - pb->palette[i].g);
+	  db[v] = abs((v << shift) + half - pb->palette[i].b);
+	}
+
+      for (r = 0; r < size; r++)
+	for (g = 0; g < size; g++)
+	  {
+	    base = dr[r] + dg[g];
+
+	    if (base >= row_worst[r * size + g])
+	      continue;
+
+	    cell  = (r * size + g) * size;
+	    worst = 0;
+
+	    for (b = 0; b < size; b++, cell++)
+	      {
+		/* The first entry fills every cell */
+		if (i == 0 || base + db[b] < best[cell])
+		  {
+		    best[cell]          = base + db[b];
+		    pb->color_cube[cell] = pb->palette[i].pixel;
+		  }
+
+		if (best[cell] > worst)
+		  worst = best[cell];
+	      }
+
+	    row_worst[r * size + g] = worst;
+	  }
+    }
+
+  /* No colors could be allocated, pixel 0 will do */
+  if (pb->num_of_cols == 0)
+    memset(pb->color_cube, 0, size * size * size);
+
+  free(best);
+  free(row_worst);
+
+  /* Rough per channel palette step, from its cube root */
+  for (levels = 1; (levels+1) * (levels+1) * (levels+1) <= pb->num_of_cols; )
+    levels++;
+  step = (levels > 1) ? 255 / (levels - 1) : 255;
+
+  for (i = 0; i < 16; i++)
+    for (v = 0; v < 256; v++)
+      {
+	int d = v + ((2 * bayer[i] + 1 - 16) * step) / 32;
+
+	if (d < 0)   d = 0;
+	if (d > 255) d = 255;
+
+	pb->dither_table[i * 256 + v] = d >> shift;
+      }
+
+  pb->dither = (getenv("MBPIXBUF_DITHER") != NULL);
+
+  return True;
+}
+
+static inline unsigned long
+_mb_pixbuf_cube_lookup(MBPixbuf *pb, int r, int g, int b)
+{
+  int bits = pb->color_cube_bits;
+
+  r >>= 8 - bits; g >>= 8 - bits; b >>= 8 - bits;
+
+  return pb->color_cube[(r << (2 * bits)) | (g << bits) | b];
+}
+
+/* As above, dithered if wanted for a pixel at x,y */
+static inline unsigned long
+_mb_pixbuf_cube_pixel(MBPixbuf *pb, int r, int g, int b, int x, int y)
+{
+  const unsigned char *d;
+  int                  bits = pb->color_cube_bits;
+
+  if (!pb->dither)
+    return _mb_pixbuf_cube_lookup(pb, r, g, b);
+
+  d = pb->dither_table + (((y & 3) << 2) | (x & 3)) * 256;
+
+  return pb->color_cube[(d[r] << (2 * bits)) | (d[g] << bits) | d[b]];
+}
+
+void
+mb_pixbuf_set_dither(MBPixbuf *pb, Bool dither)
+{
+  pb->dither = dither;
+}
+
 static unsigned long
 mb_pixbuf_get_pixel(MBPixbuf *pb, int r, int g, int b, int a)
 {
@@ -726,6 +689,8 @@ mb_pixbuf_get_pixel(MBPixbuf *pb, int r, int g, int b, int a)
       switch (pb->depth)
 	{
 	case 15:
+	  if (pb->byte_order == BYTE_ORD_24_BGR)
+	    return ((b & 0xf8) << 7) | ((g & 0xf8) << 2) | ((r & 0xf8) >> 3);
 	  return ((r & 0xf8) << 7) | ((g & 0xf8) << 2) | ((b & 0xf8) >> 3);
 	case 16:
 	  switch (pb->byte_order)
@@ -767,33 +732,9 @@ mb_pixbuf_get_pixel(MBPixbuf *pb, int r, int g, int b, int a)
     {
     case PseudoColor:
     case StaticColor:
-    {
-      int                 i;
-      int                 dif;
-      int                 dr, dg, db;
-      unsigned long       col = 0;
-      int                 mindif = 0x7fffffff;
-
-      for (i = 0; i < pb->num_of_cols; i++)
-	{
-	  dr = r - pb->palette[i].r;
-	  if (dr < 0)
-	    dr = -dr;
-	  dg = g - pb->palette[i].g;
-	  if (dg < 0)
-	    dg = -dg;
-	  db = b - pb->palette[i].b;
-	  if (db < 0)
-	    db = -db;
-	  dif = dr + dg + db;
-	  if (dif < mindif)
-	    {
-	      mindif = dif;
-	      col = i;
-	    }
-	}
-      return pb->palette[col].pixel;
-    }
+      if (pb->color_cube)
+	return _mb_pixbuf_cube_lookup(pb, r, g, b);
+      return _mb_pixbuf_palette_nearest(pb, r, g, b);
     case GrayScale:
     case StaticGray:
       return (((r * 77) + (g * 151) + (b * 28)) >> (16 - pb->depth));
@@ -828,10 +769,49 @@ void
 mb_pixbuf_destroy(MBPixbuf *pb)
 {
   /* XXX Probably needs to free more here */
-  XFreeGC(pb->dpy, pb->gc);
+  _mb_pixbuf_shm_pool_free(pb);
+  mb_pixbuf_set_icon_cache(pb, NULL);
+  if (pb->palette)      free(pb->palette);
+  if (pb->color_cube)   free(pb->color_cube);
+  if (pb->dither_table) free(pb->dither_table);
+
+  /* Images still held keep the slab until they go */
+  _mb_pixbuf_slab_unref(pb->slab);
+
+  if (pb->dpy)
+    XFreeGC(pb->dpy, pb->gc);
+  else
+    free(pb->vis);		/* made up by mb_pixbuf_new_headless */
+
   free(pb);
 }
 
+/* Allocates a pixbuf with everything not tied to a display set up */
+static MBPixbuf *
+_mb_pixbuf_alloc(int depth)
+{
+  MBPixbuf *pb = malloc(sizeof(MBPixbuf));
+
+  if (pb == NULL) return NULL;
+
+  memset(pb, 0, sizeof(MBPixbuf));
+
+  pb->depth = depth;
+  pb->kernels = _mb_pixbuf_kernels_select();
+  pb->slab = _mb_pixbuf_slab_new();
+
+  if (getenv("MBPIXBUF_THREADS"))
+    mb_pixbuf_set_threads(pb, atoi(getenv("MBPIXBUF_THREADS")));
+
+  pb->internal_bytespp = 3;
+
+  if ((pb->depth < 24 && !getenv("MBPIXBUF_FORCE_32BPP_INTERNAL"))
+      || getenv("MBPIXBUF_FORCE_16BPP_INTERNAL"))
+    pb->internal_bytespp = 2;
+
+  return pb;
+}
+
 MBPixbuf *
 mb_pixbuf_new_extended(Display *dpy, 
 		       int      scr, 
@@ -840,17 +820,16 @@ mb_pixbuf_new_extended(Display *dpy,
 {
   XGCValues gcv;
   unsigned long rmsk, gmsk, bmsk;
-  MBPixbuf *pb = malloc(sizeof(MBPixbuf));  
+  MBPixbuf *pb = _mb_pixbuf_alloc(depth);
+
+  if (pb == NULL) return NULL;
 
   pb->dpy = dpy;
   pb->scr = scr;
 
   pb->root  = RootWindow(dpy, scr);
-  pb->depth = depth;
   pb->vis   = vis;
 
-  pb->palette = NULL;
-
   rmsk = pb->vis->red_mask;
   gmsk = pb->vis->green_mask;
   bmsk = pb->vis->blue_mask;
@@ -872,12 +851,6 @@ mb_pixbuf_new_extended(Display *dpy,
   else
     pb->byte_order = 0;
 
-  pb->internal_bytespp = 3;
-
-  if ((pb->depth < 24 && !getenv("MBPIXBUF_FORCE_32BPP_INTERNAL"))
-      || getenv("MBPIXBUF_FORCE_16BPP_INTERNAL"))
-    pb->internal_bytespp = 2;
-
   if ((pb->depth <= 8))
     {
       XWindowAttributes   xwa;
@@ -892,6 +865,9 @@ mb_pixbuf_new_extended(Display *dpy,
       else
 	pb->root_cmap = DefaultColormap(dpy, scr);
       pb->num_of_cols = _paletteAlloc(pb);
+
+      if (pb->vis->class == PseudoColor || pb->vis->class == StaticColor)
+	_mb_pixbuf_color_cube_init(pb);
     }
 
   /* TODO: No exposes ? */
@@ -929,59 +905,266 @@ mb_pixbuf_new_extended(Display *dpy,
 
       shmdt(shminfo.shmaddr);
       shmctl(shminfo.shmid, IPC_RMID, 0);
+
+      pb->shm_completion_event = XShmGetEventBase(pb->dpy) + ShmCompletion;
     }
   return pb;
 }
 
-MBPixbufImage *
-mb_pixbuf_img_new(MBPixbuf *pb, int w, int h)
+MBPixbuf *
+mb_pixbuf_new_headless(int               depth,
+		       MBPixbufByteOrder byte_order,
+		       int               internal_bytespp)
 {
-  MBPixbufImage *img;
-
-  img = malloc(sizeof(MBPixbufImage));
-  img->width = w;
-  img->height = h;
+  /* Channel shifts, red green blue, for each byte order at 24 bits */
+  static const int shifts[][3] = { { 16,  8,  0 },   /* RGB */
+				   { 16,  0,  8 },   /* RBG */
+				   {  8,  0, 16 },   /* BRG */
+				   {  0,  8, 16 },   /* BGR */
+				   {  8, 16,  0 },   /* GRB */
+				   {  0, 16,  8 },   /* GBR */
+				   { 16,  8,  0 } }; /* ARGB */
+  MBPixbuf *pb;
+  Visual   *vis;
+
+  switch (depth)
+    {
+    case 15:
+    case 16:
+      if (byte_order != BYTE_ORD_24_RGB && byte_order != BYTE_ORD_24_BGR)
+	return NULL;
+      break;
+    case 24:
+      if (byte_order == BYTE_ORD_32_ARGB)
+	return NULL;
+      break;
+    case 32:
+      break;
+    default:
+      return NULL;
+    }
 
-  img->rgba = malloc(sizeof(unsigned char)*((w*h*(pb->internal_bytespp+1))));
-  memset(img->rgba, 0, sizeof(unsigned char)*((w*h*(pb->internal_bytespp+1))));
+  if (byte_order < BYTE_ORD_24_RGB || byte_order > BYTE_ORD_32_ARGB
+      || (internal_bytespp != 0 && internal_bytespp != 2
+	  && internal_bytespp != 3))
+    return NULL;
 
-  img->ximg = NULL;
-  img->has_alpha = 1;
-  img->internal_bytespp = pb->internal_bytespp;
+  if ((vis = malloc(sizeof(Visual))) == NULL)
+    return NULL;
 
-  return img;
-}
+  memset(vis, 0, sizeof(Visual));
 
-MBPixbufImage *
-mb_pixbuf_img_rgba_new(MBPixbuf *pb, int w, int h)
-{
-  return mb_pixbuf_img_new(pb, w, h);
-}
+  /* A TrueColor visual to match, so the pixel format helpers that look
+   * at the visual work as they would on a display
+   */
+  vis->class        = TrueColor;
+  vis->bits_per_rgb = 8;
+  vis->map_entries  = 256;
 
+  if (depth == 15 || depth == 16)
+    {
+      unsigned long hi = (depth == 15) ? 0x7c00 : 0xf800;
+
+      vis->red_mask   = (byte_order == BYTE_ORD_24_RGB) ? hi : 0x1f;
+      vis->green_mask = (depth == 15) ? 0x3e0 : 0x7e0;
+      vis->blue_mask  = (byte_order == BYTE_ORD_24_RGB) ? 0x1f : hi;
+    }
+  else
+    {
+      vis->red_mask   = 0xffUL << shifts[byte_order][0];
+      vis->green_mask = 0xffUL << shifts[byte_order][1];
+      vis->blue_mask  = 0xffUL << shifts[byte_order][2];
+    }
+
+  if ((pb = _mb_pixbuf_alloc(depth)) == NULL)
+    {
+      free(vis);
+      return NULL;
+    }
+
+  pb->vis        = vis;
+  pb->byte_order = byte_order;
+
+  if (internal_bytespp)
+    pb->internal_bytespp = internal_bytespp;
+
+  return pb;
+}
+
+void
+mb_pixbuf_set_premultiplied_alpha(MBPixbuf *pb, Bool premultiplied)
+{
+  pb->premultiply = premultiplied;
+}
+
+void
+mb_pixbuf_set_threads(MBPixbuf *pb, int n_threads)
+{
+  pb->n_threads = (n_threads < 0) ? 0 : n_threads;
+}
+
+/* Premultiplies, or not, @n pixels of @bpp bytes including alpha */
+static void
+_mb_convert_alpha_row(unsigned char *p, int n, int bpp, int premul)
+{
+  unsigned char *end = p + n * bpp;
+  int r, g, b, a;
+
+  for (; p < end; p += bpp)
+    {
+      a = p[bpp-1];
+
+      if (a == 255) continue;
+
+      if (bpp == 3)
+	internal_16bpp_pixel_to_rgb(p, r, g, b)
+      else
+	{ r = p[0]; g = p[1]; b = p[2]; }
+
+      if (premul)
+	{
+	  r = _mb_premultiply(r, a);
+	  g = _mb_premultiply(g, a);
+	  b = _mb_premultiply(b, a);
+	}
+      else
+	{
+	  r = _mb_unpremultiply(r, a);
+	  g = _mb_unpremultiply(g, a);
+	  b = _mb_unpremultiply(b, a);
+	}
+
+      if (bpp == 3)
+	internal_rgb_to_16bpp_pixel(r, g, b, p)
+      else
+	{ p[0] = r; p[1] = g; p[2] = b; }
+    }
+}
+
+void
+_mb_pixbuf_match_alpha_row(MBPixbufImage *dest, MBPixbufImage *src,
+			   unsigned char *p, int n)
+{
+  if (dest->has_alpha && src->has_alpha 
+      && dest->premultiplied != src->premultiplied)
+    _mb_convert_alpha_row(p, n, dest->internal_bytespp + 1, 
+			  dest->premultiplied);
+}
+
+static void
+_mb_pixbuf_img_convert_alpha(MBPixbuf *pb, MBPixbufImage *img, int premul)
+{
+  int y;
+
+  /* Uses the image's own byte count. Loaders and the new_from_*data
+   * constructors premultiply at 8 bits before any conversion down to
+   * 16, only converting an existing image works on packed pixels.
+  */
+  for (y = 0; y < img->height; y++)
+    _mb_convert_alpha_row(img->rgba + y * img->rowstride, img->width, 
+			  img->internal_bytespp + 1, premul);
+
+  img->premultiplied = premul;
+}
+
+void
+mb_pixbuf_img_premultiply(MBPixbuf *pb, MBPixbufImage *img)
+{
+  if (img->has_alpha && !img->premultiplied
+      && mb_pixbuf_img_make_writable(pb, img))
+    _mb_pixbuf_img_convert_alpha(pb, img, True);
+}
+
+void
+mb_pixbuf_img_unpremultiply(MBPixbuf *pb, MBPixbufImage *img)
+{
+  if (img->has_alpha && img->premultiplied
+      && mb_pixbuf_img_make_writable(pb, img))
+    _mb_pixbuf_img_convert_alpha(pb, img, False);
+}
+
+/* An image with rows padded to MBPIXBUF_ROW_ALIGN, in one block with
+ * its header. Cleared unless @clear is False, for callers about to
+ * write every pixel.
+ */
+static MBPixbufImage *
+_mb_pixbuf_img_alloc(MBPixbuf *pb, int w, int h, int has_alpha, Bool clear)
+{
+  MBPixbufImage *img;
+  size_t         size;
+  int            rowstride;
+
+  rowstride = mb_pixbuf_aligned_rowstride(w, pb->internal_bytespp 
+					  + has_alpha);
+  size = (size_t)rowstride * h;
+
+  if ((img = _mb_pixbuf_slab_img_alloc(pb->slab, size ? size : 1)) == NULL)
+    return NULL;
+
+  img->width = w;
+  img->height = h;
+  img->rowstride = rowstride;
+  img->rgba = _mb_pixbuf_slab_img_pixels(img);
+
+  if (clear)
+    memset(img->rgba, 0, size);
+
+  img->ximg = NULL;
+  img->has_alpha = has_alpha;
+  img->internal_bytespp = pb->internal_bytespp;
+  img->premultiplied = False;
+  img->refcount = 1;
+  img->destroy_fn = NULL;
+  img->destroy_data = NULL;
+
+  return img;
+}
 
 MBPixbufImage *
-mb_pixbuf_img_rgb_new(MBPixbuf *pixbuf, int width, int height)
+_mb_pixbuf_img_new_uninit(MBPixbuf *pb, int w, int h, int has_alpha)
 {
+  MBPixbufImage *img;
 
- MBPixbufImage *img;
+  if ((img = _mb_pixbuf_img_alloc(pb, w, h, has_alpha, False)) == NULL)
+    return NULL;
 
- img = malloc(sizeof(MBPixbufImage));
- img->width = width;
- img->height = height;
- 
- img->rgba 
-   = malloc(sizeof(unsigned char)*((width*height*pixbuf->internal_bytespp)));
- memset(img->rgba, 0, 
-	sizeof(unsigned char)*((width*height*pixbuf->internal_bytespp)));
-  
- img->ximg = NULL;
- img->has_alpha = 0;
- img->internal_bytespp = pixbuf->internal_bytespp;
+  if (has_alpha)
+    img->premultiplied = pb->premultiply;
+
+  return img;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new(MBPixbuf *pb, int w, int h)
+{
+  MBPixbufImage *img;
+
+  img = _mb_pixbuf_img_alloc(pb, w, h, 1, True);
+  if (img) img->premultiplied = pb->premultiply;
+
+  return img;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_rgba_new(MBPixbuf *pb, int w, int h)
+{
+  return mb_pixbuf_img_new(pb, w, h);
+}
 
- return img;
 
+MBPixbufImage *
+mb_pixbuf_img_rgb_new(MBPixbuf *pixbuf, int width, int height)
+{
+  return _mb_pixbuf_img_alloc(pixbuf, width, height, 0, True);
 }
 
+static void
+_mb_pixbuf_img_store_row(MBPixbufImage *img, int y, const unsigned char *row);
+
+static void
+_mb_pixbuf_img_put_row(MBPixbuf *pb, MBPixbufImage *img, int y, 
+		       unsigned char *row);
+
 /* ARGB Data */
 
 MBPixbufImage *
@@ -993,14 +1176,17 @@ mb_pixbuf_img_new_from_int_data(MBPixbuf            *pixbuf,
   MBPixbufImage *img;
   int            i=0,x,y;
 
-  img = mb_pixbuf_img_rgba_new(pixbuf, width, height);
+  img = _mb_pixbuf_img_new_uninit(pixbuf, width, height, True);
+
+  if (img == NULL)
+    return NULL;
 
   if (pixbuf->internal_bytespp == 3)
     {
-      unsigned char *p = img->rgba;
+      unsigned char *p;
       
       for (y=0; y<height; y++)
-	for (x=0; x<width; x++)
+	for (p = img->rgba + y * img->rowstride, x=0; x<width; x++)
 	  {
 	    *p++ = (data[i] >> 16) & 0xff;
 	    *p++ = (data[i] >> 8) & 0xff;
@@ -1008,19 +1194,30 @@ mb_pixbuf_img_new_from_int_data(MBPixbuf            *pixbuf,
 	    *p++ = data[i] >> 24;
 	    i++;
 	  }
+
+      if (img->premultiplied)
+	for (y=0; y<height; y++)
+	  _mb_convert_alpha_row(img->rgba + y * img->rowstride, width, 4, True);
     }
   else
     {
-      unsigned char *p = img->rgba, r,g,b,a;
+      unsigned char *p, r,g,b,a;
       
       for (y=0; y<height; y++)
-	for (x=0; x<width; x++)
+	for (p = img->rgba + y * img->rowstride, x=0; x<width; x++)
 	  {
 	    r = ((data[i] >> 16) & 0xff);
 	    g = ((data[i] >> 8) & 0xff);
 	    b = (data[i] & 0xff);
 	    a = (data[i] >> 24);
 
+	    if (img->premultiplied)
+	      {
+		r = _mb_premultiply(r, a);
+		g = _mb_premultiply(g, a);
+		b = _mb_premultiply(b, a);
+	      }
+
 	    internal_rgb_to_16bpp_pixel(r,g,b,p);
 	    internal_16bpp_pixel_next(p);
 	    *p++ = a;
@@ -1028,7 +1225,7 @@ mb_pixbuf_img_new_from_int_data(MBPixbuf            *pixbuf,
 	    i++;
 	  }
     }
-  
+
   return img;
 }
 
@@ -1041,14 +1238,17 @@ mb_pixbuf_img_new_from_long_data(MBPixbuf            *pixbuf,
   MBPixbufImage *img;
   int            i=0,x,y;
 
-  img = mb_pixbuf_img_rgba_new(pixbuf, width, height);
+  img = _mb_pixbuf_img_new_uninit(pixbuf, width, height, True);
+
+  if (img == NULL)
+    return NULL;
 
   if (pixbuf->internal_bytespp == 3)
     {
-      unsigned char *p = img->rgba;
+      unsigned char *p;
 
       for (y=0; y<height; y++)
-	for (x=0; x<width; x++)
+	for (p = img->rgba + y * img->rowstride, x=0; x<width; x++)
 	  {
 	    *p++ = (data[i] >> 16) & 0xff;
 	    *p++ = (data[i] >> 8) & 0xff;
@@ -1056,19 +1256,30 @@ mb_pixbuf_img_new_from_long_data(MBPixbuf            *pixbuf,
 	    *p++ = data[i] >> 24;
 	    i++;
 	  }
+
+      if (img->premultiplied)
+	for (y=0; y<height; y++)
+	  _mb_convert_alpha_row(img->rgba + y * img->rowstride, width, 4, True);
     }
   else
     {
-      unsigned char *p = img->rgba, r,g,b,a;
+      unsigned char *p, r,g,b,a;
 
       for (y=0; y<height; y++)
-	for (x=0; x<width; x++)
+	for (p = img->rgba + y * img->rowstride, x=0; x<width; x++)
 	  {
 	    r = ((data[i] >> 16) & 0xff);
 	    g = ((data[i] >> 8) & 0xff);
 	    b = (data[i] & 0xff);
 	    a = (data[i] >> 24);
 
+	    if (img->premultiplied)
+	      {
+		r = _mb_premultiply(r, a);
+		g = _mb_premultiply(g, a);
+		b = _mb_premultiply(b, a);
+	      }
+
 	    internal_rgb_to_16bpp_pixel(r,g,b,p);
 	    internal_16bpp_pixel_next(p);
 	    *p++ = a;
@@ -1088,37 +1299,40 @@ mb_pixbuf_img_new_from_data(MBPixbuf            *pixbuf,
 			    Bool                 has_alpha)
 {
   MBPixbufImage *img;
+  unsigned char *row = NULL;
+  int            y;
 
-  if (has_alpha)
-    img = mb_pixbuf_img_rgba_new(pixbuf, width, height);
-  else
-    img = mb_pixbuf_img_rgb_new(pixbuf, width, height);
+  img = _mb_pixbuf_img_new_uninit(pixbuf, width, height, has_alpha);
 
-  if (pixbuf->internal_bytespp == 3)
+  if (img == NULL)
+    return NULL;
+
+  /* Premultiplied at 8 bits, on a copy as the data is the caller's */
+  if (img->premultiplied && (row = malloc(width * 4)) == NULL)
     {
-      memcpy(img->rgba, data, width*height*(3+has_alpha));
+      mb_pixbuf_img_free(pixbuf, img);
+      return NULL;
     }
-  else
+
+  /* Data is expected as 24/32 RGBA, packed. Internally were 16/24 
+   * with padded rows.
+   */
+  for (y = 0; y < height; y++)
     {
-      /* Data is expected as 24/32 RGBA. but internally were 
-       * 16/24 so we need to scale the data down.
-      */
-      int x,y;
-      unsigned char r,g,b, *p16 = img->rgba;
-      const unsigned char *p24 = data;
+      const unsigned char *src = data + y * width * (3 + has_alpha);
 
-      for (x=0; x<img->width; x++)
-	for (y=0; y<img->height; y++)
-      {
-	r = *p24++; g = *p24++; b = *p24++;
-	internal_rgb_to_16bpp_pixel(r,g,b,p16);
-	internal_16bpp_pixel_next(p16);
+      if (row == NULL)
+	{
+	  _mb_pixbuf_img_store_row(img, y, src);
+	  continue;
+	}
 
-	if (has_alpha)
-	  *p16++ = *p24++;
-      }
+      memcpy(row, src, width * 4);
+      _mb_pixbuf_img_put_row(pixbuf, img, y, row);
     }
 
+  free(row);
+
   return img;
 }
 
@@ -1144,19 +1358,21 @@ mb_pixbuf_img_new_from_x_drawable (MBPixbuf *pb,
 				   int       sh,
 				   Bool      want_alpha)
 {
-  int i,x,y,br,bg,bb,mg,mb,mr,lr,lg,lb;
+  int i,x,y,bpp;
   unsigned long xpixel;
-  unsigned char *p;
+  unsigned char *p, *row;
   MBPixbufImage *img;
+  MBPixbufReadRowFunc reader;
+  MBPixbufRowFormat fmt;
 
-  XImage *ximg, *xmskimg = NULL;
+  XImage *ximg = NULL, *xmskimg = NULL;
   int num_of_cols = 1 << pb->depth;
 
   Window chld;
   int          rx;
   unsigned int rw, rh, rb, rdepth;
 
-  XShmSegmentInfo shminfo; 
+  if (pb->dpy == NULL) return NULL; /* headless */
 
   /* XXX should probably tray an X error here. */
   XGetGeometry(pb->dpy, (Window)drw, &chld, &rx, &rx,
@@ -1171,127 +1387,51 @@ mb_pixbuf_img_new_from_x_drawable (MBPixbuf *pb,
       return NULL;
     }
 
-  XGrabServer(pb->dpy);
-
-  if (1) /* (!pb->have_shm) BROKE */
-    {
-      ximg = XGetImage(pb->dpy, drw, sx, sy, sw, sh, -1, ZPixmap);
-    }
-  else
-    {
-      ximg = XShmCreateImage(pb->dpy, pb->vis, pb->depth, 
-			      ZPixmap, NULL, &shminfo,
-			      sw, sh );
-      XSync(pb->dpy, False);	  
-
-      shminfo.shmid=shmget(IPC_PRIVATE,
-			   ximg->bytes_per_line*ximg->height,
-			   IPC_CREAT|0777);
-      shminfo.shmaddr=img->ximg->data=shmat(shminfo.shmid,0,0);
-      shminfo.readOnly=True;
-      
-      XShmAttach(pb->dpy, &shminfo);
-
-      XSync(pb->dpy, False);    
-  
-      if (!XShmGetImage(pb->dpy, drw, ximg, sx, sy, -1))
-	{
-	  return NULL;
-	}
+  if (pb->have_shm)
+    ximg = _mb_pixbuf_shm_get_image(pb, drw, sx, sy, sw, sh);
 
-      XSync(pb->dpy, False);	  
+  if (ximg == NULL)
+    ximg = XGetImage(pb->dpy, drw, sx, sy, sw, sh, -1, ZPixmap);
 
-    }
+  if (ximg == NULL) return NULL;
 
   if (msk != None)
     xmskimg = XGetImage(pb->dpy, msk, sx, sy, sw, sh, -1, ZPixmap);
 
-  XUngrabServer(pb->dpy);
-  XFlush(pb->dpy);
+  img = _mb_pixbuf_img_new_uninit(pb, sw, sh, (msk || want_alpha));
 
-  if (ximg == NULL) return NULL;
+  if (img == NULL)
+    {
+      XDestroyImage (ximg);
+      if (xmskimg) XDestroyImage (xmskimg);
+      return NULL;
+    }
 
-  if (msk || want_alpha)
-    img = mb_pixbuf_img_rgba_new(pb, sw, sh);
-  else
-    img = mb_pixbuf_img_rgb_new(pb, sw, sh);
+  /* Masked out pixels keep their color */
+  img->premultiplied = False;
 
-  p = img->rgba;
+  bpp = pb->internal_bytespp + img->has_alpha;
 
-  if (pb->depth > 8)
+  if ((reader = _mb_pixbuf_row_reader(pb, ximg, img->has_alpha, &fmt)) != NULL)
     {
-      switch (pb->depth) {
-      case 15:
-        br = 7;
-        bg = 2;
-        bb = 3;
-        mr = mg = mb = 0xf8;
-	lr = lg = lb = 0;
-        break;
-      case 16:
-	br = 8;
-	bg = 3;
-	lb = 3;
-	bb = lr = lg = 0;
-        mr = mb = 0xf8;
-        mg = 0xfc;
-        break;
-      case 24:
-      case 32:
-        br = 16;
-        bg = 8;
-        bb = 0;
-	lr = lg = lb = 0;
-        mr = mg = mb = 0xff;
-        break;
-      default:
-        return NULL;
-      }
-
-      if (pb->internal_bytespp == 2)
-	{
-	  for (y = 0; y < sh; y++)
-	    for (x = 0; x < sw; x++)
-	      {
-		xpixel = XGetPixel(ximg, x, y);
-		internal_rgb_to_16bpp_pixel((((xpixel >> br) << lr) & mr),
-					    (((xpixel >> bg) << lg) & mg),
-					    (((xpixel >> bb) << lb) & mb), p);
+      p   = img->rgba;
+      row = (unsigned char *)ximg->data;
 
-		internal_16bpp_pixel_next(p);
-
-		if (msk)
-		  {
-		    if (xmskimg && XGetPixel(xmskimg, x, y))
-		      {
-			*p++ = 255;
-		      }
-		    else *p++ = 0;
-		  }
-		else if (want_alpha) p++;
-	      }
-	}
-      else
+      for (y = 0; y < sh; y++)
 	{
-	  for (y = 0; y < sh; y++)
-	    for (x = 0; x < sw; x++)
-	      {
-		xpixel = XGetPixel(ximg, x, y);
-		*p++ = (((xpixel >> br) << lr) & mr);      /* r */
-		*p++ = (((xpixel >> bg) << lg) & mg);      /* g */
-		*p++ = (((xpixel >> bb) << lb) & mb);      /* b */
-		if (msk)
-		  {
-		    if (xmskimg && XGetPixel(xmskimg, x, y))
-		      {
-			*p++ = 255;
-		      }
-		    else *p++ = 0;
-		  }
-		else if (want_alpha) p++;
-	      }
+	  reader(&fmt, p, row, sw);
+	  p   += img->rowstride;
+	  row += ximg->bytes_per_line;
 	}
     }
+  else if (pb->depth > 8)
+    {
+      /* Not a layout the readers know, should not really happen */
+      mb_pixbuf_img_free(pb, img);
+      XDestroyImage (ximg);
+      if (xmskimg) XDestroyImage (xmskimg);
+      return NULL;
+    }
   else
     {
       XColor cols[256];
@@ -1308,169 +1448,1069 @@ mb_pixbuf_img_new_from_x_drawable (MBPixbuf *pb,
 	mbcols[i].b = cols[i].blue >> 8;
 	mbcols[i].pixel = cols[i].pixel;
       }
-      for (x = 0; x < sw; x++)
-	for (y = 0; y < sh; y++)
-	  {
-	    xpixel = XGetPixel(ximg, x, y);
-	    *p++ = mbcols[xpixel & 0xff].r;
-	    *p++ = mbcols[xpixel & 0xff].g;
-	    *p++ = mbcols[xpixel & 0xff].b;
-	    if (msk)
-	      {
-		if (xmskimg && XGetPixel(xmskimg, x, y))
-		  {
-		    *p++ = 255;
-		  }
-		else *p++ = 0;
-	      }
-	    else if (want_alpha) p++;		          
-	  }
+
+      for (y = 0; y < sh; y++)
+	{
+	  row = (unsigned char *)ximg->data + y * ximg->bytes_per_line;
+	  p   = img->rgba + y * img->rowstride;
+
+	  for (x = 0; x < sw; x++, p += bpp)
+	    {
+	      if (ximg->bits_per_pixel == 8)
+		xpixel = row[x];
+	      else
+		xpixel = XGetPixel(ximg, x, y);
+
+	      xpixel &= 0xff;
+
+	      if (pb->internal_bytespp == 2)
+		internal_rgb_to_16bpp_pixel(mbcols[xpixel].r,
+					    mbcols[xpixel].g,
+					    mbcols[xpixel].b, p)
+	      else
+		{
+		  p[0] = mbcols[xpixel].r;
+		  p[1] = mbcols[xpixel].g;
+		  p[2] = mbcols[xpixel].b;
+		}
+	    }
+	}
     }
 
-  if (0) /* (pb->have_shm) BROKE */
+  /* Readers leave alpha alone, without a mask it's 0 as it always was */
+  if (img->has_alpha)
     {
-      XShmDetach(pb->dpy, &shminfo);
-      XDestroyImage (ximg);
-      shmdt(shminfo.shmaddr);
-      shmctl(shminfo.shmid, IPC_RMID, 0);
+      for (y = 0; y < sh; y++)
+	for (p = img->rgba + y * img->rowstride + pb->internal_bytespp, x = 0;
+	     x < sw; x++, p += bpp)
+	  *p = (xmskimg && XGetPixel(xmskimg, x, y)) ? 255 : 0;
     }
-  else XDestroyImage (ximg);
 
-  ximg = NULL;
+  XDestroyImage (ximg);
+  if (xmskimg) XDestroyImage (xmskimg);
 
   return img;
 }
 
-MBPixbufImage *
-mb_pixbuf_img_clone(MBPixbuf *pb, MBPixbufImage *img)
+/* Image on pixels owned by something else */
+static MBPixbufImage *
+_mb_pixbuf_img_new_foreign(MBPixbuf            *pb,
+			   unsigned char       *data,
+			   int                  w,
+			   int                  h,
+			   int                  rowstride,
+			   int                  has_alpha,
+			   MBPixbufDestroyFunc  destroy_fn,
+			   void                *destroy_data)
 {
-  MBPixbufImage *img_new;
+  MBPixbufImage *img;
 
-  if (img->has_alpha)
-    img_new = mb_pixbuf_img_rgba_new(pb, img->width, img->height);
-  else
-    img_new = mb_pixbuf_img_rgb_new(pb, img->width, img->height);
+  if ((img = _mb_pixbuf_slab_img_alloc(pb->slab, 0)) == NULL)
+    return NULL;
 
-  memcpy(img_new->rgba, img->rgba, 
-	 sizeof(unsigned char)*((img->width * img->height * (pb->internal_bytespp + img->has_alpha))));
-  return img_new;
+  img->width            = w;
+  img->height           = h;
+  img->rgba             = data;
+  img->has_alpha        = has_alpha;
+  img->ximg             = NULL;
+  img->internal_bytespp = pb->internal_bytespp;
+  img->rowstride        = rowstride;
+  img->premultiplied    = False;
+  img->refcount         = 1;
+  img->destroy_fn       = destroy_fn;
+  img->destroy_data     = destroy_data;
+
+  return img;
 }
 
-void
-mb_pixbuf_img_free(MBPixbuf *pb, MBPixbufImage *img)
+/* Pixels shared between an image and its clones, each of which has
+ * it as destroy_data. Whoever writes to them first, while there is
+ * more than one, copies them.
+ */
+typedef struct MBPixbufBuffer
 {
-  if (img->rgba) free(img->rgba);
-  free(img);
-}
+  int                  refcount;
+  int                  n_views;	/* views writing through, no sharing */
+  Bool                 read_only;
+  unsigned char       *rgba;
+  MBPixbufImage       *block;	/* image the pixels were allocated with */
+  MBPixbufDestroyFunc  destroy_fn; /* the pixels' own, NULL to free() */
+  void                *destroy_data;
+} MBPixbufBuffer;
 
 static void
-_mb_convert_24bpp_to_16bpp(MBPixbuf *pb, MBPixbufImage **img)
+_mb_pixbuf_buffer_unref(unsigned char *data, void *user_data)
 {
-  MBPixbufImage *img16, *img24 = *img;
-  int            x,y;
-  unsigned char  r,g,b, *p16 = NULL, *p24 = NULL;
-
-  if (img24->has_alpha)
-    img16 = mb_pixbuf_img_rgba_new(pb, img24->width, img24->height);
-  else
-    img16 = mb_pixbuf_img_rgb_new(pb, img24->width, img24->height);
-      
-  p16 = img16->rgba; p24 = img24->rgba;
+  MBPixbufBuffer *buf = user_data;
 
-  for (x=0; x<img24->width; x++)
-    for (y=0; y<img24->height; y++)
-      {
-	r = *p24++;
-	g = *p24++;
-	b = *p24++;
-
-	internal_rgb_to_16bpp_pixel(r,g,b,p16);
-	internal_16bpp_pixel_next(p16);
-
-	if (img24->has_alpha)
-	  *p16++ = *p24++;
-      }
+  if (--buf->refcount > 0)
+    return;
 
-  mb_pixbuf_img_free(pb, img24);
+  if (buf->block)
+    _mb_pixbuf_slab_img_release(buf->block);
+  else if (buf->destroy_fn)
+    buf->destroy_fn(buf->rgba, buf->destroy_data);
+  else
+    free(buf->rgba);
 
-  *img = img16;
+  free(buf);
 }
 
-MBPixbufImage *
-mb_pixbuf_img_new_from_file(MBPixbuf *pb, const char *filename)
+/* Moves @img's pixels into a buffer, if not already. NULL if they
+ * belong to something else, which might write to them behind our back.
+ */
+static MBPixbufBuffer *
+_mb_pixbuf_img_buffer(MBPixbufImage *img)
 {
-  MBPixbufImage *img;
+  MBPixbufBuffer *buf;
 
-  img = malloc(sizeof(MBPixbufImage));
+  if (img->destroy_fn == _mb_pixbuf_buffer_unref)
+    return img->destroy_data;
 
-#ifdef USE_PNG
-  if (!strcasecmp(&filename[strlen(filename)-4], ".png"))
-    img->rgba = _load_png_file( filename, &img->width, 
-				&img->height, &img->has_alpha ); 
-  else 
-#endif
-#ifdef USE_JPG
-  if (!strcasecmp(&filename[strlen(filename)-4], ".jpg")
-      || !strcasecmp(&filename[strlen(filename)-5], ".jpeg"))
-    img->rgba = _load_jpg_file( filename, &img->width, 
-				&img->height, &img->has_alpha ); 
-  else 
-#endif
-if (!strcasecmp(&filename[strlen(filename)-4], ".xpm"))
-    img->rgba = _load_xpm_file( pb, filename, &img->width, 
-				&img->height, &img->has_alpha ); 
-  else img->rgba = NULL;
+  if (img->destroy_fn != NULL || img->rgba == NULL)
+    return NULL;
 
-  if (img->rgba == NULL)
-    {
-      /* Load failed */
-      free(img);
-      return NULL;
-    }
+  if ((buf = malloc(sizeof(MBPixbufBuffer))) == NULL)
+    return NULL;
 
-  if (pb->internal_bytespp == 2)
+  buf->refcount     = 1;
+  buf->n_views      = 0;
+  buf->read_only    = False;
+  buf->rgba         = img->rgba;
+  buf->block        = NULL;
+  buf->destroy_fn   = NULL;
+  buf->destroy_data = NULL;
+
+  /* Pixels in the image's own block keep it until the last sharer */
+  if (img->rgba == _mb_pixbuf_slab_img_pixels(img))
     {
-      /* Need to convert the data down, always comes as 24 rgb :/ */
-      _mb_convert_24bpp_to_16bpp(pb, &img);
+      buf->block = img;
+      _mb_pixbuf_slab_img_ref(img);
     }
 
-  img->ximg = NULL;
+  img->destroy_fn   = _mb_pixbuf_buffer_unref;
+  img->destroy_data = buf;
 
-  return img;
+  return buf;
 }
 
 void
-mb_pixbuf_img_fill(MBPixbuf *pb, 
-		   MBPixbufImage *img,
-		   int r, 
-		   int g, 
-		   int b, 
-		   int a)
+_mb_pixbuf_img_set_read_only(MBPixbufImage *img)
 {
-  unsigned char *p = img->rgba;
-  int x,y;
+  MBPixbufBuffer *buf;
 
-  if (pb->internal_bytespp == 2)
-    {
-      for(y=0; y<img->height; y++)
-	for(x=0; x<img->width; x++)
-	  {
-	    internal_rgb_to_16bpp_pixel(r,g,b,p);
-	    internal_16bpp_pixel_next(p);
-	    if (img->has_alpha) *p++ = a;
-	  }
+  if ((buf = malloc(sizeof(MBPixbufBuffer))) == NULL)
+    return;
+
+  buf->refcount     = 1;
+  buf->n_views      = 0;
+  buf->read_only    = True;
+  buf->rgba         = img->rgba;
+  buf->block        = NULL;
+  buf->destroy_fn   = img->destroy_fn;
+  buf->destroy_data = img->destroy_data;
+
+  img->destroy_fn   = _mb_pixbuf_buffer_unref;
+  img->destroy_data = buf;
+}
+
+Bool
+mb_pixbuf_img_make_writable(MBPixbuf *pb, MBPixbufImage *img)
+{
+  MBPixbufBuffer *buf;
+  void           *data = NULL;
+  int             y, len, rowstride;
+
+  if (img->destroy_fn != _mb_pixbuf_buffer_unref)
+    return True;
+
+  buf = img->destroy_data;
+
+  if (buf->refcount == 1 && !buf->read_only)
+    return True;
+
+  len       = img->width * (img->internal_bytespp + img->has_alpha);
+  rowstride = mb_pixbuf_aligned_rowstride(img->width, 
+					  img->internal_bytespp 
+					  + img->has_alpha);
+
+  if (posix_memalign(&data, MBPIXBUF_ROW_ALIGN, 
+		     (size_t)rowstride * img->height) != 0)
+    return False;
+
+  for (y = 0; y < img->height; y++)
+    memcpy((unsigned char *)data + y * rowstride, 
+	   img->rgba + y * img->rowstride, len);
+
+  _mb_pixbuf_buffer_unref(img->rgba, buf);
+
+  img->rgba         = data;
+  img->rowstride    = rowstride;
+  img->destroy_fn   = NULL;
+  img->destroy_data = NULL;
+
+  return True;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_clone(MBPixbuf *pb, MBPixbufImage *img)
+{
+  MBPixbufImage  *img_new;
+  MBPixbufBuffer *buf;
+  int             y;
+
+  /* Share the pixels until one side writes to them */
+  if ((buf = _mb_pixbuf_img_buffer(img)) != NULL && buf->n_views == 0)
+    {
+      img_new = _mb_pixbuf_img_new_foreign(pb, img->rgba, 
+					   img->width, img->height,
+					   img->rowstride, img->has_alpha,
+					   _mb_pixbuf_buffer_unref, buf);
+      if (img_new != NULL)
+	{
+	  buf->refcount++;
+	  img_new->premultiplied = img->premultiplied;
+	  return img_new;
+	}
     }
+
+  img_new = _mb_pixbuf_img_new_uninit(pb, img->width, img->height,
+				      img->has_alpha);
+
+  if (img_new == NULL)
+    return NULL;
+
+  /* The source may be packed, an icon cache entry say */
+  if (img->rowstride == img_new->rowstride)
+    memcpy(img_new->rgba, img->rgba, (size_t)img->rowstride * img->height);
   else
+    for (y = 0; y < img->height; y++)
+      memcpy(img_new->rgba + y * img_new->rowstride, 
+	     img->rgba + y * img->rowstride,
+	     img->width * (pb->internal_bytespp + img->has_alpha));
+
+  img_new->premultiplied = img->premultiplied;
+  return img_new;
+}
+
+static void
+_mb_pixbuf_img_view_destroy(unsigned char *data, void *user_data)
+{
+  MBPixbufImage *parent = user_data;
+
+  if (parent->destroy_fn == _mb_pixbuf_buffer_unref)
+    ((MBPixbufBuffer *)parent->destroy_data)->n_views--;
+
+  mb_pixbuf_img_free(NULL, parent);
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new_view(MBPixbuf      *pb,
+		       MBPixbufImage *parent,
+		       int            x,
+		       int            y,
+		       int            w,
+		       int            h)
+{
+  MBPixbufImage  *img;
+  MBPixbufBuffer *buf;
+
+  if (x < 0 || y < 0 || w <= 0 || h <= 0
+      || x + w > parent->width || y + h > parent->height)
+    return NULL;
+
+  /* Writes through the view mustn't show in the parent's clones, so
+   * give it pixels of its own and stop it sharing them while viewed.
+   */
+  if (!mb_pixbuf_img_make_writable(pb, parent))
+    return NULL;
+
+  img = _mb_pixbuf_img_new_foreign(pb, mb_pixbuf_img_pixel(parent, x, y),
+				   w, h, parent->rowstride, parent->has_alpha,
+				   _mb_pixbuf_img_view_destroy, parent);
+  if (img == NULL)
+    return NULL;
+
+  img->premultiplied = parent->premultiplied;
+  mb_pixbuf_img_ref(parent);
+
+  if ((buf = _mb_pixbuf_img_buffer(parent)) != NULL)
+    buf->n_views++;
+
+  return img;
+}
+
+/* Leaves the data with the caller */
+static void
+_mb_pixbuf_img_keep_data(unsigned char *data, void *user_data)
+{
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new_wrap(MBPixbuf            *pb,
+		       unsigned char       *data,
+		       int                  w,
+		       int                  h,
+		       int                  rowstride,
+		       int                  has_alpha,
+		       MBPixbufDestroyFunc  destroy_fn)
+{
+  int len = w * (pb->internal_bytespp + (has_alpha ? 1 : 0));
+
+  if (data == NULL || w <= 0 || h <= 0)
+    return NULL;
+
+  if (rowstride == 0)
+    rowstride = len;
+  else if (rowstride < len)
+    return NULL;
+
+  return _mb_pixbuf_img_new_foreign(pb, data, w, h, rowstride, 
+				    has_alpha ? 1 : 0,
+				    destroy_fn ? destroy_fn 
+				               : _mb_pixbuf_img_keep_data, 
+				    NULL);
+}
+
+void
+mb_pixbuf_img_free(MBPixbuf *pb, MBPixbufImage *img)
+{
+  if (--img->refcount > 0)
+    return;
+
+  if (img->destroy_fn)
+    img->destroy_fn(img->rgba, img->destroy_data);
+  else if (img->rgba && img->rgba != _mb_pixbuf_slab_img_pixels(img)) 
+    free(img->rgba);
+
+  _mb_pixbuf_slab_img_release(img);
+}
+
+MBPixbufImage *
+mb_pixbuf_img_ref(MBPixbufImage *img)
+{
+  img->refcount++;
+  return img;
+}
+
+/* Stores an 8 bit rgb(a) row as row @y of @img, converting to the
+ * internal format. @row may be the image's own row when the internal
+ * format is 24 bit.
+ */
+static void
+_mb_pixbuf_img_store_row(MBPixbufImage *img, int y, const unsigned char *row)
+{
+  unsigned char *dst;
+  int            x, bpp = 3 + img->has_alpha;
+
+  dst = img->rgba + y * img->rowstride;
+
+  if (img->internal_bytespp == 3)
     {
-      for(y=0; y<img->height; y++)
-	for(x=0; x<img->width; x++)
+      if (dst != row)
+	memcpy(dst, row, img->width * bpp);
+      return;
+    }
+
+  for (x = 0; x < img->width; x++, row += bpp)
+    {
+      internal_rgb_to_16bpp_pixel(row[0], row[1], row[2], dst);
+      internal_16bpp_pixel_next(dst);
+
+      if (img->has_alpha) *dst++ = row[3];
+    }
+}
+
+/* Stores a decoded, straight alpha, row. Alpha is premultiplied first,
+ * in place, if the image wants it.
+ */
+static void
+_mb_pixbuf_img_put_row(MBPixbuf *pb, MBPixbufImage *img, int y, 
+		       unsigned char *row)
+{
+  if (img->has_alpha && img->premultiplied)
+    _mb_convert_alpha_row(row, img->width, 4, True);
+
+  _mb_pixbuf_img_store_row(img, y, row);
+}
+
+static void
+_mb_pixbuf_load_scaled_row(void *data, int y, unsigned char *row)
+{
+  _mb_pixbuf_img_store_row((MBPixbufImage *)data, y, row);
+}
+
+MBPixbufImage *
+_mb_pixbuf_load_begin(MBPixbuf           *pb, 
+		      int                 width, 
+		      int                 height,
+		      int                 has_alpha,
+		      int                 want_width,
+		      int                 want_height,
+		      MBPixbufRowScaler **scaler)
+{
+  MBPixbufImage *img;
+
+  *scaler = NULL;
+
+  if (want_width <= 0 || want_height <= 0)
+    {
+      want_width  = width;
+      want_height = height;
+    }
+
+  /* Loaders store every row, a short PNG fails and a short JPEG or XPM
+   * is padded out, so there is nothing to clear
+   */
+  if ((img = _mb_pixbuf_img_new_uninit(pb, want_width, want_height, 
+				       has_alpha)) == NULL)
+    return NULL;
+
+  if (want_width == width && want_height == height)
+    return img;
+
+  *scaler = _mb_pixbuf_row_scaler_new(width, height, want_width, want_height,
+				      3 + has_alpha, 
+				      _mb_pixbuf_load_scaled_row, img);
+  if (*scaler == NULL)
+    {
+      mb_pixbuf_img_free(pb, img);
+      return NULL;
+    }
+
+  return img;
+}
+
+void
+_mb_pixbuf_load_row(MBPixbuf          *pb, 
+		    MBPixbufImage     *img, 
+		    MBPixbufRowScaler *scaler,
+		    int                y, 
+		    unsigned char     *row,
+		    int                width)
+{
+  if (scaler == NULL)
+    {
+      _mb_pixbuf_img_put_row(pb, img, y, row);
+      return;
+    }
+
+  /* Averaged premultiplied, as scaling a loaded image would */
+  if (img->has_alpha && img->premultiplied)
+    _mb_convert_alpha_row(row, width, 4, True);
+
+  _mb_pixbuf_row_scaler_push(scaler, row);
+}
+
+/* What the data is, from its first bytes */
+static MBPixbufImageFormat
+_mb_pixbuf_sniff(const unsigned char *data, size_t len)
+{
+  static const unsigned char png_magic[8] = 
+    { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+  if (len >= 8 && !memcmp(data, png_magic, 8))
+    return MBPIXBUF_FORMAT_PNG;
+
+  if (len >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+    return MBPIXBUF_FORMAT_JPEG;
+
+  while (len && isspace(*data)) 
+    {
+      data++; 
+      len--;
+    }
+
+  if (len >= 9 && !memcmp(data, "/* XPM */", 9))
+    return MBPIXBUF_FORMAT_XPM;
+
+  return MBPIXBUF_FORMAT_UNKNOWN;
+}
+
+MBPixbufImage *
+_mb_pixbuf_img_load_data(MBPixbuf            *pb,
+			 const unsigned char *data,
+			 size_t               len,
+			 const char          *filename,
+			 int                  width,
+			 int                  height)
+{
+  MBPixbufImageFormat format;
+
+  if (width <= 0 || height <= 0)
+    width = height = 0;
+
+  format = _mb_pixbuf_sniff(data, len);
+
+  if (format == MBPIXBUF_FORMAT_UNKNOWN && filename != NULL
+      && strlen(filename) > 4
+      && !strcasecmp(&filename[strlen(filename)-4], ".xpm"))
+    format = MBPIXBUF_FORMAT_XPM;
+
+  switch (format)
+    {
+#ifdef USE_PNG
+    case MBPIXBUF_FORMAT_PNG:
+      return _load_png_data(pb, data, len, width, height);
+#endif
+#ifdef USE_JPG
+    case MBPIXBUF_FORMAT_JPEG:
+      return _load_jpg_data(pb, data, len, width, height);
+#endif
+    case MBPIXBUF_FORMAT_XPM:
+      return _mb_pixbuf_load_xpm_data(pb, data, len, width, height);
+    default:
+      if (mb_want_warnings())
+	fprintf(stderr, "mbpixbuf: %s is not a supported image\n", 
+		filename ? filename : "data");
+      return NULL;
+    }
+}
+
+/* Regular files are mapped, anything else read to end of file */
+MBPixbufImage *
+_mb_pixbuf_img_load_fd(MBPixbuf   *pb,
+		       int         fd,
+		       const char *filename,
+		       int         width,
+		       int         height)
+{
+  MBPixbufImage *img;
+  struct stat    st;
+  unsigned char *data = NULL, *tmp;
+  size_t         len = 0, size = 0;
+  ssize_t        n;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (data != MAP_FAILED)
+	{
+	  img = _mb_pixbuf_img_load_data(pb, data, st.st_size, filename,
+					 width, height);
+	  munmap(data, st.st_size);
+	  return img;
+	}
+
+      data = NULL;
+    }
+
+  for (;;)
+    {
+      if (len == size)
+	{
+	  size = size ? size * 2 : 64 * 1024;
+
+	  if ((tmp = realloc(data, size)) == NULL)
+	    {
+	      free(data);
+	      return NULL;
+	    }
+
+	  data = tmp;
+	}
+
+      n = read(fd, data + len, size - len);
+
+      if (n < 0 && errno == EINTR)
+	continue;
+
+      if (n < 0)
+	{
+	  free(data);
+	  return NULL;
+	}
+
+      if (n == 0)
+	break;
+
+      len += n;
+    }
+
+  img = _mb_pixbuf_img_load_data(pb, data, len, filename, width, height);
+
+  free(data);
+
+  return img;
+}
+
+MBPixbufImage *
+_mb_pixbuf_img_load_file(MBPixbuf   *pb,
+			 const char *filename,
+			 int         width,
+			 int         height)
+{
+  MBPixbufImage *img;
+  int            fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    {
+      if (mb_want_warnings())
+	fprintf(stderr, "mbpixbuf: can't open %s\n", filename);
+      return NULL;
+    }
+
+  img = _mb_pixbuf_img_load_fd(pb, fd, filename, width, height);
+
+  close(fd);
+
+  return img;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new_from_file_at_size(MBPixbuf   *pb,
+				    const char *filename,
+				    int         width,
+				    int         height)
+{
+  MBPixbufImage *img;
+  struct stat    st;
+
+  if (width <= 0 || height <= 0)
+    width = height = 0;
+
+  if ((img = mb_pixbuf_icon_cache_lookup(pb->icon_cache, filename, 
+					 width, height)))
+    return img;
+
+  if (!_mb_pixbuf_image_cache_enabled() || stat(filename, &st) != 0)
+    return _mb_pixbuf_img_load_file(pb, filename, width, height);
+
+  if ((img = _mb_pixbuf_image_cache_lookup(pb, filename, &st, 
+					   width, height)) != NULL)
+    return img;
+
+  if ((img = _mb_pixbuf_img_load_file(pb, filename, width, height)) != NULL)
+    _mb_pixbuf_image_cache_insert(pb, filename, &st, width, height, img);
+
+  return img;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new_from_file(MBPixbuf *pb, const char *filename)
+{
+  return mb_pixbuf_img_new_from_file_at_size(pb, filename, 0, 0);
+}
+
+typedef struct LoadBatch
+{
+  MBPixbuf        *pb;
+  const char     **paths;
+  int              width, height;
+  MBPixbufImage  **results;
+  int             *todo;
+} LoadBatch;
+
+static void
+_load_batch_task(void *data, int index)
+{
+  LoadBatch *batch = data;
+  int        i = batch->todo[index];
+
+  batch->results[i] = _mb_pixbuf_img_load_file(batch->pb, batch->paths[i],
+					       batch->width, batch->height);
+}
+
+int
+mb_pixbuf_img_load_batch(MBPixbuf        *pb,
+			 const char     **paths,
+			 int              n,
+			 int              width,
+			 int              height,
+			 MBPixbufImage  **results)
+{
+  LoadBatch    batch;
+  struct stat *st = NULL;
+  Bool         cache;
+  int          i, j, n_todo = 0, n_loaded = 0;
+
+  if (n <= 0)
+    return 0;
+
+  if (width <= 0 || height <= 0)
+    width = height = 0;
+
+  batch.pb      = pb;
+  batch.paths   = paths;
+  batch.width   = width;
+  batch.height  = height;
+  batch.results = results;
+  batch.todo    = malloc(n * sizeof(int));
+
+  if ((cache = _mb_pixbuf_image_cache_enabled()))
+    st = calloc(n, sizeof(struct stat));
+
+  /* Out of memory, load them one at a time instead */
+  if (batch.todo == NULL || (cache && st == NULL))
+    {
+      free(batch.todo);
+      free(st);
+
+      for (i = 0; i < n; i++)
+	if ((results[i] = mb_pixbuf_img_new_from_file_at_size(pb, paths[i],
+							      width, height)))
+	  n_loaded++;
+
+      return n_loaded;
+    }
+
+  /* The caches aren't thread safe, so only decoding is farmed out */
+  for (i = 0; i < n; i++)
+    {
+      results[i] = mb_pixbuf_icon_cache_lookup(pb->icon_cache, paths[i], 
+					       width, height);
+
+      if (results[i] == NULL && cache && stat(paths[i], &st[i]) == 0)
+	results[i] = _mb_pixbuf_image_cache_lookup(pb, paths[i], &st[i],
+						   width, height);
+
+      if (results[i] == NULL)
+	batch.todo[n_todo++] = i;
+    }
+
+  _mb_pixbuf_pool_run(0, n_todo, _load_batch_task, &batch);
+
+  for (j = 0; j < n_todo; j++)
+    {
+      i = batch.todo[j];
+
+      /* st_nlink stays 0 if stat() failed */
+      if (cache && results[i] && st[i].st_nlink)
+	_mb_pixbuf_image_cache_insert(pb, paths[i], &st[i], 
+				      width, height, results[i]);
+    }
+
+  for (i = 0; i < n; i++)
+    if (results[i]) n_loaded++;
+
+  free(batch.todo);
+  free(st);
+
+  return n_loaded;
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new_from_memory(MBPixbuf            *pb, 
+			      const unsigned char *data, 
+			      size_t               len)
+{
+  if (data == NULL || len == 0)
+    return NULL;
+
+  return _mb_pixbuf_img_load_data(pb, data, len, NULL, 0, 0);
+}
+
+MBPixbufImage *
+mb_pixbuf_img_new_from_fd(MBPixbuf *pb, int fd)
+{
+  return _mb_pixbuf_img_load_fd(pb, fd, NULL, 0, 0);
+}
+
+/* Pixel operations split into row bands on large images, see
+ * _mb_pixbuf_run_bands
+ */
+
+typedef struct FillBands
+{
+  unsigned char *rgba;
+  unsigned char  pixel[4];
+  int            bpp;
+  int            len;		/* bytes of pixels in a row */
+  int            stride;
+} FillBands;
+
+static void
+_fill_band(void *data, int y0, int y1)
+{
+  FillBands     *f = data;
+  unsigned char *p = f->rgba + y0 * f->stride;
+  int            y, done, same;
+
+  if (y0 >= y1) return;
+
+  /* Pack the pixel once, then double it up across the first row and
+   * copy that to the rest. A pixel of one byte repeated, black or white
+   * say, is just a memset.
+   */
+  for (same = 1; same < f->bpp && f->pixel[same] == f->pixel[0]; same++)
+    ;
+
+  if (same == f->bpp)
+    memset(p, f->pixel[0], f->len);
+  else
+    {
+      memcpy(p, f->pixel, f->bpp);
+
+      for (done = f->bpp; done < f->len; done *= 2)
+	memcpy(p + done, p, (f->len - done < done) ? f->len - done : done);
+    }
+
+  for (y = y0 + 1; y < y1; y++)
+    memcpy(f->rgba + y * f->stride, p, f->len);
+}
+
+/* Clips a rectangle to @img, False if nothing is left */
+static Bool
+_mb_pixbuf_img_clip_rect(MBPixbufImage *img, int *x, int *y, int *w, int *h)
+{
+  if (*x < 0) { *w += *x; *x = 0; }
+  if (*y < 0) { *h += *y; *y = 0; }
+
+  if (*x + *w > img->width)  *w = img->width - *x;
+  if (*y + *h > img->height) *h = img->height - *y;
+
+  return (*w > 0 && *h > 0);
+}
+
+void
+mb_pixbuf_img_fill_rect(MBPixbuf      *pb,
+			MBPixbufImage *img,
+			int            x,
+			int            y,
+			int            w,
+			int            h,
+			int            r,
+			int            g,
+			int            b,
+			int            a)
+{
+  FillBands f;
+
+  if (!_mb_pixbuf_img_clip_rect(img, &x, &y, &w, &h)) return;
+
+  if (!mb_pixbuf_img_make_writable(pb, img)) return;
+
+  if (img->has_alpha && img->premultiplied)
+    {
+      r = _mb_premultiply(r, a);
+      g = _mb_premultiply(g, a);
+      b = _mb_premultiply(b, a);
+    }
+
+  if (pb->internal_bytespp == 2)
+    {
+      internal_rgb_to_16bpp_pixel(r,g,b,f.pixel);
+    }
+  else
+    {
+      f.pixel[0] = r;
+      f.pixel[1] = g;
+      f.pixel[2] = b;
+    }
+
+  if (img->has_alpha) f.pixel[pb->internal_bytespp] = a;
+
+  f.rgba   = mb_pixbuf_img_pixel(img, x, y);
+  f.bpp    = pb->internal_bytespp + img->has_alpha;
+  f.len    = w * f.bpp;
+  f.stride = img->rowstride;
+
+  _mb_pixbuf_run_bands(pb, h, (long)w * h, _fill_band, &f);
+}
+
+void
+mb_pixbuf_img_fill(MBPixbuf *pb, 
+		   MBPixbufImage *img,
+		   int r, 
+		   int g, 
+		   int b, 
+		   int a)
+{
+  mb_pixbuf_img_fill_rect(pb, img, 0, 0, img->width, img->height, r, g, b, a);
+}
+
+void
+mb_pixbuf_img_hline(MBPixbuf      *pb,
+		    MBPixbufImage *img,
+		    int            x,
+		    int            y,
+		    int            len,
+		    int            r,
+		    int            g,
+		    int            b,
+		    int            a)
+{
+  mb_pixbuf_img_fill_rect(pb, img, x, y, len, 1, r, g, b, a);
+}
+
+void
+mb_pixbuf_img_vline(MBPixbuf      *pb,
+		    MBPixbufImage *img,
+		    int            x,
+		    int            y,
+		    int            len,
+		    int            r,
+		    int            g,
+		    int            b,
+		    int            a)
+{
+  mb_pixbuf_img_fill_rect(pb, img, x, y, 1, len, r, g, b, a);
+}
+
+void
+mb_pixbuf_img_fill_arrow(MBPixbuf      *pb,
+			 MBPixbufImage *img,
+			 int            x,
+			 int            y,
+			 int            size,
+			 MBPixbufArrow  dir,
+			 int            r,
+			 int            g,
+			 int            b,
+			 int            a)
+{
+  int depth = (size + 1) / 2, i, len;
+
+  /* One span a row, the tip a single pixel */
+  switch (dir)
+    {
+    case MBPIXBUF_ARROW_UP:
+      for (i = 0; i < depth; i++)
+	mb_pixbuf_img_hline(pb, img, x + depth - 1 - i, y + i,
+			    size - 2 * (depth - 1 - i), r, g, b, a);
+      break;
+    case MBPIXBUF_ARROW_DOWN:
+      for (i = 0; i < depth; i++)
+	mb_pixbuf_img_hline(pb, img, x + i, y + i, size - 2 * i, r, g, b, a);
+      break;
+    case MBPIXBUF_ARROW_LEFT:
+    case MBPIXBUF_ARROW_RIGHT:
+      for (i = 0; i < size; i++)
+	{
+	  len = ((i < size - 1 - i) ? i : size - 1 - i) + 1;
+
+	  if (dir == MBPIXBUF_ARROW_LEFT)
+	    mb_pixbuf_img_hline(pb, img, x + depth - len, y + i, len, 
+				r, g, b, a);
+	  else
+	    mb_pixbuf_img_hline(pb, img, x, y + i, len, r, g, b, a);
+	}
+      break;
+    }
+}
+
+typedef struct BlendBands
+{
+  MBPixbufImage *img;
+  int            x, w;
+  int            y;		/* bands are relative to this */
+  int            bytespp;	/* internal, without alpha */
+  int            r, g, b, a;
+} BlendBands;
+
+static void
+_blend_band(void *data, int y0, int y1)
+{
+  BlendBands    *bl = data;
+  MBPixbufImage *img = bl->img;
+  int            bpp = bl->bytespp + img->has_alpha;
+  int            y, i, r = bl->r, g = bl->g, b = bl->b, a = bl->a, da;
+  unsigned char *p;
+  uint64_t       fg = spread_from_rgb(r, g, b);
+  unsigned short s;
+
+  for (y = bl->y + y0; y < bl->y + y1; y++)
+    for (p = mb_pixbuf_img_pixel(img, bl->x, y), i = 0; i < bl->w; i++)
+      {
+	if (img->has_alpha && img->premultiplied)
 	  {
-	    *p++ = r;
-	    *p++ = g;
-	    *p++ = b;
-	    if (img->has_alpha) *p++ = a;
+	    /* As mb_pixbuf_img_plot_pixel_with_alpha, the destination
+	     * alpha is kept so premultiply by it
+	     */
+	    da = p[bl->bytespp];
+	    r  = _mb_premultiply(bl->r, da);
+	    g  = _mb_premultiply(bl->g, da);
+	    b  = _mb_premultiply(bl->b, da);
+	    fg = spread_from_rgb(r, g, b);
 	  }
+
+	if (bl->bytespp == 2)
+	  {
+	    s = SHORT_FROM_2BYTES(p);
+	    s = _mb_blend_565(fg, spread_from_565(s), a);
+	    BYTES_FROM_SHORT(p, s);
+	  }
+	else
+	  {
+	    alpha_composite(p[0], r, a, p[0]);
+	    alpha_composite(p[1], g, a, p[1]);
+	    alpha_composite(p[2], b, a, p[2]);
+	  }
+
+	p += bpp;
+      }
+}
+
+void
+mb_pixbuf_img_blend_rect(MBPixbuf      *pb,
+			 MBPixbufImage *img,
+			 int            x,
+			 int            y,
+			 int            w,
+			 int            h,
+			 int            r,
+			 int            g,
+			 int            b,
+			 int            a)
+{
+  BlendBands bl;
+
+  if (a <= 0) return;
+
+  if (!_mb_pixbuf_img_clip_rect(img, &x, &y, &w, &h)) return;
+
+  /* Opaque over something without alpha is just a fill */
+  if (a >= 255 && !img->has_alpha)
+    {
+      mb_pixbuf_img_fill_rect(pb, img, x, y, w, h, r, g, b, 0xff);
+      return;
+    }
+
+  if (!mb_pixbuf_img_make_writable(pb, img)) return;
+
+  bl.img     = img;
+  bl.x       = x;
+  bl.w       = w;
+  bl.y       = y;
+  bl.bytespp = pb->internal_bytespp;
+  bl.r       = r;
+  bl.g       = g;
+  bl.b       = b;
+  bl.a       = (a > 255) ? 255 : a;
+
+  _mb_pixbuf_run_bands(pb, h, (long)w * h, _blend_band, &bl);
+}
+
+MBPixbufOverRowFunc
+_mb_pixbuf_over_row_func(MBPixbuf      *pb, 
+			 MBPixbufImage *dest, 
+			 MBPixbufImage *src)
+{
+  const MBPixbufKernels *k = pb->kernels;
+
+  if (dest->has_alpha && dest->premultiplied)
+    {
+      if (pb->internal_bytespp == 2)
+	return src->premultiplied ? k->over_premul_to_premul_565a_row 
+	                          : k->over_to_premul_565a_row;
+
+      return src->premultiplied ? k->over_premul_to_premul_rgba_row 
+	                        : k->over_to_premul_rgba_row;
     }
+
+  if (src->premultiplied)
+    {
+      if (pb->internal_bytespp == 2)
+	return dest->has_alpha ? k->over_premul_565a_row : k->over_premul_565_row;
+
+      return dest->has_alpha ? k->over_premul_rgba_row : k->over_premul_rgb_row;
+    }
+
+  if (pb->internal_bytespp == 2)
+    return dest->has_alpha ? k->over_565a_row : k->over_565_row;
+
+  return dest->has_alpha ? k->over_rgba_row : k->over_rgb_row;
 }
 
 void
@@ -1478,69 +2518,54 @@ mb_pixbuf_img_composite(MBPixbuf *pb, MBPixbufImage *dest,
 			MBPixbufImage *src, int dx, int dy)
 {
   /* XXX depreictaed, should really now use copy_composite */
-  int x, y, r, g, b, a;
+  MBPixbufOverRowFunc over_row;
   unsigned char *sp, *dp;
-  int dbc = 0; 
+  int y; 
 
   if (src->has_alpha == False)
     return mb_pixbuf_img_copy(pb, dest, src, 0, 0, 
 			      src->width, src->height, dx, dy);
+
+  if (!mb_pixbuf_img_make_writable(pb, dest)) return;
+
   sp = src->rgba;
-  dp = dest->rgba;
+  dp = mb_pixbuf_img_pixel(dest, dx, dy);
+
+  over_row = _mb_pixbuf_over_row_func(pb, dest, src);
 
-  dbc = (pb->internal_bytespp + dest->has_alpha);
+  for(y=0; y<src->height; y++)
+    {
+      over_row(dp, sp, src->width, 0, False);
+      sp += src->rowstride;
+      dp += dest->rowstride;
+    }
+}
 
-  dp += ((dest->width*dbc)*dy) + (dx*dbc);
+typedef struct CopyBands
+{
+  MBPixbuf            *pb;
+  MBPixbufImage       *dest;
+  MBPixbufImage       *src;
+  int                  sx, sy, sw, dx, dy;
+  int                  alpha_level;
+  MBPixbufOverRowFunc  over_row;
+} CopyBands;
 
-  if (pb->internal_bytespp == 2)
-    {
-      for(y=0; y<src->height; y++)
-	{
-	  for(x=0; x<src->width; x++)
-	    {
-	      unsigned char dr,dg,db;
-
-	      /* TODO, This needs optimising */
-
-	      internal_16bpp_pixel_to_rgb(sp,r,g,b);
-	      internal_16bpp_pixel_next(sp);
-	      a = *sp++;
-		
-	      internal_16bpp_pixel_to_rgb(dp,dr,dg,db);
-	      alpha_composite(dr, r, a, dr);
-	      alpha_composite(dg, g, a, dg);
-	      alpha_composite(db, b, a, db);
-	      internal_rgb_to_16bpp_pixel(dr,dg,db,dp)
-	      internal_16bpp_pixel_next(dp);
-
-	      dp += dest->has_alpha;
-	    }
-	  dp += (dest->width-src->width)*dbc;
-	}
+static void
+_composite_band(void *data, int y0, int y1)
+{
+  CopyBands     *c = data;
+  unsigned char *sp, *dp;
+  int            y;
 
+  dp = mb_pixbuf_img_pixel(c->dest, c->dx, c->dy + y0);
+  sp = mb_pixbuf_img_pixel(c->src,  c->sx, c->sy + y0);
 
-    }
-  else
+  for(y=y0; y<y1; y++)
     {
-      for(y=0; y<src->height; y++)
-	{
-	  for(x=0; x<src->width; x++)
-	    {
-	      r = *sp++;
-	      g = *sp++;
-	      b = *sp++;
-	      a = *sp++;
-	      
-	      alpha_composite(*dp, r, a, *dp);
-	      dp++;
-	      alpha_composite(*dp, g, a, *dp);
-	      dp++;
-	      alpha_composite(*dp, b, a, *dp);
-	      dp++;
-	      dp += dest->has_alpha;
-	    }
-	  dp += (dest->width-src->width)*dbc;
-	}
+      c->over_row(dp, sp, c->sw, c->alpha_level, True);
+      sp += c->src->rowstride;
+      dp += c->dest->rowstride;
     }
 }
 
@@ -1553,86 +2578,26 @@ mb_pixbuf_img_copy_composite_with_alpha (MBPixbuf      *pb,
 					 int dx, int dy,
 					 int alpha_level )
 {
-  int x, y, r, g, b, a;
-  unsigned char *sp, *dp;
-  int dbc = 0;   
+  CopyBands c;
 
   if (!src->has_alpha)
     return mb_pixbuf_img_copy(pb, dest, src, sx, sy, sw, sh, dx, dy);
- 
-  sp = src->rgba;
-  dp = dest->rgba;
 
-  dbc = (pb->internal_bytespp + dest->has_alpha);
-
-  dp += ((dest->width*dbc)*dy) + (dx*dbc);
-  sp += ((src->width*(pb->internal_bytespp+1))*sy)  + (sx*(pb->internal_bytespp+1));
-
-  if (pb->internal_bytespp == 2)
-    {
-      for(y=0; y<sh; y++)
-	{
-	  for(x=0; x < sw; x++)
-	    {
-	      unsigned char dr,dg,db;
+  if (!mb_pixbuf_img_make_writable(pb, dest)) return;
 
-	      /* TODO, This needs optimising */
+  c.pb   = pb;
+  c.dest = dest;
+  c.src  = src;
+  c.sx   = sx;
+  c.sy   = sy;
+  c.sw   = sw;
+  c.dx   = dx;
+  c.dy   = dy;
 
-	      internal_16bpp_pixel_to_rgb(sp,r,g,b);
-	      internal_16bpp_pixel_next(sp);
-	      a = *sp; sp++;
+  c.alpha_level = alpha_level;
+  c.over_row    = _mb_pixbuf_over_row_func(pb, dest, src);
 
-	      if (alpha_level)
-		{
-		  a += alpha_level;
-		  if (a < 0) a = 0;
-		  if (a > 255) a = 255;
-		}
-		
-	      internal_16bpp_pixel_to_rgb(dp,dr,dg,db);
-	      alpha_composite(dr, r, a, dr);
-	      alpha_composite(dg, g, a, dg);
-	      alpha_composite(db, b, a, db);
-	      internal_rgb_to_16bpp_pixel(dr,dg,db,dp);
-	      internal_16bpp_pixel_next(dp);
-	      
-	      if (dest->has_alpha)
-		*dp++ =  a;
-	    }
-	  dp += (dest->width-sw)*dbc;
-	  sp += (src->width-sw)*3;
-	}
-    }
-  else
-    {
-      for(y=0; y<sh; y++)
-	{
-	  for(x=0; x < sw; x++)
-	    {
-	      r = *sp++;
-	      g = *sp++;
-	      b = *sp++;
-	      a = *sp++;
-	      
-	      if (alpha_level)
-		{
-		  a += alpha_level;
-		  if (a < 0) a = 0;
-		  if (a > 255) a = 255;
-		}
-	      
-	      alpha_composite(*dp, r, a, *dp);
-	      dp++;
-	      alpha_composite(*dp, g, a, *dp);
-	      dp++;
-	      alpha_composite(*dp, b, a, *dp);
-	      dp++;
-	      if (dest->has_alpha) *dp++ = a;
-	    }
-	  dp += (dest->width-sw)*dbc;
-	  sp += (src->width-sw)*4;
-	}
-    }
+  _mb_pixbuf_run_bands(pb, sh, (long)sw * sh, _composite_band, &c);
 }
      
 
@@ -1645,25 +2610,21 @@ mb_pixbuf_img_copy_composite(MBPixbuf *pb, MBPixbufImage *dest,
 }
 
 
-void
-mb_pixbuf_img_copy(MBPixbuf *pb, MBPixbufImage *dest,
-		   MBPixbufImage *src, int sx, int sy, int sw, int sh,
-		   int dx, int dy)
+static void
+_copy_band(void *data, int y0, int y1)
 {
-  int x, y, dbc, sbc;
+  CopyBands     *c = data;
+  MBPixbuf      *pb = c->pb;
+  MBPixbufImage *dest = c->dest, *src = c->src;
+  int x, y;
   unsigned char *sp, *dp;
   
-  sp = src->rgba;
-  dp = dest->rgba;
-  dbc = (pb->internal_bytespp + dest->has_alpha);
-  sbc = (pb->internal_bytespp + src->has_alpha);
-
-  dp += ((dest->width*dbc)*dy) + (dx*dbc);
-  sp += ((src->width*sbc)*sy)  + (sx*sbc);
-
-  for(y=0; y<sh; y++)
+  for(y=y0; y<y1; y++)
     {
-      for(x=0; x < sw; x++)
+      dp = mb_pixbuf_img_pixel(dest, c->dx, c->dy + y);
+      sp = mb_pixbuf_img_pixel(src,  c->sx, c->sy + y);
+
+      for(x=0; x < c->sw; x++)
 	{
 	  *dp++ = *sp++;
 	  *dp++ = *sp++;
@@ -1679,200 +2640,80 @@ mb_pixbuf_img_copy(MBPixbuf *pb, MBPixbufImage *dest,
 	      sp += src->has_alpha;
 	    }
 	}
-      dp += (dest->width-sw)*dbc;
-      sp += (src->width-sw)*sbc;
+
+      _mb_pixbuf_match_alpha_row(dest, src, 
+				 mb_pixbuf_img_pixel(dest, c->dx, c->dy + y),
+				 c->sw);
+    }
+}
+
+void
+mb_pixbuf_img_copy(MBPixbuf *pb, MBPixbufImage *dest,
+		   MBPixbufImage *src, int sx, int sy, int sw, int sh,
+		   int dx, int dy)
+{
+  CopyBands c;
+
+  if (!mb_pixbuf_img_make_writable(pb, dest)) return;
+
+  c.pb   = pb;
+  c.dest = dest;
+  c.src  = src;
+  c.sx   = sx;
+  c.sy   = sy;
+  c.sw   = sw;
+  c.dx   = dx;
+  c.dy   = dy;
+
+  if (sw <= 0 || sh <= 0) return;
+
+  /* Copying within one image, or between an image and a view of it,
+   * with the areas overlapping: bands would read rows another band is
+   * writing, so keep to the one thread, top down as ever.
+   */
+  if (mb_pixbuf_img_pixel(src, sx, sy) 
+        < mb_pixbuf_img_pixel(dest, dx + sw, dy + sh - 1)
+      && mb_pixbuf_img_pixel(dest, dx, dy) 
+        < mb_pixbuf_img_pixel(src, sx + sw, sy + sh - 1))
+    {
+      _copy_band(&c, 0, sh);
+      return;
     }
+
+  _mb_pixbuf_run_bands(pb, sh, (long)sw * sh, _copy_band, &c);
 }
 
 MBPixbufImage *
 mb_pixbuf_img_scale_down(MBPixbuf *pb, MBPixbufImage *img, 
 			 int new_width, int new_height)
 {
-  MBPixbufImage *img_scaled;
-  unsigned char *dest, *src, *srcy;
-  int *xsample, *ysample;
-  int bytes_per_line, i, x, y,  r, g, b, a, nb_samples, xrange, yrange, rx, ry;
-
   if ( new_width > img->width || new_height > img->height) 
     return NULL;
 
-  if (img->has_alpha)
-    {
-      img_scaled = mb_pixbuf_img_rgba_new(pb, new_width, new_height);
-      bytes_per_line = (img->width * (pb->internal_bytespp+1));
-    }
-  else
-    {
-      img_scaled = mb_pixbuf_img_rgb_new(pb, new_width, new_height);
-      bytes_per_line = (img->width * pb->internal_bytespp);
-    }
-
-  xsample = malloc( (new_width+1) * sizeof(int));
-  ysample = malloc( (new_height+1) * sizeof(int));
-
-  for ( i = 0; i <= new_width; i++ )
-    xsample[i] = i*img->width/new_width;
-  for ( i = 0; i <= new_height; i++ )
-    ysample[i] = i*img->height/new_height * img->width;
-
-  dest = img_scaled->rgba;
-
-  /* scan output image */
-  for ( y = 0; y < new_height; y++ ) 
-    {
-      yrange = ( ysample[y+1] - ysample[y] )/img->width;
-      for ( x = 0; x < new_width; x++) 
-	{
-	  xrange = xsample[x+1] - xsample[x];
-	  srcy = img->rgba + (( ysample[y] + xsample[x] ) 
-			      * ( (img->has_alpha) ?  (pb->internal_bytespp+1) : pb->internal_bytespp ) );
-	  
-      /* average R,G,B,A values on sub-rectangle of source image */
-	  nb_samples = xrange * yrange;
-	  if ( nb_samples > 1 ) 
-	    {
-	      r = 0;
-	      g = 0;
-	      b = 0;
-	      a = 0;
-	      for ( ry = 0; ry < yrange; ry++ ) 
-		{
-		  src = srcy;
-		  for ( rx = 0; rx < xrange; rx++ ) 
-		    {
-		      /* average R,G,B,A values */
-		      if (pb->internal_bytespp == 2)
-			{
-			  unsigned char rr,gg,bb;
-			  internal_16bpp_pixel_to_rgb(src,rr,gg,bb);
-			  r += rr; g += gg; b += bb;
-			  internal_16bpp_pixel_next(src);
-			}
-		      else
-			{
-			  r += *src++;
-			  g += *src++;
-			  b += *src++;
-			}
-		      if (img->has_alpha) a += *src++;
-		    }
-		  srcy += bytes_per_line;
-		}
-
-	      if (pb->internal_bytespp == 2)
-		{
-		  unsigned char rr,gg,bb;
-		  rr = (r/nb_samples);
-		  gg = (g/nb_samples);
-		  bb = (b/nb_samples);
-
-		  internal_rgb_to_16bpp_pixel(rr, gg, bb, dest);
-		  internal_16bpp_pixel_next(dest);
-		}
-	      else
-		{
-		  *dest++ = r/nb_samples;
-		  *dest++ = g/nb_samples;
-		  *dest++ = b/nb_samples;
-		}
-	      if (img_scaled->has_alpha) *dest++ = a/nb_samples; 
-	    }
-	  else 
-	    {
-	      int i;
-	      for (i=0; i<(pb->internal_bytespp + img_scaled->has_alpha); i++)
-		*dest++ = *srcy++;
-	    }
-	}
-    }
-
-  /* cleanup */
-  free( xsample );
-  free( ysample );
-
-  return img_scaled;
+  return mb_pixbuf_img_scale_with_filter(pb, img, new_width, new_height,
+					 MBPIXBUF_FILTER_BOX);
 }
 
 MBPixbufImage *
 mb_pixbuf_img_scale_up(MBPixbuf *pb, MBPixbufImage *img, 
 		       int new_width, int new_height)
 {
-  MBPixbufImage *img_scaled;
-  unsigned char *dest, *src;
-  int x, y, xx, yy, bytes_per_line;
-
   if ( new_width < img->width || new_height < img->height) 
     return NULL;
 
-  if (img->has_alpha)
-    {
-      img_scaled = mb_pixbuf_img_rgba_new(pb, new_width, new_height);
-      bytes_per_line = (img->width * (pb->internal_bytespp+1));
-    }
-  else
-    {
-      img_scaled = mb_pixbuf_img_rgb_new(pb, new_width, new_height);
-      bytes_per_line = (img->width * pb->internal_bytespp);
-    }
-
-
-  dest = img_scaled->rgba;
-  
-  for (y = 0; y < new_height; y++)
-    {
-      yy = (y * img->height) / new_height;
-      for (x = 0; x < new_width; x++)
-      {
-	 xx = (x * img->width) / new_width;
-	 src = img->rgba + ((yy * bytes_per_line)) 
-	   + ( (img->has_alpha) ? (xx * (pb->internal_bytespp+1)) : (xx * pb->internal_bytespp) );
-	 *dest++ = *src++;
-	 *dest++ = *src++;
-	 if (pb->internal_bytespp > 2)
-	   *dest++ = *src++;
-	 
-	 if (img->has_alpha)
-	   *dest++ = *src++;
-      }
-   }
-
-  return img_scaled;
+  return mb_pixbuf_img_scale_with_filter(pb, img, new_width, new_height,
+					 MBPIXBUF_FILTER_NEAREST);
 }
 
 MBPixbufImage *
 mb_pixbuf_img_scale(MBPixbuf *pb, MBPixbufImage *img, 
 		    int new_width, int new_height)
 {
-  if (new_width >= img->width && new_height >= img->height)
-    return mb_pixbuf_img_scale_up(pb, img, new_width, new_height);
-
-  if (new_width <= img->width && new_height <= img->height)
-    return mb_pixbuf_img_scale_down(pb, img, new_width, new_height);
-
-  /* TODO: all scale functions should check for a dimention change
-           being zero and act accordingly - ie faster. 
-  */
-  if (new_width >= img->width && new_height <= img->height)
-    {
-      MBPixbufImage *tmp=NULL, *tmp2 = NULL;
-      tmp = mb_pixbuf_img_scale_up(pb, img, new_width, img->height);
-      
-      tmp2 = mb_pixbuf_img_scale_down(pb, tmp, new_width, new_height);
-      mb_pixbuf_img_free(pb, tmp);
-      return tmp2;
-    }
-
-  if (new_width <= img->width && new_height >= img->height)
-    {
-      MBPixbufImage *tmp, *tmp2;
-      tmp = mb_pixbuf_img_scale_down(pb, img, new_width, img->height);
-      
-      tmp2 = mb_pixbuf_img_scale_up(pb, tmp, new_width, new_height);
-      mb_pixbuf_img_free(pb, tmp);
-      return tmp2;
-    }
-
-  return NULL;
+  /* Box handles each axis on its own, so a mixed scale needs no
+   * intermediate image. mbpixbuf-scale.c
+   */
+  return mb_pixbuf_img_scale_with_filter(pb, img, new_width, new_height,
+					 MBPIXBUF_FILTER_BOX);
 }
 
 void
@@ -1886,6 +2727,102 @@ mb_pixbuf_img_render_to_drawable(MBPixbuf    *pb,
 }
 
 
+void
+_mb_pixbuf_img_write_ximage(MBPixbuf      *pb,
+			    MBPixbufImage *img,
+			    XImage        *ximg)
+{
+  unsigned char *p;
+  unsigned long pixel;
+  int x,y;
+  int a, r, g, b;
+  Bool premul = (img->has_alpha && img->premultiplied);
+  MBPixbufWriteRowFunc writer;
+  MBPixbufRowFormat fmt;
+
+  p = img->rgba;
+
+  writer = _mb_pixbuf_row_writer(pb, img, ximg, &fmt);
+
+  if (writer)
+    {
+      int            sbc = pb->internal_bytespp + img->has_alpha;
+      unsigned char *row = NULL, *d;
+
+      if (premul) row = malloc(img->width * sbc);
+
+      d = (unsigned char *)ximg->data;
+
+      for(y=0; y<img->height; y++)
+	{
+	  if (premul)
+	    {
+	      memcpy(row, p, img->width * sbc);
+	      _mb_convert_alpha_row(row, img->width, sbc, False);
+	      writer(&fmt, d, row, img->width);
+	    }
+	  else
+	    writer(&fmt, d, p, img->width);
+
+	  p += img->rowstride;
+	  d += ximg->bytes_per_line;
+	}
+
+      if (row) free(row);
+    }
+  else if (pb->internal_bytespp == 2)
+    {
+      for(y=0; y<img->height; y++)
+	for(x=0, p = img->rgba + y * img->rowstride; x<img->width; x++)
+	  {
+	    internal_16bpp_pixel_to_rgb(p, r, g, b);
+	    internal_16bpp_pixel_next(p);
+	    a = ((img->has_alpha) ?  *p++ : 0xff);
+
+	    if (premul && a < 255)
+	      {
+		r = _mb_unpremultiply(r, a);
+		g = _mb_unpremultiply(g, a);
+		b = _mb_unpremultiply(b, a);
+	      }
+
+	    if (pb->color_cube)
+	      pixel = _mb_pixbuf_cube_pixel(pb, r, g, b, x, y);
+	    else
+	      pixel = mb_pixbuf_get_pixel(pb, r, g, b, a);
+	    XPutPixel(ximg, x, y, pixel);
+	  }
+    }
+  else
+    {
+      for(y=0; y<img->height; y++)
+	{
+	  p = img->rgba + y * img->rowstride;
+
+	  for(x=0; x<img->width; x++)
+	    {
+	      r = ( *p++ );
+	      g = ( *p++ );
+	      b = ( *p++ );
+	      a = ((img->has_alpha) ?  *p++ : 0xff);
+
+	      if (premul && a < 255)
+		{
+		  r = _mb_unpremultiply(r, a);
+		  g = _mb_unpremultiply(g, a);
+		  b = _mb_unpremultiply(b, a);
+		}
+
+	      if (pb->color_cube)
+		pixel = _mb_pixbuf_cube_pixel(pb, r, g, b, x, y);
+	      else
+		pixel = mb_pixbuf_get_pixel(pb, r, g, b, a);
+	      XPutPixel(ximg, x, y, pixel);
+	    }
+	}
+    }
+}
+
 void
 mb_pixbuf_img_render_to_drawable_with_gc(MBPixbuf    *pb,
 					 MBPixbufImage *img,
@@ -1895,37 +2832,17 @@ mb_pixbuf_img_render_to_drawable_with_gc(MBPixbuf    *pb,
 					 GC gc)
 {
       int bitmap_pad;
-      unsigned char *p;
-      unsigned long pixel;
-      int x,y;
-      int a, r, g, b;
-
-      XShmSegmentInfo shminfo;
+      MBPixbufShmSegment *seg = NULL;
       Bool shm_success = False;
 
+      if (pb->dpy == NULL) return; /* headless */
+
       if (pb->have_shm)
 	{
-	  img->ximg = XShmCreateImage(pb->dpy, pb->vis, pb->depth, 
-				      ZPixmap, NULL, &shminfo,
-				      img->width, img->height );
-	  
-	  shminfo.shmid=shmget(IPC_PRIVATE,
-			       img->ximg->bytes_per_line*img->ximg->height,
-			       IPC_CREAT|0777);
-	  shminfo.shmaddr = img->ximg->data = shmat(shminfo.shmid,0,0);
-
-	  if (img->ximg->data == (char *)-1)
-	    {
-	      fprintf(stderr, "mbpixbuf: SHM can't attach SHM Segment for Shared XImage, falling back to XImages\n");
-	      XDestroyImage(img->ximg);
-	      shmctl(shminfo.shmid, IPC_RMID, 0);
-	    }
-	  else
-	    {
-	      shminfo.readOnly=True;
-	      XShmAttach(pb->dpy, &shminfo);
-	      shm_success = True;
-	    }
+	  img->ximg = _mb_pixbuf_shm_create_image(pb, pb->depth, ZPixmap, 
+						  img->width, img->height,
+						  &seg);
+	  shm_success = (img->ximg != NULL);
 	}
 
       if (!shm_success)
@@ -1939,37 +2856,7 @@ mb_pixbuf_img_render_to_drawable_with_gc(MBPixbuf    *pb,
 	  img->ximg->data = malloc( img->ximg->bytes_per_line*img->height );
 	}
 
-      p = img->rgba;
-
-      if (pb->internal_bytespp == 2)
-	{
-	  for(y=0; y<img->height; y++)
-	    for(x=0; x<img->width; x++)
-	      {
-		internal_16bpp_pixel_to_rgb(p, r, g, b);
-		internal_16bpp_pixel_next(p);
-		a = ((img->has_alpha) ?  *p++ : 0xff);
-
-		pixel = mb_pixbuf_get_pixel(pb, r, g, b, a);
-		XPutPixel(img->ximg, x, y, pixel);
-	      }
-	}
-      else
-	{
-	  for(y=0; y<img->height; y++)
-	    {
-	      for(x=0; x<img->width; x++)
-		{
-		  r = ( *p++ );
-		  g = ( *p++ );
-		  b = ( *p++ );
-		  a = ((img->has_alpha) ?  *p++ : 0xff);
-		  
-		  pixel = mb_pixbuf_get_pixel(pb, r, g, b, a);
-		  XPutPixel(img->ximg, x, y, pixel);
-		}
-	    }
-	}
+      _mb_pixbuf_img_write_ximage(pb, img, img->ximg);
 
       if (!shm_success)
 	{
@@ -1978,16 +2865,7 @@ mb_pixbuf_img_render_to_drawable_with_gc(MBPixbuf    *pb,
 	  XDestroyImage (img->ximg);
 	}
       else
-	{
-	  XShmPutImage(pb->dpy, drw, gc, img->ximg, 0, 0, 
-		       drw_x, drw_y, img->width, img->height, False);
-
-	  XSync(pb->dpy, False);
-	  XShmDetach(pb->dpy, &shminfo);
-	  XDestroyImage (img->ximg);
-	  shmdt(shminfo.shmaddr);
-	  shmctl(shminfo.shmid, IPC_RMID, 0);
-	}
+	_mb_pixbuf_shm_put_image(pb, seg, drw, gc, img->ximg, drw_x, drw_y);
 
       img->ximg = NULL;		/* Safety On */
 }
@@ -2002,38 +2880,20 @@ mb_pixbuf_img_render_to_mask(MBPixbuf    *pb,
       unsigned char *p;
       int x,y;
       GC gc1;
-      XShmSegmentInfo shminfo; 
+      MBPixbufShmSegment *seg = NULL;
       Bool shm_success = False;
 
-      if (!img->has_alpha) return;
+      if (!img->has_alpha || pb->dpy == NULL) return;
 
       gc1 = XCreateGC( pb->dpy, mask, 0, 0 );
       XSetForeground(pb->dpy, gc1, WhitePixel( pb->dpy, pb->scr ));
 
       if (pb->have_shm)
 	{
-	  img->ximg = XShmCreateImage(pb->dpy, pb->vis, 1, 
-				      XYPixmap, NULL, &shminfo,
-				      img->width, img->height );
-
-	  shminfo.shmid=shmget(IPC_PRIVATE,
-			       img->ximg->bytes_per_line*img->ximg->height,
-			       IPC_CREAT|0777);
-	  shminfo.shmaddr=img->ximg->data=shmat(shminfo.shmid,0,0);
-
-	  if (img->ximg->data == (char *)-1)
-	    {
-	      if (mb_want_warnings())
-		fprintf(stderr, "mbpixbuf: SHM can't attach SHM Segment for Shared XImage, falling back to XImages\n");
-	      XDestroyImage(img->ximg);
-	      shmctl(shminfo.shmid, IPC_RMID, 0);
-	    }
-	  else
-	    {
-	      shminfo.readOnly=True;
-	      XShmAttach(pb->dpy, &shminfo);
-	      shm_success = True;
-	    }
+	  img->ximg = _mb_pixbuf_shm_create_image(pb, 1, XYPixmap, 
+						  img->width, img->height,
+						  &seg);
+	  shm_success = (img->ximg != NULL);
 	}
 
       if (!shm_success)
@@ -2044,10 +2904,8 @@ mb_pixbuf_img_render_to_mask(MBPixbuf    *pb,
 	  img->ximg->data = malloc( img->ximg->bytes_per_line*img->height );
 	}
 
-      p = img->rgba;
-
       for(y=0; y<img->height; y++)
-	for(x=0; x<img->width; x++)
+	for(x=0, p = img->rgba + y * img->rowstride; x<img->width; x++)
 	    {
 	      p += pb->internal_bytespp; 
 	      XPutPixel(img->ximg, x, y, (*p < 127) ? 0 : 1);
@@ -2061,15 +2919,7 @@ mb_pixbuf_img_render_to_mask(MBPixbuf    *pb,
 	  XDestroyImage (img->ximg);
 	}
       else
-	{
-	  XShmPutImage(pb->dpy, mask, gc1, img->ximg, 0, 0, 
-		       drw_x, drw_y, img->width, img->height, False);
-	  XSync(pb->dpy, False);
-	  XShmDetach(pb->dpy, &shminfo);
-	  XDestroyImage (img->ximg);
-	  shmdt(shminfo.shmaddr);
-	  shmctl(shminfo.shmid, IPC_RMID, 0);
-	}
+	_mb_pixbuf_shm_put_image(pb, seg, mask, gc1, img->ximg, drw_x, drw_y);
 
       XFreeGC( pb->dpy, gc1 );
       img->ximg = NULL;		/* Safety On */
@@ -2079,6 +2929,10 @@ unsigned char *
 mb_pixbuf_img_data (MBPixbuf      *pixbuf,
 		    MBPixbufImage *image)
 {
+  /* Callers write through this, so it can't hand out shared pixels */
+  if (!mb_pixbuf_img_make_writable(pixbuf, image))
+    return NULL;
+
   return image->rgba;
 }
 
@@ -2099,7 +2953,7 @@ mb_pixbuf_img_get_pixel (MBPixbuf      *pixbuf,
 
   if (pixbuf->internal_bytespp == 2)
     {
-      int offset = ( (y * img->width * idx) + ( x * idx ) );
+      int offset = ( (y * img->rowstride) + ( x * idx ) );
       internal_16bpp_pixel_to_rgb(img->rgba+offset, *r, *g, *b);
 
       if (img->has_alpha)
@@ -2109,15 +2963,22 @@ mb_pixbuf_img_get_pixel (MBPixbuf      *pixbuf,
     }
   else
     {
-      *r = img->rgba[(((y)*img->width*idx)+((x)*idx))];    
-      *g = img->rgba[(((y)*img->width*idx)+((x)*idx))+1];    
-      *b = img->rgba[(((y)*img->width*idx)+((x)*idx))+2]; 
+      *r = img->rgba[(((y)*img->rowstride)+((x)*idx))];    
+      *g = img->rgba[(((y)*img->rowstride)+((x)*idx))+1];    
+      *b = img->rgba[(((y)*img->rowstride)+((x)*idx))+2]; 
       
       if (img->has_alpha)
-	*a = img->rgba[(((y)*img->width*idx)+((x)*idx))+3];
+	*a = img->rgba[(((y)*img->rowstride)+((x)*idx))+3];
       else
 	*a = 255;
     }
+
+  if (img->has_alpha && img->premultiplied)
+    {
+      *r = _mb_unpremultiply(*r, *a);
+      *g = _mb_unpremultiply(*g, *a);
+      *b = _mb_unpremultiply(*b, *a);
+    }
 }
 
 
@@ -2133,18 +2994,30 @@ mb_pixbuf_img_plot_pixel (MBPixbuf      *pb,
   int idx;
   if (x >= img->width || y >= img->height) return;
 
+  if (!mb_pixbuf_img_make_writable(pb, img)) return;
+
   idx = pb->internal_bytespp + img->has_alpha;
 
+  if (img->has_alpha && img->premultiplied)
+    {
+      /* Keep the existing alpha, so premultiply by that */
+      int a = img->rgba[(y*img->rowstride)+(x*idx)+pb->internal_bytespp];
+
+      r = _mb_premultiply(r, a);
+      g = _mb_premultiply(g, a);
+      b = _mb_premultiply(b, a);
+    }
+
   if (pb->internal_bytespp == 2)
     {
-      int offset = (((y)*img->width*idx)+((x)*idx));
+      int offset = (((y)*img->rowstride)+((x)*idx));
       internal_rgb_to_16bpp_pixel(r,g,b, (img->rgba+offset));
     }
   else
     {
-      img->rgba[(((y)*img->width*idx)+((x)*idx))]   = r;    
-      img->rgba[(((y)*img->width*idx)+((x)*idx))+1] = g;    
-      img->rgba[(((y)*img->width*idx)+((x)*idx))+2] = b; 
+      img->rgba[(((y)*img->rowstride)+((x)*idx))]   = r;    
+      img->rgba[(((y)*img->rowstride)+((x)*idx))+1] = g;    
+      img->rgba[(((y)*img->rowstride)+((x)*idx))+2] = b; 
     }
 }
 
@@ -2158,7 +3031,7 @@ mb_pixbuf_img_plot_pixel_with_alpha (MBPixbuf      *pb,
 				     unsigned char  b,
 				     unsigned char  a)
 { 
-  int idx = (((y)*img->width*(pb->internal_bytespp+1))+((x)*(pb->internal_bytespp+1)));   
+  int idx;
 
   if (!img->has_alpha)
     {
@@ -2168,106 +3041,34 @@ mb_pixbuf_img_plot_pixel_with_alpha (MBPixbuf      *pb,
     
   if (x >= img->width || y >= img->height) return;   
 
-  if (pb->internal_bytespp == 2)
-    {
-      unsigned char rr,gg, bb;
-      internal_16bpp_pixel_to_rgb((img->rgba+idx), rr,gg,bb);
+  if (!mb_pixbuf_img_make_writable(pb, img)) return;
 
-      alpha_composite(rr, (r), (a), rr);    
-      alpha_composite(gg, (g), (a), gg);    
-      alpha_composite(bb, (b), (a), bb);    
+  idx = (((y)*img->rowstride)+((x)*(pb->internal_bytespp+1)));   
 
-      internal_rgb_to_16bpp_pixel(rr,gg,bb, (img->rgba+idx));
-    }
-  else
+  if (img->premultiplied)
     {
-      alpha_composite(img->rgba[idx],   (r), (a), img->rgba[idx]);    
-      alpha_composite(img->rgba[idx+1], (g), (a), img->rgba[idx+1]);  
-      alpha_composite(img->rgba[idx+2], (b), (a), img->rgba[idx+2]);  
+      /* Blending is linear so premultiply by the destination alpha,
+       * which is left as-is, and blend as normal.
+       */
+      int da = img->rgba[idx+pb->internal_bytespp];
+
+      r = _mb_premultiply(r, da);
+      g = _mb_premultiply(g, da);
+      b = _mb_premultiply(b, da);
     }
-}
-
-MBPixbufImage *
-mb_pixbuf_img_transform (MBPixbuf          *pb,
-			 MBPixbufImage     *img,
-			 MBPixbufTransform  transform)
-{
-  MBPixbufImage *img_trans;
-  int            new_width = 0, new_height = 0, new_x = 0, new_y = 0, idx;
-  int            bytes_per_line, x, y;
-  int            byte_offset = 0, new_byte_offset = 0;
 
-  switch (transform)
+  if (pb->internal_bytespp == 2)
     {
-    case MBPIXBUF_TRANS_ROTATE_90:
-    case MBPIXBUF_TRANS_ROTATE_270:
-      new_width = mb_pixbuf_img_get_height(img);
-      new_height = mb_pixbuf_img_get_width(img);
-      break;
-    case MBPIXBUF_TRANS_ROTATE_180:
-    case MBPIXBUF_TRANS_FLIP_VERT:
-    case MBPIXBUF_TRANS_FLIP_HORIZ:
-      new_width = mb_pixbuf_img_get_width(img);
-      new_height = mb_pixbuf_img_get_height(img);
+      unsigned short s = SHORT_FROM_2BYTES(img->rgba+idx);
 
-      break;
-    }
+      s = _mb_blend_565(spread_from_rgb(r, g, b), spread_from_565(s), a);
 
-  if (img->has_alpha)
-    {
-      img_trans = mb_pixbuf_img_rgba_new(pb, new_width, new_height);
-      bytes_per_line = (img->width * (pb->internal_bytespp+1));
-      idx = pb->internal_bytespp +1 ;
+      BYTES_FROM_SHORT((img->rgba+idx), s);
     }
   else
     {
-      img_trans = mb_pixbuf_img_rgb_new(pb, new_width, new_height);
-      bytes_per_line = (img->width * pb->internal_bytespp);
-      idx = pb->internal_bytespp;
-    }
-  
-  for( y = 0; y < img->height; y++ ) 
-    {
-      for( x = 0; x < img->width; x++ ) 
-	{
-
-
-	  /* XXX This could all be heavily optimised */
-	  switch (transform)
-	    {
-	    case MBPIXBUF_TRANS_ROTATE_180:
-	      new_x = new_width  - 1 - x;
-	      new_y = new_height - 1 - y;
-	      break;
-	    case MBPIXBUF_TRANS_ROTATE_270:
-	      new_x = y;
-	      new_y = img->width - x - 1;
-	      break;
-	    case MBPIXBUF_TRANS_ROTATE_90:
-	      new_x = img->height - y - 1;
-	      new_y = x;
-	      break;
-	    case MBPIXBUF_TRANS_FLIP_VERT:
-	      new_x = x; new_y = img->height - y - 1;
-	      break;
-	    case MBPIXBUF_TRANS_FLIP_HORIZ:
-	      new_y = y; new_x = img->width - x - 1;
-	      break;
-	    }
-
-	  byte_offset     = (y * bytes_per_line) + ( x * idx );
-	  new_byte_offset = (new_y * (new_width) * idx) + ( new_x * idx );
-
-	  img_trans->rgba[new_byte_offset]   = img->rgba[byte_offset];
-	  img_trans->rgba[new_byte_offset+1] = img->rgba[byte_offset+1];
-
-	  if (pb->internal_bytespp > 2)
-	    img_trans->rgba[new_byte_offset+2] = img->rgba[byte_offset+2];
-
-	  if (img->has_alpha)
-	    img_trans->rgba[new_byte_offset+pb->internal_bytespp] = img->rgba[byte_offset+pb->internal_bytespp];
-	}
+      alpha_composite(img->rgba[idx],   (r), (a), img->rgba[idx]);    
+      alpha_composite(img->rgba[idx+1], (g), (a), img->rgba[idx+1]);  
+      alpha_composite(img->rgba[idx+2], (b), (a), img->rgba[idx+2]);  
     }
-
-  return img_trans;
 }
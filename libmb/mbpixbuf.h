@@ -103,7 +103,13 @@ extern "C" {
  * </pre>
  *
  * Notes: if the enviromental varible 'MBPIXBUF_NO_SHM' is set, the MIT-SHM 
- * extension will not be used.       
+ * extension will not be used. If 'MBPIXBUF_NO_SIMD' is set, the plain C
+ * versions of the compositing routines are used even when the CPU
+ * supports SSE2, AVX2 or NEON. On PseudoColor and StaticColor visuals
+ * colors are looked up in a cube of 2^n entries per channel, n being
+ * 'MBPIXBUF_COLOR_CUBE_BITS' ( 3 to 6, default 5 ), and rendering uses
+ * ordered dithering if 'MBPIXBUF_DITHER' is set. 'MBPIXBUF_IMAGE_CACHE'
+ * turns on the decoded image cache with a budget in kilobytes.
  *
  * @{
  */
@@ -122,6 +128,68 @@ typedef enum
   MBPIXBUF_TRANS_FLIP_HORIZ
 } MBPixbufTransform;
 
+/**
+ * @typedef MBPixbufFilter
+ *
+ * enumerated types for #mb_pixbuf_img_scale_with_filter
+ */
+typedef enum
+{
+  MBPIXBUF_FILTER_NEAREST,	/**< Nearest pixel, fastest  */
+  MBPIXBUF_FILTER_BOX,		/**< Averages when shrinking, as #mb_pixbuf_img_scale */
+  MBPIXBUF_FILTER_BILINEAR	/**< Smooth, interpolates when enlarging */
+} MBPixbufFilter;
+
+/**
+ * @typedef MBPixbufArrow
+ *
+ * Direction an arrow points, for #mb_pixbuf_img_fill_arrow
+ */
+typedef enum
+{
+  MBPIXBUF_ARROW_UP,
+  MBPIXBUF_ARROW_DOWN,
+  MBPIXBUF_ARROW_LEFT,
+  MBPIXBUF_ARROW_RIGHT
+} MBPixbufArrow;
+
+/**
+ * @typedef MBPixbufByteOrder
+ *
+ * Order of the color channels, most significant first, in the pixels of
+ * a pixbuf made with #mb_pixbuf_new_headless
+ */
+typedef enum
+{
+  MBPIXBUF_BYTE_ORDER_RGB,
+  MBPIXBUF_BYTE_ORDER_RBG,
+  MBPIXBUF_BYTE_ORDER_BRG,
+  MBPIXBUF_BYTE_ORDER_BGR,
+  MBPIXBUF_BYTE_ORDER_GRB,
+  MBPIXBUF_BYTE_ORDER_GBR,
+  MBPIXBUF_BYTE_ORDER_ARGB	/**< 32 bit only, alpha in the top byte */
+} MBPixbufByteOrder;
+
+
+typedef struct MBPixbufKernels MBPixbufKernels;
+typedef struct MBPixbufShmSegment MBPixbufShmSegment;
+typedef struct MBPixbufSlab MBPixbufSlab;
+
+/**
+ * @typedef MBPixbufIconCache
+ *
+ * Opaque handle on a mapped on disk icon cache, see
+ * #mb_pixbuf_icon_cache_open
+ */
+typedef struct MBPixbufIconCache MBPixbufIconCache;
+
+/**
+ * @typedef MBPixbufDestroyFunc
+ *
+ * Called to release an image's pixel data when it isn't owned by the
+ * image.
+ */
+typedef void (*MBPixbufDestroyFunc) (unsigned char *data, void *user_data);
 
 typedef struct _mb_pixbuf_col {
   int                 r, g, b;
@@ -146,16 +214,37 @@ typedef struct MBPixbuf
   GC             gc;
   MBPixbufColor *palette;
   Bool           have_shm;
+  int            shm_completion_event;
+  MBPixbufShmSegment *shm_pool;
 
   int            internal_bytespp;
 
+  const MBPixbufKernels *kernels;
+
+  Bool           premultiply;
+
+  unsigned char *color_cube;
+  int            color_cube_bits;
+  unsigned char *dither_table;
+  Bool           dither;
+
+  MBPixbufIconCache *icon_cache;
+
+  int            n_threads;
+
+  MBPixbufSlab  *slab;
+
 } MBPixbuf;
 
 /**
  * @typedef MBPixbufImage
  *
  * Type for representing an mbpixbuf image.
- * Its not recommended you touch this directly. 
+ * Its not recommended you touch this directly. Rows are rowstride
+ * bytes apart, which may be more than width times the pixel size, so
+ * walk rgba a row at a time with rowstride rather than as width times
+ * the pixel size per row. Images must come from the mb_pixbuf_img_*
+ * constructors; #mb_pixbuf_img_free only frees those.
  */
 typedef struct MBPixbufImage 
 {
@@ -167,8 +256,33 @@ typedef struct MBPixbufImage
 
   int            internal_bytespp;
 
+  int            rowstride; /**< bytes from the start of one row to the next */
+
+  int            premultiplied; /**< color is premultiplied by alpha */
+
+  int            refcount;  /**< references, see #mb_pixbuf_img_ref */
+
+  MBPixbufDestroyFunc destroy_fn; /**< frees rgba, if not ours */
+  void          *destroy_data;
+
 } MBPixbufImage;
 
+/**
+ * @typedef MBPixbufImageCacheStats
+ *
+ * Counters for the decoded image cache, see
+ * #mb_pixbuf_image_cache_get_stats
+ */
+typedef struct MBPixbufImageCacheStats
+{
+  unsigned long hits;	   /**< loads served from the cache */
+  unsigned long misses;	   /**< loads that decoded the file */
+  unsigned long evictions; /**< entries dropped to stay in budget */
+  unsigned long entries;   /**< images currently cached */
+  size_t        bytes;	   /**< pixel data currently cached */
+  size_t        budget;	   /**< most pixel data to cache, 0 if off */
+} MBPixbufImageCacheStats;
+
 /* macros */
 
 /**
@@ -177,10 +291,10 @@ typedef struct MBPixbufImage
  * DEPRICIATED. Use #mb_pixbuf_img_plot_pixel instead. 
  */
 #define mb_pixbuf_img_set_pixel(i, x, y, r, g, b) { \
-  (i)->rgba[(((y)*(i)->width*4)+((x)*4))]   = r;    \
-  (i)->rgba[(((y)*(i)->width*4)+((x)*4))+1] = g;    \
-  (i)->rgba[(((y)*(i)->width*4)+((x)*4))+2] = b;    \
-  (i)->rgba[(((y)*(i)->width*4)+((x)*4))+3] = 0;    \
+  (i)->rgba[(((y)*(i)->rowstride)+((x)*4))]   = r;  \
+  (i)->rgba[(((y)*(i)->rowstride)+((x)*4))+1] = g;  \
+  (i)->rgba[(((y)*(i)->rowstride)+((x)*4))+2] = b;  \
+  (i)->rgba[(((y)*(i)->rowstride)+((x)*4))+3] = 0;  \
 }
 
 /**
@@ -189,7 +303,7 @@ typedef struct MBPixbufImage
  * sets a pixels alpha value
  */
 #define mb_pixbuf_img_set_pixel_alpha(i, x, y, a) { \
-  if ((i)->has_alpha) (i)->rgba[(((y)*(i)->width*(i->internal_bytespp+1))+((x)*(i->internal_bytespp+1)))+i->internal_bytespp] = a;    \
+  if ((i)->has_alpha) (i)->rgba[(((y)*(i)->rowstride)+((x)*(i->internal_bytespp+1)))+i->internal_bytespp] = a;    \
 }
 
 
@@ -222,6 +336,13 @@ typedef struct MBPixbufImage
  */
 #define mb_pixbuf_img_has_alpha(image)  (image)->has_alpha
 
+/**
+ * @def mb_pixbuf_img_is_premultiplied
+ *
+ * Returns True if the image color data is premultiplied by its alpha.
+ */
+#define mb_pixbuf_img_is_premultiplied(image)  (image)->premultiplied
+
 /**
  * Constructs a new MBPixbuf instance
  *
@@ -249,6 +370,25 @@ mb_pixbuf_new_extended(Display *dpy,
 		       Visual  *vis,
 		       int      depth);
 
+/**
+ * Constructs a new MBPixbuf instance needing no X display, for loading,
+ * scaling, compositing and transforming images off screen, for instance
+ * on a build server or worker thread. Such a pixbuf can't render to, or
+ * grab from, drawables.
+ *
+ * @param depth TrueColor depth the pixbuf stands for, 15, 16, 24 or 32
+ * @param byte_order channel order of that depth's pixels, only
+ *        #MBPIXBUF_BYTE_ORDER_RGB and #MBPIXBUF_BYTE_ORDER_BGR at 15
+ *        and 16 bits
+ * @param internal_bytespp 2 for 16 bit internal images, 3 for 24 bit,
+ *        or 0 to pick as #mb_pixbuf_new_extended would
+ * @returns a #MBPixbuf object, or NULL if the format isn't supported
+ */
+MBPixbuf *
+mb_pixbuf_new_headless(int               depth,
+		       MBPixbufByteOrder byte_order,
+		       int               internal_bytespp);
+
 /**
  * Destroys a new MBPixbuf instance
  *
@@ -271,6 +411,60 @@ mb_pixbuf_destroy(MBPixbuf *pixbuf);
 unsigned long
 mb_pixbuf_lookup_x_pixel(MBPixbuf *pixbuf, int r, int g, int b, int a);
 
+/**
+ * Sets whether rendering to PseudoColor or StaticColor visuals uses
+ * ordered dithering. Has no effect on other visuals.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param dither True to dither
+ */
+void
+mb_pixbuf_set_dither(MBPixbuf *pixbuf, Bool dither);
+
+/**
+ * Sets whether images subsequently loaded or created by the pixbuf keep
+ * their color premultiplied by alpha. Compositing a premultiplied image
+ * skips a multiply per channel. Images already created are unaffected.
+ * Defaults to False.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param premultiplied True for premultiplied images
+ */
+void
+mb_pixbuf_set_premultiplied_alpha(MBPixbuf *pixbuf, Bool premultiplied);
+
+/**
+ * Sets how many threads fills, copies, compositing, scaling and
+ * transforms on large images are split across, the calling thread
+ * included. 1 keeps everything in the calling thread, 0 uses one per
+ * CPU online. Small images are always done by the calling thread.
+ * Defaults to the MBPIXBUF_THREADS environment variable, or 0.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param n_threads thread count, or 0
+ */
+void
+mb_pixbuf_set_threads(MBPixbuf *pixbuf, int n_threads);
+
+/**
+ * Converts an image's color data to be premultiplied by its alpha.
+ * Does nothing if the image has no alpha or is already premultiplied.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image image to convert
+ */
+void
+mb_pixbuf_img_premultiply(MBPixbuf *pixbuf, MBPixbufImage *image);
+
+/**
+ * Converts a premultiplied image back to straight alpha.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image image to convert
+ */
+void
+mb_pixbuf_img_unpremultiply(MBPixbuf *pixbuf, MBPixbufImage *image);
+
 
 /**
  * DEPRECIATED. Use #mb_pixbuf_img_rgb_new, #mb_pixbuf_img_rgba_new instead. 
@@ -346,7 +540,14 @@ mb_pixbuf_img_new_from_x_drawable (MBPixbuf *pixbuf,
 
 /**
  * Creates an mbpixbuf image from a file on disk.
- * Supports PNG, JPEGS and XPMS. 
+ * Supports PNG, JPEGS and XPMS, recognised by their contents rather
+ * than the filename.
+ *
+ * If the decoded image cache is on ( see
+ * #mb_pixbuf_image_cache_set_budget ) the image returned may be shared
+ * and must not be modified, clone it first. Images found in an icon
+ * cache ( see #mb_pixbuf_set_icon_cache ) are copied when first drawn
+ * on.
  *
  * @param pixbuf mbpixbuf object
  * @param filename full filename of image to be loaded
@@ -356,6 +557,80 @@ MBPixbufImage *
 mb_pixbuf_img_new_from_file (MBPixbuf   *pixbuf,
 			     const char *filename);
 
+/**
+ * Creates an mbpixbuf image from an image file's contents in memory.
+ * The format, PNG, JPEG or XPM, is worked out from the data itself.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param data the image file's bytes
+ * @param len number of bytes
+ * @returns a MBPixbufImage object, NULL on faliure
+ */
+MBPixbufImage *
+mb_pixbuf_img_new_from_memory (MBPixbuf            *pixbuf,
+			       const unsigned char *data,
+			       size_t               len);
+
+/**
+ * Creates an mbpixbuf image from an open file descriptor. A regular
+ * file is mapped and used whole, anything else, such as a pipe or
+ * socket, is read to end of file. The format is worked out from the
+ * data and @fd is not closed.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param fd file descriptor to read the image from
+ * @returns a MBPixbufImage object, NULL on faliure
+ */
+MBPixbufImage *
+mb_pixbuf_img_new_from_fd (MBPixbuf *pixbuf,
+			   int       fd);
+
+/**
+ * Loads a set of image files, decoding them in parallel on a pool of
+ * threads sized to the CPUs online, optionally scaled to a size as
+ * #mb_pixbuf_img_new_from_file_at_size does. Decoding never touches
+ * the display. Much faster than loading one at a time when there are
+ * many, such as a menu full of icons.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param paths full filenames of the images
+ * @param n number of images
+ * @param width width wanted, 0 for each image's own
+ * @param height height wanted, 0 for each image's own
+ * @param results filled in with the n images, NULL for any that failed
+ * @returns the number of images loaded
+ */
+int
+mb_pixbuf_img_load_batch (MBPixbuf        *pixbuf,
+			  const char     **paths,
+			  int              n,
+			  int              width,
+			  int              height,
+			  MBPixbufImage  **results);
+
+/**
+ * Creates an mbpixbuf image from a file on disk, scaled to a given
+ * size while it is decoded. Much cheaper than loading and then scaling
+ * a large image; JPEGs are decoded at 1/2, 1/4 or 1/8 size where that
+ * is still big enough and PNGs and XPMS are scaled a row at a time, so
+ * the full size image is never held in memory.
+ *
+ * Results match #mb_pixbuf_img_scale of the loaded image, except for
+ * JPEGs decoded at reduced size. The same sharing rules as
+ * #mb_pixbuf_img_new_from_file apply.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param filename full filename of image to be loaded
+ * @param width width wanted, 0 for the image's own
+ * @param height height wanted, 0 for the image's own
+ * @returns a MBPixbufImage object, NULL on faliure
+ */
+MBPixbufImage *
+mb_pixbuf_img_new_from_file_at_size (MBPixbuf   *pixbuf,
+				     const char *filename,
+				     int         width,
+				     int         height);
+
 /**
  * Creates an mbpixbuf image from arbituary supplied rgb(a) data
  *
@@ -410,7 +685,79 @@ mb_pixbuf_img_new_from_long_data(MBPixbuf            *pixbuf,
 				 int                  height);
  
 /**
- * Frees up  a mbpixbuf image.
+ * Maps an icon cache file written by mb-icon-cache. The cache must have
+ * been built for the same internal pixel format as @pixbuf uses, and is
+ * refused if any of the directories its images came from has been
+ * modified since.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param filename the cache file
+ * @returns the cache, NULL if missing, out of date or unusable
+ */
+MBPixbufIconCache *
+mb_pixbuf_icon_cache_open (MBPixbuf   *pixbuf,
+			   const char *filename);
+
+/**
+ * Gets an image from an icon cache. The image's data points straight
+ * into the mapped file, drawing on it copies it first as for a shared
+ * clone. It keeps the cache mapped until freed with #mb_pixbuf_img_free.
+ *
+ * @param cache icon cache
+ * @param path the path of the image as given when building the cache
+ * @param width size the image was cached at, 0 for its natural size
+ * @param height size the image was cached at, 0 for its natural size
+ * @returns a MBPixbufImage, NULL if not in the cache
+ */
+MBPixbufImage *
+mb_pixbuf_icon_cache_lookup (MBPixbufIconCache *cache,
+			     const char        *path,
+			     int                width,
+			     int                height);
+
+/**
+ * Releases an icon cache. Images from it stay valid.
+ *
+ * @param cache icon cache
+ */
+void
+mb_pixbuf_icon_cache_close (MBPixbufIconCache *cache);
+
+/**
+ * Makes #mb_pixbuf_img_new_from_file, and
+ * #mb_pixbuf_img_new_from_file_at_size for the sizes it holds, look in
+ * @cache first. NULL stops using a cache.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param cache icon cache, or NULL
+ */
+void
+mb_pixbuf_set_icon_cache (MBPixbuf          *pixbuf,
+			  MBPixbufIconCache *cache);
+
+/**
+ * Decodes image files and writes them, in @pixbuf's internal pixel
+ * format, to an icon cache file. Used by mb-icon-cache.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param filename the cache file to write
+ * @param paths image files to add
+ * @param n_paths number of image files
+ * @param sizes square sizes to cache each image at, 0 for natural size
+ * @param n_sizes number of sizes, if 0 only natural size is cached
+ * @returns True on success
+ */
+Bool
+mb_pixbuf_icon_cache_build (MBPixbuf    *pixbuf,
+			    const char  *filename,
+			    const char **paths,
+			    int          n_paths,
+			    const int   *sizes,
+			    int          n_sizes);
+
+/**
+ * Frees up  a mbpixbuf image. If other references to the image are held
+ * it just drops this one.
  *
  * @param pixbuf mbpixbuf object
  * @param image image to free
@@ -419,6 +766,46 @@ void
 mb_pixbuf_img_free (MBPixbuf      *pixbuf,
 		    MBPixbufImage *image);
 
+/**
+ * Takes a reference to an image. Each reference is released with
+ * #mb_pixbuf_img_free.
+ *
+ * @param image mbpixbuf image
+ * @returns the image
+ */
+MBPixbufImage *
+mb_pixbuf_img_ref (MBPixbufImage *image);
+
+/**
+ * Sets the most pixel data, in bytes, the process wide cache of
+ * decoded images may hold. Once over budget the least recently used
+ * images are dropped. 0, the default unless 'MBPIXBUF_IMAGE_CACHE'
+ * gives a size in kilobytes, turns the cache off.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param bytes the budget
+ */
+void
+mb_pixbuf_image_cache_set_budget (MBPixbuf *pixbuf,
+				  size_t    bytes);
+
+/**
+ * Drops every image in the decoded image cache. Images still held by
+ * callers stay valid.
+ *
+ * @param pixbuf mbpixbuf object
+ */
+void
+mb_pixbuf_image_cache_flush (MBPixbuf *pixbuf);
+
+/**
+ * Gets the decoded image cache's counters.
+ *
+ * @param stats filled in with the current counters
+ */
+void
+mb_pixbuf_image_cache_get_stats (MBPixbufImageCacheStats *stats);
+
 /**
  * Renders a mbpixbuf image to an X Drawable. 
  *
@@ -470,7 +857,8 @@ void mb_pixbuf_img_render_to_mask (MBPixbuf      *pixbuf,
 				   int            mask_y);
 
 /**
- * Clones a exisiting mbpixbuf image
+ * Clones a exisiting mbpixbuf image. The clone shares the pixels with
+ * @image until either is drawn on, which copies them first.
  *
  * @param pixbuf mbpixbuf object
  * @param image image to clone
@@ -479,6 +867,64 @@ void mb_pixbuf_img_render_to_mask (MBPixbuf      *pixbuf,
 MBPixbufImage *mb_pixbuf_img_clone (MBPixbuf      *pixbuf,
 				    MBPixbufImage *image);
 
+/**
+ * Makes sure an image's pixels are its own to write to, copying them
+ * if they are shared with a clone or read only. mbpixbuf drawing calls
+ * do this themselves; call it before writing to the pixels directly,
+ * say with #mb_pixbuf_img_set_pixel. It may change the image's rgba
+ * and rowstride.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image image to write to
+ * @returns False if the copy couldn't be allocated
+ */
+Bool mb_pixbuf_img_make_writable (MBPixbuf      *pixbuf,
+				  MBPixbufImage *image);
+
+/**
+ * Makes an image of a rectangle of another image's pixels, without
+ * copying them. Drawing on either shows through to the other. The view
+ * holds a reference on @parent, so it may be freed first.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param parent image to view
+ * @param x X co-ord of the rectangle in @parent
+ * @param y Y co-ord of the rectangle in @parent
+ * @param width width of the rectangle
+ * @param height height of the rectangle
+ * @returns a new image, or NULL if the rectangle isn't inside @parent
+ */
+MBPixbufImage *mb_pixbuf_img_new_view (MBPixbuf      *pixbuf,
+				       MBPixbufImage *parent,
+				       int            x,
+				       int            y,
+				       int            width,
+				       int            height);
+
+/**
+ * Makes an image of pixel data already in the pixbuf's internal
+ * format, such as a buffer shared with another toolkit, without copying
+ * it.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param data pixel data, in the internal format
+ * @param width width of the image
+ * @param height height of the image
+ * @param rowstride bytes between rows, 0 if they are packed
+ * @param has_alpha True if the data has an alpha byte per pixel
+ * @param destroy_fn called with @data, and NULL user data, when the
+ *        image is freed. NULL to leave @data to the caller, who must
+ *        keep it until then.
+ * @returns a new image, or NULL if @rowstride is too small
+ */
+MBPixbufImage *mb_pixbuf_img_new_wrap (MBPixbuf            *pixbuf,
+				       unsigned char       *data,
+				       int                  width,
+				       int                  height,
+				       int                  rowstride,
+				       int                  has_alpha,
+				       MBPixbufDestroyFunc  destroy_fn);
+
 /**
  * Fills an image with specified color / alpha level. 
  *
@@ -520,7 +966,8 @@ mb_pixbuf_img_plot_pixel (MBPixbuf      *pixbuf,
 
 
 /**
- * Gets the component values for a specified pixel
+ * Gets the component values for a specified pixel. Color values of a
+ * premultiplied image are returned unpremultiplied.
  *
  * @param pixbuf mbpixbuf object
  * @param image destination image
@@ -543,11 +990,13 @@ mb_pixbuf_img_get_pixel (MBPixbuf      *pixbuf,
 			 );
 
 /**
- * Gets rgb(a) internal data representation of an image
+ * Gets rgb(a) internal data representation of an image, first making
+ * the image writable as #mb_pixbuf_img_make_writable does.
  *
  * @param pixbuf mbpixbuf object
  * @param image destination image
- * @returns rgb(a) data 
+ * @returns rgb(a) data, or NULL if a copy of shared pixels couldn't be
+ *          allocated
  */
 unsigned char *
 mb_pixbuf_img_data (MBPixbuf      *pixbuf,
@@ -577,6 +1026,142 @@ mb_pixbuf_img_plot_pixel_with_alpha (MBPixbuf      *pixbuf,
 				     unsigned char  b,
 				     unsigned char  a);
 
+/**
+ * Fills a rectangle of an image with specified color / alpha level, as
+ * #mb_pixbuf_img_fill does the whole image. The rectangle is clipped
+ * to the image. Much faster than plotting each pixel.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image destination image
+ * @param x X co-ord of the rectangle
+ * @param y Y co-ord of the rectangle
+ * @param w width of the rectangle
+ * @param h height of the rectangle
+ * @param r red component of color
+ * @param g green component of color
+ * @param b blue component of color
+ * @param a alpha component
+ */
+void
+mb_pixbuf_img_fill_rect (MBPixbuf      *pixbuf,
+			 MBPixbufImage *image,
+			 int            x,
+			 int            y,
+			 int            w,
+			 int            h,
+			 int            r,
+			 int            g,
+			 int            b,
+			 int            a);
+
+/**
+ * Draws a horizontal line @len pixels long, starting at @x,@y and
+ * going right. See #mb_pixbuf_img_fill_rect.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image destination image
+ * @param x X co-ord of the line start
+ * @param y Y co-ord of the line
+ * @param len length of the line in pixels
+ * @param r red component of color
+ * @param g green component of color
+ * @param b blue component of color
+ * @param a alpha component
+ */
+void
+mb_pixbuf_img_hline (MBPixbuf      *pixbuf,
+		     MBPixbufImage *image,
+		     int            x,
+		     int            y,
+		     int            len,
+		     int            r,
+		     int            g,
+		     int            b,
+		     int            a);
+
+/**
+ * Draws a vertical line @len pixels long, starting at @x,@y and going
+ * down. See #mb_pixbuf_img_fill_rect.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image destination image
+ * @param x X co-ord of the line
+ * @param y Y co-ord of the line start
+ * @param len length of the line in pixels
+ * @param r red component of color
+ * @param g green component of color
+ * @param b blue component of color
+ * @param a alpha component
+ */
+void
+mb_pixbuf_img_vline (MBPixbuf      *pixbuf,
+		     MBPixbufImage *image,
+		     int            x,
+		     int            y,
+		     int            len,
+		     int            r,
+		     int            g,
+		     int            b,
+		     int            a);
+
+/**
+ * Blends a solid color over a rectangle of an image at alpha level @a,
+ * as #mb_pixbuf_img_plot_pixel_with_alpha does a pixel. The image's
+ * own alpha channel is left as-is. Unlike plotting, images without an
+ * alpha channel are blended too. The rectangle is clipped to the image.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image destination image
+ * @param x X co-ord of the rectangle
+ * @param y Y co-ord of the rectangle
+ * @param w width of the rectangle
+ * @param h height of the rectangle
+ * @param r red component of color
+ * @param g green component of color
+ * @param b blue component of color
+ * @param a alpha level to blend at, 0 for none, 255 for opaque
+ */
+void
+mb_pixbuf_img_blend_rect (MBPixbuf      *pixbuf,
+			  MBPixbufImage *image,
+			  int            x,
+			  int            y,
+			  int            w,
+			  int            h,
+			  int            r,
+			  int            g,
+			  int            b,
+			  int            a);
+
+/**
+ * Fills a triangular arrow pointing in direction @dir, such as a menu's
+ * submenu arrow. The arrow's base is @size pixels long and it is
+ * (@size + 1) / 2 deep, with the box holding it at @x,@y. Odd sizes
+ * give a one pixel tip.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image destination image
+ * @param x X co-ord of the box holding the arrow
+ * @param y Y co-ord of the box holding the arrow
+ * @param size length of the arrow's base in pixels
+ * @param dir direction the arrow points
+ * @param r red component of color
+ * @param g green component of color
+ * @param b blue component of color
+ * @param a alpha component
+ */
+void
+mb_pixbuf_img_fill_arrow (MBPixbuf      *pixbuf,
+			  MBPixbufImage *image,
+			  int            x,
+			  int            y,
+			  int            size,
+			  MBPixbufArrow  dir,
+			  int            r,
+			  int            g,
+			  int            b,
+			  int            a);
+
 /**
  * Copys an specified area of an image to another. 
  * No Alpha composition is performed. 
@@ -658,7 +1243,8 @@ void mb_pixbuf_img_composite (MBPixbuf      *pb,
 			      int            dy);
 
 /**
- * Scales an image arbitually. 
+ * Scales an image arbitually. Each axis is averaged when shrinking and
+ * uses the nearest pixel when enlarging.
  *
  * @param pixbuf mbpixbuf object
  * @param image mbpixbuf image to scale
@@ -683,6 +1269,65 @@ MBPixbufImage *mb_pixbuf_img_scale_up (MBPixbuf      *pixbuf,
 				       int            new_width,
 				       int            new_height);
 
+/**
+ * Scales an image with a choice of filter. Enlarging one axis while
+ * shrinking the other is done in a single pass.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image mbpixbuf image to scale
+ * @param new_width new image width
+ * @param new_height new image height
+ * @param filter the #MBPixbufFilter to use
+ * @returns a new scaled image, NULL on failure
+ */
+MBPixbufImage *mb_pixbuf_img_scale_with_filter (MBPixbuf       *pixbuf,
+						MBPixbufImage  *image,
+						int             new_width,
+						int             new_height,
+						MBPixbufFilter  filter);
+
+/**
+ * Scales an image, as #mb_pixbuf_img_scale, straight into an area of
+ * another image. Nothing is allocated for images of a usual icon size.
+ * The area is clipped to the destination.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param src  source image
+ * @param dest destination image
+ * @param dx   destination image X co-ord. 
+ * @param dy   destination image Y co-ord. 
+ * @param dw   width to scale the source to.
+ * @param dh   height to scale the source to.
+ */
+void mb_pixbuf_img_scale_into (MBPixbuf      *pixbuf,
+			       MBPixbufImage *src,
+			       MBPixbufImage *dest,
+			       int            dx,
+			       int            dy,
+			       int            dw,
+			       int            dh);
+
+/**
+ * As #mb_pixbuf_img_scale_into, but alpha composites the scaled image
+ * like #mb_pixbuf_img_copy_composite. Saves scaling into a temporary
+ * image first.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param src  source image
+ * @param dest destination image
+ * @param dx   destination image X co-ord. 
+ * @param dy   destination image Y co-ord. 
+ * @param dw   width to scale the source to.
+ * @param dh   height to scale the source to.
+ */
+void mb_pixbuf_img_scale_composite (MBPixbuf      *pixbuf,
+				    MBPixbufImage *src,
+				    MBPixbufImage *dest,
+				    int            dx,
+				    int            dy,
+				    int            dw,
+				    int            dh);
+
 /**
  * Performs a basic transform on an image. 
  *
@@ -696,6 +1341,21 @@ mb_pixbuf_img_transform (MBPixbuf          *pixbuf,
 			 MBPixbufImage     *image,
 			 MBPixbufTransform  transform);
 
+/**
+ * Performs a flip or a 180 degree rotation on an image in place,
+ * without allocating. Rotations by 90 and 270 degrees change the
+ * image's shape so need #mb_pixbuf_img_transform.
+ *
+ * @param pixbuf mbpixbuf object
+ * @param image mbpixbuf image to transform
+ * @param transform the type of transform to perform
+ * @returns True if done, False for rotations by 90 or 270 degrees
+ */
+Bool
+mb_pixbuf_img_transform_in_place (MBPixbuf          *pixbuf,
+				  MBPixbufImage     *image,
+				  MBPixbufTransform  transform);
+
 
 /** @} */
 
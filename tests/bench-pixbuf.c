@@ -0,0 +1,300 @@
+/*
+ * bench-pixbuf - times the pixbuf operations and prints their
+ * throughput in megapixels a second as JSON.
+ *
+ * Runs on a headless pixbuf, so needs no X server, once with 24 bit
+ * and once with 16 bit internal images. Each case is repeated for at
+ * least the given number of seconds, 0.2 by default:
+ *
+ *   bench-pixbuf [seconds]
+ *
+ * Rendering is timed as the conversion into a 32 bit XImage in memory,
+ * the part of mb_pixbuf_img_render_to_drawable libmb does itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libmb/mb.h>
+#include <libmb/mbpixbuf-private.h>
+
+typedef struct Bench
+{
+  MBPixbuf      *pb;
+  MBPixbufImage *src;		/* random, with alpha */
+  MBPixbufImage *dest;		/* random, without */
+  unsigned char *data;		/* the 8 bit rgba src was made from */
+  XImage        *ximg;
+  int            width, height;
+} Bench;
+
+typedef long (*BenchFunc) (Bench *b);
+
+static long
+bench_fill(Bench *b)
+{
+  mb_pixbuf_img_fill(b->pb, b->dest, 0x12, 0x34, 0x56, 0xff);
+  return (long)b->width * b->height;
+}
+
+static long
+bench_copy(Bench *b)
+{
+  mb_pixbuf_img_copy(b->pb, b->dest, b->src, 0, 0,
+		     b->width, b->height, 0, 0);
+  return (long)b->width * b->height;
+}
+
+static long
+bench_composite(Bench *b)
+{
+  mb_pixbuf_img_composite(b->pb, b->dest, b->src, 0, 0);
+  return (long)b->width * b->height;
+}
+
+static long
+bench_composite_with_alpha(Bench *b)
+{
+  mb_pixbuf_img_copy_composite_with_alpha(b->pb, b->dest, b->src, 0, 0,
+					  b->width, b->height, 0, 0, -64);
+  return (long)b->width * b->height;
+}
+
+/* Scales count the larger of the source and result */
+
+static long
+bench_scale_up(Bench *b)
+{
+  MBPixbufImage *img;
+
+  img = mb_pixbuf_img_scale(b->pb, b->src, b->width * 2, b->height * 2);
+  mb_pixbuf_img_free(b->pb, img);
+
+  return (long)b->width * b->height * 4;
+}
+
+static long
+bench_scale_down(Bench *b)
+{
+  MBPixbufImage *img;
+
+  img = mb_pixbuf_img_scale(b->pb, b->src, b->width / 3, b->height / 3);
+  mb_pixbuf_img_free(b->pb, img);
+
+  return (long)b->width * b->height;
+}
+
+static long
+bench_transform(Bench *b, MBPixbufTransform t)
+{
+  MBPixbufImage *img;
+
+  img = mb_pixbuf_img_transform(b->pb, b->src, t);
+  mb_pixbuf_img_free(b->pb, img);
+
+  return (long)b->width * b->height;
+}
+
+static long
+bench_rotate_90(Bench *b)
+{
+  return bench_transform(b, MBPIXBUF_TRANS_ROTATE_90);
+}
+
+static long
+bench_rotate_180(Bench *b)
+{
+  return bench_transform(b, MBPIXBUF_TRANS_ROTATE_180);
+}
+
+static long
+bench_rotate_270(Bench *b)
+{
+  return bench_transform(b, MBPIXBUF_TRANS_ROTATE_270);
+}
+
+static long
+bench_flip_vert(Bench *b)
+{
+  return bench_transform(b, MBPIXBUF_TRANS_FLIP_VERT);
+}
+
+static long
+bench_flip_horiz(Bench *b)
+{
+  return bench_transform(b, MBPIXBUF_TRANS_FLIP_HORIZ);
+}
+
+static long
+bench_new_from_data(Bench *b)
+{
+  MBPixbufImage *img;
+
+  img = mb_pixbuf_img_new_from_data(b->pb, b->data,
+				    b->width, b->height, True);
+  mb_pixbuf_img_free(b->pb, img);
+
+  return (long)b->width * b->height;
+}
+
+static long
+bench_render(Bench *b)
+{
+  _mb_pixbuf_img_write_ximage(b->pb, b->dest, b->ximg);
+  return (long)b->width * b->height;
+}
+
+static const struct
+{
+  const char *name;
+  BenchFunc   func;
+}
+benches[] = {
+  { "fill",                 bench_fill },
+  { "copy",                 bench_copy },
+  { "composite",            bench_composite },
+  { "composite_with_alpha", bench_composite_with_alpha },
+  { "scale_up",             bench_scale_up },
+  { "scale_down",           bench_scale_down },
+  { "rotate_90",            bench_rotate_90 },
+  { "rotate_180",           bench_rotate_180 },
+  { "rotate_270",           bench_rotate_270 },
+  { "flip_vert",            bench_flip_vert },
+  { "flip_horiz",           bench_flip_horiz },
+  { "new_from_data",        bench_new_from_data },
+  { "render",               bench_render },
+};
+
+static const int sizes[][2] = { { 48, 48 }, { 256, 256 }, { 1024, 768 },
+				{ 1920, 1080 } };
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_setup(Bench *b, MBPixbuf *pb, int width, int height)
+{
+  unsigned char *rgb;
+  int            i;
+
+  b->pb     = pb;
+  b->width  = width;
+  b->height = height;
+
+  b->data = malloc(width * height * 4);
+  rgb     = malloc(width * height * 3);
+
+  for (i = 0; i < width * height * 4; i++)
+    b->data[i] = rand();
+
+  for (i = 0; i < width * height * 3; i++)
+    rgb[i] = rand();
+
+  b->src  = mb_pixbuf_img_new_from_data(pb, b->data, width, height, True);
+  b->dest = mb_pixbuf_img_new_from_data(pb, rgb, width, height, False);
+
+  free(rgb);
+
+  b->ximg = calloc(1, sizeof(XImage));
+
+  b->ximg->width            = width;
+  b->ximg->height           = height;
+  b->ximg->format           = ZPixmap;
+  b->ximg->byte_order       = LSBFirst;
+  b->ximg->bitmap_unit      = 32;
+  b->ximg->bitmap_bit_order = LSBFirst;
+  b->ximg->bitmap_pad       = 32;
+  b->ximg->depth            = pb->depth;
+  b->ximg->bits_per_pixel   = 32;
+  b->ximg->bytes_per_line   = width * 4;
+  b->ximg->red_mask         = pb->vis->red_mask;
+  b->ximg->green_mask       = pb->vis->green_mask;
+  b->ximg->blue_mask        = pb->vis->blue_mask;
+  b->ximg->data             = malloc(width * height * 4);
+
+  XInitImage(b->ximg);
+}
+
+static void
+bench_teardown(Bench *b)
+{
+  mb_pixbuf_img_free(b->pb, b->src);
+  mb_pixbuf_img_free(b->pb, b->dest);
+  free(b->data);
+  free(b->ximg->data);
+  free(b->ximg);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const int formats[] = { 3, 2 };
+  double    min_time = 0.2, start, elapsed;
+  MBPixbuf *pb;
+  Bench     b;
+  long      pixels, iterations;
+  int       f, s, i, first = 1;
+
+  if (argc > 1)
+    min_time = atof(argv[1]);
+
+  srand(1);
+
+  printf("{\n  \"results\": [");
+
+  for (f = 0; f < sizeof(formats)/sizeof(formats[0]); f++)
+    {
+      pb = mb_pixbuf_new_headless(32, MBPIXBUF_BYTE_ORDER_ARGB, formats[f]);
+
+      if (pb == NULL)
+	{
+	  fprintf(stderr, "bench-pixbuf: can't make a headless pixbuf\n");
+	  return 1;
+	}
+
+      for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+	  bench_setup(&b, pb, sizes[s][0], sizes[s][1]);
+
+	  for (i = 0; i < sizeof(benches)/sizeof(benches[0]); i++)
+	    {
+	      pixels     = 0;
+	      iterations = 0;
+	      start      = now();
+
+	      do
+		{
+		  pixels += benches[i].func(&b);
+		  iterations++;
+		  elapsed = now() - start;
+		}
+	      while (elapsed < min_time);
+
+	      printf("%s\n    { \"op\": \"%s\", \"format\": \"%s\", "
+		     "\"kernels\": \"%s\", \"width\": %d, \"height\": %d, "
+		     "\"iterations\": %ld, \"mpixels_per_sec\": %.2f }",
+		     first ? "" : ",",
+		     benches[i].name, (formats[f] == 3) ? "rgb888" : "rgb565",
+		     pb->kernels->name, b.width, b.height,
+		     iterations, pixels / elapsed / 1e6);
+	      first = 0;
+	      fflush(stdout);
+	    }
+
+	  bench_teardown(&b);
+	}
+
+      mb_pixbuf_destroy(pb);
+    }
+
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
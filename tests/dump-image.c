@@ -3,14 +3,16 @@
 
 void dump(MBPixbufImage *image, const char* symbol)
 {
-  int i;
+  int i, y;
   printf("/* Image data generated by dump-image */\n");
   printf("#define %s_WIDTH %d\n", symbol, mb_pixbuf_img_get_width(image));
   printf("#define %s_HEIGHT %d\n", symbol, mb_pixbuf_img_get_height(image));
   printf("#define %s_HASALPHA %d\n", symbol, mb_pixbuf_img_has_alpha(image));
   printf("unsigned char %s[] = {\n", symbol);
-  for (i = 0; i < (image->width * image->height * (3 + image->has_alpha)); ++i) {
-    printf("0x%X, ", image->rgba[i]);
+  for (y = 0; y < image->height; ++y) {
+    for (i = 0; i < (image->width * (3 + image->has_alpha)); ++i) {
+      printf("0x%X, ", image->rgba[y * image->rowstride + i]);
+    }
   }
   printf("};\n");
 }
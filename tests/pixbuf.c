@@ -11,8 +11,10 @@
 #include <check.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libmb/mbconfig.h>
 #include <libmb/mb.h>
+#include <libmb/mbpixbuf-private.h>
 
 /**
  * Contains the in-memory representation of oh.png, to verify the PNG loader
@@ -30,12 +32,16 @@ MBPixbufImage *OHImg;
 static void dump_image(MBPixbufImage *img)
 {
   FILE *f;
-  int i;
+  unsigned char *row;
+  int i, y;
   f = fopen("dump.raw", "wb");
-  for (i = 0; i < (img->width * img->height * (3 + img->has_alpha)); i=i+4) {
-    fputc(img->rgba[i], f);
-    fputc(img->rgba[i+1], f);
-    fputc(img->rgba[i+2], f);
+  for (y = 0; y < img->height; y++) {
+    row = img->rgba + y * img->rowstride;
+    for (i = 0; i < (img->width * (3 + img->has_alpha)); i=i+4) {
+      fputc(row[i], f);
+      fputc(row[i+1], f);
+      fputc(row[i+2], f);
+    }
   }
   fclose(f);
 }
@@ -86,17 +92,20 @@ compare_with_pixel(MBPixbufImage *img,
   return 1;
 }
 
+/* @data has the same row stride as @img */
 static int 
 compare_with_array(MBPixbufImage *img, 
 		   unsigned char *data)
 {
-  int i;
+  int y, len;
   if (img == NULL || data == NULL) return 0;
 
-  for (i = 0; 
-       i < (img->width*img->height*(pb->internal_bytespp + img->has_alpha)); 
-       ++i)
-    if (img->rgba[i] != data[i]) return 0;
+  len = img->width * (pb->internal_bytespp + img->has_alpha);
+
+  for (y = 0; y < img->height; ++y)
+    if (memcmp(img->rgba + y * img->rowstride, 
+	       data + y * img->rowstride, len)) 
+      return 0;
 
   return 1;
 }
@@ -105,15 +114,17 @@ static int
 compare_with_image (MBPixbufImage *a, 
 		    MBPixbufImage *b)
 {
-  int i;
+  int y, len;
   if (a == NULL || b == NULL) return 0;
   if (a->width != b->width || a->height != b->height 
       || a->has_alpha != b->has_alpha) return 0;
-  for (i = 0; 
-       i < (a->width * a->height * (pb->internal_bytespp + a->has_alpha)); 
-       ++i)
+
+  len = a->width * (pb->internal_bytespp + a->has_alpha);
+
+  for (y = 0; y < a->height; ++y)
     { 
-      if (a->rgba[i] != b->rgba[i]) 
+      if (memcmp(a->rgba + y * a->rowstride, 
+		 b->rgba + y * b->rowstride, len)) 
 	{
 	  return 0;
 	}
@@ -123,6 +134,538 @@ compare_with_image (MBPixbufImage *a,
 }
 
 
+/**
+ * Builds an image filled with random data, with plenty of fully
+ * transparent and fully opaque pixels.
+ */
+static MBPixbufImage *
+random_image(int width, int height, Bool has_alpha)
+{
+  MBPixbufImage *img;
+  unsigned char *data, *p;
+  int i, bpp = has_alpha ? 4 : 3;
+
+  data = malloc(width * height * bpp);
+  for (i = 0, p = data; i < width * height; i++, p += bpp)
+    {
+      p[0] = rand(); p[1] = rand(); p[2] = rand();
+      if (has_alpha)
+	{
+	  switch (rand() % 4) {
+	  case 0:  p[3] = 0;      break;
+	  case 1:  p[3] = 255;    break;
+	  default: p[3] = rand(); break;
+	  }
+	}
+    }
+
+  img = mb_pixbuf_img_new_from_data(pb, data, width, height, has_alpha);
+  free(data);
+  return img;
+}
+
+static unsigned char
+blend_channel(int fg, int bg, int a)
+{
+  int t = fg * a + bg * (255 - a) + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+/**
+ * Pixel at a time reference for mb_pixbuf_img_copy_composite_with_alpha
+ * and mb_pixbuf_img_composite.
+ */
+static void
+composite_reference(MBPixbufImage *dest, 
+		    MBPixbufImage *src, 
+		    int            dx, 
+		    int            dy, 
+		    int            alpha_level,
+		    Bool           write_alpha)
+{
+  int x, y, a;
+  unsigned char sr, sg, sb, sa, dr, dg, db, da;
+
+  for (y = 0; y < src->height; y++)
+    for (x = 0; x < src->width; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, src, x, y, &sr, &sg, &sb, &sa);
+	mb_pixbuf_img_get_pixel (pb, dest, dx + x, dy + y, &dr, &dg, &db, &da);
+
+	a = sa + alpha_level;
+	if (a < 0) a = 0;
+	if (a > 255) a = 255;
+
+	mb_pixbuf_img_plot_pixel (pb, dest, dx + x, dy + y,
+				  blend_channel(sr, dr, a),
+				  blend_channel(sg, dg, a),
+				  blend_channel(sb, db, a));
+	if (write_alpha)
+	  mb_pixbuf_img_set_pixel_alpha(dest, dx + x, dy + y, a);
+      }
+}
+
+/**
+ * Test the compositors ( which may be SIMD versions ) against the plain
+ * reference above for widths that exercise the vector and tail loops.
+ */
+START_TEST (pixbuf_composite_reference)
+{
+  static const int levels[] = { 0, 100, -100, 300 };
+  MBPixbufImage *src, *dest, *expected;
+  int w, l, dest_alpha;
+
+  srand(42);
+
+  for (w = 1; w <= 37; w += 3)
+    for (l = 0; l < sizeof(levels)/sizeof(levels[0]); l++)
+      for (dest_alpha = 0; dest_alpha <= 1; dest_alpha++)
+	{
+	  src  = random_image(w, 3, True);
+	  dest = random_image(w + 2, 5, dest_alpha);
+
+	  expected = mb_pixbuf_img_clone (pb, dest);
+	  composite_reference(expected, src, 1, 2, levels[l], True);
+	  mb_pixbuf_img_copy_composite_with_alpha (pb, dest, src, 0, 0, 
+						   w, 3, 1, 2, levels[l]);
+	  fail_unless (compare_with_image (dest, expected), 
+		       "copy_composite_with_alpha differs from reference");
+	  mb_pixbuf_img_free (pb, expected);
+
+	  if (levels[l] == 0)
+	    {
+	      expected = mb_pixbuf_img_clone (pb, dest);
+	      composite_reference(expected, src, 2, 1, 0, False);
+	      mb_pixbuf_img_composite (pb, dest, src, 2, 1);
+	      fail_unless (compare_with_image (dest, expected), 
+			   "composite differs from reference");
+	      mb_pixbuf_img_free (pb, expected);
+	    }
+
+	  mb_pixbuf_img_free (pb, src);
+	  mb_pixbuf_img_free (pb, dest);
+	}
+}
+END_TEST
+
+/**
+ * Test box filtered scaling down against a pixel at a time reference.
+ */
+START_TEST (pixbuf_scale_down_reference)
+{
+  MBPixbufImage *src, *img, *expected;
+  int has_alpha, x, y, sx, sy, x0, x1, y0, y1, n, sum[4];
+  unsigned char r, g, b, a;
+
+  srand(7);
+
+  for (has_alpha = 0; has_alpha <= 1; has_alpha++)
+    {
+      src = random_image(37, 23, has_alpha);
+      img = mb_pixbuf_img_scale_down (pb, src, 10, 7);
+      fail_unless (img != NULL, NULL);
+
+      if (has_alpha)
+	expected = mb_pixbuf_img_rgba_new (pb, 10, 7);
+      else
+	expected = mb_pixbuf_img_rgb_new (pb, 10, 7);
+
+      for (y = 0; y < 7; y++)
+	for (x = 0; x < 10; x++)
+	  {
+	    x0 = x * 37 / 10; x1 = (x + 1) * 37 / 10;
+	    y0 = y * 23 / 7;  y1 = (y + 1) * 23 / 7;
+	    n  = (x1 - x0) * (y1 - y0);
+	    memset(sum, 0, sizeof(sum));
+
+	    for (sy = y0; sy < y1; sy++)
+	      for (sx = x0; sx < x1; sx++)
+		{
+		  mb_pixbuf_img_get_pixel (pb, src, sx, sy, &r, &g, &b, &a);
+		  sum[0] += r; sum[1] += g; sum[2] += b; sum[3] += a;
+		}
+
+	    mb_pixbuf_img_plot_pixel (pb, expected, x, y, 
+				      sum[0] / n, sum[1] / n, sum[2] / n);
+	    mb_pixbuf_img_set_pixel_alpha(expected, x, y, sum[3] / n);
+	  }
+
+      fail_unless (compare_with_image (img, expected), NULL);
+
+      mb_pixbuf_img_free (pb, src);
+      mb_pixbuf_img_free (pb, img);
+      mb_pixbuf_img_free (pb, expected);
+    }
+}
+END_TEST
+
+/**
+ * Scaling up one axis and down the other should match doing each in
+ * turn, and the bilinear filter should keep flat areas flat and ramp
+ * between neighbouring pixels.
+ */
+START_TEST (pixbuf_scale_filters)
+{
+  static const int sizes[][2] = { { 97, 2 }, { 5, 40 }, { 41, 3 }, { 1, 1 } };
+  MBPixbufImage *src, *img, *tmp, *expected;
+  unsigned char r, g, b, a, last, white;
+  int i, x;
+
+  srand(3);
+  src = random_image(13, 29, True);
+
+  img      = mb_pixbuf_img_scale (pb, src, 31, 11);
+  tmp      = mb_pixbuf_img_scale_up (pb, src, 31, 29);
+  expected = mb_pixbuf_img_scale_down (pb, tmp, 31, 11);
+  fail_unless (compare_with_image (img, expected), NULL);
+  mb_pixbuf_img_free (pb, img);
+  mb_pixbuf_img_free (pb, tmp);
+  mb_pixbuf_img_free (pb, expected);
+
+  img      = mb_pixbuf_img_scale (pb, src, 5, 40);
+  tmp      = mb_pixbuf_img_scale_down (pb, src, 5, 29);
+  expected = mb_pixbuf_img_scale_up (pb, tmp, 5, 40);
+  fail_unless (compare_with_image (img, expected), NULL);
+  mb_pixbuf_img_free (pb, img);
+  mb_pixbuf_img_free (pb, tmp);
+  mb_pixbuf_img_free (pb, expected);
+  mb_pixbuf_img_free (pb, src);
+
+  src = mb_pixbuf_img_rgba_new (pb, 41, 3);
+  mb_pixbuf_img_fill (pb, src, 200, 100, 50, 30);
+  mb_pixbuf_img_get_pixel (pb, src, 0, 0, &r, &g, &b, &a);
+
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+    {
+      img = mb_pixbuf_img_scale_with_filter (pb, src, sizes[i][0], sizes[i][1],
+					     MBPIXBUF_FILTER_BILINEAR);
+      fail_unless (compare_with_pixel (img, r, g, b, a), NULL);
+      mb_pixbuf_img_free (pb, img);
+    }
+
+  mb_pixbuf_img_free (pb, src);
+
+  src = mb_pixbuf_img_rgb_new (pb, 2, 1);
+  mb_pixbuf_img_plot_pixel (pb, src, 0, 0, 0, 0, 0);
+  mb_pixbuf_img_plot_pixel (pb, src, 1, 0, 255, 255, 255);
+  mb_pixbuf_img_get_pixel (pb, src, 1, 0, &r, &white, &b, &a);
+
+  img = mb_pixbuf_img_scale_with_filter (pb, src, 20, 1,
+					 MBPIXBUF_FILTER_BILINEAR);
+  for (x = 0, last = 0; x < 20; x++)
+    {
+      mb_pixbuf_img_get_pixel (pb, img, x, 0, &r, &g, &b, &a);
+      fail_unless (g >= last, NULL);
+      last = g;
+    }
+
+  mb_pixbuf_img_get_pixel (pb, img, 0, 0, &r, &g, &b, &a);
+  fail_unless (r == 0 && g == 0 && b == 0, NULL);
+  fail_unless (last == white, NULL);
+
+  mb_pixbuf_img_free (pb, img);
+  mb_pixbuf_img_free (pb, src);
+}
+END_TEST
+
+/**
+ * Scaling into and compositing onto part of an image, clipped or not,
+ * should match scaling to a new image and copying that.
+ */
+START_TEST (pixbuf_scale_into)
+{
+  static const int pos[][2] = { { 3, 2 }, { -4, -3 }, { 20, 9 } };
+  MBPixbufImage *src, *scaled, *dest, *expected;
+  int i, src_alpha, dest_alpha, sx, sy, w, h;
+
+  srand(5);
+
+  for (src_alpha = 0; src_alpha <= 1; src_alpha++)
+    for (dest_alpha = 0; dest_alpha <= 1; dest_alpha++)
+      for (i = 0; i < sizeof(pos)/sizeof(pos[0]); i++)
+	{
+	  src    = random_image(17, 9, src_alpha);
+	  scaled = mb_pixbuf_img_scale (pb, src, 12, 14);
+	  dest   = random_image(30, 20, dest_alpha);
+
+	  sx = (pos[i][0] < 0) ? -pos[i][0] : 0;
+	  sy = (pos[i][1] < 0) ? -pos[i][1] : 0;
+	  w  = ((pos[i][0] + 12 > 30) ? 30 - pos[i][0] : 12) - sx;
+	  h  = ((pos[i][1] + 14 > 20) ? 20 - pos[i][1] : 14) - sy;
+
+	  expected = mb_pixbuf_img_clone (pb, dest);
+	  mb_pixbuf_img_copy (pb, expected, scaled, sx, sy, w, h, 
+			      pos[i][0] + sx, pos[i][1] + sy);
+	  mb_pixbuf_img_scale_into (pb, src, dest, pos[i][0], pos[i][1], 12, 14);
+	  fail_unless (compare_with_image (dest, expected), NULL);
+
+	  mb_pixbuf_img_copy_composite (pb, expected, scaled, sx, sy, w, h, 
+					pos[i][0] + sx, pos[i][1] + sy);
+	  mb_pixbuf_img_scale_composite (pb, src, dest, 
+					 pos[i][0], pos[i][1], 12, 14);
+	  fail_unless (compare_with_image (dest, expected), NULL);
+
+	  mb_pixbuf_img_free (pb, src);
+	  mb_pixbuf_img_free (pb, scaled);
+	  mb_pixbuf_img_free (pb, dest);
+	  mb_pixbuf_img_free (pb, expected);
+	}
+}
+END_TEST
+
+/**
+ * Compositing a premultiplied copy of an image should look the same as
+ * compositing the original, give or take rounding.
+ */
+START_TEST (pixbuf_premultiplied)
+{
+  MBPixbufImage *src, *premul, *dest1, *dest2;
+  int x, y, levels[] = { 0, -100 }, i, slack;
+  unsigned char r1, g1, b1, a1, r2, g2, b2, a2;
+
+  slack = (pb->internal_bytespp == 2) ? 8 : 2;
+
+  srand(11);
+  src    = random_image(23, 9, True);
+  premul = mb_pixbuf_img_clone(pb, src);
+
+  mb_pixbuf_img_premultiply(pb, premul);
+  fail_unless (mb_pixbuf_img_is_premultiplied(premul), NULL);
+
+  for (i = 0; i < 2; i++)
+    {
+      dest1 = random_image(23, 9, True);
+      dest2 = mb_pixbuf_img_clone(pb, dest1);
+
+      mb_pixbuf_img_copy_composite_with_alpha (pb, dest1, src, 
+					       0, 0, 23, 9, 0, 0, levels[i]);
+      mb_pixbuf_img_copy_composite_with_alpha (pb, dest2, premul, 
+					       0, 0, 23, 9, 0, 0, levels[i]);
+
+      for (y = 0; y < 9; y++)
+	for (x = 0; x < 23; x++)
+	  {
+	    mb_pixbuf_img_get_pixel (pb, dest1, x, y, &r1, &g1, &b1, &a1);
+	    mb_pixbuf_img_get_pixel (pb, dest2, x, y, &r2, &g2, &b2, &a2);
+
+	    fail_unless (abs(r1 - r2) <= slack && abs(g1 - g2) <= slack
+			 && abs(b1 - b2) <= slack && a1 == a2, NULL);
+	  }
+
+      mb_pixbuf_img_free (pb, dest1);
+      mb_pixbuf_img_free (pb, dest2);
+    }
+
+  /* Opaque pixels survive the round trip */
+  mb_pixbuf_img_unpremultiply(pb, premul);
+  fail_unless (!mb_pixbuf_img_is_premultiplied(premul), NULL);
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 23; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, src, x, y, &r1, &g1, &b1, &a1);
+	mb_pixbuf_img_get_pixel (pb, premul, x, y, &r2, &g2, &b2, &a2);
+
+	if (a1 == 255)
+	  fail_unless (r1 == r2 && g1 == g2 && b1 == b2, NULL);
+      }
+
+  /* Images created in premultiplied mode give straight values back */
+  mb_pixbuf_set_premultiplied_alpha(pb, True);
+  dest1 = mb_pixbuf_img_rgba_new (pb, 4, 4);
+  mb_pixbuf_set_premultiplied_alpha(pb, False);
+
+  fail_unless (mb_pixbuf_img_is_premultiplied(dest1), NULL);
+
+  mb_pixbuf_img_fill (pb, dest1, 0xff, 0xff, 0xff, 0x80);
+  mb_pixbuf_img_get_pixel (pb, dest1, 1, 1, &r1, &g1, &b1, &a1);
+  fail_unless (r1 >= 0xf0 && g1 >= 0xf0 && b1 >= 0xf0 && a1 == 0x80, NULL);
+
+  mb_pixbuf_img_free (pb, dest1);
+  mb_pixbuf_img_free (pb, src);
+  mb_pixbuf_img_free (pb, premul);
+}
+END_TEST
+
+/* Compositing onto a premultiplied destination, from a straight or a
+ * premultiplied source, gives what it does onto a straight one
+ */
+START_TEST (pixbuf_premultiplied_dest)
+{
+  MBPixbufImage *srcs[2], *orig, *dest1, *dest2;
+  int x, y, s, i, op, levels[] = { 0, -100 }, slack;
+  unsigned char r1, g1, b1, a1, r2, g2, b2, a2, r0, g0, b0, a0;
+
+  slack = (pb->internal_bytespp == 2) ? 24 : 4;
+
+  srand(17);
+  srcs[0] = random_image(23, 9, True);
+  srcs[1] = mb_pixbuf_img_clone(pb, srcs[0]);
+  mb_pixbuf_img_premultiply(pb, srcs[1]);
+
+  orig = random_image(23, 9, True);
+
+  for (s = 0; s < 2; s++)
+    for (i = 0; i < 2; i++)
+      for (op = 0; op < 2; op++)
+	{
+	  dest1 = mb_pixbuf_img_clone(pb, orig);
+	  dest2 = mb_pixbuf_img_clone(pb, orig);
+	  mb_pixbuf_img_premultiply(pb, dest2);
+
+	  if (op == 0)
+	    {
+	      mb_pixbuf_img_copy_composite_with_alpha (pb, dest1, srcs[s], 
+						       0, 0, 23, 9, 0, 0, 
+						       levels[i]);
+	      mb_pixbuf_img_copy_composite_with_alpha (pb, dest2, srcs[s], 
+						       0, 0, 23, 9, 0, 0, 
+						       levels[i]);
+	    }
+	  else
+	    {
+	      mb_pixbuf_img_composite (pb, dest1, srcs[s], 0, 0);
+	      mb_pixbuf_img_composite (pb, dest2, srcs[s], 0, 0);
+	    }
+
+	  fail_unless (mb_pixbuf_img_is_premultiplied(dest2), NULL);
+
+	  for (y = 0; y < 9; y++)
+	    for (x = 0; x < 23; x++)
+	      {
+		mb_pixbuf_img_get_pixel (pb, orig, x, y, &r0, &g0, &b0, &a0);
+		mb_pixbuf_img_get_pixel (pb, dest1, x, y, &r1, &g1, &b1, &a1);
+		mb_pixbuf_img_get_pixel (pb, dest2, x, y, &r2, &g2, &b2, &a2);
+
+		fail_unless (a1 == a2, NULL);
+
+		/* Faint pixels don't keep enough color to compare */
+		if (a0 < 128 || a1 < 128)
+		  continue;
+
+		fail_unless (abs(r1 - r2) <= slack && abs(g1 - g2) <= slack
+			     && abs(b1 - b2) <= slack, NULL);
+	      }
+
+	  mb_pixbuf_img_free (pb, dest1);
+	  mb_pixbuf_img_free (pb, dest2);
+	}
+
+  /* Half black over opaque white is mid grey, at half alpha */
+  dest2 = mb_pixbuf_img_rgba_new (pb, 1, 1);
+  mb_pixbuf_img_fill (pb, dest2, 0xff, 0xff, 0xff, 0xff);
+  mb_pixbuf_img_premultiply (pb, dest2);
+
+  dest1 = mb_pixbuf_img_rgba_new (pb, 1, 1);
+  mb_pixbuf_img_fill (pb, dest1, 0, 0, 0, 0x80);
+
+  mb_pixbuf_img_copy_composite (pb, dest2, dest1, 0, 0, 1, 1, 0, 0);
+  mb_pixbuf_img_get_pixel (pb, dest2, 0, 0, &r2, &g2, &b2, &a2);
+  fail_unless (abs(r2 - 0x7f) <= slack && abs(g2 - 0x7f) <= slack 
+	       && abs(b2 - 0x7f) <= slack && a2 == 0x80, NULL);
+
+  mb_pixbuf_img_free (pb, dest1);
+  mb_pixbuf_img_free (pb, dest2);
+  mb_pixbuf_img_free (pb, orig);
+  mb_pixbuf_img_free (pb, srcs[0]);
+  mb_pixbuf_img_free (pb, srcs[1]);
+}
+END_TEST
+
+/* Copies and scales between straight and premultiplied images keep
+ * each image in its own mode
+ */
+START_TEST (pixbuf_premultiplied_copy)
+{
+  MBPixbufImage *srcs[2], *dest, *img;
+  int x, y, s, d, op, slack, data[23 * 9];
+  unsigned char r1, g1, b1, a1, r2, g2, b2, a2;
+
+  /* 5 bit channels premultiplied at 16 bpp come back a step or two out */
+  slack = (pb->internal_bytespp == 2) ? 16 : 2;
+
+  srand(19);
+  srcs[0] = random_image(23, 9, True);
+  srcs[1] = mb_pixbuf_img_clone(pb, srcs[0]);
+  mb_pixbuf_img_premultiply(pb, srcs[1]);
+
+  for (s = 0; s < 2; s++)
+    for (d = 0; d < 2; d++)
+      for (op = 0; op < 3; op++)
+	{
+	  dest = mb_pixbuf_img_rgba_new (pb, 27, 12);
+	  if (d) mb_pixbuf_img_premultiply(pb, dest);
+
+	  if (op == 0)
+	    mb_pixbuf_img_copy (pb, dest, srcs[s], 0, 0, 23, 9, 2, 1);
+	  else if (op == 1)
+	    mb_pixbuf_img_scale_into (pb, srcs[s], dest, 2, 1, 23, 9);
+	  else
+	    {
+	      /* All of the destination, scaled in place when modes match */
+	      mb_pixbuf_img_free (pb, dest);
+	      dest = mb_pixbuf_img_rgba_new (pb, 23, 9);
+	      if (d) mb_pixbuf_img_premultiply(pb, dest);
+	      mb_pixbuf_img_scale_into (pb, srcs[s], dest, 0, 0, 23, 9);
+	    }
+
+	  fail_unless (mb_pixbuf_img_is_premultiplied(dest) == d, NULL);
+
+	  for (y = 0; y < 9; y++)
+	    for (x = 0; x < 23; x++)
+	      {
+		mb_pixbuf_img_get_pixel (pb, srcs[0], x, y, &r1, &g1, &b1, &a1);
+		mb_pixbuf_img_get_pixel (pb, dest, 
+					 x + (op < 2) * 2, y + (op < 2), 
+					 &r2, &g2, &b2, &a2);
+
+		fail_unless (a1 == a2, NULL);
+
+		if (a1 < 128)
+		  continue;
+
+		fail_unless (abs(r1 - r2) <= slack && abs(g1 - g2) <= slack
+			     && abs(b1 - b2) <= slack, NULL);
+	      }
+
+	  mb_pixbuf_img_free (pb, dest);
+	}
+
+  /* ARGB data is premultiplied at 8 bits, before any packing to 16 */
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 23; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, srcs[0], x, y, &r1, &g1, &b1, &a1);
+	data[y * 23 + x] = ((unsigned)a1 << 24) | (r1 << 16) | (g1 << 8) | b1;
+      }
+
+  mb_pixbuf_set_premultiplied_alpha(pb, True);
+  img = mb_pixbuf_img_new_from_int_data (pb, data, 23, 9);
+  mb_pixbuf_set_premultiplied_alpha(pb, False);
+
+  fail_unless (mb_pixbuf_img_is_premultiplied(img), NULL);
+
+  for (y = 0; y < 9; y++)
+    for (x = 0; x < 23; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, srcs[1], x, y, &r1, &g1, &b1, &a1);
+	mb_pixbuf_img_get_pixel (pb, img, x, y, &r2, &g2, &b2, &a2);
+
+	fail_unless (a1 == a2, NULL);
+
+	if (a1 < 128)
+	  continue;
+
+	fail_unless (abs(r1 - r2) <= slack && abs(g1 - g2) <= slack
+		     && abs(b1 - b2) <= slack, NULL);
+      }
+
+  mb_pixbuf_img_free (pb, img);
+  mb_pixbuf_img_free (pb, srcs[0]);
+  mb_pixbuf_img_free (pb, srcs[1]);
+}
+END_TEST
+
 START_TEST (pixbuf_rgb_new_fill)
 {
   MBPixbufImage *img;
@@ -247,6 +790,135 @@ START_TEST (pixbuf_load_xpm)
 }
 END_TEST
 
+/**
+ * XPM parsing without the X server: any number of characters per
+ * pixel, color names, the #rgb forms, None and a choice of visuals.
+ */
+START_TEST (pixbuf_load_xpm_colors)
+{
+  static const char xpm[] =
+    "/* XPM */\n"
+    "static char *test[] = {\n"
+    "/* columns rows colors chars-per-pixel */\n"
+    "\"4 2 6 3\",\n"
+    "\"aaa c Light Grey\",\n"
+    "\"bb  c #f08\",\n"
+    "\"b b m black c #123456789abc\",\n"
+    "\"...\tc None\",\n"
+    "\"x/* m white\",\n"
+    "\"zzz s blah c navy blue\",\n"
+    "/* pixels */\n"
+    "\"aaabb b b...\",\n"
+    "\"x/*zzz...qqq\"\n"
+    "};\n";
+  static const unsigned char expected[2][4][4] = {
+    { { 211, 211, 211, 255 }, { 240, 0, 128, 255 }, 
+      { 0x12, 0x56, 0x9a, 255 }, { 0, 0, 0, 0 } },
+    { { 255, 255, 255, 255 }, { 0, 0, 128, 255 }, 
+      { 0, 0, 0, 0 }, { 0, 0, 0, 0 } }
+  };
+  MBPixbufImage *img;
+  FILE *fp;
+  unsigned char r, g, b, a;
+  int x, y, tolerance = (pb->internal_bytespp == 2) ? 8 : 0;
+
+  fp = fopen ("pixbuf-test.xpm", "w");
+  fail_unless (fp != NULL, NULL);
+  fputs (xpm, fp);
+  fclose (fp);
+
+  img = mb_pixbuf_img_new_from_file (pb, "pixbuf-test.xpm");
+  fail_unless (img != NULL, NULL);
+  fail_unless (img->width == 4 && img->height == 2 && img->has_alpha, NULL);
+
+  for (y = 0; y < 2; y++)
+    for (x = 0; x < 4; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, img, x, y, &r, &g, &b, &a);
+
+	fail_unless (a == expected[y][x][3], NULL);
+	if (a)
+	  fail_unless (abs(r - expected[y][x][0]) <= tolerance
+		       && abs(g - expected[y][x][1]) <= tolerance
+		       && abs(b - expected[y][x][2]) <= tolerance, NULL);
+      }
+
+  mb_pixbuf_img_free (pb, img);
+  unlink ("pixbuf-test.xpm");
+}
+END_TEST
+
+static unsigned char *
+read_file (const char *filename, size_t *len)
+{
+  unsigned char *data;
+  FILE *fp;
+
+  fp = fopen (filename, "rb");
+  fail_unless (fp != NULL, NULL);
+  fseek (fp, 0, SEEK_END);
+  *len = ftell (fp);
+  rewind (fp);
+  data = malloc (*len);
+  fail_unless (fread (data, 1, *len, fp) == *len, NULL);
+  fclose (fp);
+
+  return data;
+}
+
+/**
+ * Images from memory, from a pipe and from a file with the wrong
+ * suffix should match loading the file normally, and truncated data
+ * should fail cleanly.
+ */
+START_TEST (pixbuf_load_memory)
+{
+  static const char *files[] = { "oh.png", "oh.xpm",
+#ifdef MB_HAVE_JPEG
+				 "oh.jpg",
+#endif
+  };
+  MBPixbufImage *orig, *img;
+  unsigned char *data;
+  size_t len;
+  FILE *fp;
+  int i, fds[2];
+
+  for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+      orig = mb_pixbuf_img_new_from_file (pb, files[i]);
+      data = read_file (files[i], &len);
+
+      img = mb_pixbuf_img_new_from_memory (pb, data, len);
+      fail_unless (compare_with_image (img, orig), NULL);
+      mb_pixbuf_img_free (pb, img);
+
+      fail_unless (pipe (fds) == 0, NULL);
+      fail_unless (write (fds[1], data, len) == len, NULL);
+      close (fds[1]);
+      img = mb_pixbuf_img_new_from_fd (pb, fds[0]);
+      close (fds[0]);
+      fail_unless (compare_with_image (img, orig), NULL);
+      mb_pixbuf_img_free (pb, img);
+
+      fp = fopen ("pixbuf-test.img", "wb");
+      fwrite (data, 1, len, fp);
+      fclose (fp);
+      img = mb_pixbuf_img_new_from_file (pb, "pixbuf-test.img");
+      fail_unless (compare_with_image (img, orig), NULL);
+      mb_pixbuf_img_free (pb, img);
+      unlink ("pixbuf-test.img");
+
+      if (i == 0)
+	fail_unless (mb_pixbuf_img_new_from_memory (pb, data, len / 2) == NULL,
+		     NULL);
+
+      mb_pixbuf_img_free (pb, orig);
+      free (data);
+    }
+}
+END_TEST
+
 /**
  * Test that mbpixmap can clone.
  */
@@ -375,44 +1047,1054 @@ START_TEST (pixbuf_flip_v_identity)
 }
 END_TEST
 
-START_TEST (pixbuf_scale)
+/**
+ * Check every transform against where each pixel should end up, on
+ * images larger than a tile and with odd sizes, and the in place
+ * versions against the copying ones.
+ */
+START_TEST (pixbuf_transform_reference)
 {
-  MBPixbufImage *img1, *img2, *orig, *exp;
-  orig = mb_pixbuf_img_new_from_file (pb, "oh.png");
-  fail_unless (orig != NULL, NULL);
-  exp = mb_pixbuf_img_new_from_file (pb, "oh-scaled.png");
-  fail_unless (orig != NULL, NULL);
-  img1 = mb_pixbuf_img_scale (pb, orig, 32, 32);
-  fail_unless (!compare_with_image (img1, orig), NULL);
-  fail_unless (compare_with_image (img1, exp), NULL);
-  img2 = mb_pixbuf_img_scale (pb, img1, 16, 16);
-  fail_unless (compare_with_image (img2, orig), NULL);
-  fail_unless (!compare_with_image (img2, exp), NULL);
-  mb_pixbuf_img_free (pb, img1);
-  mb_pixbuf_img_free (pb, img2);
-  mb_pixbuf_img_free (pb, orig);
-  mb_pixbuf_img_free (pb, exp);
+  MBPixbufImage *src, *img, *inplace;
+  int has_alpha, t, x, y, nx = 0, ny = 0, w = 45, h = 37;
+  unsigned char r1, g1, b1, a1, r2, g2, b2, a2;
+
+  srand(9);
+
+  for (has_alpha = 0; has_alpha <= 1; has_alpha++)
+    {
+      src = random_image(w, h, has_alpha);
+
+      for (t = MBPIXBUF_TRANS_ROTATE_90; t <= MBPIXBUF_TRANS_FLIP_HORIZ; t++)
+	{
+	  img = mb_pixbuf_img_transform (pb, src, t);
+
+	  for (y = 0; y < h; y++)
+	    for (x = 0; x < w; x++)
+	      {
+		switch (t)
+		  {
+		  case MBPIXBUF_TRANS_ROTATE_90:
+		    nx = h - 1 - y; ny = x; break;
+		  case MBPIXBUF_TRANS_ROTATE_180:
+		    nx = w - 1 - x; ny = h - 1 - y; break;
+		  case MBPIXBUF_TRANS_ROTATE_270:
+		    nx = y; ny = w - 1 - x; break;
+		  case MBPIXBUF_TRANS_FLIP_VERT:
+		    nx = x; ny = h - 1 - y; break;
+		  case MBPIXBUF_TRANS_FLIP_HORIZ:
+		    nx = w - 1 - x; ny = y; break;
+		  }
+
+		mb_pixbuf_img_get_pixel (pb, src, x, y, &r1, &g1, &b1, &a1);
+		mb_pixbuf_img_get_pixel (pb, img, nx, ny, &r2, &g2, &b2, &a2);
+		fail_unless (r1 == r2 && g1 == g2 && b1 == b2 && a1 == a2, NULL);
+	      }
+
+	  inplace = mb_pixbuf_img_clone (pb, src);
+
+	  if (mb_pixbuf_img_transform_in_place (pb, inplace, t))
+	    fail_unless (compare_with_image (inplace, img), NULL);
+	  else
+	    fail_unless (t == MBPIXBUF_TRANS_ROTATE_90 
+			 || t == MBPIXBUF_TRANS_ROTATE_270, NULL);
+
+	  mb_pixbuf_img_free (pb, inplace);
+	  mb_pixbuf_img_free (pb, img);
+	}
+
+      mb_pixbuf_img_free (pb, src);
+    }
 }
 END_TEST
 
 /**
- * Test that the scale_(up|down) functions correctly return NULL if you try and
- * scale an image the wrong way.
+ * A pixbuf made without a display should load, scale, composite,
+ * transform and fill just as one made with a display and the same
+ * internal format does.
  */
-START_TEST (pixbuf_scale_failures)
+START_TEST (pixbuf_headless)
 {
-  MBPixbufImage *img, *orig;
-  orig = mb_pixbuf_img_new_from_file (pb, "oh.png");
-  img = mb_pixbuf_img_scale_down (pb, orig, 32, 32);
-  fail_unless (img == NULL, NULL);
-  img = mb_pixbuf_img_scale_up (pb, orig, 8, 8);
-  fail_unless (img == NULL, NULL);
-  mb_pixbuf_img_free (pb, orig);
+  MBPixbuf      *hpb;
+  MBPixbufImage *img, *himg, *tmp, *htmp;
+  unsigned char  r1, g1, b1, a1, r2, g2, b2, a2;
+  int            x, y;
+
+  fail_unless (mb_pixbuf_new_headless (8, MBPIXBUF_BYTE_ORDER_RGB, 0) 
+	       == NULL, NULL);
+  fail_unless (mb_pixbuf_new_headless (16, MBPIXBUF_BYTE_ORDER_GRB, 0) 
+	       == NULL, NULL);
+  fail_unless (mb_pixbuf_new_headless (24, MBPIXBUF_BYTE_ORDER_RGB, 4) 
+	       == NULL, NULL);
+
+  hpb = mb_pixbuf_new_headless (32, MBPIXBUF_BYTE_ORDER_ARGB, 
+				pb->internal_bytespp);
+  fail_unless (hpb != NULL, NULL);
+  fail_unless (hpb->internal_bytespp == pb->internal_bytespp, NULL);
+
+  img  = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  himg = mb_pixbuf_img_new_from_file (hpb, "oh.png");
+  fail_unless (compare_with_image (img, himg), NULL);
+
+  tmp  = mb_pixbuf_img_scale (pb, img, 40, 30);
+  htmp = mb_pixbuf_img_scale (hpb, himg, 40, 30);
+  fail_unless (compare_with_image (tmp, htmp), NULL);
+
+  mb_pixbuf_img_copy_composite (pb, tmp, img, 0, 0, 16, 16, 5, 5);
+  mb_pixbuf_img_copy_composite (hpb, htmp, himg, 0, 0, 16, 16, 5, 5);
+  fail_unless (compare_with_image (tmp, htmp), NULL);
+
+  mb_pixbuf_img_free (pb, tmp);
+  mb_pixbuf_img_free (hpb, htmp);
+
+  tmp  = mb_pixbuf_img_transform (pb, img, MBPIXBUF_TRANS_ROTATE_90);
+  htmp = mb_pixbuf_img_transform (hpb, himg, MBPIXBUF_TRANS_ROTATE_90);
+  fail_unless (compare_with_image (tmp, htmp), NULL);
+
+  mb_pixbuf_img_fill (hpb, htmp, 10, 20, 30, 40);
+
+  for (y = 0; y < htmp->height; y++)
+    for (x = 0; x < htmp->width; x++)
+      {
+	mb_pixbuf_img_get_pixel (hpb, htmp, x, y, &r1, &g1, &b1, &a1);
+	mb_pixbuf_img_get_pixel (pb, htmp, x, y, &r2, &g2, &b2, &a2);
+	fail_unless (r1 == r2 && g1 == g2 && b1 == b2 && a1 == a2, NULL);
+      }
+
+  mb_pixbuf_img_free (pb, tmp);
+  mb_pixbuf_img_free (hpb, htmp);
+  mb_pixbuf_img_free (pb, img);
+  mb_pixbuf_img_free (hpb, himg);
+
+  mb_pixbuf_destroy (hpb);
 }
 END_TEST
 
-Suite *pixbuf_suite(void)
-{
+/**
+ * Every row writer should put the pixels the pixel at a time path,
+ * mb_pixbuf_get_pixel() and XPutPixel(), does. Run headless into
+ * XImages in memory, so no server is needed.
+ */
+static XImage *
+memory_ximage (MBPixbuf *hpb, int width, int height, int bpp, int byte_order)
+{
+  XImage *ximg = calloc (1, sizeof(XImage));
+
+  ximg->width            = width;
+  ximg->height           = height;
+  ximg->format           = ZPixmap;
+  ximg->byte_order       = byte_order;
+  ximg->bitmap_unit      = 32;
+  ximg->bitmap_bit_order = byte_order;
+  ximg->bitmap_pad       = 32;
+  ximg->depth            = hpb->depth;
+  ximg->bits_per_pixel   = bpp;
+  ximg->bytes_per_line   = ((width * bpp + 31) / 32) * 4;
+  ximg->red_mask         = hpb->vis->red_mask;
+  ximg->green_mask       = hpb->vis->green_mask;
+  ximg->blue_mask        = hpb->vis->blue_mask;
+  ximg->data             = calloc (height, ximg->bytes_per_line);
+
+  XInitImage (ximg);
+
+  return ximg;
+}
+
+START_TEST (pixbuf_row_writers)
+{
+  static const struct { int depth, byte_order, bpp; } formats[] = {
+    { 15, MBPIXBUF_BYTE_ORDER_RGB,  16 },
+    { 15, MBPIXBUF_BYTE_ORDER_BGR,  16 },
+    { 16, MBPIXBUF_BYTE_ORDER_RGB,  16 },
+    { 16, MBPIXBUF_BYTE_ORDER_BGR,  16 },
+    { 24, MBPIXBUF_BYTE_ORDER_RGB,  24 },
+    { 24, MBPIXBUF_BYTE_ORDER_BGR,  24 },
+    { 24, MBPIXBUF_BYTE_ORDER_RGB,  32 },
+    { 24, MBPIXBUF_BYTE_ORDER_GRB,  32 },
+    { 32, MBPIXBUF_BYTE_ORDER_ARGB, 32 },
+    { 32, MBPIXBUF_BYTE_ORDER_BGR,  32 }
+  };
+  static const int orders[] = { LSBFirst, MSBFirst };
+  const int      width = 37, height = 5;
+  MBPixbuf      *hpb;
+  MBPixbufImage *img;
+  XImage        *ximg, *ref;
+  unsigned char *data, r, g, b, a;
+  int            f, ibpp, alpha, o, x, y, i;
+
+  srand(23);
+  data = malloc (width * height * 4);
+
+  for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    for (ibpp = 2; ibpp <= 3; ibpp++)
+      {
+	hpb = mb_pixbuf_new_headless (formats[f].depth, 
+				      formats[f].byte_order, ibpp);
+	fail_unless (hpb != NULL, NULL);
+
+	for (alpha = 0; alpha < 2; alpha++)
+	  for (o = 0; o < 2; o++)
+	    {
+	      for (i = 0; i < width * height * 4; i++)
+		data[i] = rand();
+
+	      img = mb_pixbuf_img_new_from_data (hpb, data, width, height, 
+						 alpha);
+
+	      ximg = memory_ximage (hpb, width, height, formats[f].bpp, 
+				    orders[o]);
+	      ref  = memory_ximage (hpb, width, height, formats[f].bpp, 
+				    orders[o]);
+
+	      _mb_pixbuf_img_write_ximage (hpb, img, ximg);
+
+	      for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+		  {
+		    mb_pixbuf_img_get_pixel (hpb, img, x, y, &r, &g, &b, &a);
+		    XPutPixel (ref, x, y, 
+			       mb_pixbuf_lookup_x_pixel (hpb, r, g, b, 
+							 alpha ? a : 0xff));
+		  }
+
+	      for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+		  fail_unless (XGetPixel (ximg, x, y) == XGetPixel (ref, x, y),
+			       NULL);
+
+	      free (ximg->data);
+	      free (ximg);
+	      free (ref->data);
+	      free (ref);
+	      mb_pixbuf_img_free (hpb, img);
+	    }
+
+	mb_pixbuf_destroy (hpb);
+      }
+
+  free (data);
+}
+END_TEST
+
+/**
+ * The inverse colormap should hold the palette entry nearest each
+ * cell's center, first one on a tie, and the dither table should
+ * average out to the value dithered.
+ */
+START_TEST (pixbuf_color_cube)
+{
+  MBPixbuf *hpb;
+  int       n, i, r, g, b, v, size, shift, half, best, d, sum, cell;
+  unsigned long pixel;
+
+  hpb = mb_pixbuf_new_headless (24, MBPIXBUF_BYTE_ORDER_RGB, 3);
+  fail_unless (hpb != NULL, NULL);
+
+  srand(29);
+  n = 200;
+
+  hpb->palette     = malloc (n * sizeof(MBPixbufColor));
+  hpb->num_of_cols = n;
+
+  /* Some duplicates, so ties come up */
+  for (i = 0; i < n; i++)
+    {
+      if (i % 50 == 49)
+	hpb->palette[i] = hpb->palette[i-1];
+      else
+	{
+	  hpb->palette[i].r = rand() & 0xff;
+	  hpb->palette[i].g = rand() & 0xff;
+	  hpb->palette[i].b = rand() & 0xff;
+	}
+
+      hpb->palette[i].pixel = i;
+    }
+
+  fail_unless (_mb_pixbuf_color_cube_init (hpb), NULL);
+
+  size  = 1 << hpb->color_cube_bits;
+  shift = 8 - hpb->color_cube_bits;
+  half  = (1 << shift) / 2;
+
+  for (r = 0, cell = 0; r < size; r++)
+    for (g = 0; g < size; g++)
+      for (b = 0; b < size; b++, cell++)
+	{
+	  for (i = 0, pixel = 0, best = 0x7fffffff; i < n; i++)
+	    {
+	      d = abs ((r << shift) + half - hpb->palette[i].r)
+		+ abs ((g << shift) + half - hpb->palette[i].g)
+		+ abs ((b << shift) + half - hpb->palette[i].b);
+
+	      if (d < best)
+		{
+		  best  = d;
+		  pixel = hpb->palette[i].pixel;
+		}
+	    }
+
+	  fail_unless (hpb->color_cube[cell] == pixel, NULL);
+	}
+
+  for (v = 0; v < 256; v++)
+    {
+      for (i = 0, sum = 0; i < 16; i++)
+	{
+	  d = hpb->dither_table[i * 256 + v];
+
+	  fail_unless (d < size, NULL);
+	  if (v > 0)
+	    fail_unless (d >= hpb->dither_table[i * 256 + v - 1], NULL);
+
+	  sum += (d << shift) + half;
+	}
+
+      /* Away from the ends, where nudges get clamped */
+      if (v >= 32 && v < 224)
+	fail_unless (abs (sum / 16 - v) <= (1 << shift), NULL);
+    }
+
+  mb_pixbuf_destroy (hpb);
+}
+END_TEST
+
+/**
+ * Sets the padding on the end of each row of @img to @v.
+ */
+static void
+set_row_padding(MBPixbufImage *img, unsigned char v)
+{
+  int y, len = img->width * (pb->internal_bytespp + img->has_alpha);
+
+  for (y = 0; y < img->height; y++)
+    memset(img->rgba + y * img->rowstride + len, v, img->rowstride - len);
+}
+
+static int
+check_row_padding(MBPixbufImage *img, unsigned char v)
+{
+  int y, i, len = img->width * (pb->internal_bytespp + img->has_alpha);
+
+  for (y = 0; y < img->height; y++)
+    for (i = len; i < img->rowstride; i++)
+      if (img->rgba[y * img->rowstride + i] != v) return 0;
+
+  return 1;
+}
+
+static int
+same_pixel(MBPixbufImage *a, int ax, int ay, MBPixbufImage *b, int bx, int by)
+{
+  unsigned char r1, g1, b1, a1, r2, g2, b2, a2;
+
+  mb_pixbuf_img_get_pixel (pb, a, ax, ay, &r1, &g1, &b1, &a1);
+  mb_pixbuf_img_get_pixel (pb, b, bx, by, &r2, &g2, &b2, &a2);
+
+  return (r1 == r2 && g1 == g2 && b1 == b2 && a1 == a2);
+}
+
+/**
+ * Rows are aligned and padded, and operations on images whose rows
+ * don't fill their stride only touch the pixels.
+ */
+START_TEST (pixbuf_rowstride)
+{
+  MBPixbufImage *src, *dest, *tmp;
+  int            has_alpha, x, y, bpp;
+
+  for (has_alpha = 0; has_alpha < 2; has_alpha++)
+    {
+      bpp = pb->internal_bytespp + has_alpha;
+
+      src  = random_image (7, 5, has_alpha);
+      dest = random_image (9, 6, has_alpha);
+
+      fail_unless (src->rowstride % MBPIXBUF_ROW_ALIGN == 0, NULL);
+      fail_unless (src->rowstride >= src->width * bpp, NULL);
+      fail_unless ((unsigned long)src->rgba % MBPIXBUF_ROW_ALIGN == 0, NULL);
+      fail_unless (src->rowstride > src->width * bpp, "7 pixels not padded");
+
+      set_row_padding (src, 0xa5);
+      set_row_padding (dest, 0x5a);
+
+      /* Copying and compositing */
+      mb_pixbuf_img_copy (pb, dest, src, 1, 1, 6, 4, 2, 1);
+      for (y = 0; y < 4; y++)
+	for (x = 0; x < 6; x++)
+	  fail_unless (same_pixel (dest, x + 2, y + 1, src, x + 1, y + 1), NULL);
+
+      mb_pixbuf_img_copy_composite (pb, dest, src, 0, 0, 7, 5, 1, 0);
+      mb_pixbuf_img_composite (pb, dest, src, 2, 1);
+      fail_unless (check_row_padding (dest, 0x5a), NULL);
+
+      /* Filling */
+      mb_pixbuf_img_fill (pb, dest, 0x80, 0x40, 0x20, 0xff);
+      fail_unless (compare_with_pixel (dest, 0x80, 0x40, 0x20, 0xff), NULL);
+      fail_unless (check_row_padding (dest, 0x5a), NULL);
+
+      /* Scaling, nearest at twice the size takes each pixel twice */
+      tmp = mb_pixbuf_img_scale_with_filter (pb, src, 14, 10,
+					     MBPIXBUF_FILTER_NEAREST);
+      for (y = 0; y < 10; y++)
+	for (x = 0; x < 14; x++)
+	  fail_unless (same_pixel (tmp, x, y, src, x / 2, y / 2), NULL);
+      mb_pixbuf_img_free (pb, tmp);
+
+      mb_pixbuf_img_scale_into (pb, src, dest, 1, 1, 7, 5);
+      fail_unless (check_row_padding (dest, 0x5a), NULL);
+
+      /* Transforms */
+      tmp = mb_pixbuf_img_transform (pb, src, MBPIXBUF_TRANS_ROTATE_90);
+      for (y = 0; y < 7; y++)
+	for (x = 0; x < 5; x++)
+	  fail_unless (same_pixel (tmp, x, y, src, y, 4 - x), NULL);
+      mb_pixbuf_img_free (pb, tmp);
+
+      tmp = mb_pixbuf_img_transform (pb, src, MBPIXBUF_TRANS_ROTATE_180);
+      mb_pixbuf_img_transform_in_place (pb, tmp, MBPIXBUF_TRANS_FLIP_VERT);
+      mb_pixbuf_img_transform_in_place (pb, tmp, MBPIXBUF_TRANS_FLIP_HORIZ);
+      fail_unless (compare_with_image (tmp, src), NULL);
+
+      mb_pixbuf_img_transform_in_place (pb, tmp, MBPIXBUF_TRANS_ROTATE_180);
+      for (y = 0; y < 5; y++)
+	for (x = 0; x < 7; x++)
+	  fail_unless (same_pixel (tmp, x, y, src, 6 - x, 4 - y), NULL);
+      mb_pixbuf_img_free (pb, tmp);
+
+      tmp = mb_pixbuf_img_clone (pb, src);
+      fail_unless (compare_with_image (tmp, src), NULL);
+      mb_pixbuf_img_free (pb, tmp);
+
+      fail_unless (check_row_padding (src, 0xa5), NULL);
+
+      mb_pixbuf_img_free (pb, src);
+      mb_pixbuf_img_free (pb, dest);
+    }
+}
+END_TEST
+
+static int wrap_destroyed;
+
+static void
+wrap_destroy(unsigned char *data, void *user_data)
+{
+  wrap_destroyed++;
+  free(data);
+}
+
+/**
+ * Views share their parent's pixels, and wrapped images the buffer
+ * they were given.
+ */
+START_TEST (pixbuf_view_wrap)
+{
+  MBPixbufImage *parent, *view, *wrap, *tmp;
+  unsigned char *data;
+  int            x, y, bpp;
+
+  parent = random_image (20, 15, True);
+  bpp    = pb->internal_bytespp + 1;
+
+  fail_unless (mb_pixbuf_img_new_view (pb, parent, 15, 0, 6, 4) == NULL, 
+	       NULL);
+  fail_unless (mb_pixbuf_img_new_view (pb, parent, -1, 0, 4, 4) == NULL,
+	       NULL);
+
+  view = mb_pixbuf_img_new_view (pb, parent, 3, 2, 9, 7);
+  fail_unless (view != NULL, NULL);
+  fail_unless (view->width == 9 && view->height == 7, NULL);
+
+  for (y = 0; y < 7; y++)
+    for (x = 0; x < 9; x++)
+      fail_unless (same_pixel (view, x, y, parent, x + 3, y + 2), NULL);
+
+  /* Drawing on the view draws on the parent, inside the rectangle only */
+  tmp = mb_pixbuf_img_clone (pb, parent);
+  mb_pixbuf_img_fill (pb, view, 0x80, 0x40, 0x20, 0xff);
+  fail_unless (compare_with_pixel (view, 0x80, 0x40, 0x20, 0xff), NULL);
+
+  for (y = 0; y < 15; y++)
+    for (x = 0; x < 20; x++)
+      if (x < 3 || x >= 12 || y < 2 || y >= 9)
+	fail_unless (same_pixel (parent, x, y, tmp, x, y), NULL);
+
+  /* Other operations take views as either side */
+  mb_pixbuf_img_copy_composite (pb, tmp, view, 0, 0, 9, 7, 1, 1);
+  mb_pixbuf_img_free (pb, tmp);
+  tmp = mb_pixbuf_img_scale (pb, view, 18, 14);
+  fail_unless (compare_with_pixel (tmp, 0x80, 0x40, 0x20, 0xff), NULL);
+  mb_pixbuf_img_free (pb, tmp);
+
+  /* The view keeps the parent alive */
+  mb_pixbuf_img_free (pb, parent);
+  fail_unless (compare_with_pixel (view, 0x80, 0x40, 0x20, 0xff), NULL);
+  mb_pixbuf_img_free (pb, view);
+
+  /* Wrapping */
+  data = calloc (24 * 5, 1);
+  fail_unless (mb_pixbuf_img_new_wrap (pb, data, 7, 5, 7, True, NULL) 
+	       == NULL, NULL);
+
+  wrap_destroyed = 0;
+  wrap = mb_pixbuf_img_new_wrap (pb, data, 5, 5, 24, True, wrap_destroy);
+  fail_unless (wrap != NULL && wrap->rgba == data, NULL);
+  fail_unless (wrap->rowstride == 24, NULL);
+
+  mb_pixbuf_img_fill (pb, wrap, 0x80, 0x40, 0x20, 0xff);
+  fail_unless (compare_with_pixel (wrap, 0x80, 0x40, 0x20, 0xff), NULL);
+  fail_unless (data[5 * bpp] == 0 && data[24 + 5 * bpp] == 0, NULL);
+
+  mb_pixbuf_img_free (pb, wrap);
+  fail_unless (wrap_destroyed == 1, NULL);
+
+  /* Without a destroy function the data stays the caller's */
+  data = malloc (3 * 4 * 3);
+  wrap = mb_pixbuf_img_new_wrap (pb, data, 4, 3, 0, False, NULL);
+  fail_unless (wrap->rowstride == 4 * pb->internal_bytespp, NULL);
+  mb_pixbuf_img_fill (pb, wrap, 0x80, 0x40, 0x20, 0xff);
+  mb_pixbuf_img_free (pb, wrap);
+  free (data);
+}
+END_TEST
+
+/**
+ * Clones share pixels until one of them is written to.
+ */
+START_TEST (pixbuf_copy_on_write)
+{
+  MBPixbufImage *img, *clone, *clone2, *orig, *view;
+  unsigned char *rgba, r1, g1, b1, a1, r2, g2, b2, a2;
+
+  img  = random_image (21, 13, True);
+  orig = random_image (21, 13, True);
+  mb_pixbuf_img_copy (pb, orig, img, 0, 0, 21, 13, 0, 0);
+
+  clone  = mb_pixbuf_img_clone (pb, img);
+  clone2 = mb_pixbuf_img_clone (pb, clone);
+  fail_unless (clone->rgba == img->rgba && clone2->rgba == img->rgba, NULL);
+  fail_unless (compare_with_image (clone, orig), NULL);
+
+  /* Writing to one copies it, the others keep sharing */
+  mb_pixbuf_img_fill (pb, clone, 0x80, 0x40, 0x20, 0xff);
+  fail_unless (clone->rgba != img->rgba, NULL);
+  fail_unless (clone2->rgba == img->rgba, NULL);
+  fail_unless (compare_with_pixel (clone, 0x80, 0x40, 0x20, 0xff), NULL);
+  fail_unless (compare_with_image (img, orig), NULL);
+
+  mb_pixbuf_img_plot_pixel (pb, img, 3, 4, 0x80, 0x40, 0x20);
+  fail_unless (img->rgba != clone2->rgba, NULL);
+  fail_unless (compare_with_image (clone2, orig), NULL);
+
+  /* Plotting keeps the random alpha, so only the color matches */
+  mb_pixbuf_img_get_pixel (pb, img, 3, 4, &r1, &g1, &b1, &a1);
+  mb_pixbuf_img_get_pixel (pb, clone, 0, 0, &r2, &g2, &b2, &a2);
+  fail_unless (r1 == r2 && g1 == g2 && b1 == b2, NULL);
+
+  /* Once the others are gone the last holder writes in place */
+  mb_pixbuf_img_free (pb, clone2);
+  clone2 = mb_pixbuf_img_clone (pb, img);
+  mb_pixbuf_img_free (pb, img);
+  img  = clone2;
+  rgba = img->rgba;
+  fail_unless (mb_pixbuf_img_make_writable (pb, img), NULL);
+  mb_pixbuf_img_composite (pb, img, clone, 0, 0);
+  fail_unless (img->rgba == rgba, NULL);
+
+  /* Viewed images don't share, so writes through the view stay put */
+  mb_pixbuf_img_fill (pb, img, 0x80, 0x40, 0x20, 0xff);
+  view   = mb_pixbuf_img_new_view (pb, img, 2, 2, 4, 4);
+  clone2 = mb_pixbuf_img_clone (pb, img);
+  fail_unless (clone2->rgba != img->rgba, NULL);
+
+  mb_pixbuf_img_fill (pb, view, 0, 0, 0, 0xff);
+  fail_unless (same_pixel (img, 2, 2, view, 0, 0), NULL);
+  fail_unless (compare_with_pixel (clone2, 0x80, 0x40, 0x20, 0xff), NULL);
+
+  mb_pixbuf_img_free (pb, view);
+  mb_pixbuf_img_free (pb, clone2);
+  mb_pixbuf_img_free (pb, clone);
+  mb_pixbuf_img_free (pb, orig);
+  mb_pixbuf_img_free (pb, img);
+}
+END_TEST
+
+START_TEST (pixbuf_slab)
+{
+  MBPixbuf      *hpb;
+  MBPixbufImage *img, *clone;
+  unsigned char *rgba;
+
+  /* A freed icon's block is the next one of its size handed out, and
+   * comes back cleared
+   */
+  img  = mb_pixbuf_img_rgba_new (pb, 32, 32);
+  mb_pixbuf_img_fill (pb, img, 0x80, 0x40, 0x20, 0xff);
+  rgba = img->rgba;
+  mb_pixbuf_img_free (pb, img);
+
+  img = mb_pixbuf_img_rgba_new (pb, 32, 32);
+  fail_unless (img->rgba == rgba, NULL);
+  fail_unless (compare_with_pixel (img, 0, 0, 0, 0), NULL);
+  mb_pixbuf_img_free (pb, img);
+
+  /* Images and their clones may outlive their pixbuf */
+  hpb = mb_pixbuf_new_headless (32, MBPIXBUF_BYTE_ORDER_ARGB, 
+				pb->internal_bytespp);
+  img = mb_pixbuf_img_rgba_new (hpb, 24, 24);
+  mb_pixbuf_img_fill (hpb, img, 0x80, 0x40, 0x20, 0xff);
+  clone = mb_pixbuf_img_clone (hpb, img);
+  mb_pixbuf_destroy (hpb);
+
+  mb_pixbuf_img_free (NULL, img);
+  fail_unless (compare_with_pixel (clone, 0x80, 0x40, 0x20, 0xff), NULL);
+  mb_pixbuf_img_free (NULL, clone);
+}
+END_TEST
+
+static int
+count_pixel(MBPixbufImage *img, unsigned char r, unsigned char g, 
+	    unsigned char b)
+{
+  unsigned char r1, g1, b1, a1;
+  int           x, y, n = 0;
+
+  for (y = 0; y < img->height; y++)
+    for (x = 0; x < img->width; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, img, x, y, &r1, &g1, &b1, &a1);
+	if (r1 == r && g1 == g && b1 == b) n++;
+      }
+
+  return n;
+}
+
+START_TEST (pixbuf_primitives)
+{
+  MBPixbufImage *img, *ref, *clone;
+  unsigned char  r, g, b, a;
+  int            x, y;
+
+  /* Rectangles and lines are clipped, and stay inside their rows */
+  img = mb_pixbuf_img_rgba_new (pb, 20, 10);
+  set_row_padding (img, 0xaa);
+
+  mb_pixbuf_img_fill_rect (pb, img, -3, 2, 8, 4, 0x80, 0x40, 0x20, 0xff);
+  fail_unless (count_pixel (img, 0x80, 0x40, 0x20) == 5 * 4, NULL);
+  mb_pixbuf_img_get_pixel (pb, img, 4, 5, &r, &g, &b, &a);
+  fail_unless (r == 0x80 && g == 0x40 && b == 0x20 && a == 0xff, NULL);
+
+  mb_pixbuf_img_hline (pb, img, 15, 0, 10, 0x20, 0x80, 0x40, 0xff);
+  mb_pixbuf_img_vline (pb, img, 19, -5, 20, 0x20, 0x80, 0x40, 0xff);
+  fail_unless (count_pixel (img, 0x20, 0x80, 0x40) == 4 + 10, NULL);
+  fail_unless (check_row_padding (img, 0xaa), NULL);
+
+  /* A right arrow of 5 is 3 deep with its tip mid way down */
+  mb_pixbuf_img_fill (pb, img, 0, 0, 0, 0xff);
+  mb_pixbuf_img_fill_arrow (pb, img, 10, 2, 5, MBPIXBUF_ARROW_RIGHT, 
+			    0x80, 0x40, 0x20, 0xff);
+  fail_unless (count_pixel (img, 0x80, 0x40, 0x20) == 9, NULL);
+  fail_unless (same_pixel (img, 12, 4, img, 10, 2), NULL);
+  fail_unless (!same_pixel (img, 12, 4, img, 13, 4), NULL);
+  fail_unless (!same_pixel (img, 12, 4, img, 12, 3), NULL);
+
+  mb_pixbuf_img_fill (pb, img, 0, 0, 0, 0xff);
+  mb_pixbuf_img_fill_arrow (pb, img, 2, 1, 5, MBPIXBUF_ARROW_UP, 
+			    0x80, 0x40, 0x20, 0xff);
+  fail_unless (count_pixel (img, 0x80, 0x40, 0x20) == 9, NULL);
+  fail_unless (same_pixel (img, 4, 1, img, 2, 3), NULL);
+  fail_unless (!same_pixel (img, 4, 1, img, 3, 1), NULL);
+  mb_pixbuf_img_free (pb, img);
+
+  /* Blending matches plotting each pixel with alpha */
+  img = random_image (21, 13, True);
+  ref = mb_pixbuf_img_clone (pb, img);
+
+  for (y = 3; y < 13; y++)
+    for (x = 0; x < 7; x++)
+      mb_pixbuf_img_plot_pixel_with_alpha (pb, ref, x, y, 0x80, 0x40, 0x20, 
+					   0x60);
+
+  mb_pixbuf_img_blend_rect (pb, img, -2, 3, 9, 20, 0x80, 0x40, 0x20, 0x60);
+  fail_unless (compare_with_image (img, ref), NULL);
+
+  /* Drawing on a clone leaves the original be */
+  clone = mb_pixbuf_img_clone (pb, img);
+  mb_pixbuf_img_fill_rect (pb, clone, 0, 0, 4, 4, 0, 0, 0, 0xff);
+  fail_unless (compare_with_image (img, ref), NULL);
+  fail_unless (!compare_with_image (clone, ref), NULL);
+
+  mb_pixbuf_img_free (pb, clone);
+  mb_pixbuf_img_free (pb, ref);
+  mb_pixbuf_img_free (pb, img);
+
+  /* Without alpha, blending still blends */
+  img = mb_pixbuf_img_rgb_new (pb, 8, 8);
+  mb_pixbuf_img_fill (pb, img, 0xff, 0xff, 0xff, 0xff);
+  mb_pixbuf_img_blend_rect (pb, img, 0, 0, 8, 8, 0, 0, 0, 0x80);
+  mb_pixbuf_img_get_pixel (pb, img, 7, 7, &r, &g, &b, &a);
+  fail_unless (r > 0x60 && r < 0xa0 && g > 0x60 && g < 0xa0, NULL);
+  mb_pixbuf_img_free (pb, img);
+}
+END_TEST
+
+/**
+ * Operations on images big enough to be split into row bands across
+ * threads should give the same result as doing them in one thread.
+ */
+#define N_THREADED_OPS 12
+
+static MBPixbufImage *
+threaded_op(int op, MBPixbufImage *src, MBPixbufImage *back)
+{
+  MBPixbufImage *img;
+
+  switch (op)
+    {
+    case 0:
+      img = mb_pixbuf_img_clone (pb, src);
+      mb_pixbuf_img_fill (pb, img, 10, 200, 30, 140);
+      return img;
+    case 1:
+      img = mb_pixbuf_img_clone (pb, back);
+      mb_pixbuf_img_copy (pb, img, src, 5, 3, 390, 290, 7, 11);
+      return img;
+    case 2:
+      img = mb_pixbuf_img_clone (pb, back);
+      mb_pixbuf_img_copy_composite_with_alpha (pb, img, src, 5, 3, 390, 290,
+					       7, 11, -40);
+      return img;
+    case 3:
+      return mb_pixbuf_img_scale (pb, src, 151, 97);
+    case 4:
+      return mb_pixbuf_img_scale_with_filter (pb, src, 640, 480,
+					      MBPIXBUF_FILTER_BILINEAR);
+    case 5:
+      img = mb_pixbuf_img_clone (pb, back);
+      mb_pixbuf_img_scale_composite (pb, src, img, -13, -9, 420, 333);
+      return img;
+    case 6:
+      /* Overlapping, within the one image */
+      img = mb_pixbuf_img_clone (pb, back);
+      mb_pixbuf_img_copy (pb, img, img, 0, 0, 390, 290, 3, 5);
+      return img;
+    default:
+      return mb_pixbuf_img_transform (pb, src, op - 7);
+    }
+}
+
+START_TEST (pixbuf_threads)
+{
+  MBPixbufImage *src, *back, *expected[N_THREADED_OPS], *img;
+  int has_alpha, op;
+
+  srand(13);
+
+  for (has_alpha = 0; has_alpha <= 1; has_alpha++)
+    {
+      src  = random_image(403, 301, has_alpha);
+      back = random_image(410, 320, !has_alpha);
+
+      mb_pixbuf_set_threads (pb, 1);
+
+      for (op = 0; op < N_THREADED_OPS; op++)
+	expected[op] = threaded_op(op, src, back);
+
+      mb_pixbuf_set_threads (pb, 4);
+
+      for (op = 0; op < N_THREADED_OPS; op++)
+	{
+	  img = threaded_op(op, src, back);
+	  fail_unless (compare_with_image (img, expected[op]), NULL);
+	  mb_pixbuf_img_free (pb, img);
+	  mb_pixbuf_img_free (pb, expected[op]);
+	}
+
+      mb_pixbuf_img_free (pb, src);
+      mb_pixbuf_img_free (pb, back);
+    }
+}
+END_TEST
+
+/**
+ * Loading the same file repeatedly with the image cache on should
+ * decode it once and hand out clones sharing its pixels, which a
+ * caller writing to one doesn't change for the rest.
+ */
+START_TEST (pixbuf_image_cache)
+{
+  MBPixbufImageCacheStats before, stats;
+  MBPixbufImage *imgs[300], *orig;
+  int i;
+
+  orig = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  fail_unless (orig != NULL, NULL);
+
+  mb_pixbuf_image_cache_set_budget (pb, 1024 * 1024);
+  mb_pixbuf_image_cache_flush (pb);
+  mb_pixbuf_image_cache_get_stats (&before);
+
+  for (i = 0; i < 300; i++)
+    {
+      imgs[i] = mb_pixbuf_img_new_from_file (pb, "oh.png");
+      fail_unless (imgs[i]->rgba == imgs[0]->rgba, NULL);
+    }
+
+  fail_unless (compare_with_image (imgs[0], orig), NULL);
+
+  fail_unless (mb_pixbuf_img_make_writable (pb, imgs[1]), NULL);
+  fail_unless (imgs[1]->rgba != imgs[0]->rgba, NULL);
+  mb_pixbuf_img_fill (pb, imgs[1], 1, 2, 3, 4);
+
+  mb_pixbuf_img_free (pb, imgs[2]);
+  imgs[2] = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  fail_unless (compare_with_image (imgs[2], orig), NULL);
+
+  mb_pixbuf_image_cache_get_stats (&stats);
+  fail_unless (stats.misses - before.misses == 1, NULL);
+  fail_unless (stats.hits - before.hits == 300, NULL);
+  fail_unless (stats.entries == 1 && stats.bytes > 0, NULL);
+
+  /* Dropping the cache leaves held images alone */
+  mb_pixbuf_image_cache_flush (pb);
+  fail_unless (compare_with_image (imgs[299], orig), NULL);
+
+  for (i = 0; i < 300; i++)
+    mb_pixbuf_img_free (pb, imgs[i]);
+
+  /* Too big for the budget, so never kept */
+  mb_pixbuf_image_cache_set_budget (pb, 16);
+  imgs[0] = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  imgs[1] = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  fail_unless (imgs[0] != imgs[1], NULL);
+
+  mb_pixbuf_image_cache_get_stats (&stats);
+  fail_unless (stats.entries == 0 && stats.bytes == 0, NULL);
+
+  mb_pixbuf_img_free (pb, imgs[0]);
+  mb_pixbuf_img_free (pb, imgs[1]);
+  mb_pixbuf_img_free (pb, orig);
+
+  mb_pixbuf_image_cache_set_budget (pb, 0);
+}
+END_TEST
+
+/**
+ * Build an icon cache, map it back and check the images match what
+ * loading and scaling the files gives.
+ */
+START_TEST (pixbuf_icon_cache)
+{
+  static const char *paths[] = { "oh.png", "overlay.png" };
+  static const int   sizes[] = { 0, 16 };
+  MBPixbufIconCache *cache;
+  MBPixbufImage *orig, *scaled, *img;
+
+  fail_unless (mb_pixbuf_icon_cache_build (pb, "pixbuf-test.cache", 
+					   paths, 2, sizes, 2), NULL);
+
+  cache = mb_pixbuf_icon_cache_open (pb, "pixbuf-test.cache");
+  fail_unless (cache != NULL, NULL);
+
+  orig   = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  scaled = mb_pixbuf_img_scale (pb, orig, 16, 16);
+
+  img = mb_pixbuf_icon_cache_lookup (cache, "oh.png", 0, 0);
+  fail_unless (img != NULL && compare_with_image (img, orig), NULL);
+  mb_pixbuf_img_free (pb, img);
+
+  img = mb_pixbuf_icon_cache_lookup (cache, "oh.png", 16, 16);
+  fail_unless (img != NULL && compare_with_image (img, scaled), NULL);
+
+  fail_unless (mb_pixbuf_icon_cache_lookup (cache, "oh.png", 8, 8) == NULL,
+	       NULL);
+  fail_unless (mb_pixbuf_icon_cache_lookup (cache, "oh.jpg", 0, 0) == NULL,
+	       NULL);
+
+  /* Images keep the mapping alive */
+  mb_pixbuf_icon_cache_close (cache);
+  fail_unless (compare_with_image (img, scaled), NULL);
+
+  /* and can be drawn on, which copies them out of it */
+  mb_pixbuf_img_copy (pb, img, orig, 0, 0, 16, 16, 0, 0);
+  fail_unless (compare_with_image (img, orig), NULL);
+  mb_pixbuf_img_free (pb, img);
+
+  mb_pixbuf_img_free (pb, orig);
+  mb_pixbuf_img_free (pb, scaled);
+
+  /* An entry's path pointing off the end gets the file refused. The
+   * header's last field is where the entries start.
+   */
+  {
+    FILE     *fp;
+    uint32_t  entries_offset, bad = 0xffffffff;
+
+    fp = fopen ("pixbuf-test.cache", "r+b");
+    fail_unless (fp != NULL, NULL);
+    fseek (fp, 8 + 7 * sizeof(uint32_t), SEEK_SET);
+    fail_unless (fread (&entries_offset, sizeof(uint32_t), 1, fp) == 1, NULL);
+    fseek (fp, entries_offset, SEEK_SET);
+    fail_unless (fwrite (&bad, sizeof(uint32_t), 1, fp) == 1, NULL);
+    fclose (fp);
+  }
+
+  fail_unless (mb_pixbuf_icon_cache_open (pb, "pixbuf-test.cache") == NULL,
+	       NULL);
+
+  unlink ("pixbuf-test.cache");
+}
+END_TEST
+
+/**
+ * Loading at a size should give what loading and then scaling does, to
+ * within the 16bpp rounding. JPEGs decoded at reduced size only come
+ * close.
+ */
+static int
+near_image (MBPixbufImage *a, MBPixbufImage *b, int tolerance)
+{
+  unsigned char p[4], q[4];
+  int x, y, i;
+
+  if (a == NULL || b == NULL) return 0;
+  if (a->width != b->width || a->height != b->height 
+      || a->has_alpha != b->has_alpha) return 0;
+
+  for (y = 0; y < a->height; y++)
+    for (x = 0; x < a->width; x++)
+      {
+	mb_pixbuf_img_get_pixel (pb, a, x, y, &p[0], &p[1], &p[2], &p[3]);
+	mb_pixbuf_img_get_pixel (pb, b, x, y, &q[0], &q[1], &q[2], &q[3]);
+
+	for (i = 0; i < 3 + a->has_alpha; i++)
+	  if (abs(p[i] - q[i]) > tolerance)
+	    return 0;
+      }
+
+  return 1;
+}
+
+START_TEST (pixbuf_load_at_size)
+{
+  static const int sizes[][2] = { { 7, 5 }, { 16, 3 }, { 40, 24 }, { 16, 16 } };
+  MBPixbufImage *orig, *img, *expected;
+  int i, tolerance = (pb->internal_bytespp == 2) ? 8 : 0;
+
+  orig = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  fail_unless (orig != NULL, NULL);
+
+  for (i = 0; i < 4; i++)
+    {
+      img = mb_pixbuf_img_new_from_file_at_size (pb, "oh.png", 
+						 sizes[i][0], sizes[i][1]);
+      expected = mb_pixbuf_img_scale (pb, orig, sizes[i][0], sizes[i][1]);
+
+      fail_unless (near_image (img, expected, tolerance), NULL);
+
+      mb_pixbuf_img_free (pb, img);
+      mb_pixbuf_img_free (pb, expected);
+    }
+
+  mb_pixbuf_img_free (pb, orig);
+
+#ifdef MB_HAVE_JPEG
+  orig = mb_pixbuf_img_new_from_file (pb, "oh.jpg");
+  fail_unless (orig != NULL, NULL);
+
+  for (i = 2; i <= 8; i *= 2)
+    {
+      img = mb_pixbuf_img_new_from_file_at_size (pb, "oh.jpg", 16 / i, 16 / i);
+      expected = mb_pixbuf_img_scale (pb, orig, 16 / i, 16 / i);
+
+      fail_unless (near_image (img, expected, 48), NULL);
+
+      mb_pixbuf_img_free (pb, img);
+      mb_pixbuf_img_free (pb, expected);
+    }
+
+  mb_pixbuf_img_free (pb, orig);
+#endif
+}
+END_TEST
+
+/**
+ * A batch loaded on the worker pool should give the same images as
+ * loading each file in turn.
+ */
+START_TEST (pixbuf_load_batch)
+{
+  static const char *files[] = { "oh.png", "oh.xpm", "no-such-file.png", 
+				 "overlay.png", 
+#ifdef MB_HAVE_JPEG
+				 "oh.jpg",
+#endif
+  };
+  const char *paths[40];
+  MBPixbufImage *results[40], *img;
+  int i, size, n_files = sizeof(files) / sizeof(files[0]), n_ok;
+
+  for (i = 0; i < 40; i++)
+    paths[i] = files[i % n_files];
+
+  for (size = 0; size <= 12; size += 12)
+    {
+      n_ok = mb_pixbuf_img_load_batch (pb, paths, 40, size, size, results);
+      fail_unless (n_ok == 40 - 40 / n_files, NULL);
+
+      for (i = 0; i < 40; i++)
+	{
+	  img = mb_pixbuf_img_new_from_file_at_size (pb, paths[i], size, size);
+
+	  if (img == NULL)
+	    fail_unless (results[i] == NULL, NULL);
+	  else
+	    fail_unless (compare_with_image (results[i], img), NULL);
+
+	  if (img) mb_pixbuf_img_free (pb, img);
+	  if (results[i]) mb_pixbuf_img_free (pb, results[i]);
+	}
+    }
+}
+END_TEST
+
+START_TEST (pixbuf_scale)
+{
+  MBPixbufImage *img1, *img2, *orig, *exp;
+  orig = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  fail_unless (orig != NULL, NULL);
+  exp = mb_pixbuf_img_new_from_file (pb, "oh-scaled.png");
+  fail_unless (orig != NULL, NULL);
+  img1 = mb_pixbuf_img_scale (pb, orig, 32, 32);
+  fail_unless (!compare_with_image (img1, orig), NULL);
+  fail_unless (compare_with_image (img1, exp), NULL);
+  img2 = mb_pixbuf_img_scale (pb, img1, 16, 16);
+  fail_unless (compare_with_image (img2, orig), NULL);
+  fail_unless (!compare_with_image (img2, exp), NULL);
+  mb_pixbuf_img_free (pb, img1);
+  mb_pixbuf_img_free (pb, img2);
+  mb_pixbuf_img_free (pb, orig);
+  mb_pixbuf_img_free (pb, exp);
+}
+END_TEST
+
+/**
+ * Test that the scale_(up|down) functions correctly return NULL if you try and
+ * scale an image the wrong way.
+ */
+START_TEST (pixbuf_scale_failures)
+{
+  MBPixbufImage *img, *orig;
+  orig = mb_pixbuf_img_new_from_file (pb, "oh.png");
+  img = mb_pixbuf_img_scale_down (pb, orig, 32, 32);
+  fail_unless (img == NULL, NULL);
+  img = mb_pixbuf_img_scale_up (pb, orig, 8, 8);
+  fail_unless (img == NULL, NULL);
+  mb_pixbuf_img_free (pb, orig);
+}
+END_TEST
+
+Suite *pixbuf_suite(void)
+{
   Suite *s = suite_create("MbPixbuf");
   TCase *tc_core = tcase_create("Core");
   tcase_add_checked_fixture(tc_core, setup, teardown);
@@ -424,19 +2106,42 @@ Suite *pixbuf_suite(void)
   tcase_add_test(tc_core, pixbuf_new_from_x_drawable);
   tcase_add_test(tc_core, pixbuf_load_png);
   tcase_add_test(tc_core, pixbuf_load_xpm);
+  tcase_add_test(tc_core, pixbuf_load_xpm_colors);
+  tcase_add_test(tc_core, pixbuf_load_memory);
 #ifdef MB_HAVE_JPEG
   tcase_add_test(tc_core, pixbuf_load_jpeg);
 #endif
   tcase_add_test(tc_core, pixbuf_clone);
   tcase_add_test(tc_core, pixbuf_copy);
   tcase_add_test(tc_core, pixbuf_composite);
+  tcase_add_test(tc_core, pixbuf_composite_reference);
   tcase_add_test(tc_core, pixbuf_rotate_90_identity);
   tcase_add_test(tc_core, pixbuf_rotate_180_identity);
   tcase_add_test(tc_core, pixbuf_rotate_270_identity);
   tcase_add_test(tc_core, pixbuf_flip_h_identity);
   tcase_add_test(tc_core, pixbuf_flip_v_identity);
+  tcase_add_test(tc_core, pixbuf_transform_reference);
+  tcase_add_test(tc_core, pixbuf_threads);
+  tcase_add_test(tc_core, pixbuf_headless);
+  tcase_add_test(tc_core, pixbuf_row_writers);
+  tcase_add_test(tc_core, pixbuf_color_cube);
+  tcase_add_test(tc_core, pixbuf_rowstride);
+  tcase_add_test(tc_core, pixbuf_view_wrap);
+  tcase_add_test(tc_core, pixbuf_copy_on_write);
+  tcase_add_test(tc_core, pixbuf_slab);
+  tcase_add_test(tc_core, pixbuf_primitives);
   tcase_add_test(tc_core, pixbuf_scale);
   tcase_add_test(tc_core, pixbuf_scale_failures);
+  tcase_add_test(tc_core, pixbuf_scale_down_reference);
+  tcase_add_test(tc_core, pixbuf_scale_filters);
+  tcase_add_test(tc_core, pixbuf_scale_into);
+  tcase_add_test(tc_core, pixbuf_image_cache);
+  tcase_add_test(tc_core, pixbuf_icon_cache);
+  tcase_add_test(tc_core, pixbuf_load_at_size);
+  tcase_add_test(tc_core, pixbuf_load_batch);
+  tcase_add_test(tc_core, pixbuf_premultiplied);
+  tcase_add_test(tc_core, pixbuf_premultiplied_dest);
+  tcase_add_test(tc_core, pixbuf_premultiplied_copy);
   return s;
 }
 
@@ -454,6 +2159,12 @@ int main(void)
   unsetenv("MBPIXBUF_FORCE_32BPP_INTERNAL");
   srunner_run_all(sr, CK_NORMAL);
   nf = nf + srunner_ntests_failed(sr);
+  /* And again in 32bpp with the plain C, non SIMD, routines */
+  setenv("MBPIXBUF_FORCE_32BPP_INTERNAL", "1", 1);
+  setenv("MBPIXBUF_NO_SIMD", "1", 1);
+  unsetenv("MBPIXBUF_FORCE_16BPP_INTERNAL");
+  srunner_run_all(sr, CK_NORMAL);
+  nf = nf + srunner_ntests_failed(sr);
 
   srunner_free(sr);
   return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -0,0 +1,190 @@
+/* mb-icon-cache
+ *
+ * Builds a cache of pre decoded, and optionally pre scaled, images that
+ * libmb maps straight into memory, see mb_pixbuf_icon_cache_open(). 
+ *
+ * The cache holds pixels in its users' internal format. By default that
+ * comes from the display, so build the cache with the same display depth
+ * ( and MBPIXBUF_* environment ) as its users. Given -d, -b or -i it
+ * needs no display at all, for building caches on a build server, and
+ * the format is the one those describe instead.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <dirent.h>
+#include <libmb/mb.h>
+
+static void
+usage(void)
+{
+  fprintf(stderr, 
+	  "usage: mb-icon-cache [-d depth] [-b order] [-i bytes] [-s size]...\n"
+	  "                     -o cache image|directory...\n"
+	  "\n"
+	  "  -o cache  cache file to write\n"
+	  "  -s size   also cache each image scaled to size x size, 0 is\n"
+	  "            natural size. Natural size only if not given.\n"
+	  "\n"
+	  "Without a display, for the users' format rather than this one's:\n"
+	  "\n"
+	  "  -d depth  display depth, 15, 16, 24 or 32. 24 if not given.\n"
+	  "  -b order  channel order, rgb, rbg, brg, bgr, grb, gbr or argb.\n"
+	  "            argb at 32 bits, otherwise rgb, if not given.\n"
+	  "  -i bytes  internal bytes per pixel, 2 or 3. As the display\n"
+	  "            would pick if not given.\n"
+	  "\n"
+	  "Directories are scanned for .png, .jpg, .jpeg and .xpm files.\n"
+	  "Images are looked up by the path given here, so use absolute paths.\n");
+  exit(1);
+}
+
+static int
+parse_byte_order(const char *name)
+{
+  static const char *orders[] = { "rgb", "rbg", "brg", "bgr", "grb", "gbr",
+				  "argb" };
+  int i;
+
+  for (i = 0; i < sizeof(orders)/sizeof(orders[0]); i++)
+    if (!strcasecmp(name, orders[i]))
+      return MBPIXBUF_BYTE_ORDER_RGB + i;
+
+  usage();
+  return -1;
+}
+
+static int
+is_image(const char *name)
+{
+  static const char *exts[] = { ".png", ".jpg", ".jpeg", ".xpm" };
+  size_t len = strlen(name), elen;
+  int i;
+
+  for (i = 0; i < sizeof(exts)/sizeof(exts[0]); i++)
+    {
+      elen = strlen(exts[i]);
+      if (len > elen && !strcasecmp(name + len - elen, exts[i]))
+	return 1;
+    }
+  return 0;
+}
+
+static void
+add_path(char ***paths, int *n_paths, const char *path)
+{
+  *paths = realloc(*paths, (*n_paths + 1) * sizeof(char *));
+  (*paths)[(*n_paths)++] = strdup(path);
+}
+
+static void
+add_dir(char ***paths, int *n_paths, const char *dir)
+{
+  struct dirent *de;
+  DIR           *dp;
+  char          *path;
+
+  if ((dp = opendir(dir)) == NULL)
+    return;
+
+  while ((de = readdir(dp)) != NULL)
+    if (is_image(de->d_name))
+      {
+	path = malloc(strlen(dir) + strlen(de->d_name) + 2);
+	sprintf(path, "%s/%s", dir, de->d_name);
+	add_path(paths, n_paths, path);
+	free(path);
+      }
+
+  closedir(dp);
+}
+
+int 
+main(int argc, char* argv[])
+{
+  Display  *dpy = NULL;
+  MBPixbuf *pb;
+  char     *output = NULL, **paths = NULL;
+  int      *sizes = NULL, n_sizes = 0, n_paths = 0, i;
+  int       depth = 0, byte_order = -1, internal_bytespp = -1;
+  DIR      *dp;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "-o") && i + 1 < argc)
+	output = argv[++i];
+      else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+	{
+	  sizes = realloc(sizes, (n_sizes + 1) * sizeof(int));
+	  sizes[n_sizes++] = atoi(argv[++i]);
+	}
+      else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+	depth = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+	byte_order = parse_byte_order(argv[++i]);
+      else if (!strcmp(argv[i], "-i") && i + 1 < argc)
+	internal_bytespp = atoi(argv[++i]);
+      else if (argv[i][0] == '-')
+	usage();
+      else if ((dp = opendir(argv[i])) != NULL)
+	{
+	  closedir(dp);
+	  add_dir(&paths, &n_paths, argv[i]);
+	}
+      else
+	add_path(&paths, &n_paths, argv[i]);
+    }
+
+  if (output == NULL || n_paths == 0)
+    usage();
+
+  if (depth || byte_order >= 0 || internal_bytespp >= 0)
+    {
+      if (depth == 0)
+	depth = 24;
+
+      if (byte_order < 0)
+	byte_order = (depth == 32) ? MBPIXBUF_BYTE_ORDER_ARGB 
+	                           : MBPIXBUF_BYTE_ORDER_RGB;
+
+      pb = mb_pixbuf_new_headless(depth, byte_order, 
+				  (internal_bytespp < 0) ? 0 
+				                         : internal_bytespp);
+      if (pb == NULL)
+	{
+	  fprintf(stderr, "mb-icon-cache: unsupported pixel format\n");
+	  return 1;
+	}
+    }
+  else
+    {
+      if ((dpy = XOpenDisplay(NULL)) == NULL)
+	{
+	  fprintf(stderr, "mb-icon-cache: can't open display\n");
+	  return 1;
+	}
+
+      pb = mb_pixbuf_new(dpy, DefaultScreen(dpy));
+    }
+
+  if (!mb_pixbuf_icon_cache_build(pb, output, (const char **)paths, n_paths,
+				  sizes, n_sizes))
+    {
+      fprintf(stderr, "mb-icon-cache: failed to write %s\n", output);
+      return 1;
+    }
+
+  mb_pixbuf_destroy(pb);
+  if (dpy) XCloseDisplay(dpy);
+
+  for (i = 0; i < n_paths; i++)
+    free(paths[i]);
+  free(paths);
+  free(sizes);
+
+  return 0;
+}